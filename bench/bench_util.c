@@ -0,0 +1,55 @@
+#include "bench_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_frame.h"
+
+int bench_cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+double bench_percentile(const uint64_t* v, size_t n, double p) {
+    if (n == 0) return 0.0;
+    return (double)v[(size_t)(p * (double)(n - 1))];
+}
+
+uint32_t bench_rng_next(uint32_t* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+int bench_parse_addr(const char* host, int port, struct sockaddr_in* dst) {
+    memset(dst, 0, sizeof(*dst));
+    dst->sin_family = AF_INET;
+    dst->sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, host, &dst->sin_addr) == 1;
+}
+
+int bench_wait_frame(SOCKET s, const char* prefix, char* out, size_t out_size) {
+    for (;;) {
+        uint8_t* payload = NULL;
+        uint32_t len = 0;
+        if (!chat_frame_recv_alloc(s, &payload, &len, CHAT_MAX_FRAME)) return 0;
+        int match = strncmp((const char*)payload, prefix, strlen(prefix)) == 0;
+        if (match && out) snprintf(out, out_size, "%s", (const char*)payload);
+        free(payload);
+        if (match) return 1;
+    }
+}
+
+SOCKET bench_connect(const struct sockaddr_in* dst) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    (void)chat_socket_set_nodelay(s);
+    if (connect(s, (const struct sockaddr*)dst, sizeof(*dst)) != 0 || !bench_wait_frame(s, "HELLO", NULL, 0)) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "chat_platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers shared by the load generators and benchmarks (Linux).
+
+// qsort comparator for uint64_t samples.
+int bench_cmp_u64(const void* a, const void* b);
+
+// The p-th (0..1) of n sorted samples, in their own unit; 0 if none.
+double bench_percentile(const uint64_t* v, size_t n, double p);
+
+// xorshift32: a fast, repeatable stream for picking test data. *s must not
+// start at 0.
+uint32_t bench_rng_next(uint32_t* s);
+
+// Fill dst with an IPv4 host and port. Returns 0 if host is not an address.
+int bench_parse_addr(const char* host, int port, struct sockaddr_in* dst);
+
+// Read frames until one starts with prefix; copies it into out if given.
+int bench_wait_frame(SOCKET s, const char* prefix, char* out, size_t out_size);
+
+// Open a blocking TCP_NODELAY connection and wait for the server's HELLO.
+SOCKET bench_connect(const struct sockaddr_in* dst);
@@ -0,0 +1,412 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "chat_frame.h"
+
+// Server load generator (Linux).
+// Simulates --clients clients from one process and one epoll loop. Each
+// connects without blocking, answers the greeting with HELLO 1, then sends
+// AUTH and JOIN. --connect-burst handshakes run at once, and the connect
+// phase reports the handshake rate and AUTH latency. Clients fill rooms of
+// --room-size members in order. At a fixed total --rate, clients take turns
+// sending MSG to their room. The text is the send time in nanoseconds,
+// padded with filler to --size bytes, so every member that receives the
+// ROOMMSG measures end-to-end fan-out latency. The run prints one summary
+// line of key=value pairs and exits non-zero if a handshake failed or a
+// delivery went missing.
+
+#define BENCH_RBUF (64 * 1024)
+// Largest --size: the ROOMMSG event, with its longest header, must still
+// fit in one frame.
+#define BENCH_SIZE_MAX ((int)CHAT_MAX_FRAME - 128)
+
+typedef enum BenchState {
+    ST_CONNECTING, // Non-blocking connect in progress.
+    ST_GREETING, // Waiting for the server's HELLO.
+    ST_HELLO, // Sent HELLO 1, waiting for its echo.
+    ST_AUTH, // Sent AUTH.
+    ST_JOIN, // Sent JOIN.
+    ST_READY,
+    ST_FAILED,
+} BenchState;
+
+typedef struct BenchClient {
+    SOCKET sock;
+    BenchState state;
+    int room;
+    uint64_t start_ns; // Connect started.
+    ChatFrameDecoder in;
+} BenchClient;
+
+typedef struct Samples {
+    uint64_t* ns;
+    size_t count;
+    size_t cap;
+} Samples;
+
+typedef struct Bench {
+    const char* password;
+    const char* prefix;
+    BenchClient* c;
+    int clients;
+    int epfd;
+    int handshaking; // Handshakes in flight.
+    int ready;
+    int failed;
+    Samples auth; // Connect start to OK AUTH.
+    Samples lat; // MSG sent to ROOMMSG received.
+    uint64_t deliveries;
+    uint64_t rx_bytes;
+} Bench;
+
+static void usage(void) {
+    printf("chat_bench --password <pw> [--host <ip>] [--port <port>] [--clients <n>] [--room-size <n>]\n"
+           "           [--rate <msgs/s>] [--size <bytes>] [--seconds <n>] [--connect-burst <n>]\n"
+           "           [--prefix <name>]\n");
+}
+
+static void sample_add(Samples* s, uint64_t ns) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 65536;
+        uint64_t* p = (uint64_t*)realloc(s->ns, cap * sizeof(*p));
+        if (!p) return;
+        s->ns = p;
+        s->cap = cap;
+    }
+    s->ns[s->count++] = ns;
+}
+
+// Queue a whole frame on a non-blocking socket, waiting out a full buffer.
+static int send_frame_nb(SOCKET s, const char* payload, uint32_t len) {
+    static uint8_t frame[4 + CHAT_MAX_FRAME]; // One thread sends.
+    if (len > sizeof(frame) - 4) return 0;
+    uint32_t net_len = htonl(len);
+    memcpy(frame, &net_len, 4);
+    memcpy(frame + 4, payload, len);
+    size_t off = 0;
+    while (off < 4 + (size_t)len) {
+        ssize_t w = send(s, frame + off, 4 + (size_t)len - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EAGAIN) {
+            WSAPOLLFD pfd = {s, POLLOUT, 0};
+            (void)WSAPoll(&pfd, 1, 100);
+            continue;
+        }
+        if (w <= 0) return 0;
+        off += (size_t)w;
+    }
+    return 1;
+}
+
+static void client_fail(Bench* b, BenchClient* c) {
+    if (c->state != ST_READY) b->handshaking--;
+    else b->ready--;
+    c->state = ST_FAILED;
+    b->failed++;
+    (void)epoll_ctl(b->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    closesocket(c->sock);
+    c->sock = INVALID_SOCKET;
+}
+
+static int client_start(Bench* b, int idx, const struct sockaddr_in* dst) {
+    BenchClient* c = &b->c[idx];
+    c->start_ns = chat_now_ns();
+    c->state = ST_CONNECTING;
+    b->handshaking++;
+    chat_decoder_init(&c->in, CHAT_MAX_FRAME);
+    c->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c->sock == INVALID_SOCKET || !chat_socket_set_nonblocking(c->sock)) return 0;
+    (void)chat_socket_set_nodelay(c->sock);
+    if (connect(c->sock, (const struct sockaddr*)dst, sizeof(*dst)) != 0 && errno != EINPROGRESS) return 0;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = (uint32_t)idx;
+    return epoll_ctl(b->epfd, EPOLL_CTL_ADD, c->sock, &ev) == 0;
+}
+
+// One frame from the server; drives the handshake, then times ROOMMSGs.
+static void client_frame(Bench* b, BenchClient* c, const char* f) {
+    char cmd[128];
+    int len;
+    switch (c->state) {
+    case ST_GREETING:
+        if (strncmp(f, "HELLO", 5) != 0 || !send_frame_nb(c->sock, "HELLO 1", 7)) break;
+        c->state = ST_HELLO;
+        return;
+    case ST_HELLO:
+        len = snprintf(cmd, sizeof(cmd), "AUTH %s%d %s", b->prefix, (int)(c - b->c), b->password);
+        if (strcmp(f, "HELLO 1") != 0 || !send_frame_nb(c->sock, cmd, (uint32_t)len)) break;
+        c->state = ST_AUTH;
+        return;
+    case ST_AUTH:
+        len = snprintf(cmd, sizeof(cmd), "JOIN %sr%d", b->prefix, c->room);
+        if (strcmp(f, "OK AUTH") != 0 || !send_frame_nb(c->sock, cmd, (uint32_t)len)) break;
+        sample_add(&b->auth, chat_now_ns() - c->start_ns);
+        c->state = ST_JOIN;
+        return;
+    case ST_JOIN:
+        if (strncmp(f, "USERJOIN ", 9) == 0) return;
+        if (strcmp(f, "OK JOIN") != 0) break;
+        c->state = ST_READY;
+        b->handshaking--;
+        b->ready++;
+        return;
+    case ST_READY:
+        if (strncmp(f, "ROOMMSG ", 8) == 0) {
+            const char* text = strstr(f, " :");
+            if (text) {
+                sample_add(&b->lat, chat_now_ns() - strtoull(text + 2, NULL, 10));
+                b->deliveries++;
+            }
+        }
+        return;
+    default:
+        break;
+    }
+    // The first few are enough to see what went wrong.
+    if (b->failed < 5) printf("client %d: unexpected \"%.60s\"\n", (int)(c - b->c), f);
+    client_fail(b, c);
+}
+
+static void client_event(Bench* b, BenchClient* c, uint32_t events) {
+    static uint8_t rbuf[BENCH_RBUF + 1]; // One spare byte for the decoder.
+    if (c->state == ST_CONNECTING) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if ((events & (EPOLLERR | EPOLLHUP)) || getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &elen) != 0 || err) {
+            client_fail(b, c);
+            return;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)(c - b->c);
+        (void)epoll_ctl(b->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        c->state = ST_GREETING;
+    }
+    for (;;) {
+        ssize_t r = recv(c->sock, rbuf, BENCH_RBUF, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EAGAIN) return;
+            client_fail(b, c);
+            return;
+        }
+        b->rx_bytes += (uint64_t)r;
+        chat_decoder_feed(&c->in, rbuf, (size_t)r);
+        uint8_t* payload;
+        uint32_t len;
+        int got;
+        while ((got = chat_decoder_next(&c->in, &payload, &len)) == 1) {
+            client_frame(b, c, (const char*)payload);
+            if (c->state == ST_FAILED) return;
+        }
+        if (got < 0) {
+            client_fail(b, c);
+            return;
+        }
+    }
+}
+
+static int poll_events(Bench* b, int timeout_ms) {
+    struct epoll_event events[256];
+    int n = epoll_wait(b->epfd, events, 256, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (int k = 0; k < n; k++) {
+        BenchClient* c = &b->c[events[k].data.u32];
+        if (c->state != ST_FAILED) client_event(b, c, events[k].events);
+    }
+    return n;
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    const char* port = "5555";
+    int room_size = 50;
+    int rate = 1000;
+    int size = 64;
+    int seconds = 10;
+    int burst = 256;
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.clients = 1000;
+    b.prefix = "bench";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            b.password = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            b.clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--room-size") == 0 && i + 1 < argc) {
+            room_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connect-burst") == 0 && i + 1 < argc) {
+            burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            b.prefix = argv[++i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    // Names are the prefix plus a number; the room adds "r".
+    if (!b.password || b.clients <= 0 || room_size <= 0 || rate <= 0 || size < 20 || size > BENCH_SIZE_MAX || seconds <= 0 ||
+        burst <= 0 || strlen(b.prefix) == 0 || strlen(b.prefix) > 20) {
+        usage();
+        return 2;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in dst;
+    if (!bench_parse_addr(host, atoi(port), &dst)) {
+        printf("bad host address: %s\n", host);
+        return 2;
+    }
+
+    b.c = (BenchClient*)calloc((size_t)b.clients, sizeof(*b.c));
+    b.epfd = epoll_create1(0);
+    if (!b.c || b.epfd < 0) return 1;
+    int rooms = (b.clients + room_size - 1) / room_size;
+    for (int i = 0; i < b.clients; i++) {
+        b.c[i].room = i / room_size;
+        b.c[i].sock = INVALID_SOCKET;
+    }
+
+    // Connect phase: keep up to burst handshakes in flight.
+    uint64_t t0 = chat_now_ns();
+    uint64_t last_progress = t0;
+    int started = 0;
+    while (b.ready + b.failed < b.clients) {
+        while (started < b.clients && b.handshaking < burst) {
+            if (!client_start(&b, started, &dst)) {
+                printf("client %d: connect failed: %s\n", started, strerror(errno));
+                client_fail(&b, &b.c[started]);
+            }
+            started++;
+        }
+        int n = poll_events(&b, 100);
+        if (n < 0) return 1;
+        uint64_t now = chat_now_ns();
+        if (n > 0) last_progress = now;
+        else if (now - last_progress > 5000000000ull) {
+            printf("handshakes stalled: %d ready, %d failed, %d in flight\n", b.ready, b.failed, b.handshaking);
+            return 1;
+        }
+    }
+    double connect_secs = (double)(chat_now_ns() - t0) / 1e9;
+    if (b.ready == 0) {
+        printf("no client completed the handshake\n");
+        return 1;
+    }
+
+    // Expected deliveries per message, by room: every live member.
+    uint64_t* room_members = (uint64_t*)calloc((size_t)rooms, sizeof(*room_members));
+    if (!room_members) return 1;
+    for (int i = 0; i < b.clients; i++) {
+        if (b.c[i].state == ST_READY) room_members[b.c[i].room]++;
+    }
+    // Let the USERJOIN backlog (and any history replayed on JOIN) settle so
+    // it does not count as message traffic.
+    while (poll_events(&b, 200) > 0) {
+    }
+    uint64_t rx_before = b.rx_bytes;
+    b.deliveries = 0;
+    b.lat.count = 0;
+
+    // Message phase: on schedule, clients take turns; then drain.
+    static char filler[BENCH_SIZE_MAX];
+    memset(filler, 'x', sizeof(filler));
+    long sent = 0;
+    uint64_t expected = 0;
+    int next = 0;
+    uint64_t run_ns = (uint64_t)seconds * 1000000000ull;
+    t0 = chat_now_ns();
+    uint64_t last_rx = t0;
+    uint64_t send_end = t0;
+    for (;;) {
+        uint64_t now = chat_now_ns();
+        uint64_t elapsed = now - t0;
+        if (elapsed < run_ns) {
+            long due = (long)(elapsed * (uint64_t)rate / 1000000000ull);
+            for (; sent < due; sent++) {
+                BenchClient* c = NULL;
+                for (int tries = 0; tries < b.clients && !c; tries++) {
+                    BenchClient* cand = &b.c[next];
+                    next = (next + 1) % b.clients;
+                    if (cand->state == ST_READY) c = cand;
+                }
+                if (!c) {
+                    printf("no clients left\n");
+                    return 1;
+                }
+                static char msg[BENCH_SIZE_MAX + 128];
+                int len = snprintf(msg, sizeof(msg), "MSG %sr%d :%llu ", b.prefix, c->room,
+                    (unsigned long long)chat_now_ns());
+                int text_len = len - (int)(strchr(msg, ':') - msg) - 1;
+                if (text_len < size) {
+                    memcpy(msg + len, filler, (size_t)(size - text_len));
+                    len += size - text_len;
+                }
+                if (!send_frame_nb(c->sock, msg, (uint32_t)len)) {
+                    client_fail(&b, c);
+                    continue;
+                }
+                expected += room_members[c->room];
+            }
+            send_end = chat_now_ns();
+        } else if (b.deliveries >= expected || now - last_rx > 2000000000ull) {
+            break;
+        }
+        uint64_t before = b.deliveries;
+        if (poll_events(&b, 1) < 0) return 1;
+        if (b.deliveries != before) last_rx = chat_now_ns();
+    }
+    double send_secs = (double)(send_end - t0) / 1e9;
+    double total_secs = (double)(chat_now_ns() - t0) / 1e9;
+    qsort(b.auth.ns, b.auth.count, sizeof(*b.auth.ns), bench_cmp_u64);
+    qsort(b.lat.ns, b.lat.count, sizeof(*b.lat.ns), bench_cmp_u64);
+
+    // One machine-readable summary line.
+    printf("clients=%d room_size=%d rooms=%d rate=%d size=%d seconds=%d connect_secs=%.3f connects_per_sec=%.0f"
+           " auth_p50_us=%.1f auth_p99_us=%.1f failed=%d sent=%ld msgs_per_sec=%.0f deliveries=%llu expected=%llu"
+           " deliveries_per_sec=%.0f rx_mb_per_sec=%.2f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f"
+           " max_us=%.1f\n",
+        b.clients, room_size, rooms, rate, size, seconds, connect_secs,
+        connect_secs > 0 ? (b.clients - b.failed) / connect_secs : 0.0,
+        bench_percentile(b.auth.ns, b.auth.count, 0.50) / 1e3, bench_percentile(b.auth.ns, b.auth.count, 0.99) / 1e3,
+        b.failed, sent, send_secs > 0 ? sent / send_secs : 0.0, (unsigned long long)b.deliveries,
+        (unsigned long long)expected, total_secs > 0 ? (double)b.deliveries / total_secs : 0.0,
+        total_secs > 0 ? (double)(b.rx_bytes - rx_before) / total_secs / 1e6 : 0.0,
+        bench_percentile(b.lat.ns, b.lat.count, 0.50) / 1e3, bench_percentile(b.lat.ns, b.lat.count, 0.90) / 1e3,
+        bench_percentile(b.lat.ns, b.lat.count, 0.99) / 1e3, bench_percentile(b.lat.ns, b.lat.count, 0.999) / 1e3,
+        b.lat.count ? (double)b.lat.ns[b.lat.count - 1] / 1000.0 : 0.0);
+
+    for (int i = 0; i < b.clients; i++) {
+        if (b.c[i].sock != INVALID_SOCKET) closesocket(b.c[i].sock);
+        chat_decoder_free(&b.c[i].in);
+    }
+    free(room_members);
+    free(b.auth.ns);
+    free(b.lat.ns);
+    free(b.c);
+    return b.failed == 0 && b.deliveries >= expected ? 0 : 1;
+}
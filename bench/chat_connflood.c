@@ -0,0 +1,342 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "chat_frame.h"
+
+// Idle-connection capacity probe (Linux).
+// Opens N authenticated connections, holds them, and reports the server's
+// RSS and thread count from /proc so backends can be compared.
+//
+// With --burst it instead starts all N connects at once, like clients
+// reconnecting after a restart, and drives every HELLO/AUTH handshake
+// concurrently from one epoll loop. It reports the percentiles of the time
+// from connect() to OK AUTH, how many handshakes failed, and the rate at
+// which they completed (against a --credentials server, logins hashed or
+// served from its cache per second).
+
+#define BURST_WAIT_MS 60000 // Give up on a burst after this long.
+#define BURST_PASS_EVERY 64 // Connects between event passes while starting the burst.
+
+typedef struct BurstConn {
+    SOCKET sock;
+    int stage; // 0 connecting, 1 waiting for HELLO, 2 waiting for OK AUTH, 3 done.
+    uint64_t started;
+    uint8_t buf[64];
+    uint32_t len;
+} BurstConn;
+
+typedef struct Burst {
+    BurstConn* conns;
+    int epfd;
+    const char* password;
+    uint64_t* auth_ns; // Per authenticated connection.
+    int authed;
+    int failed;
+} Burst;
+
+typedef struct ProcStats {
+    long rss_kb;
+    long threads;
+} ProcStats;
+
+static void usage(void) {
+    printf("chat_connflood --password <pw> [--host <ip>] [--port <port>] [--conns <n>]\n"
+           "               [--hold <sec>] [--src-ips <k>] [--server-pid <pid>] [--burst]\n");
+}
+
+static int read_proc_stats(long pid, ProcStats* out) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+
+    char line[256];
+    out->rss_kb = -1;
+    out->threads = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) out->rss_kb = strtol(line + 6, NULL, 10);
+        if (strncmp(line, "Threads:", 8) == 0) out->threads = strtol(line + 8, NULL, 10);
+    }
+    fclose(f);
+    return out->rss_kb >= 0;
+}
+
+// Read one frame and check that it starts with the expected prefix.
+static int expect_frame(SOCKET s, const char* prefix) {
+    uint8_t* payload = NULL;
+    uint32_t len = 0;
+    if (!chat_frame_recv_alloc(s, &payload, &len, CHAT_MAX_FRAME)) return 0;
+    int ok = strncmp((const char*)payload, prefix, strlen(prefix)) == 0;
+    free(payload);
+    return ok;
+}
+
+// Connect (optionally from a rotating loopback source address) and AUTH.
+static SOCKET open_authed(const struct sockaddr_in* dst, int src_ips, int idx, const char* password) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+
+    if (src_ips > 1) {
+        // Each source address gets its own ephemeral port range.
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001u + (uint32_t)(idx % src_ips));
+        if (bind(s, (struct sockaddr*)&src, sizeof(src)) != 0) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+    }
+
+    if (connect(s, (const struct sockaddr*)dst, sizeof(*dst)) != 0 || !expect_frame(s, "HELLO")) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    char auth[128];
+    snprintf(auth, sizeof(auth), "AUTH flood%d %s", idx, password);
+    if (!chat_frame_send(s, auth, (uint32_t)strlen(auth)) || !expect_frame(s, "OK AUTH")) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static void burst_fail(Burst* b, BurstConn* c) {
+    closesocket(c->sock);
+    c->sock = INVALID_SOCKET;
+    c->stage = 3;
+    b->failed++;
+}
+
+// One whole frame from the server.
+static void burst_frame(Burst* b, BurstConn* c, int idx, const char* p, uint32_t len, uint64_t now) {
+    if (c->stage == 1 && len >= 5 && memcmp(p, "HELLO", 5) == 0) {
+        char auth[128];
+        snprintf(auth, sizeof(auth), "AUTH flood%d %s", idx, b->password);
+        // Tiny and first on the socket: a non-blocking send takes it whole.
+        if (!chat_frame_send(c->sock, auth, (uint32_t)strlen(auth))) {
+            burst_fail(b, c);
+            return;
+        }
+        c->stage = 2;
+    } else if (c->stage == 2 && len >= 7 && memcmp(p, "OK AUTH", 7) == 0) {
+        b->auth_ns[b->authed++] = now - c->started;
+        c->stage = 3;
+        // Held open, but nothing more to read.
+        (void)epoll_ctl(b->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    } else {
+        burst_fail(b, c);
+    }
+}
+
+static void burst_event(Burst* b, int idx, uint32_t events, uint64_t now) {
+    BurstConn* c = &b->conns[idx];
+    if (c->stage == 3) return;
+    if (c->stage == 0) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &elen) != 0 || err != 0) {
+            burst_fail(b, c);
+            return;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)idx;
+        (void)epoll_ctl(b->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        c->stage = 1;
+        if (!(events & EPOLLIN)) return;
+    }
+    for (;;) {
+        ssize_t r = recv(c->sock, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+        if (r < 0 && errno == EAGAIN) return;
+        if (r <= 0) {
+            burst_fail(b, c);
+            return;
+        }
+        c->len += (uint32_t)r;
+        while (c->stage != 3 && c->len >= 4) {
+            uint32_t net_len;
+            memcpy(&net_len, c->buf, 4);
+            uint32_t flen = ntohl(net_len);
+            if (flen > sizeof(c->buf) - 4) {
+                burst_fail(b, c);
+                return;
+            }
+            if (c->len < 4 + flen) break;
+            burst_frame(b, c, idx, (const char*)c->buf + 4, flen, now);
+            memmove(c->buf, c->buf + 4 + flen, c->len - 4 - flen);
+            c->len -= 4 + flen;
+        }
+        if (c->stage == 3) return;
+    }
+}
+
+static void burst_pump(Burst* b, int wait_ms) {
+    struct epoll_event events[256];
+    int n = epoll_wait(b->epfd, events, 256, wait_ms);
+    uint64_t now = chat_now_ns();
+    for (int k = 0; k < n; k++) burst_event(b, (int)events[k].data.u32, events[k].events, now);
+}
+
+static int run_burst(const struct sockaddr_in* dst, int src_ips, int conns, int hold, const char* password) {
+    Burst b;
+    memset(&b, 0, sizeof(b));
+    b.password = password;
+    b.conns = (BurstConn*)calloc((size_t)conns, sizeof(*b.conns));
+    b.auth_ns = (uint64_t*)calloc((size_t)conns, sizeof(*b.auth_ns));
+    b.epfd = epoll_create1(0);
+    if (!b.conns || !b.auth_ns || b.epfd < 0) return 1;
+
+    uint64_t t0 = chat_now_ns();
+    for (int i = 0; i < conns; i++) {
+        BurstConn* c = &b.conns[i];
+        c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        if (c->sock == INVALID_SOCKET) {
+            printf("socket %d failed: %s\n", i, strerror(errno));
+            c->stage = 3;
+            b.failed++;
+            continue;
+        }
+        if (src_ips > 1) {
+            struct sockaddr_in src;
+            memset(&src, 0, sizeof(src));
+            src.sin_family = AF_INET;
+            src.sin_addr.s_addr = htonl(0x7f000001u + (uint32_t)(i % src_ips));
+            (void)bind(c->sock, (struct sockaddr*)&src, sizeof(src));
+        }
+        c->started = chat_now_ns();
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = (uint32_t)i;
+        if ((connect(c->sock, (const struct sockaddr*)dst, sizeof(*dst)) != 0 && errno != EINPROGRESS) ||
+            epoll_ctl(b.epfd, EPOLL_CTL_ADD, c->sock, &ev) != 0) {
+            burst_fail(&b, c);
+            continue;
+        }
+        // Serve what already came back, so early handshakes are not timed
+        // while this loop is still connecting.
+        if (i % BURST_PASS_EVERY == BURST_PASS_EVERY - 1) burst_pump(&b, 0);
+    }
+    double connect_secs = (double)(chat_now_ns() - t0) / 1e9;
+    uint64_t deadline = t0 + (uint64_t)BURST_WAIT_MS * 1000000u;
+    while (b.authed + b.failed < conns && chat_now_ns() < deadline) burst_pump(&b, 100);
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+
+    qsort(b.auth_ns, (size_t)b.authed, sizeof(*b.auth_ns), bench_cmp_u64);
+    // One machine-readable summary line.
+    printf("burst=%d authed=%d failed=%d pending=%d connect_secs=%.3f all_secs=%.3f auth_p50_ms=%.1f"
+           " auth_p90_ms=%.1f auth_p99_ms=%.1f auth_max_ms=%.1f auth_per_sec=%.0f\n",
+        conns, b.authed, b.failed, conns - b.authed - b.failed, connect_secs, secs,
+        bench_percentile(b.auth_ns, (size_t)b.authed, 0.50) / 1e6,
+        bench_percentile(b.auth_ns, (size_t)b.authed, 0.90) / 1e6,
+        bench_percentile(b.auth_ns, (size_t)b.authed, 0.99) / 1e6,
+        bench_percentile(b.auth_ns, (size_t)b.authed, 1.0) / 1e6,
+        secs > 0 ? (double)b.authed / secs : 0.0);
+
+    sleep((unsigned)hold);
+    for (int i = 0; i < conns; i++) {
+        if (b.conns[i].sock != INVALID_SOCKET) closesocket(b.conns[i].sock);
+    }
+    close(b.epfd);
+    int ok = b.authed == conns;
+    free(b.conns);
+    free(b.auth_ns);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    const char* port = "5555";
+    const char* password = NULL;
+    int conns = 1000;
+    int hold = 5;
+    int src_ips = 1;
+    long server_pid = 0;
+    int burst = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "--conns") == 0 && i + 1 < argc) {
+            conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+            hold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--src-ips") == 0 && i + 1 < argc) {
+            src_ips = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server-pid") == 0 && i + 1 < argc) {
+            server_pid = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--burst") == 0) {
+            burst = 1;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!password || conns <= 0) {
+        usage();
+        return 2;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in dst;
+    if (!bench_parse_addr(host, atoi(port), &dst)) {
+        printf("bad host address: %s\n", host);
+        return 2;
+    }
+
+    if (burst) return run_burst(&dst, src_ips, conns, hold, password);
+
+    ProcStats before = {-1, -1};
+    if (server_pid) (void)read_proc_stats(server_pid, &before);
+
+    SOCKET* socks = (SOCKET*)malloc((size_t)conns * sizeof(SOCKET));
+    if (!socks) return 1;
+
+    uint64_t t0 = chat_now_ns();
+    int opened = 0;
+    for (int i = 0; i < conns; i++) {
+        SOCKET s = open_authed(&dst, src_ips, i, password);
+        if (s == INVALID_SOCKET) {
+            printf("connection %d failed: %s\n", i, strerror(errno));
+            break;
+        }
+        socks[opened++] = s;
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+
+    sleep((unsigned)hold);
+
+    ProcStats after = {-1, -1};
+    if (server_pid) (void)read_proc_stats(server_pid, &after);
+
+    // One machine-readable summary line.
+    printf("conns=%d connect_secs=%.3f conn_per_sec=%.0f", opened, secs, secs > 0 ? opened / secs : 0.0);
+    if (server_pid && after.rss_kb >= 0) {
+        long delta_kb = after.rss_kb - before.rss_kb;
+        printf(" server_rss_kb=%ld server_threads=%ld rss_per_conn_bytes=%.0f",
+            after.rss_kb, after.threads, opened ? (double)delta_kb * 1024.0 / opened : 0.0);
+    }
+    printf("\n");
+
+    for (int i = 0; i < opened; i++) closesocket(socks[i]);
+    free(socks);
+    return opened == conns ? 0 : 1;
+}
@@ -0,0 +1,285 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "chat_frame.h"
+
+// Broadcast contention benchmark (Linux).
+// Every sender joins every hot room; at a fixed total rate, senders take
+// turns posting MSG frames stamped with the send time, so many threads (in
+// threaded mode) broadcast into the same rooms at once. Churn clients keep
+// joining and leaving those rooms meanwhile. Each member times every
+// ROOMMSG it receives, and the run reports delivery latency percentiles.
+// It also reports TCP segments sent machine-wide (/proc/net/snmp OutSegs)
+// per delivery; against a local server that is both directions plus ACKs,
+// so compare runs rather than reading it as the server's count alone.
+
+#define CONTENTION_FRAME_MAX 1024 // Largest frame a member reassembles.
+
+typedef struct Member {
+    SOCKET sock;
+    uint8_t buf[4 + CONTENTION_FRAME_MAX];
+    uint32_t have; // Bytes buffered toward the current frame.
+    int joined; // Churn clients: currently in their room.
+} Member;
+
+typedef struct Samples {
+    uint64_t* ns;
+    size_t count;
+    size_t cap;
+} Samples;
+
+static void usage(void) {
+    printf("chat_contention --password <pw> [--host <ip>] [--port <port>] [--senders <n>]\n"
+           "                [--rooms <n>] [--rate <msgs/s>] [--seconds <n>] [--churn <n>]\n");
+}
+
+static SOCKET open_member(const struct sockaddr_in* dst, const char* name, const char* password) {
+    SOCKET s = bench_connect(dst);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "AUTH %s %s", name, password);
+    if (!chat_frame_send(s, cmd, (uint32_t)strlen(cmd)) || !bench_wait_frame(s, "OK AUTH", NULL, 0)) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static int join_room(SOCKET s, int room) {
+    char cmd[64];
+    int len = snprintf(cmd, sizeof(cmd), "JOIN hot%d", room);
+    return chat_frame_send(s, cmd, (uint32_t)len) && bench_wait_frame(s, "OK JOIN", NULL, 0);
+}
+
+// Queue a whole frame on a non-blocking socket, waiting out a full buffer.
+static int send_frame_nb(SOCKET s, const char* payload, uint32_t len) {
+    uint8_t frame[4 + CONTENTION_FRAME_MAX];
+    uint32_t net_len = htonl(len);
+    memcpy(frame, &net_len, 4);
+    memcpy(frame + 4, payload, len);
+    size_t off = 0;
+    while (off < 4 + (size_t)len) {
+        ssize_t w = send(s, frame + off, 4 + (size_t)len - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EAGAIN) {
+            WSAPOLLFD pfd = {s, POLLOUT, 0};
+            (void)WSAPoll(&pfd, 1, 100);
+            continue;
+        }
+        if (w <= 0) return 0;
+        off += (size_t)w;
+    }
+    return 1;
+}
+
+static void sample_add(Samples* s, uint64_t ns) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 65536;
+        uint64_t* p = (uint64_t*)realloc(s->ns, cap * sizeof(*p));
+        if (!p) return;
+        s->ns = p;
+        s->cap = cap;
+    }
+    s->ns[s->count++] = ns;
+}
+
+// Tcp OutSegs from /proc/net/snmp: a header line naming the fields, then a
+// line of values. Returns 0 if unavailable.
+static unsigned long long tcp_out_segs(void) {
+    FILE* f = fopen("/proc/net/snmp", "r");
+    if (!f) return 0;
+    char names[1024], values[1024];
+    unsigned long long segs = 0;
+    while (fgets(names, sizeof(names), f)) {
+        if (strncmp(names, "Tcp:", 4) != 0) continue;
+        if (!fgets(values, sizeof(values), f)) break;
+        char* save_n = NULL;
+        char* save_v = NULL;
+        char* n = strtok_r(names, " \n", &save_n);
+        char* v = strtok_r(values, " \n", &save_v);
+        while (n && v) {
+            if (strcmp(n, "OutSegs") == 0) segs = strtoull(v, NULL, 10);
+            n = strtok_r(NULL, " \n", &save_n);
+            v = strtok_r(NULL, " \n", &save_v);
+        }
+        break;
+    }
+    fclose(f);
+    return segs;
+}
+
+// Split received bytes into frames; ROOMMSG text is the send timestamp.
+static void member_consume(Member* m, const uint8_t* p, size_t n, Samples* lat) {
+    for (;;) {
+        uint32_t want = 4;
+        if (m->have >= 4) {
+            uint32_t net_len;
+            memcpy(&net_len, m->buf, 4);
+            want = 4 + ntohl(net_len);
+            if (m->have == want) {
+                if (want < sizeof(m->buf) && strncmp((const char*)m->buf + 4, "ROOMMSG ", 8) == 0) {
+                    m->buf[want] = 0;
+                    const char* text = strstr((const char*)m->buf + 4, " :");
+                    if (text) sample_add(lat, chat_now_ns() - strtoull(text + 2, NULL, 10));
+                }
+                m->have = 0;
+                continue;
+            }
+        }
+        if (n == 0) return;
+        size_t take = want - m->have < n ? want - m->have : n;
+        if (m->have + take <= sizeof(m->buf)) memcpy(m->buf + m->have, p, take);
+        m->have += (uint32_t)take;
+        p += take;
+        n -= take;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    const char* port = "5555";
+    const char* password = NULL;
+    int senders = 64;
+    int rooms = 4;
+    int rate = 2000;
+    int seconds = 5;
+    int churn = 4;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "--senders") == 0 && i + 1 < argc) {
+            senders = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc) {
+            rooms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--churn") == 0 && i + 1 < argc) {
+            churn = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!password || senders <= 0 || rooms <= 0 || rate <= 0 || seconds <= 0 || churn < 0) {
+        usage();
+        return 2;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in dst;
+    if (!bench_parse_addr(host, atoi(port), &dst)) {
+        printf("bad host address: %s\n", host);
+        return 2;
+    }
+
+    // Senders first, then churn clients; everyone reads.
+    int total = senders + churn;
+    Member* m = (Member*)calloc((size_t)total, sizeof(*m));
+    if (!m) return 1;
+    for (int i = 0; i < total; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), i < senders ? "hot%d" : "churn%d", i);
+        m[i].sock = open_member(&dst, name, password);
+        if (m[i].sock == INVALID_SOCKET) {
+            printf("client %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        for (int k = 0; i < senders && k < rooms; k++) {
+            if (!join_room(m[i].sock, k)) return 1;
+        }
+    }
+
+    int epfd = epoll_create1(0);
+    for (int i = 0; i < total; i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (!chat_socket_set_nonblocking(m[i].sock) || epoll_ctl(epfd, EPOLL_CTL_ADD, m[i].sock, &ev) != 0) return 1;
+    }
+
+    Samples lat = {NULL, 0, 0};
+    static uint8_t rbuf[64 * 1024];
+    struct epoll_event events[256];
+    long sent = 0;
+    long churn_ops = 0;
+    uint64_t run_ns = (uint64_t)seconds * 1000000000ull;
+    unsigned long long segs0 = tcp_out_segs();
+    uint64_t t0 = chat_now_ns();
+    uint64_t last_rx = t0;
+
+    // Send on schedule, then keep reading until deliveries go quiet.
+    for (;;) {
+        uint64_t now = chat_now_ns();
+        uint64_t elapsed = now - t0;
+        if (elapsed < run_ns) {
+            long due = (long)(elapsed * (uint64_t)rate / 1000000000ull);
+            for (; sent < due; sent++) {
+                char msg[64];
+                int len = snprintf(msg, sizeof(msg), "MSG hot%ld :%llu", sent % rooms,
+                    (unsigned long long)chat_now_ns());
+                if (!send_frame_nb(m[sent % senders].sock, msg, (uint32_t)len)) return 1;
+            }
+            // Churn: one JOIN or LEAVE per client per millisecond at most.
+            for (int i = senders; i < total; i++) {
+                char cmd[64];
+                int len = snprintf(cmd, sizeof(cmd), "%s hot%d", m[i].joined ? "LEAVE" : "JOIN", i % rooms);
+                if (!send_frame_nb(m[i].sock, cmd, (uint32_t)len)) return 1;
+                m[i].joined = !m[i].joined;
+                churn_ops++;
+            }
+        } else if (now - last_rx > 1000000000ull) {
+            break;
+        }
+
+        int n = epoll_wait(epfd, events, 256, 1);
+        if (n < 0) return 1;
+        for (int k = 0; k < n; k++) {
+            Member* mm = &m[events[k].data.u32];
+            for (;;) {
+                ssize_t r = recv(mm->sock, rbuf, sizeof(rbuf), 0);
+                if (r <= 0) {
+                    if (r < 0 && errno == EAGAIN) break;
+                    printf("client disconnected\n");
+                    return 1;
+                }
+                member_consume(mm, rbuf, (size_t)r, &lat);
+                last_rx = chat_now_ns();
+            }
+        }
+    }
+
+    unsigned long long segs = tcp_out_segs() - segs0;
+    qsort(lat.ns, lat.count, sizeof(*lat.ns), bench_cmp_u64);
+    long expected = sent * senders;
+    // One machine-readable summary line.
+    printf("senders=%d rooms=%d churn=%d rate=%d seconds=%d sent=%ld churn_ops=%ld deliveries=%zu"
+           " expected_min=%ld p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f tcp_segs=%llu"
+           " segs_per_delivery=%.3f\n",
+        senders, rooms, churn, rate, seconds, sent, churn_ops, lat.count, expected,
+        bench_percentile(lat.ns, lat.count, 0.50) / 1e3, bench_percentile(lat.ns, lat.count, 0.99) / 1e3,
+        bench_percentile(lat.ns, lat.count, 0.999) / 1e3, lat.count ? (double)lat.ns[lat.count - 1] / 1000.0 : 0.0,
+        segs, lat.count ? (double)segs / (double)lat.count : 0.0);
+
+    for (int i = 0; i < total; i++) closesocket(m[i].sock);
+    free(lat.ns);
+    free(m);
+    return lat.count >= (size_t)expected ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+#include "chat_platform.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "chat_frame.h"
+
+// Room fan-out benchmark (Linux).
+// Joins N members to one room, has one of them send M messages in
+// pipelined bursts while all members read, and reports delivery rate plus
+// the server's own write-syscall count (summed from every member's QUEUE
+// reply), i.e. syscalls per delivered message. With --deflate members
+// negotiate compression, and bytes received per delivery show what it saves.
+
+#define FANOUT_WINDOW 256 // Max messages in flight ahead of the slowest reader.
+
+typedef struct Member {
+    SOCKET sock;
+    uint8_t hdr[4];
+    uint32_t hdr_len;
+    uint32_t need; // Payload bytes left in the current frame.
+    long frames;
+} Member;
+
+typedef struct QueueStats {
+    unsigned long long sent;
+    unsigned long long writes;
+} QueueStats;
+
+static void usage(void) {
+    printf("chat_fanout --password <pw> [--host <ip>] [--port <port>] [--members <n>]\n"
+           "            [--messages <n>] [--burst <n>] [--size <bytes>] [--deflate]\n");
+}
+
+static SOCKET open_member(const struct sockaddr_in* dst, int idx, const char* password, int deflate) {
+    SOCKET s = bench_connect(dst);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    if (deflate && (!chat_frame_send(s, "HELLO 1 deflate", 15) || !bench_wait_frame(s, "HELLO 1 deflate", NULL, 0))) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "AUTH fan%d %s", idx, password);
+    if (!chat_frame_send(s, cmd, (uint32_t)strlen(cmd)) || !bench_wait_frame(s, "OK AUTH", NULL, 0) ||
+        !chat_frame_send(s, "JOIN fanout", 11) || !bench_wait_frame(s, "OK JOIN", NULL, 0)) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// Sum the server-side queue counters over all members (sockets must be blocking).
+static int collect_stats(Member* m, int count, QueueStats* out) {
+    out->sent = 0;
+    out->writes = 0;
+    for (int i = 0; i < count; i++) {
+        char reply[128];
+        unsigned frames, bytes, hwm, dropped, sent, writes;
+        if (!chat_frame_send(m[i].sock, "QUEUE", 5) || !bench_wait_frame(m[i].sock, "QUEUE ", reply, sizeof(reply))) {
+            return 0;
+        }
+        if (sscanf(reply, "QUEUE %u %u %u %u %u %u", &frames, &bytes, &hwm, &dropped, &sent, &writes) != 6) return 0;
+        out->sent += sent;
+        out->writes += writes;
+    }
+    return 1;
+}
+
+// Count complete frames in newly received bytes.
+static void member_consume(Member* m, const uint8_t* p, size_t n) {
+    while (n > 0) {
+        if (m->hdr_len < 4) {
+            m->hdr[m->hdr_len++] = *p++;
+            n--;
+            if (m->hdr_len < 4) continue;
+            uint32_t net_len;
+            memcpy(&net_len, m->hdr, 4);
+            m->need = ntohl(net_len);
+        }
+        size_t take = m->need < n ? m->need : n;
+        m->need -= (uint32_t)take;
+        p += take;
+        n -= take;
+        if (m->need == 0) {
+            m->frames++;
+            m->hdr_len = 0;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    const char* port = "5555";
+    const char* password = NULL;
+    int members = 1000;
+    int messages = 1000;
+    int burst = 16;
+    int size = 64;
+    int deflate = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "--members") == 0 && i + 1 < argc) {
+            members = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc) {
+            burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--deflate") == 0) {
+            deflate = 1;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!password || members <= 0 || messages <= 0 || burst <= 0 || size <= 0 || size > 900) {
+        usage();
+        return 2;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in dst;
+    if (!bench_parse_addr(host, atoi(port), &dst)) {
+        printf("bad host address: %s\n", host);
+        return 2;
+    }
+
+    Member* m = (Member*)calloc((size_t)members, sizeof(*m));
+    if (!m) return 1;
+    for (int i = 0; i < members; i++) {
+        m[i].sock = open_member(&dst, i, password, deflate);
+        if (m[i].sock == INVALID_SOCKET) {
+            printf("member %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+
+    // Flush the USERJOIN backlog so only the measured messages remain.
+    for (int i = 0; i < members; i++) {
+        if (!chat_frame_send(m[i].sock, "PING", 4) || !bench_wait_frame(m[i].sock, "PONG", NULL, 0)) return 1;
+    }
+    QueueStats before;
+    if (!collect_stats(m, members, &before)) return 1;
+
+    int epfd = epoll_create1(0);
+    for (int i = 0; i < members; i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (!chat_socket_set_nonblocking(m[i].sock) || epoll_ctl(epfd, EPOLL_CTL_ADD, m[i].sock, &ev) != 0) return 1;
+    }
+
+    // One burst is a run of back-to-back MSG frames sent with a single write.
+    // The text is made of words so compression sees something chat-like.
+    static const char* words[] = {"the", "build", "is", "green", "can", "you", "review", "my", "patch", "thanks",
+        "deploy", "failed", "on", "staging", "because", "of", "a", "flaky", "test", "meeting", "tomorrow", "okay"};
+    char text[1024];
+    uint32_t rng = 2463534242u;
+    for (int i = 0; i < size;) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        const char* w = words[rng % (sizeof(words) / sizeof(words[0]))];
+        for (; *w && i < size; w++) text[i++] = *w;
+        if (i < size) text[i++] = ' ';
+    }
+    text[size] = 0;
+    size_t frame_max = 4 + strlen("MSG fanout :") + (size_t)size;
+    uint8_t* out = (uint8_t*)malloc(frame_max * (size_t)burst);
+    static uint8_t rbuf[64 * 1024];
+    struct epoll_event events[256];
+    if (!out) return 1;
+
+    uint64_t t0 = chat_now_ns();
+    long expected = (long)members * messages;
+    long delivered = 0;
+    unsigned long long rx_bytes = 0;
+    int sent = 0;
+    while (delivered < expected) {
+        long slowest = messages;
+        for (int i = 0; i < members; i++) {
+            if (m[i].frames < slowest) slowest = m[i].frames;
+        }
+        int can_send = sent < messages && sent - slowest < FANOUT_WINDOW;
+        if (can_send) {
+            size_t len = 0;
+            int n = 0;
+            for (; n < burst && sent + n < messages; n++) {
+                char msg[1024];
+                int plen = snprintf(msg, sizeof(msg), "MSG fanout :%s", text);
+                uint32_t net_len = htonl((uint32_t)plen);
+                memcpy(out + len, &net_len, 4);
+                memcpy(out + len + 4, msg, (size_t)plen);
+                len += 4 + (size_t)plen;
+            }
+            // Write the whole burst, waiting out a full socket buffer.
+            size_t off = 0;
+            while (off < len) {
+                ssize_t w = send(m[0].sock, out + off, len - off, MSG_NOSIGNAL);
+                if (w < 0 && errno == EAGAIN) {
+                    WSAPOLLFD pfd = {m[0].sock, POLLOUT, 0};
+                    (void)WSAPoll(&pfd, 1, 100);
+                    continue;
+                }
+                if (w <= 0) return 1;
+                off += (size_t)w;
+            }
+            sent += n;
+        }
+
+        int n = epoll_wait(epfd, events, 256, can_send ? 0 : 2000);
+        if (n < 0) return 1;
+        if (n == 0 && !can_send) {
+            printf("timed out waiting for deliveries (%ld of %ld)\n", delivered, expected);
+            return 1;
+        }
+        for (int k = 0; k < n; k++) {
+            Member* mm = &m[events[k].data.u32];
+            for (;;) {
+                ssize_t r = recv(mm->sock, rbuf, sizeof(rbuf), 0);
+                if (r <= 0) {
+                    if (r < 0 && errno == EAGAIN) break;
+                    printf("member disconnected\n");
+                    return 1;
+                }
+                rx_bytes += (unsigned long long)r;
+                long prev = mm->frames;
+                member_consume(mm, rbuf, (size_t)r);
+                delivered += mm->frames - prev;
+            }
+        }
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+
+    QueueStats after;
+    for (int i = 0; i < members; i++) {
+        int flags = fcntl(m[i].sock, F_GETFL, 0);
+        (void)fcntl(m[i].sock, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    if (!collect_stats(m, members, &after)) return 1;
+    unsigned long long writes = after.writes - before.writes;
+
+    // One machine-readable summary line.
+    printf("members=%d messages=%d burst=%d size=%d deflate=%d deliveries=%ld secs=%.3f deliveries_per_sec=%.0f"
+           " server_writes=%llu writes_per_delivery=%.4f rx_bytes_per_delivery=%.1f\n",
+        members, messages, burst, size, deflate, delivered, secs, secs > 0 ? delivered / secs : 0.0, writes,
+        delivered ? (double)writes / (double)delivered : 0.0, delivered ? (double)rx_bytes / (double)delivered : 0.0);
+
+    for (int i = 0; i < members; i++) closesocket(m[i].sock);
+    free(out);
+    free(m);
+    return 0;
+}
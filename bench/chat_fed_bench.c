@@ -0,0 +1,272 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "chat_frame.h"
+
+// Cross-node fan-out latency benchmark (Linux).
+// Spreads N members round-robin over the nodes of a federation (member 0,
+// the sender, is on the first node), joins them all to one room, and has
+// the sender post M timestamped messages one at a time, each once every
+// member has the last. Reports delivery latency percentiles separately for
+// members on the sender's node and members on other nodes; the difference
+// is what a peer link hop costs. Run against a single node it measures
+// plain local fan-out.
+
+#define FED_NODES_MAX 64
+#define FED_FRAME_MAX 512 // Largest frame a member needs to keep.
+
+// Latencies in ns, by whether the member shares the sender's node.
+typedef struct Latencies {
+    uint64_t* local;
+    long local_count;
+    uint64_t* remote;
+    long remote_count;
+} Latencies;
+
+typedef struct Member {
+    SOCKET sock;
+    int node; // Index into --ports.
+    int sender; // Its own copies are not measured.
+    uint8_t buf[FED_FRAME_MAX + 4];
+    uint32_t len;
+    uint32_t skip; // Bytes left of a frame too long to be ours.
+    long got; // Measured messages received.
+    long probe; // Highest probe number received.
+} Member;
+
+static void usage(void) {
+    printf("chat_fed_bench --password <pw> --ports <port>[,<port>...] [--host <ip>] [--members <n>]\n"
+           "               [--messages <n>]\n");
+}
+
+static SOCKET open_member(const struct sockaddr_in* dst, int idx, const char* password) {
+    SOCKET s = bench_connect(dst);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "AUTH fed%d %s", idx, password);
+    if (!chat_frame_send(s, cmd, (uint32_t)strlen(cmd)) || !bench_wait_frame(s, "OK AUTH", NULL, 0) ||
+        !chat_frame_send(s, "JOIN fedbench", 13) || !bench_wait_frame(s, "OK JOIN", NULL, 0)) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// Handle one whole frame: a probe or a timestamped message from the sender.
+static void member_frame(Member* m, const char* p, uint32_t len, uint64_t now, Latencies* lat) {
+    static const char head[] = "ROOMMSG fedbench fed0 :";
+    if (len < sizeof(head) - 1 || memcmp(p, head, sizeof(head) - 1) != 0) return;
+    p += sizeof(head) - 1;
+    if (*p == 'p') {
+        long n = atol(p + 1);
+        if (n > m->probe) m->probe = n;
+        return;
+    }
+    uint64_t sent = strtoull(p, NULL, 10);
+    m->got++;
+    if (m->sender) return;
+    if (m->node == 0) lat->local[lat->local_count++] = now - sent;
+    else lat->remote[lat->remote_count++] = now - sent;
+}
+
+// Reassemble frames from newly received bytes.
+static void member_consume(Member* m, const uint8_t* p, size_t n, uint64_t now, Latencies* lat) {
+    while (n > 0) {
+        if (m->skip) {
+            size_t take = m->skip < n ? m->skip : n;
+            m->skip -= (uint32_t)take;
+            p += take;
+            n -= take;
+            continue;
+        }
+        size_t room = sizeof(m->buf) - m->len;
+        size_t take = n < room ? n : room;
+        memcpy(m->buf + m->len, p, take);
+        m->len += (uint32_t)take;
+        p += take;
+        n -= take;
+        for (;;) {
+            if (m->len < 4) break;
+            uint32_t net_len;
+            memcpy(&net_len, m->buf, 4);
+            uint32_t flen = ntohl(net_len);
+            if (flen > FED_FRAME_MAX) {
+                // Not a ROOMMSG from the sender: skip the rest of it.
+                m->skip = flen - (m->len - 4);
+                m->len = 0;
+                break;
+            }
+            if (m->len < 4 + flen) break;
+            char frame[FED_FRAME_MAX + 1];
+            memcpy(frame, m->buf + 4, flen);
+            frame[flen] = 0;
+            member_frame(m, frame, flen, now, lat);
+            memmove(m->buf, m->buf + 4 + flen, m->len - 4 - flen);
+            m->len -= 4 + flen;
+        }
+    }
+}
+
+// Read whatever is ready; returns 0 when a member disconnects.
+static int pump(int epfd, Member* m, int wait_ms, Latencies* lat) {
+    static uint8_t rbuf[64 * 1024];
+    struct epoll_event events[256];
+    int n = epoll_wait(epfd, events, 256, wait_ms);
+    if (n < 0) return errno == EINTR;
+    uint64_t now = chat_now_ns();
+    for (int k = 0; k < n; k++) {
+        Member* mm = &m[events[k].data.u32];
+        for (;;) {
+            ssize_t r = recv(mm->sock, rbuf, sizeof(rbuf), 0);
+            if (r <= 0) {
+                if (r < 0 && errno == EAGAIN) break;
+                printf("member disconnected\n");
+                return 0;
+            }
+            member_consume(mm, rbuf, (size_t)r, now, lat);
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    const char* ports = NULL;
+    const char* password = NULL;
+    int members = 30;
+    int messages = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--ports") == 0 && i + 1 < argc) {
+            ports = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "--members") == 0 && i + 1 < argc) {
+            members = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!password || !ports || members < 2 || messages <= 0) {
+        usage();
+        return 2;
+    }
+
+    struct sockaddr_in dst[FED_NODES_MAX];
+    int nodes = 0;
+    for (const char* p = ports; *p && nodes < FED_NODES_MAX;) {
+        char* end = NULL;
+        long port = strtol(p, &end, 10);
+        if (port <= 0 || port > 65535 || (*end && *end != ',')) {
+            usage();
+            return 2;
+        }
+        if (!bench_parse_addr(host, (int)port, &dst[nodes])) {
+            printf("bad host address: %s\n", host);
+            return 2;
+        }
+        nodes++;
+        p = *end ? end + 1 : end;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Member* m = (Member*)calloc((size_t)members, sizeof(*m));
+    Latencies lat;
+    lat.local = (uint64_t*)malloc((size_t)members * (size_t)messages * sizeof(*lat.local));
+    lat.remote = (uint64_t*)malloc((size_t)members * (size_t)messages * sizeof(*lat.remote));
+    lat.local_count = 0;
+    lat.remote_count = 0;
+    if (!m || !lat.local || !lat.remote) return 1;
+    int epfd = epoll_create1(0);
+    int remote_members = 0;
+    for (int i = 0; i < members; i++) {
+        m[i].node = i % nodes;
+        m[i].sender = i == 0;
+        m[i].sock = open_member(&dst[m[i].node], i, password);
+        if (m[i].sock == INVALID_SOCKET) {
+            printf("member %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        if (m[i].node) remote_members++;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (!chat_socket_set_nonblocking(m[i].sock) || epoll_ctl(epfd, EPOLL_CTL_ADD, m[i].sock, &ev) != 0) return 1;
+    }
+
+    // Membership crosses the links asynchronously: probe until one message
+    // reaches everyone, so the measured ones see the settled room.
+    for (long probe = 1;; probe++) {
+        if (probe > 50) {
+            printf("room did not settle across nodes\n");
+            return 1;
+        }
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "MSG fedbench :p%ld", probe);
+        if (!chat_frame_send(m[0].sock, msg, (uint32_t)len)) return 1;
+        uint64_t deadline = chat_now_ns() + 200000000ull;
+        int all = 0;
+        while (!all && chat_now_ns() < deadline) {
+            if (!pump(epfd, m, 20, &lat)) return 1;
+            all = 1;
+            for (int i = 1; i < members; i++) all &= m[i].probe >= probe;
+        }
+        if (all) break;
+    }
+
+    uint64_t t0 = chat_now_ns();
+    for (int k = 0; k < messages; k++) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "MSG fedbench :%llu", (unsigned long long)chat_now_ns());
+        if (!chat_frame_send(m[0].sock, msg, (uint32_t)len)) return 1;
+        for (int i = 0; i < members;) {
+            if (m[i].got > k) {
+                i++;
+                continue;
+            }
+            uint64_t waited = chat_now_ns();
+            if (!pump(epfd, m, 2000, &lat)) return 1;
+            if (m[i].got <= k && chat_now_ns() - waited >= 2000000000ull) {
+                printf("timed out waiting for deliveries (message %d)\n", k);
+                return 1;
+            }
+        }
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+
+    qsort(lat.local, (size_t)lat.local_count, sizeof(*lat.local), bench_cmp_u64);
+    qsort(lat.remote, (size_t)lat.remote_count, sizeof(*lat.remote), bench_cmp_u64);
+
+    // One machine-readable summary line.
+    printf("nodes=%d members=%d remote_members=%d messages=%d secs=%.3f"
+           " local_p50_us=%.1f local_p99_us=%.1f remote_p50_us=%.1f remote_p99_us=%.1f remote_max_us=%.1f\n",
+        nodes, members, remote_members, messages, secs,
+        bench_percentile(lat.local, (size_t)lat.local_count, 0.50) / 1e3,
+        bench_percentile(lat.local, (size_t)lat.local_count, 0.99) / 1e3,
+        bench_percentile(lat.remote, (size_t)lat.remote_count, 0.50) / 1e3,
+        bench_percentile(lat.remote, (size_t)lat.remote_count, 0.99) / 1e3,
+        bench_percentile(lat.remote, (size_t)lat.remote_count, 1.0) / 1e3);
+
+    for (int i = 0; i < members; i++) closesocket(m[i].sock);
+    free(lat.local);
+    free(lat.remote);
+    free(m);
+    return 0;
+}
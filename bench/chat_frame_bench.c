@@ -0,0 +1,165 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_frame.h"
+
+// Frame decoder benchmark.
+// Encodes a pipelined stream of frames (sizes cycling through a small
+// mix), then decodes it delivered in chunks of various sizes, once with
+// ChatFrameDecoder and once with the per-frame malloc reassembly it
+// replaced. Both sum the payload bytes so the work can't be skipped and
+// the two results can be checked against each other.
+
+typedef struct AllocReader {
+    uint8_t hdr[4];
+    uint32_t hdr_len;
+    uint8_t* buf;
+    uint32_t len;
+    uint32_t need;
+} AllocReader;
+
+static void usage(void) {
+    printf("chat_frame_bench [--frames <n>] [--rounds <n>]\n");
+}
+
+static uint64_t checksum(const uint8_t* p, uint32_t len) {
+    uint64_t sum = len;
+    if (len > 0) sum += p[0] + p[len - 1];
+    return sum;
+}
+
+// The previous reassembly: stage the prefix, then malloc each payload.
+static int alloc_consume(AllocReader* r, const uint8_t* p, size_t n, long* frames, uint64_t* sum) {
+    while (n > 0) {
+        if (r->hdr_len < 4) {
+            size_t take = 4u - r->hdr_len;
+            if (take > n) take = n;
+            memcpy(r->hdr + r->hdr_len, p, take);
+            r->hdr_len += (uint32_t)take;
+            p += take;
+            n -= take;
+            if (r->hdr_len < 4) return 1;
+            uint32_t net_len;
+            memcpy(&net_len, r->hdr, 4);
+            r->need = ntohl(net_len);
+            if (r->need > CHAT_MAX_FRAME) return 0;
+            r->buf = (uint8_t*)malloc(r->need + 1u);
+            if (!r->buf) return 0;
+            r->len = 0;
+        }
+        size_t take = r->need - r->len;
+        if (take > n) take = n;
+        memcpy(r->buf + r->len, p, take);
+        r->len += (uint32_t)take;
+        p += take;
+        n -= take;
+        if (r->len == r->need) {
+            r->buf[r->len] = 0;
+            *sum += checksum(r->buf, r->len);
+            (*frames)++;
+            free(r->buf);
+            r->buf = NULL;
+            r->hdr_len = 0;
+        }
+    }
+    return 1;
+}
+
+// Both readers copy each chunk into a receive buffer first, as recv() would.
+static double run_alloc(uint8_t* stream, size_t size, size_t chunk, int rounds, long* frames, uint64_t* sum) {
+    uint8_t* rbuf = (uint8_t*)malloc(chunk);
+    if (!rbuf) exit(1);
+    uint64_t t0 = chat_now_ns();
+    for (int k = 0; k < rounds; k++) {
+        AllocReader r;
+        memset(&r, 0, sizeof(r));
+        for (size_t off = 0; off < size; off += chunk) {
+            size_t n = size - off < chunk ? size - off : chunk;
+            memcpy(rbuf, stream + off, n);
+            if (!alloc_consume(&r, rbuf, n, frames, sum)) exit(1);
+        }
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+    free(rbuf);
+    return secs;
+}
+
+static double run_decoder(uint8_t* stream, size_t size, size_t chunk, int rounds, long* frames, uint64_t* sum) {
+    uint8_t* rbuf = (uint8_t*)malloc(chunk + 1);
+    if (!rbuf) exit(1);
+    uint64_t t0 = chat_now_ns();
+    for (int k = 0; k < rounds; k++) {
+        ChatFrameDecoder d;
+        chat_decoder_init(&d, CHAT_MAX_FRAME);
+        for (size_t off = 0; off < size; off += chunk) {
+            size_t n = size - off < chunk ? size - off : chunk;
+            memcpy(rbuf, stream + off, n);
+            chat_decoder_feed(&d, rbuf, n);
+            uint8_t* payload = NULL;
+            uint32_t len = 0;
+            int r;
+            while ((r = chat_decoder_next(&d, &payload, &len)) > 0) {
+                *sum += checksum(payload, len);
+                (*frames)++;
+            }
+            if (r < 0) exit(1);
+        }
+        chat_decoder_free(&d);
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+    free(rbuf);
+    return secs;
+}
+
+int main(int argc, char** argv) {
+    int nframes = 200000;
+    int rounds = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            nframes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (nframes <= 0 || rounds <= 0) {
+        usage();
+        return 2;
+    }
+
+    // Mostly chat-sized frames, with the odd empty and large one.
+    static const uint32_t sizes[] = {24, 48, 64, 0, 96, 32, 200, 4000};
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t size = 0;
+    for (int i = 0; i < nframes; i++) size += 4 + sizes[(size_t)i % nsizes];
+    uint8_t* stream = (uint8_t*)malloc(size);
+    if (!stream) return 1;
+    size_t off = 0;
+    for (int i = 0; i < nframes; i++) {
+        uint32_t len = sizes[(size_t)i % nsizes];
+        uint32_t net_len = htonl(len);
+        memcpy(stream + off, &net_len, 4);
+        for (uint32_t j = 0; j < len; j++) stream[off + 4 + j] = (uint8_t)('a' + (i + j) % 26);
+        off += 4 + len;
+    }
+
+    static const size_t chunks[] = {1, 7, 64, 1500, 16384, 65536};
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        long old_frames = 0;
+        long new_frames = 0;
+        uint64_t old_sum = 0;
+        uint64_t new_sum = 0;
+        double old_secs = run_alloc(stream, size, chunks[c], rounds, &old_frames, &old_sum);
+        double new_secs = run_decoder(stream, size, chunks[c], rounds, &new_frames, &new_sum);
+        printf("chunk=%zu frames=%ld alloc_frames_per_sec=%.0f decoder_frames_per_sec=%.0f speedup=%.2f match=%d\n",
+            chunks[c], new_frames, old_frames / old_secs, new_frames / new_secs, old_secs / new_secs,
+            old_frames == new_frames && old_sum == new_sum);
+    }
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "chat_cmd.h"
+#include "server.h"
+
+// Room history benchmark.
+// Fills --rooms rooms with --depth ROOMMSG events each through
+// history_append, as broadcast_room does, and reports the history bytes
+// per room and per message. Then replays whole histories of random rooms
+// to a v1 and a v2 client whose send_frame only counts frames, and
+// compares that with formatting and framing the same messages again.
+// Finally refills with the memory limit at a quarter of what the rooms
+// need and reports how many rooms keep their history.
+
+typedef struct Sink {
+    uint64_t frames;
+    uint64_t bytes;
+} Sink;
+
+static Sink sink;
+static uint32_t rng_state = 2463534242u;
+
+static void usage(void) {
+    printf("chat_history_bench [--rooms <n>] [--depth <n>] [--text <bytes>] [--replays <n>]\n");
+}
+
+// Stands in for a backend: the frame is counted, not queued.
+static int count_frame(ServerState* st, Client* c, OutFrame* f) {
+    (void)st;
+    (void)c;
+    sink.frames++;
+    sink.bytes += f->len;
+    return 1;
+}
+
+static void fill_text(char* out, int avg) {
+    int len = avg / 2 + (int)(bench_rng_next(&rng_state) % (uint32_t)(avg + 1));
+    for (int i = 0; i < len; i++) out[i] = (char)('a' + bench_rng_next(&rng_state) % 26);
+    out[len] = 0;
+}
+
+// One event in both versions, as a kept broadcast builds it.
+static int build_event(Room* r, const char* user, uint32_t user_id, int text_avg, OutFrames* fs) {
+    char text[1024], out[1200];
+    fill_text(text, text_avg);
+    if (!chat_cmd_format(out, sizeof(out), "ROOMMSG", r->name, user, text)) return 0;
+    uint8_t bin[1200];
+    ChatBinWriter w;
+    chat_bw_init(&w, bin, sizeof(bin));
+    chat_bw_u8(&w, CHAT_OP_ROOMMSG);
+    chat_bw_varint(&w, r->id);
+    chat_bw_varint(&w, user_id);
+    chat_bw_text(&w, text);
+    fs->text = outframe_new(out, (uint32_t)strlen(out));
+    fs->bin = outframe_new_bin(w.buf, w.len);
+    fs->text_zip = NULL;
+    fs->bin_zip = NULL;
+    return fs->text && fs->bin;
+}
+
+// Append depth events to every room; returns ns per append.
+static double fill(ServerState* st, Room** rooms, int count, uint32_t depth, int text_avg) {
+    uint64_t ns = 0;
+    for (int i = 0; i < count; i++) {
+        for (uint32_t k = 0; k < depth; k++) {
+            OutFrames fs;
+            if (!build_event(rooms[i], "user_0042", 42, text_avg, &fs)) exit(1);
+            uint64_t t0 = chat_now_ns();
+            history_append(st, rooms[i], &fs);
+            ns += chat_now_ns() - t0;
+            outframes_release(&fs);
+        }
+    }
+    return (double)ns / ((double)count * depth);
+}
+
+int main(int argc, char** argv) {
+    int rooms = 10000;
+    long depth = CHAT_HISTORY_DEFAULT;
+    int text_avg = 64;
+    int replays = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc) {
+            rooms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--text") == 0 && i + 1 < argc) {
+            text_avg = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replays") == 0 && i + 1 < argc) {
+            replays = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (rooms <= 0 || depth <= 0 || depth > (long)CHAT_HISTORY_MAX || text_avg <= 0 || text_avg > 600 ||
+        replays <= 0) {
+        usage();
+        return 2;
+    }
+
+    state_pools_init(1);
+    ServerState st;
+    memset(&st, 0, sizeof(st));
+    st.nshards = 1;
+    st.send_frame = count_frame;
+    st.hist_depth = (uint32_t)depth;
+    st.hist_limit = 1u << 30;
+    InitializeCriticalSection(&st.hist_lock);
+
+    Room** r = (Room**)malloc((size_t)rooms * sizeof(*r));
+    if (!r) return 1;
+    for (int i = 0; i < rooms; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "room-%d", i);
+        r[i] = state_get_or_create_room(&st, name);
+        if (!r[i]) {
+            printf("out of memory at %d rooms\n", i);
+            return 1;
+        }
+    }
+
+    double append_ns = fill(&st, r, rooms, st.hist_depth, text_avg);
+    int32_t bytes = chat_atomic_load(&st.hist_bytes);
+    printf("rooms=%d depth=%u text_avg=%d history_bytes=%d bytes_per_room=%.0f bytes_per_msg=%.1f append_ns=%.1f\n",
+        rooms, st.hist_depth, text_avg, bytes, (double)bytes / rooms, (double)bytes / ((double)rooms * st.hist_depth),
+        append_ns);
+
+    // Replay whole histories, alternating client versions.
+    Client v1, v2;
+    memset(&v1, 0, sizeof(v1));
+    memset(&v2, 0, sizeof(v2));
+    v1.proto = CHAT_PROTO_TEXT;
+    v2.proto = CHAT_PROTO_BIN;
+    sink.frames = sink.bytes = 0;
+    uint64_t t0 = chat_now_ns();
+    for (int i = 0; i < replays; i++) {
+        (void)history_replay(&st, r[bench_rng_next(&rng_state) % (uint32_t)rooms], (i & 1) ? &v2 : &v1, st.hist_depth);
+    }
+    double replay_secs = (double)(chat_now_ns() - t0) / 1e9;
+    uint64_t replayed = sink.frames;
+
+    // The same number of messages formatted and framed from scratch.
+    static char texts[256][1024];
+    for (int i = 0; i < 256; i++) fill_text(texts[i], text_avg);
+    t0 = chat_now_ns();
+    for (uint64_t i = 0; i < replayed; i++) {
+        char out[1200];
+        if (!chat_cmd_format(out, sizeof(out), "ROOMMSG", "room-1", "user_0042", texts[i & 255])) return 1;
+        OutFrame* f = outframe_new(out, (uint32_t)strlen(out));
+        if (!f || !count_frame(&st, &v1, f)) return 1;
+        outframe_release(f);
+    }
+    double format_secs = (double)(chat_now_ns() - t0) / 1e9;
+    printf("replays=%d msgs_replayed=%llu replay_msgs_per_sec=%.0f replay_ns_per_msg=%.1f reformat_ns_per_msg=%.1f\n",
+        replays, (unsigned long long)replayed, replayed / replay_secs, replay_secs * 1e9 / (double)replayed,
+        format_secs * 1e9 / (double)replayed);
+
+    // Refill with a quarter of the memory the rooms need.
+    st.hist_limit = (uint32_t)(bytes / 4);
+    append_ns = fill(&st, r, rooms, st.hist_depth, text_avg);
+    int kept = 0;
+    for (int i = 0; i < rooms; i++) kept += r[i]->hist.count > 0;
+    printf("limit=%u history_bytes=%d rooms_with_history=%d append_ns=%.1f\n", st.hist_limit,
+        chat_atomic_load(&st.hist_bytes), kept, append_ns);
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "chat_platform.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "server.h"
+
+// Message log benchmark.
+// Part one: --producers threads append --messages records spread over
+// --rooms rooms as fast as they can, as handle_msg does, and the run ends
+// once log_sync says everything is durable. Reports the sustained rate,
+// the cost of one append call and how many records each group-commit
+// msync covered.
+// Part two: reads the newest --depth records of random rooms, as a new
+// room's history backfill does, and reports latency percentiles.
+// Part three: reopens the log twice, with its segment indexes and without
+// them (a full scan), then measures backfill again on the reopened log.
+
+typedef struct Producer {
+    pthread_t tid;
+    ChatLog* log;
+    long count;
+    int rooms;
+    int text_avg;
+    uint32_t rng;
+    uint64_t ns; // Time spent inside log_append.
+    long dropped;
+} Producer;
+
+typedef struct ReadSink {
+    uint64_t records;
+    uint64_t bytes;
+} ReadSink;
+
+static void usage(void) {
+    printf("chat_log_bench [--dir <path>] [--messages <n>] [--rooms <n>] [--text <bytes>] [--producers <n>]\n"
+           "               [--sync-ms <ms>] [--segment-mb <n>] [--depth <n>] [--reads <n>] [--keep]\n");
+}
+
+static void* producer_main(void* arg) {
+    Producer* p = (Producer*)arg;
+    char text[1024], room[32];
+    for (long i = 0; i < p->count; i++) {
+        int len = p->text_avg / 2 + (int)(bench_rng_next(&p->rng) % (uint32_t)(p->text_avg + 1));
+        for (int k = 0; k < len; k++) text[k] = (char)('a' + (i + k) % 26);
+        text[len] = 0;
+        snprintf(room, sizeof(room), "room-%u", bench_rng_next(&p->rng) % (uint32_t)p->rooms);
+        uint64_t t0 = chat_now_ns();
+        int ok = log_append(p->log, room, "user_0042", text, (uint32_t)len);
+        p->ns += chat_now_ns() - t0;
+        // A full queue means the writer is behind: back off like a client would.
+        if (!ok) {
+            p->dropped++;
+            Sleep(1);
+        }
+    }
+    return NULL;
+}
+
+static void count_record(void* arg, const char* user, const char* text, uint64_t time_ms) {
+    ReadSink* s = (ReadSink*)arg;
+    (void)time_ms;
+    s->records++;
+    s->bytes += strlen(user) + strlen(text);
+}
+
+// Backfill random rooms; prints percentiles of one read.
+static void run_reads(ChatLog* log, const char* label, int rooms, uint32_t depth, int reads) {
+    uint64_t* ns = (uint64_t*)malloc((size_t)reads * sizeof(*ns));
+    if (!ns) exit(1);
+    ReadSink sink = {0, 0};
+    uint32_t rng = 88172645u;
+    for (int i = 0; i < reads; i++) {
+        char room[32];
+        snprintf(room, sizeof(room), "room-%u", bench_rng_next(&rng) % (uint32_t)rooms);
+        uint64_t t0 = chat_now_ns();
+        (void)log_read_recent(log, room, depth, count_record, &sink);
+        ns[i] = chat_now_ns() - t0;
+    }
+    qsort(ns, (size_t)reads, sizeof(*ns), bench_cmp_u64);
+    printf("%s reads=%d depth=%u records_per_read=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f ns_per_record=%.0f\n",
+        label, reads, depth, (double)sink.records / reads, ns[reads / 2] / 1e3, ns[(size_t)reads * 99 / 100] / 1e3,
+        ns[reads - 1] / 1e3, sink.records ? (double)ns[reads / 2] * reads / (double)sink.records : 0.0);
+    free(ns);
+}
+
+// Delete the directory's files with the given extension.
+static void remove_files(const char* dir, const char* ext) {
+    DIR* d = opendir(dir);
+    if (!d) return;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        size_t n = strlen(e->d_name), x = strlen(ext);
+        if (n <= x || strcmp(e->d_name + n - x, ext) != 0) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+static ChatLog* timed_open(const LogConfig* cfg, double* ms) {
+    uint64_t t0 = chat_now_ns();
+    ChatLog* log = log_open(cfg);
+    *ms = (double)(chat_now_ns() - t0) / 1e6;
+    if (!log) exit(1);
+    return log;
+}
+
+int main(int argc, char** argv) {
+    char dir_buf[64];
+    snprintf(dir_buf, sizeof(dir_buf), "/tmp/chat_log_bench.%d", (int)getpid());
+    const char* dir = dir_buf;
+    long messages = 2000000;
+    int rooms = 1000;
+    int text_avg = 64;
+    int producers = 4;
+    long sync_ms = CHAT_LOG_SYNC_MS_DEFAULT;
+    long segment_mb = CHAT_LOG_SEGMENT_DEFAULT >> 20;
+    long depth = CHAT_HISTORY_DEFAULT;
+    int reads = 20000;
+    int keep = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc) {
+            rooms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--text") == 0 && i + 1 < argc) {
+            text_avg = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--producers") == 0 && i + 1 < argc) {
+            producers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sync-ms") == 0 && i + 1 < argc) {
+            sync_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--segment-mb") == 0 && i + 1 < argc) {
+            segment_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--reads") == 0 && i + 1 < argc) {
+            reads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            keep = 1;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (messages <= 0 || rooms <= 0 || text_avg <= 0 || text_avg > 600 || producers <= 0 || sync_ms < 0 ||
+        segment_mb < 1 || segment_mb > 1024 || depth <= 0 || depth > (long)CHAT_HISTORY_MAX || reads <= 0) {
+        usage();
+        return 2;
+    }
+
+    LogConfig cfg = {dir, (uint32_t)segment_mb * 1024u * 1024u, 0, (uint32_t)sync_ms};
+    double open_ms;
+    ChatLog* log = timed_open(&cfg, &open_ms);
+
+    Producer* p = (Producer*)calloc((size_t)producers, sizeof(*p));
+    if (!p) return 1;
+    uint64_t t0 = chat_now_ns();
+    for (int i = 0; i < producers; i++) {
+        p[i].log = log;
+        p[i].count = messages / producers + (i < messages % producers);
+        p[i].rooms = rooms;
+        p[i].text_avg = text_avg;
+        p[i].rng = 2463534242u + (uint32_t)i * 7919u;
+        if (pthread_create(&p[i].tid, NULL, producer_main, &p[i]) != 0) return 1;
+    }
+    uint64_t append_ns = 0;
+    long dropped = 0;
+    for (int i = 0; i < producers; i++) {
+        pthread_join(p[i].tid, NULL);
+        append_ns += p[i].ns;
+        dropped += p[i].dropped;
+    }
+    log_sync(log);
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+    LogStats ls;
+    log_stats(log, &ls);
+    printf("append messages=%ld producers=%d rooms=%d text_avg=%d sync_ms=%ld secs=%.3f msgs_per_sec=%.0f"
+           " mb_per_sec=%.1f append_call_ns=%.0f syncs=%llu records_per_sync=%.1f dropped=%ld log_bytes=%llu"
+           " segments=%u\n",
+        messages, producers, rooms, text_avg, sync_ms, secs, (double)ls.synced / secs, (double)ls.bytes / secs / 1e6,
+        (double)append_ns / (double)messages, (unsigned long long)ls.syncs,
+        ls.syncs ? (double)ls.synced / (double)ls.syncs : 0.0, dropped, (unsigned long long)ls.bytes, ls.segments);
+
+    run_reads(log, "backfill", rooms, (uint32_t)depth, reads);
+    log_close(log);
+
+    // Reopen with the sealed segments' indexes, then with a full scan.
+    log = timed_open(&cfg, &open_ms);
+    log_close(log);
+    remove_files(dir, ".idx");
+    double scan_ms;
+    log = timed_open(&cfg, &scan_ms);
+    log_stats(log, &ls);
+    printf("reopen segments=%u rooms=%u indexed_open_ms=%.1f scan_open_ms=%.1f\n", ls.segments, ls.rooms, open_ms,
+        scan_ms);
+    run_reads(log, "backfill_reopened", rooms, (uint32_t)depth, reads);
+    log_close(log);
+
+    if (!keep) {
+        remove_files(dir, ".log");
+        remove_files(dir, ".idx");
+        rmdir(dir);
+    }
+    free(p);
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "server.h"
+
+// Allocator churn benchmark (Linux).
+// Part one times alloc/free pairs from several threads sharing one slot
+// array, so most frees happen on a different thread than the allocation,
+// as with broadcast frames. The mix is connection and room objects plus
+// frame buffers of skewed sizes. It runs once on malloc and once on the
+// server's pools. Part two is a compressed soak for the allocator chosen
+// with --alloc: rounds of message storms that leave scattered survivors,
+// plus connection churn, sampling RSS after each round.
+
+#define KIND_CLIENT 0
+#define KIND_ROOM 1
+#define KIND_BUF 2
+
+typedef struct Obj {
+    uint32_t size;
+    uint32_t kind;
+} Obj;
+
+typedef struct Worker {
+    pthread_t tid;
+    int use_pool;
+    long ops;
+    uint32_t rng;
+    double secs;
+} Worker;
+
+static ObjPool client_pool;
+static ObjPool room_pool;
+static void* volatile* slots;
+static uint32_t slot_mask;
+
+static void usage(void) {
+    printf("chat_pool_bench [--threads <n>] [--ops <n>] [--alloc pool|malloc] [--rounds <n>]\n");
+}
+
+// Mostly small frames, some medium, a few large; occasional clients and rooms.
+static void pick(uint32_t* rng, uint32_t* kind, uint32_t* size) {
+    uint32_t r = bench_rng_next(rng) % 1000;
+    *kind = KIND_BUF;
+    if (r < 30) {
+        *kind = KIND_CLIENT;
+        *size = (uint32_t)sizeof(Client);
+    } else if (r < 50) {
+        *kind = KIND_ROOM;
+        *size = (uint32_t)(sizeof(Room) + sizeof(RoomShard));
+    } else if (r < 800) {
+        *size = 16 + bench_rng_next(rng) % 240;
+    } else if (r < 980) {
+        *size = 256 + bench_rng_next(rng) % 1792;
+    } else {
+        *size = 2048 + bench_rng_next(rng) % 14336;
+    }
+}
+
+static Obj* obj_alloc(int use_pool, uint32_t kind, uint32_t size) {
+    Obj* o;
+    if (!use_pool) o = (Obj*)malloc(size);
+    else if (kind == KIND_CLIENT) o = (Obj*)pool_alloc(&client_pool);
+    else if (kind == KIND_ROOM) o = (Obj*)pool_alloc(&room_pool);
+    else o = (Obj*)buf_alloc(size);
+    if (!o) exit(1);
+    o->size = size;
+    o->kind = kind;
+    // Touch the object the way a constructor would.
+    memset(o + 1, 0, size > 64 ? 64 - sizeof(*o) : size - sizeof(*o));
+    return o;
+}
+
+static void obj_free(int use_pool, Obj* o) {
+    if (!o) return;
+    if (!use_pool) free(o);
+    else if (o->kind == KIND_CLIENT) pool_free(&client_pool, o);
+    else if (o->kind == KIND_ROOM) pool_free(&room_pool, o);
+    else buf_free(o, o->size);
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = (Worker*)arg;
+    uint64_t t0 = chat_now_ns();
+    for (long i = 0; i < w->ops; i++) {
+        uint32_t kind, size;
+        pick(&w->rng, &kind, &size);
+        Obj* o = obj_alloc(w->use_pool, kind, size);
+        Obj* old = (Obj*)chat_atomic_xchg_ptr(&slots[bench_rng_next(&w->rng) & slot_mask], o);
+        obj_free(w->use_pool, old);
+    }
+    w->secs = (double)(chat_now_ns() - t0) / 1e9;
+    if (w->use_pool) pool_thread_exit();
+    return NULL;
+}
+
+static double run_churn(int use_pool, int nthreads, long ops) {
+    Worker* w = (Worker*)calloc((size_t)nthreads, sizeof(*w));
+    if (!w) exit(1);
+    for (int i = 0; i < nthreads; i++) {
+        w[i].use_pool = use_pool;
+        w[i].ops = ops;
+        w[i].rng = 2463534242u + (uint32_t)i * 7919u;
+        if (pthread_create(&w[i].tid, NULL, worker_main, &w[i]) != 0) exit(1);
+    }
+    double secs = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        if (w[i].secs > secs) secs = w[i].secs;
+    }
+    for (uint32_t i = 0; i <= slot_mask; i++) {
+        obj_free(use_pool, (Obj*)slots[i]);
+        slots[i] = NULL;
+    }
+    free(w);
+    return secs;
+}
+
+static long rss_kb(void) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Each round: a storm grows a working set of frames, then frees all but a
+// random tenth, whose survivors persist into the next round; connection
+// and room objects churn alongside.
+static void run_soak(int use_pool, int rounds) {
+    enum { STORM = 200000, KEEP = 8192 };
+    Obj** storm = (Obj**)calloc(STORM, sizeof(*storm));
+    Obj** keep = (Obj**)calloc(KEEP, sizeof(*keep));
+    if (!storm || !keep) exit(1);
+    uint32_t rng = 88172645u;
+    long first = 0, peak = 0, last = 0, settled = 0;
+    uint64_t t0 = chat_now_ns();
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < STORM; i++) {
+            uint32_t kind, size;
+            pick(&rng, &kind, &size);
+            storm[i] = obj_alloc(use_pool, kind, size);
+        }
+        for (int i = 0; i < STORM; i++) {
+            if (bench_rng_next(&rng) % 10 == 0) {
+                uint32_t k = bench_rng_next(&rng) % KEEP;
+                obj_free(use_pool, keep[k]);
+                keep[k] = storm[i];
+            } else {
+                obj_free(use_pool, storm[i]);
+            }
+        }
+
+        last = rss_kb();
+        if (r == 0) first = last;
+        if (r == rounds / 10) settled = last;
+        if (last > peak) peak = last;
+        if (rounds <= 20 || r % (rounds / 10) == 0) printf("round=%d rss_kb=%ld\n", r, last);
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+    printf("soak alloc=%s rounds=%d secs=%.1f rss_first_kb=%ld rss_settled_kb=%ld rss_last_kb=%ld rss_peak_kb=%ld"
+           " drift_after_settle=%.1f%%\n",
+        use_pool ? "pool" : "malloc", rounds, secs, first, settled, last, peak,
+        settled > 0 ? 100.0 * (double)(last - settled) / (double)settled : 0.0);
+
+    if (use_pool) {
+        PoolStats stats[32];
+        int n = pool_stats_all(stats, 32);
+        for (int i = 0; i < n; i++) {
+            if (stats[i].slabs == 0) continue;
+            printf("pool=%s size=%u in_use=%llu idle=%llu reserved_kb=%llu frag=%.1f%%\n", stats[i].name,
+                stats[i].obj_size, (unsigned long long)stats[i].in_use, (unsigned long long)stats[i].idle,
+                (unsigned long long)(stats[i].reserved_bytes / 1024), stats[i].frag_pct);
+        }
+    }
+    for (int i = 0; i < KEEP; i++) obj_free(use_pool, keep[i]);
+    free(storm);
+    free(keep);
+}
+
+int main(int argc, char** argv) {
+    int nthreads = 4;
+    long ops = 2000000;
+    int rounds = 0;
+    int use_pool = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+            const char* a = argv[++i];
+            if (strcmp(a, "pool") != 0 && strcmp(a, "malloc") != 0) {
+                usage();
+                return 2;
+            }
+            use_pool = strcmp(a, "pool") == 0;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (nthreads <= 0 || ops <= 0 || rounds < 0) {
+        usage();
+        return 2;
+    }
+
+    state_pools_init(1);
+    (void)pool_init(&client_pool, "bench-client", sizeof(Client));
+    (void)pool_init(&room_pool, "bench-room", sizeof(Room) + sizeof(RoomShard));
+
+    // Soak runs alone so RSS reflects only the chosen allocator.
+    if (rounds > 0) {
+        run_soak(use_pool, rounds);
+        return 0;
+    }
+
+    slot_mask = 65535;
+    slots = (void* volatile*)calloc(slot_mask + 1, sizeof(void*));
+    if (!slots) return 1;
+    double malloc_secs = run_churn(0, nthreads, ops);
+    double pool_secs = run_churn(1, nthreads, ops);
+    double total = (double)nthreads * (double)ops;
+    // Wall time over all pairs: per-pair cost with every thread's work included.
+    printf("threads=%d ops_per_thread=%ld malloc_ns_per_pair=%.1f pool_ns_per_pair=%.1f speedup=%.2f\n", nthreads, ops,
+        malloc_secs * 1e9 / total, pool_secs * 1e9 / total, malloc_secs / pool_secs);
+    free((void*)slots);
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_cmd.h"
+#include "chat_frame.h"
+#include "chat_proto.h"
+
+// Wire protocol benchmark: v1 text vs v2 binary.
+// Encodes a stream of messages both ways: ROOMMSG events as the server
+// sends them, or MSG requests as clients send them. Reports bytes on the
+// wire per message, then times parsing each stream end to end: the frame
+// decoder plus command parsing (chat_cmd_parse_inplace for v1, opcode and
+// varint fields for v2). Both parsers sum the same fields so the results
+// can be checked against each other.
+
+#define BENCH_ROOMS 64
+#define BENCH_USERS 1024
+
+typedef struct Stream {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} Stream;
+
+typedef struct Parsed {
+    long messages;
+    uint64_t sum; // Text bytes plus room and user fields.
+} Parsed;
+
+static void usage(void) {
+    printf("chat_proto_bench [--messages <n>] [--rounds <n>] [--text <bytes>]\n");
+}
+
+static void stream_put(Stream* s, const void* p, size_t n) {
+    if (s->len + n > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1u << 20;
+        while (cap < s->len + n) cap *= 2;
+        s->data = (uint8_t*)realloc(s->data, cap);
+        if (!s->data) exit(1);
+        s->cap = cap;
+    }
+    memcpy(s->data + s->len, p, n);
+    s->len += n;
+}
+
+static void put_text_frame(Stream* s, const char* payload) {
+    uint32_t len = (uint32_t)strlen(payload);
+    uint32_t net_len = htonl(len);
+    stream_put(s, &net_len, 4);
+    stream_put(s, payload, len);
+}
+
+static void put_bin_frame(Stream* s, const ChatBinWriter* w) {
+    uint8_t prefix[CHAT_VARINT_MAX];
+    stream_put(s, prefix, chat_varint_put(prefix, w->len));
+    stream_put(s, w->buf, w->len);
+}
+
+// Room i is named like a real channel; ids are what the server would assign.
+static void room_name(char* out, size_t cap, int i) {
+    static const char* words[] = {"general", "random", "dev-backend", "ops", "design-review", "lobby"};
+    snprintf(out, cap, "%s%d", words[i % 6], i);
+}
+
+static void user_name(char* out, size_t cap, int i) {
+    snprintf(out, cap, "user_%04d", i);
+}
+
+// Fill both streams with the same messages. Events are what the server
+// broadcasts (ROOMMSG); otherwise what clients send (MSG).
+static void build(Stream* v1, Stream* v2, int n, int text_len, int events) {
+    char text[CHAT_MAX_FRAME];
+    uint32_t rng = 2463534242u;
+    for (int i = 0; i < n; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        int room = (int)(rng % BENCH_ROOMS);
+        int user = (int)((rng >> 8) % BENCH_USERS);
+        int len = text_len / 2 + (int)((rng >> 16) % (uint32_t)(text_len + 1));
+        for (int j = 0; j < len; j++) text[j] = (char)('a' + (i + j) % 26);
+        text[len] = 0;
+
+        char rname[64], uname[64], out[CHAT_MAX_FRAME];
+        room_name(rname, sizeof(rname), room);
+        user_name(uname, sizeof(uname), user);
+        if (events) (void)chat_cmd_format(out, sizeof(out), "ROOMMSG", rname, uname, text);
+        else (void)chat_cmd_format(out, sizeof(out), "MSG", rname, NULL, text);
+        put_text_frame(v1, out);
+
+        uint8_t bin[CHAT_MAX_FRAME];
+        ChatBinWriter w;
+        chat_bw_init(&w, bin, sizeof(bin));
+        chat_bw_u8(&w, events ? CHAT_OP_ROOMMSG : CHAT_OP_MSG);
+        chat_bw_varint(&w, (uint32_t)room + 1);
+        if (events) chat_bw_varint(&w, (uint32_t)user + 1);
+        chat_bw_text(&w, text);
+        put_bin_frame(v2, &w);
+    }
+}
+
+// Room and user fields are summed by index so both parsers agree.
+static uint32_t name_index(const char* s) {
+    const char* p = s + strlen(s);
+    while (p > s && p[-1] >= '0' && p[-1] <= '9') p--;
+    return (uint32_t)atoi(p) + 1;
+}
+
+static void parse_v1(uint8_t* payload, uint32_t len, int events, Parsed* out) {
+    (void)len;
+    ChatCmd cmd;
+    if (!chat_cmd_parse_inplace((char*)payload, &cmd) || !cmd.arg1 || !cmd.text) exit(1);
+    out->sum += strlen(cmd.text) + name_index(cmd.arg1);
+    if (events) out->sum += name_index(cmd.arg2) - 1;
+    out->messages++;
+}
+
+static void parse_v2(uint8_t* payload, uint32_t len, int events, Parsed* out) {
+    ChatBinReader r;
+    chat_br_init(&r, payload, len);
+    (void)chat_br_u8(&r);
+    uint32_t room = chat_br_varint(&r);
+    uint32_t user = events ? chat_br_varint(&r) : 1;
+    const char* text = chat_br_text(&r);
+    if (!text) exit(1);
+    out->sum += (size_t)(r.end - (uint8_t*)text) + room + user - 1;
+    out->messages++;
+}
+
+// Decode the stream in receive-sized chunks, as a connection would see it.
+static double run(const Stream* s, int varint, int events, int rounds, Parsed* out) {
+    enum { CHUNK = 16384 };
+    uint8_t* rbuf = (uint8_t*)malloc(CHUNK + 1);
+    if (!rbuf) exit(1);
+    uint64_t t0 = chat_now_ns();
+    for (int k = 0; k < rounds; k++) {
+        ChatFrameDecoder d;
+        chat_decoder_init(&d, CHAT_MAX_FRAME);
+        chat_decoder_set_varint(&d, varint);
+        for (size_t off = 0; off < s->len; off += CHUNK) {
+            size_t n = s->len - off < CHUNK ? s->len - off : CHUNK;
+            memcpy(rbuf, s->data + off, n);
+            chat_decoder_feed(&d, rbuf, n);
+            uint8_t* payload = NULL;
+            uint32_t len = 0;
+            int r;
+            while ((r = chat_decoder_next(&d, &payload, &len)) > 0) {
+                if (varint) parse_v2(payload, len, events, out);
+                else parse_v1(payload, len, events, out);
+            }
+            if (r < 0) exit(1);
+        }
+        chat_decoder_free(&d);
+    }
+    double secs = (double)(chat_now_ns() - t0) / 1e9;
+    free(rbuf);
+    return secs;
+}
+
+int main(int argc, char** argv) {
+    int messages = 200000;
+    int rounds = 5;
+    int text_len = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--text") == 0 && i + 1 < argc) {
+            text_len = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (messages <= 0 || rounds <= 0 || text_len == 0 || text_len > 900) {
+        usage();
+        return 2;
+    }
+
+    // Average text sizes: chat-typical by default, or the one asked for.
+    static const int sizes[] = {8, 32, 128, 512};
+    int nsizes = text_len >= 0 ? 1 : (int)(sizeof(sizes) / sizeof(sizes[0]));
+    for (int events = 1; events >= 0; events--) {
+        for (int k = 0; k < nsizes; k++) {
+            int avg = text_len >= 0 ? text_len : sizes[k];
+            Stream v1 = {NULL, 0, 0};
+            Stream v2 = {NULL, 0, 0};
+            build(&v1, &v2, messages, avg, events);
+
+            Parsed p1 = {0, 0};
+            Parsed p2 = {0, 0};
+            double s1 = run(&v1, 0, events, rounds, &p1);
+            double s2 = run(&v2, 1, events, rounds, &p2);
+            double total = (double)messages * rounds;
+            printf("kind=%s text_avg=%d v1_bytes_per_msg=%.1f v2_bytes_per_msg=%.1f saved=%.1f%%"
+                   " v1_parse_ns=%.1f v2_parse_ns=%.1f speedup=%.2f match=%d\n",
+                events ? "ROOMMSG" : "MSG", avg, (double)v1.len / messages, (double)v2.len / messages,
+                100.0 * (1.0 - (double)v2.len / (double)v1.len), s1 * 1e9 / total, s2 * 1e9 / total, s1 / s2,
+                p1.messages == p2.messages && p1.sum == p2.sum);
+            free(v1.data);
+            free(v2.data);
+        }
+    }
+    return 0;
+}
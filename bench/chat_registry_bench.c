@@ -0,0 +1,212 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "server.h"
+
+// Registry microbenchmark.
+// Builds the room index at sizes from 10 up to --max rooms and times
+// state_find_room hits and misses, room removal, and (up to 10k rooms) the
+// linked-list scan the index replaced. Then times membership: leave/join
+// in rooms of growing size, and disconnect cleanup for a client in a few
+// rooms on servers with growing room counts. Prints one line per size.
+
+#define LINEAR_MAX 10000 // Largest size the old linear scan is timed at.
+
+static uint32_t rng_state = 2463534242u;
+
+static void usage(void) {
+    printf("chat_registry_bench [--max <rooms>] [--lookups <n>]\n");
+}
+
+// Mean slots touched per successful lookup.
+static double avg_probe(const NameTable* t) {
+    uint64_t total = 0;
+    uint32_t mask = t->cap - 1;
+    for (uint32_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].item) total += ((i - (t->slots[i].hash & mask)) & mask) + 1;
+    }
+    return t->count ? (double)total / t->count : 0.0;
+}
+
+// The pre-index lookup: walk every room comparing names.
+static Room* linear_find(Room** rooms, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (_stricmp(rooms[i]->name, name) == 0) return rooms[i];
+    }
+    return NULL;
+}
+
+static void run_size(int count, int lookups) {
+    ServerState st;
+    memset(&st, 0, sizeof(st));
+    st.nshards = 1;
+
+    char (*names)[CHAT_NAME_MAX + 1] = malloc((size_t)count * sizeof(*names));
+    Room** rooms = (Room**)malloc((size_t)count * sizeof(*rooms));
+    char (*probes)[CHAT_NAME_MAX + 1] = malloc((size_t)lookups * sizeof(*probes));
+    if (!names || !rooms || !probes) {
+        printf("out of memory at %d rooms\n", count);
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(names[i], sizeof(names[i]), "Room-%d", i);
+        rooms[i] = state_get_or_create_room(&st, names[i]);
+        if (!rooms[i]) {
+            printf("out of memory at %d rooms\n", count);
+            exit(1);
+        }
+    }
+    // Hits of random rooms, spelled with different case than created.
+    for (int i = 0; i < lookups; i++) {
+        snprintf(probes[i], sizeof(probes[i]), "rOOM-%u", bench_rng_next(&rng_state) % (uint32_t)count);
+    }
+    size_t found = 0;
+    uint64_t t0 = chat_now_ns();
+    for (int i = 0; i < lookups; i++) found += state_find_room(&st, probes[i]) != NULL;
+    uint64_t hit_ns = chat_now_ns() - t0;
+
+    // Keep the linear scan's total work bounded at larger sizes.
+    double linear = -1.0;
+    if (count <= LINEAR_MAX) {
+        int n = lookups / (count / 10 + 1) + 1;
+        t0 = chat_now_ns();
+        for (int i = 0; i < n; i++) found += linear_find(rooms, count, probes[i]) != NULL;
+        linear = (double)(chat_now_ns() - t0) / n;
+    }
+
+    for (int i = 0; i < lookups; i++) {
+        snprintf(probes[i], sizeof(probes[i]), "Nope-%u", bench_rng_next(&rng_state) % (uint32_t)count);
+    }
+    t0 = chat_now_ns();
+    for (int i = 0; i < lookups; i++) found += state_find_room(&st, probes[i]) != NULL;
+    uint64_t miss_ns = chat_now_ns() - t0;
+
+    double probe_len = avg_probe(&st.rooms);
+    uint32_t slots = st.rooms.cap;
+
+    t0 = chat_now_ns();
+    for (int i = 0; i < count; i++) state_prune_room(&st, rooms[i]);
+    uint64_t remove_ns = chat_now_ns() - t0;
+
+    printf("rooms=%d slots=%u avg_probe=%.2f hit_ns=%.1f miss_ns=%.1f remove_ns=%.1f", count, slots, probe_len,
+        (double)hit_ns / lookups, (double)miss_ns / lookups, (double)remove_ns / count);
+    if (linear >= 0) printf(" linear_ns=%.1f", linear);
+    printf(" left=%u check=%zu\n", st.rooms.count, found);
+
+    name_table_free(&st.rooms);
+    free(probes);
+    free(rooms);
+    free(names);
+}
+
+// Random members leave and rejoin one room of the given size.
+static void run_members(int count, int ops) {
+    ServerState st;
+    memset(&st, 0, sizeof(st));
+    st.nshards = 1;
+    Room* r = state_get_or_create_room(&st, "big");
+    Client* clients = (Client*)calloc((size_t)count, sizeof(*clients));
+    int* order = (int*)malloc((size_t)ops * sizeof(*order));
+    if (!r || !clients || !order) {
+        printf("out of memory at %d members\n", count);
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) (void)room_add_member(r, &clients[i]);
+    for (int i = 0; i < ops; i++) order[i] = (int)(bench_rng_next(&rng_state) % (uint32_t)count);
+
+    uint64_t leave_ns = 0;
+    uint64_t join_ns = 0;
+    for (int i = 0; i < ops; i++) {
+        uint64_t t0 = chat_now_ns();
+        room_remove_member(r, &clients[order[i]]);
+        uint64_t t1 = chat_now_ns();
+        (void)room_add_member(r, &clients[order[i]]);
+        leave_ns += t1 - t0;
+        join_ns += chat_now_ns() - t1;
+    }
+    printf("members=%d leave_ns=%.1f join_ns=%.1f size=%d\n", count, (double)leave_ns / ops, (double)join_ns / ops,
+        r->shards[0].member_count);
+
+    for (int i = 0; i < count; i++) {
+        room_remove_member(r, &clients[i]);
+        free(clients[i].joined);
+    }
+    state_prune_room(&st, r);
+    name_table_free(&st.rooms);
+    free(order);
+    free(clients);
+}
+
+// Disconnect cleanup for a client in `joined` rooms among `count` rooms.
+static void run_cleanup(int count, int joined, int ops) {
+    ServerState st;
+    memset(&st, 0, sizeof(st));
+    st.nshards = 1;
+    // Other clients keep every room occupied, at most 64 rooms each.
+    int nowners = count / 64 + 1;
+    Client* owners = (Client*)calloc((size_t)nowners, sizeof(*owners));
+    Client c;
+    memset(&c, 0, sizeof(c));
+    Room** rooms = (Room**)malloc((size_t)count * sizeof(*rooms));
+    if (!owners || !rooms) exit(1);
+    for (int i = 0; i < count; i++) {
+        char name[CHAT_NAME_MAX + 1];
+        snprintf(name, sizeof(name), "room-%d", i);
+        rooms[i] = state_get_or_create_room(&st, name);
+        if (!rooms[i] || !room_add_member(rooms[i], &owners[i / 64])) {
+            printf("out of memory at %d rooms\n", count);
+            exit(1);
+        }
+    }
+
+    uint64_t ns = 0;
+    for (int k = 0; k < ops; k++) {
+        for (int j = 0; j < joined; j++) (void)room_add_member(rooms[bench_rng_next(&rng_state) % (uint32_t)count], &c);
+        Room** left = NULL;
+        uint64_t t0 = chat_now_ns();
+        int n = state_leave_all_rooms(&st, &c, &left);
+        ns += chat_now_ns() - t0;
+        for (int j = 0; j < n; j++) room_release(left[j]);
+        free(left);
+    }
+    printf("rooms=%d joined=%d disconnect_cleanup_ns=%.1f\n", count, joined, (double)ns / ops);
+
+    for (int i = 0; i < count; i++) {
+        room_remove_member(rooms[i], &owners[i / 64]);
+        state_prune_room(&st, rooms[i]);
+    }
+    for (int i = 0; i < nowners; i++) free(owners[i].joined);
+    free(owners);
+    free(c.joined);
+    name_table_free(&st.rooms);
+    free(rooms);
+}
+
+int main(int argc, char** argv) {
+    int max = 1000000;
+    int lookups = 2000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) {
+            max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            lookups = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (max < 10 || lookups <= 0) {
+        usage();
+        return 2;
+    }
+
+    state_pools_init(1);
+    for (int count = 10; count <= max; count *= 10) run_size(count, lookups);
+    for (int count = 10; count <= max / 10; count *= 10) run_members(count, lookups / 10);
+    for (int count = 10; count <= max; count *= 10) run_cleanup(count, 10, 10000);
+    return 0;
+}
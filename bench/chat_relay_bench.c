@@ -0,0 +1,214 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "chat_proto.h"
+#include "server.h"
+
+// MSG relay benchmark: the server's cost per message, without a network
+// or a load generator sharing the CPU. One room of --members clients, half
+// of them on v2, each with a real socket (one end of a socketpair). Every
+// message is a "MSG room :text" frame handed to server_handle_frame by a
+// member in turn; the backend queues the event on every member's outbound
+// queue and flushes each queue into its socket with gather writes, as a
+// reactor does. Both are timed. Reading the other ends is not.
+// Runs each --size (default 100, 1024, 16384 and 65000 bytes of text) and
+// reports ns per message, ns per delivery and delivered MB/s (bytes read
+// from the sockets, framing included). --trace-file traces one message in
+// --trace-sample as the server's option does, to price tracing.
+
+#define BENCH_MEMBERS_MAX 256
+
+typedef struct Bench {
+    ServerState st;
+    Client* members[BENCH_MEMBERS_MAX];
+    SOCKET peers[BENCH_MEMBERS_MAX]; // Other ends, read outside the timer.
+    int count;
+} Bench;
+
+static Bench bench;
+
+static void usage(void) {
+    printf("chat_relay_bench [--members <n>] [--messages <n>] [--size <bytes>]... [--trace-file <path>]\n"
+           "                 [--trace-sample <n>]\n");
+}
+
+// Backend stubs: queue, then write whatever the socket takes.
+static int bench_send_frame(ServerState* st, Client* c, OutFrame* f) {
+    if (!outq_push(st, &c->outq, f)) return 0;
+    return outq_flush(&c->outq, c->sock);
+}
+
+static void bench_broadcast(ServerState* st, Room* r, const OutFrames* fs) {
+    (void)r;
+    for (int i = 0; i < bench.count; i++) {
+        Client* m = bench.members[i];
+        OutFrame* f = outframes_pick(fs, m);
+        if (f && !bench_send_frame(st, m, f)) {
+            printf("member %d: queue failed\n", i);
+            exit(1);
+        }
+    }
+}
+
+// Read everything the server wrote to every member; returns the bytes.
+static uint64_t drain_peers(void) {
+    static char buf[256 * 1024];
+    uint64_t total = 0;
+    for (int i = 0; i < bench.count; i++) {
+        ssize_t n;
+        while ((n = recv(bench.peers[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0) total += (uint64_t)n;
+    }
+    return total;
+}
+
+// Hand one payload to the server as if it had just been read.
+static void feed(Client* c, const void* payload, uint32_t len) {
+    static char frame[CHAT_MAX_FRAME + 1];
+    memcpy(frame, payload, len);
+    frame[len] = 0;
+    if (!server_handle_frame(&bench.st, c, frame, len)) {
+        printf("server closed a member during setup\n");
+        exit(1);
+    }
+}
+
+// Connect, authenticate and join one member; odd members negotiate v2.
+static void add_member(int i) {
+    SOCKET sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) exit(1);
+    int sndbuf = 4 * 1024 * 1024;
+    (void)setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    Client* c = client_new();
+    if (!c) exit(1);
+    c->sock = sv[0];
+    bench.members[i] = c;
+    bench.peers[i] = sv[1];
+    bench.count = i + 1;
+    state_add_client(&bench.st, c);
+    server_on_connect(&bench.st, c);
+
+    char name[32], text[64];
+    snprintf(name, sizeof(name), "user_%04d", i);
+    if (i % 2) {
+        feed(c, "HELLO 2", 7);
+        uint8_t buf[64];
+        ChatBinWriter w;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_AUTH);
+        chat_bw_str(&w, name);
+        chat_bw_str(&w, "pw");
+        feed(c, w.buf, w.len);
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_JOIN);
+        chat_bw_str(&w, "lobby");
+        feed(c, w.buf, w.len);
+    } else {
+        int n = snprintf(text, sizeof(text), "AUTH %s pw", name);
+        feed(c, text, (uint32_t)n);
+        feed(c, "JOIN lobby", 10);
+    }
+    (void)drain_peers();
+}
+
+static void run_size(int size, long messages) {
+    // v1 senders only: the MSG text is the same bytes either way.
+    char* msg = (char*)malloc(16 + (size_t)size);
+    if (!msg) exit(1);
+    int head = snprintf(msg, 16, "MSG lobby :");
+    for (int k = 0; k < size; k++) msg[head + k] = (char)('a' + k % 26);
+    uint32_t len = (uint32_t)(head + size);
+
+    static char frame[CHAT_MAX_FRAME + 1];
+    uint64_t ns = 0, bytes = 0;
+    long sent = 0;
+    for (long m = 0; m < messages; m++) {
+        Client* c = bench.members[(m % ((bench.count + 1) / 2)) * 2];
+        memcpy(frame, msg, len);
+        frame[len] = 0;
+        uint32_t sent_before = 0;
+        for (int i = 0; i < bench.count; i++) sent_before += bench.members[i]->outq.sent;
+        uint64_t t0 = chat_now_ns();
+        (void)server_handle_frame(&bench.st, c, frame, len);
+        ns += chat_now_ns() - t0;
+        uint32_t sent_after = 0;
+        for (int i = 0; i < bench.count; i++) sent_after += bench.members[i]->outq.sent;
+        if (sent_after - sent_before != (uint32_t)bench.count) {
+            printf("size=%d: message %ld reached %u of %d members\n", size, m, sent_after - sent_before, bench.count);
+            exit(1);
+        }
+        sent++;
+        bytes += drain_peers();
+    }
+    printf("size=%d members=%d messages=%ld ns_per_msg=%.0f ns_per_delivery=%.0f delivered_mb_per_sec=%.0f\n", size,
+        bench.count, sent, (double)ns / (double)sent, (double)ns / ((double)sent * bench.count),
+        (double)bytes * 1e3 / (double)ns);
+    free(msg);
+}
+
+int main(int argc, char** argv) {
+    int members = 20;
+    long messages = 0; // Default: about 4 MB of text per size.
+    int sizes[16];
+    int nsizes = 0;
+    const char* trace_file = NULL;
+    long trace_sample = CHAT_TRACE_SAMPLE_DEFAULT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--members") == 0 && i + 1 < argc) {
+            members = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc && nsizes < 16) {
+            sizes[nsizes++] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            trace_sample = atol(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (nsizes == 0) {
+        static const int defaults[] = {100, 1024, 16384, 65000};
+        for (; nsizes < 4; nsizes++) sizes[nsizes] = defaults[nsizes];
+    }
+    if (members < 2 || members > BENCH_MEMBERS_MAX || messages < 0 || trace_sample < 1 || trace_sample > 1000000) {
+        usage();
+        return 2;
+    }
+    for (int i = 0; i < nsizes; i++) {
+        if (sizes[i] < 1 || sizes[i] > (int)CHAT_MAX_FRAME - 64) {
+            usage();
+            return 2;
+        }
+    }
+
+    ServerState* st = &bench.st;
+    InitializeSRWLock(&st->lock);
+    epoch_init();
+    zip_init();
+    state_pools_init(1);
+    st->nshards = 1;
+    st->password = "pw";
+    st->outq_limit = 64u * 1024u * 1024u;
+    st->slow_policy = SLOW_DISCONNECT;
+    st->zip_min = CHAT_ZIP_MIN_DEFAULT;
+    st->hist_depth = CHAT_HISTORY_DEFAULT;
+    st->hist_limit = CHAT_HISTORY_MEM_DEFAULT;
+    InitializeCriticalSection(&st->hist_lock);
+    st->send_frame = bench_send_frame;
+    st->broadcast = bench_broadcast;
+
+    for (int i = 0; i < members; i++) add_member(i);
+    if (trace_file && !trace_open(trace_file, (uint32_t)trace_sample)) return 1;
+    for (int i = 0; i < nsizes; i++) {
+        long n = messages;
+        if (!n) n = 4000000L / sizes[i] < 500 ? 500 : 4000000L / sizes[i] > 20000 ? 20000 : 4000000L / sizes[i];
+        run_size(sizes[i], n);
+    }
+    return 0;
+}
@@ -0,0 +1,887 @@
+#include "chat_platform.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bench_util.h"
+#include "chat_cmd.h"
+#include "chat_frame.h"
+
+// Shared library microbenchmark.
+// Runs the per-message helpers both sides share over fixed corpora:
+//   short   - typical commands (PING, JOIN, AUTH, short MSG/PM)
+//   text    - MSG with 1-4 KB of free text
+//   spacing - runs of spaces, stray colons, space-only and colon-first
+//             payloads, more than three tokens
+//   max     - CHAT_MAX_FRAME payloads, half of them one unbroken token
+// and eight operations per corpus:
+//   parse      - chat_cmd_parse (buffers are reset outside the timer)
+//   parse_ref  - the reference parser below, plus a strlen of each field
+//                (chat_cmd_parse returns the lengths)
+//   dispatch   - chat_cmd_lookup plus chat_cmd_check on the parsed name
+//   dispatch_ref - the _stricmp chain the server used before the registry
+//   format     - chat_cmd_format from the parsed fields
+//   encode     - chat_frame_send into a socketpair drained by a second thread
+//   decode     - recv() plus ChatFrameDecoder, as the reactors read
+//   recv_alloc - chat_frame_recv_alloc plus free, as the client reads
+// Corpora come from a fixed seed, so every run sees the same bytes.
+// Allocations are counted by wrapping malloc/calloc/realloc at link time;
+// only the calling thread's count is used.
+//
+// Before timing, a differential check runs chat_cmd_parse at every kernel
+// level the CPU has against a copy of the original strstr/strchr parser,
+// over the corpora and --fuzz random payloads, and fails the run on any
+// difference in result, fields, lengths or buffer bytes. It also checks
+// the command registry: the characters typed into each CHAT_CMD_LIST entry
+// are its name's, every name (in either case) looks up its own spec, and
+// near misses of every name look up nothing or another command.
+//
+// Output is one header line and one line per case. Every case line holds
+// key=value pairs; readers match on corpus and op and ignore unknown keys,
+// so the output of one run can be saved and passed back as --baseline.
+
+#define BENCH_FORMAT 1
+#define BENCH_ROUNDS_SHORT 128
+#define BENCH_ROUNDS_TEXT 32
+#define BENCH_ROUNDS_SPACING 64
+#define BENCH_ROUNDS_MAX 1024
+#define BENCH_MAX_CASES 48
+
+typedef struct Corpus {
+    const char* name;
+    uint32_t count;
+    char** items;      // NUL-terminated payloads.
+    uint32_t* lens;
+    uint64_t bytes;    // Sum of lens.
+    long rounds;
+} Corpus;
+
+typedef struct Result {
+    char corpus[16];
+    char op[16];
+    uint64_t ops;
+    double bytes_per_op;
+    double ns_per_op;
+    double bytes_per_sec;
+    double allocs_per_op;
+} Result;
+
+typedef struct Pump {
+    pthread_t tid;
+    SOCKET sock;
+    const uint8_t* stream; // Feeder: encoded corpus to send rounds times.
+    size_t stream_len;
+    long rounds;
+    uint64_t bytes;        // Drain: bytes read until EOF.
+} Pump;
+
+static _Thread_local uint64_t g_allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t count, size_t size);
+void* __wrap_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    g_allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    g_allocs++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    g_allocs++;
+    return __real_realloc(p, size);
+}
+
+static void usage(void) {
+    printf("chat_shared_bench [--scale <x>] [--corpus <name>] [--baseline <file>] [--tolerance <pct>]\n"
+           "                  [--simd <level>] [--fuzz <n>]\n");
+}
+
+static const char* const k_words[] = {"hello", "the", "deploy", "is", "green", "again", "see", "you", "at", "noon",
+    "ok", "thanks", "lunch?", "build", "failed", "on", "arm64", "retrying", "now", "x"};
+
+// Append n bytes of space-separated words (no " :") to p.
+static char* put_words(char* p, uint32_t n, uint32_t* rng) {
+    char* end = p + n;
+    while (p < end) {
+        const char* w = k_words[bench_rng_next(rng) % (sizeof(k_words) / sizeof(k_words[0]))];
+        size_t wl = strlen(w);
+        if (wl > (size_t)(end - p)) wl = (size_t)(end - p);
+        memcpy(p, w, wl);
+        p += wl;
+        if (p < end) *p++ = ' ';
+    }
+    return p;
+}
+
+static char* put_spaces(char* p, uint32_t n) {
+    memset(p, ' ', n);
+    return p + n;
+}
+
+static void corpus_add(Corpus* c, const char* s, size_t len) {
+    char* item = (char*)malloc(len + 1);
+    if (!item) exit(1);
+    memcpy(item, s, len);
+    item[len] = 0;
+    c->items[c->count] = item;
+    c->lens[c->count] = (uint32_t)len;
+    c->bytes += len;
+    c->count++;
+}
+
+static void corpus_init(Corpus* c, const char* name, uint32_t count, long rounds) {
+    c->name = name;
+    c->count = 0;
+    c->items = (char**)calloc(count, sizeof(*c->items));
+    c->lens = (uint32_t*)calloc(count, sizeof(*c->lens));
+    if (!c->items || !c->lens) exit(1);
+    c->bytes = 0;
+    c->rounds = rounds;
+}
+
+static void corpus_free(Corpus* c) {
+    for (uint32_t i = 0; i < c->count; i++) free(c->items[i]);
+    free(c->items);
+    free(c->lens);
+}
+
+static void build_short(Corpus* c) {
+    uint32_t rng = 2463534242u;
+    corpus_init(c, "short", 4096, BENCH_ROUNDS_SHORT);
+    char buf[128];
+    for (uint32_t i = 0; i < 4096; i++) {
+        uint32_t r = bench_rng_next(&rng) % 1000u;
+        int n;
+        switch (i % 8) {
+            case 0: n = snprintf(buf, sizeof(buf), "PING"); break;
+            case 1: n = snprintf(buf, sizeof(buf), "JOIN room-%u", r); break;
+            case 2: n = snprintf(buf, sizeof(buf), "LEAVE room-%u", r); break;
+            case 3: n = snprintf(buf, sizeof(buf), "AUTH user_%04u pw%u", r, r * 7u); break;
+            case 4: n = snprintf(buf, sizeof(buf), "PM user_%04u :ok %u", r, i); break;
+            case 5: n = snprintf(buf, sizeof(buf), "WHO room-%u", r); break;
+            default: n = snprintf(buf, sizeof(buf), "MSG room-%u :hi all %u", r, i); break;
+        }
+        corpus_add(c, buf, (size_t)n);
+    }
+}
+
+static void build_text(Corpus* c) {
+    uint32_t rng = 88172645u;
+    corpus_init(c, "text", 1024, BENCH_ROUNDS_TEXT);
+    char* buf = (char*)malloc(8192);
+    if (!buf) exit(1);
+    for (uint32_t i = 0; i < 1024; i++) {
+        char* p = buf + sprintf(buf, "MSG room-%u :", bench_rng_next(&rng) % 1000u);
+        p = put_words(p, 1024u + bench_rng_next(&rng) % 3072u, &rng);
+        corpus_add(c, buf, (size_t)(p - buf));
+    }
+    free(buf);
+}
+
+static void build_spacing(Corpus* c) {
+    uint32_t rng = 362436069u;
+    corpus_init(c, "spacing", 1024, BENCH_ROUNDS_SPACING);
+    char* buf = (char*)malloc(4096);
+    if (!buf) exit(1);
+    for (uint32_t i = 0; i < 1024; i++) {
+        char* p = buf;
+        switch (i % 6) {
+            case 0: // Leading and repeated spaces, " :" inside the text.
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 64u);
+                p += sprintf(p, "MSG");
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 64u);
+                p += sprintf(p, "room-%u", i);
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 64u);
+                p += sprintf(p, ":a : b :: c :");
+                break;
+            case 1: // Two args separated by long runs, text of spaces.
+                p += sprintf(p, "PM");
+                p = put_spaces(p, 64u + bench_rng_next(&rng) % 256u);
+                p += sprintf(p, "user_%04u", i);
+                p = put_spaces(p, 64u + bench_rng_next(&rng) % 256u);
+                p += sprintf(p, ":");
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 256u);
+                break;
+            case 2: // Spaces only.
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 512u);
+                break;
+            case 3: // Colon first: text without a command.
+                p += sprintf(p, ":");
+                p = put_words(p, 16u + bench_rng_next(&rng) % 256u, &rng);
+                break;
+            case 4: // Many tokens, trailing spaces, no text.
+                for (uint32_t k = 0, n = 4u + bench_rng_next(&rng) % 32u; k < n; k++) {
+                    p += sprintf(p, "tok%u", k);
+                    p = put_spaces(p, 1u + bench_rng_next(&rng) % 16u);
+                }
+                break;
+            default: // Colons inside tokens, then text full of " :".
+                p += sprintf(p, "MSG a:b:c");
+                p = put_spaces(p, 1u + bench_rng_next(&rng) % 32u);
+                for (uint32_t k = 0, n = 8u + bench_rng_next(&rng) % 64u; k < n; k++) p += sprintf(p, " :%u", k);
+                break;
+        }
+        corpus_add(c, buf, (size_t)(p - buf));
+    }
+    free(buf);
+}
+
+static void build_max(Corpus* c) {
+    uint32_t rng = 521288629u;
+    corpus_init(c, "max", 16, BENCH_ROUNDS_MAX);
+    char* buf = (char*)malloc(CHAT_MAX_FRAME);
+    if (!buf) exit(1);
+    for (uint32_t i = 0; i < 16; i++) {
+        char* p = buf;
+        if (i % 2 == 0) {
+            p += sprintf(p, "MSG room-%u :", i);
+            p = put_words(p, CHAT_MAX_FRAME - (uint32_t)(p - buf), &rng);
+        } else {
+            // One token the size of the frame: every scan runs to the end.
+            p += sprintf(p, "MSG ");
+            for (; p < buf + CHAT_MAX_FRAME; p++) *p = (char)('a' + bench_rng_next(&rng) % 26u);
+        }
+        corpus_add(c, buf, (size_t)(p - buf));
+    }
+    free(buf);
+}
+
+// The parser chat_cmd_parse replaced, kept verbatim as the reference it
+// must match.
+static void trim_leading_spaces(char** p) {
+    // Move pointer past any leading spaces.
+    while (**p == ' ') (*p)++;
+}
+
+static int ref_parse(char* payload, ChatCmd* out) {
+    memset(out, 0, sizeof(*out));
+    out->buf = payload;
+
+    // Split off trailing free-form text (":" delimiter).
+    char* text_start = strstr(payload, " :");
+    if (text_start) {
+        *text_start = 0;
+        out->text = text_start + 2;
+    } else {
+        char* colon = strchr(payload, ':');
+        if (colon == payload) {
+            out->text = payload + 1;
+            payload[0] = 0;
+        }
+    }
+
+    // Tokenize command and up to two args by inserting NULs.
+    char* p = payload;
+    trim_leading_spaces(&p);
+    if (*p == 0) return 0;
+
+    out->cmd = p;
+    char* space = strchr(p, ' ');
+    if (!space) return 1;
+    *space = 0;
+
+    p = space + 1;
+    trim_leading_spaces(&p);
+    if (*p == 0) return 1;
+
+    out->arg1 = p;
+    space = strchr(p, ' ');
+    if (!space) return 1;
+    *space = 0;
+
+    p = space + 1;
+    trim_leading_spaces(&p);
+    if (*p == 0) return 1;
+
+    out->arg2 = p;
+    space = strchr(p, ' ');
+    if (!space) return 1;
+    *space = 0;
+
+    return 1;
+}
+
+static int field_differs(const char* buf, const char* want, const char* got, const char* got_base, uint32_t got_len) {
+    if (!want || !got) return want != got || got_len != 0;
+    return want - buf != got - got_base || got_len != strlen(got);
+}
+
+// Parse a copy of payload (len bytes, NULs allowed) with both parsers;
+// returns 1 if anything differs.
+static int verify_one(const char* payload, uint32_t len, char* a, char* b) {
+    memcpy(a, payload, len);
+    a[len] = 0;
+    memcpy(b, payload, len);
+    b[len] = 0;
+    ChatCmd want, got;
+    int rc_want = ref_parse(a, &want);
+    int rc_got = chat_cmd_parse(b, len, &got);
+    return rc_want != rc_got || memcmp(a, b, len + 1u) != 0 || field_differs(a, want.cmd, got.cmd, b, got.cmd_len) ||
+           field_differs(a, want.arg1, got.arg1, b, got.arg1_len) ||
+           field_differs(a, want.arg2, got.arg2, b, got.arg2_len) ||
+           field_differs(a, want.text, got.text, b, got.text_len);
+}
+
+static void print_escaped(const char* p, uint32_t len) {
+    for (uint32_t i = 0; i < len && i < 200; i++) {
+        if (p[i] >= 32 && p[i] < 127) putchar(p[i]);
+        else printf("\\x%02x", (unsigned char)p[i]);
+    }
+}
+
+// Hand-typed hash characters of each registry entry, to hold against its name.
+typedef struct RegistryEntry {
+    ChatCmdId id;
+    const char* name;
+    char c0, c1, cl;
+} RegistryEntry;
+
+static const RegistryEntry registry[] = {
+#define CHAT_CMD_ENTRY(id, c0, c1, cl, flags, args, text, usage) {CHAT_CMD_##id, #id, c0, c1, cl},
+    CHAT_CMD_LIST(CHAT_CMD_ENTRY)
+#undef CHAT_CMD_ENTRY
+};
+
+// A lookup that must not find want: NULL, or a command whose name it is.
+static int near_miss_ok(const char* name, const ChatCmdSpec* want) {
+    const ChatCmdSpec* got = chat_cmd_lookup(name, (uint32_t)strlen(name));
+    return got != want || _stricmp(got->name, name) == 0;
+}
+
+// Check the command registry; returns the number of failures.
+static long verify_registry(void) {
+    long failures = 0;
+    long checks = 0;
+    for (size_t i = 0; i < sizeof(registry) / sizeof(registry[0]); i++) {
+        const RegistryEntry* e = &registry[i];
+        const ChatCmdSpec* spec = chat_cmd_spec(e->id);
+        size_t len = strlen(e->name);
+        char lower[CHAT_CMD_NAME_MAX + 2];
+        for (size_t j = 0; j <= len; j++) lower[j] = (char)(e->name[j] | (e->name[j] ? 0x20 : 0));
+        int ok = spec && e->c0 == e->name[0] && e->c1 == e->name[1] && e->cl == e->name[len - 1] &&
+                 chat_cmd_lookup(spec->name, spec->name_len) == spec &&
+                 chat_cmd_lookup(e->name, (uint32_t)len) == spec && chat_cmd_lookup(lower, (uint32_t)len) == spec;
+        checks += 4;
+        // Near misses: last character changed, one dropped, one added.
+        char miss[CHAT_CMD_NAME_MAX + 2];
+        memcpy(miss, e->name, len + 1);
+        miss[len - 1] = miss[len - 1] == 'X' ? 'Y' : 'X';
+        ok &= near_miss_ok(miss, spec);
+        miss[len - 1] = 0;
+        ok &= near_miss_ok(miss, spec);
+        memcpy(miss, e->name, len);
+        miss[len] = 'S';
+        miss[len + 1] = 0;
+        ok &= near_miss_ok(miss, spec);
+        checks += 3;
+        if (!ok) {
+            printf("# verify registry entry %s does not look up its own spec\n", e->name);
+            failures++;
+        }
+    }
+    static const char* const unknown[] = {"HELO", "AUTHS", "JION", "MS", "PMM", "PONG", "QUIT", "STAT", "NODES"};
+    for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        checks++;
+        if (chat_cmd_lookup(unknown[i], (uint32_t)strlen(unknown[i]))) {
+            printf("# verify registry found unregistered %s\n", unknown[i]);
+            failures++;
+        }
+    }
+    printf("# verify registry commands=%d checks=%ld failures=%ld\n", (int)(sizeof(registry) / sizeof(registry[0])),
+        checks, failures);
+    return failures;
+}
+
+// Differential check of every kernel level; returns the mismatch count.
+static long verify_parse(const Corpus* corpora, int ncorpora, long fuzz) {
+    char* payload = (char*)malloc(CHAT_MAX_FRAME + 1u);
+    char* a = (char*)malloc(CHAT_MAX_FRAME + 1u);
+    char* b = (char*)malloc(CHAT_MAX_FRAME + 1u);
+    if (!payload || !a || !b) exit(1);
+    // Runs of spaces, words and colons, so delimiters land on every block
+    // offset and whole blocks of one kind get skipped.
+    static const char* const pieces[] = {" ", ":", " :", "a", "b:c", "\t"};
+    int best = chat_cmd_simd_level(-1);
+    long inputs = 0, mismatches = 0;
+    char levels[16] = "";
+    for (int level = 0; level <= best; level++) {
+        chat_cmd_simd_level(level);
+        snprintf(levels + strlen(levels), sizeof(levels) - strlen(levels), level ? ",%d" : "%d", level);
+        uint32_t rng = 1234567u;
+        for (long i = 0; i < fuzz + (long)ncorpora * 4096; i++) {
+            uint32_t len;
+            if (i < fuzz) {
+                // Lengths cluster around block edges; some payloads hold a NUL.
+                uint32_t r = bench_rng_next(&rng);
+                uint32_t want = r % 4u == 0 ? 32u * (1u + bench_rng_next(&rng) % 4u) - 2u + bench_rng_next(&rng) % 5u
+                                            : bench_rng_next(&rng) % 300u;
+                len = 0;
+                while (len < want) {
+                    const char* piece = pieces[bench_rng_next(&rng) % (sizeof(pieces) / sizeof(pieces[0]))];
+                    uint32_t pl = (uint32_t)strlen(piece);
+                    uint32_t reps = bench_rng_next(&rng) % 4u == 0 ? 1u + bench_rng_next(&rng) % 80u : 1u;
+                    for (uint32_t k = 0; k < reps && len < want; k++) {
+                        for (uint32_t j = 0; j < pl && len < want; j++) payload[len++] = piece[j];
+                    }
+                }
+                if (len > 0 && bench_rng_next(&rng) % 16u == 0) payload[bench_rng_next(&rng) % len] = 0;
+            } else {
+                long k = i - fuzz;
+                const Corpus* c = &corpora[k / 4096];
+                if ((uint32_t)(k % 4096) >= c->count) continue;
+                len = c->lens[k % 4096];
+                memcpy(payload, c->items[k % 4096], len);
+            }
+            inputs++;
+            if (!verify_one(payload, len, a, b)) continue;
+            if (mismatches++ < 5) {
+                printf("# verify mismatch level=%d len=%u payload=\"", level, len);
+                print_escaped(payload, len);
+                printf("\"\n");
+            }
+        }
+    }
+    chat_cmd_simd_level(best);
+    printf("# verify inputs=%ld levels=%s mismatches=%ld\n", inputs, levels, mismatches);
+    free(payload);
+    free(a);
+    free(b);
+    return mismatches;
+}
+
+static void result_set(Result* r, const Corpus* c, const char* op, uint64_t ops, uint64_t bytes, uint64_t ns,
+    uint64_t allocs) {
+    snprintf(r->corpus, sizeof(r->corpus), "%s", c->name);
+    snprintf(r->op, sizeof(r->op), "%s", op);
+    r->ops = ops;
+    r->bytes_per_op = (double)bytes / (double)ops;
+    r->ns_per_op = (double)ns / (double)ops;
+    r->bytes_per_sec = ns ? (double)bytes * 1e9 / (double)ns : 0.0;
+    r->allocs_per_op = (double)allocs / (double)ops;
+}
+
+// Parse every item of a contiguous copy, resetting the copy between rounds,
+// with chat_cmd_parse or the reference parser.
+static void run_parse(const Corpus* c, Result* r, int use_ref) {
+    char* pristine = (char*)malloc(c->bytes + c->count);
+    char* arena = (char*)malloc(c->bytes + c->count);
+    size_t* off = (size_t*)malloc(c->count * sizeof(*off));
+    if (!pristine || !arena || !off) exit(1);
+    size_t at = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        off[i] = at;
+        memcpy(pristine + at, c->items[i], c->lens[i] + 1u);
+        at += c->lens[i] + 1u;
+    }
+
+    uint64_t ns = 0, allocs = 0, sink = 0;
+    for (long round = 0; round < c->rounds; round++) {
+        memcpy(arena, pristine, at);
+        uint64_t a0 = g_allocs;
+        uint64_t t0 = chat_now_ns();
+        for (uint32_t i = 0; i < c->count; i++) {
+            ChatCmd cmd;
+            if (use_ref) {
+                // Callers of the old parser measured each field themselves.
+                sink += (uint64_t)ref_parse(arena + off[i], &cmd);
+                if (cmd.cmd) sink += strlen(cmd.cmd);
+                if (cmd.arg1) sink += strlen(cmd.arg1);
+                if (cmd.arg2) sink += strlen(cmd.arg2);
+                if (cmd.text) sink += strlen(cmd.text);
+            } else {
+                sink += (uint64_t)chat_cmd_parse(arena + off[i], c->lens[i], &cmd);
+            }
+            if (cmd.text) sink += (uint64_t)(cmd.text - cmd.buf);
+        }
+        ns += chat_now_ns() - t0;
+        allocs += g_allocs - a0;
+    }
+    if (sink == 0) printf("# parse sink 0\n");
+    result_set(r, c, use_ref ? "parse_ref" : "parse", (uint64_t)c->rounds * c->count, (uint64_t)c->rounds * c->bytes, ns, allocs);
+    free(pristine);
+    free(arena);
+    free(off);
+}
+
+// The server's dispatch before the command registry: one _stricmp per
+// command until a name matches. Returns a handler ID.
+static int ref_dispatch(const char* name) {
+    static const char* const names[] = {"JOIN", "LEAVE", "MSG", "PM", "HISTORY", "PING", "QUEUE", "POOLS"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (_stricmp(name, names[i]) == 0) return i + 1;
+    }
+    return 0;
+}
+
+// Map each item's parsed command name to its handler, through the
+// registry or the reference chain. Only the lookup is timed.
+static void run_dispatch(const Corpus* c, Result* r, int use_ref) {
+    char* arena = (char*)malloc(c->bytes + c->count);
+    ChatCmd* cmds = (ChatCmd*)malloc(c->count * sizeof(*cmds));
+    if (!arena || !cmds) exit(1);
+    size_t at = 0;
+    uint64_t names = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        memcpy(arena + at, c->items[i], c->lens[i] + 1u);
+        (void)chat_cmd_parse(arena + at, c->lens[i], &cmds[i]);
+        if (!cmds[i].cmd) {
+            cmds[i].cmd = arena + at + c->lens[i]; // Empty name: never matches.
+            cmds[i].cmd_len = 0;
+        }
+        names += cmds[i].cmd_len;
+        at += c->lens[i] + 1u;
+    }
+
+    uint64_t ns = 0, allocs = 0, sink = 0;
+    for (long round = 0; round < c->rounds; round++) {
+        uint64_t a0 = g_allocs;
+        uint64_t t0 = chat_now_ns();
+        for (uint32_t i = 0; i < c->count; i++) {
+            if (use_ref) {
+                sink += (uint64_t)ref_dispatch(cmds[i].cmd);
+            } else {
+                const ChatCmdSpec* spec = chat_cmd_lookup(cmds[i].cmd, cmds[i].cmd_len);
+                if (spec && chat_cmd_check(spec, &cmds[i])) sink += (uint64_t)spec->id;
+            }
+        }
+        ns += chat_now_ns() - t0;
+        allocs += g_allocs - a0;
+    }
+    if (sink == 0 && names) printf("# dispatch sink 0\n");
+    result_set(r, c, use_ref ? "dispatch_ref" : "dispatch", (uint64_t)c->rounds * c->count,
+        (uint64_t)c->rounds * names, ns, allocs);
+    free(arena);
+    free(cmds);
+}
+
+// Re-format the fields parsed from each item (items that don't parse are
+// skipped, as senders never produce them).
+static void run_format(const Corpus* c, Result* r) {
+    char** copies = (char**)calloc(c->count, sizeof(*copies));
+    ChatCmd* cmds = (ChatCmd*)calloc(c->count, sizeof(*cmds));
+    char* out = (char*)malloc(CHAT_MAX_FRAME + 1u);
+    if (!copies || !cmds || !out) exit(1);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        copies[n] = (char*)malloc(c->lens[i] + 1u);
+        if (!copies[n]) exit(1);
+        memcpy(copies[n], c->items[i], c->lens[i] + 1u);
+        if (chat_cmd_parse_inplace(copies[n], &cmds[n])) n++;
+        else free(copies[n]);
+    }
+
+    uint64_t bytes = 0, failed = 0;
+    uint64_t a0 = g_allocs;
+    uint64_t t0 = chat_now_ns();
+    for (long round = 0; round < c->rounds; round++) {
+        for (uint32_t i = 0; i < n; i++) {
+            const ChatCmd* cmd = &cmds[i];
+            if (!chat_cmd_format(out, CHAT_MAX_FRAME + 1u, cmd->cmd, cmd->arg1, cmd->arg2, cmd->text)) failed++;
+            else bytes += strlen(out);
+        }
+    }
+    uint64_t ns = chat_now_ns() - t0;
+    uint64_t allocs = g_allocs - a0;
+    if (failed) printf("# format failed=%llu\n", (unsigned long long)failed);
+    result_set(r, c, "format", (uint64_t)c->rounds * n, bytes, ns, allocs);
+    for (uint32_t i = 0; i < n; i++) free(copies[i]);
+    free(copies);
+    free(cmds);
+    free(out);
+}
+
+static void* drain_main(void* arg) {
+    Pump* p = (Pump*)arg;
+    uint8_t* buf = (uint8_t*)malloc(256 * 1024);
+    if (!buf) exit(1);
+    for (;;) {
+        ssize_t n = recv(p->sock, buf, 256 * 1024, 0);
+        if (n <= 0) break;
+        p->bytes += (uint64_t)n;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void* feed_main(void* arg) {
+    Pump* p = (Pump*)arg;
+    for (long round = 0; round < p->rounds; round++) {
+        if (!chat_send_all(p->sock, p->stream, (int)p->stream_len)) break;
+    }
+    shutdown(p->sock, SHUT_WR);
+    return NULL;
+}
+
+static void make_pair(SOCKET sv[2]) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    sv[0] = fds[0];
+    sv[1] = fds[1];
+}
+
+// chat_frame_send each item; a second thread reads the other end until EOF.
+static void run_encode(const Corpus* c, Result* r) {
+    SOCKET sv[2];
+    make_pair(sv);
+    Pump drain = {0};
+    drain.sock = sv[1];
+    if (pthread_create(&drain.tid, NULL, drain_main, &drain) != 0) exit(1);
+
+    uint64_t a0 = g_allocs;
+    uint64_t t0 = chat_now_ns();
+    for (long round = 0; round < c->rounds; round++) {
+        for (uint32_t i = 0; i < c->count; i++) {
+            if (!chat_frame_send(sv[0], c->items[i], c->lens[i])) {
+                printf("# encode send failed\n");
+                exit(1);
+            }
+        }
+    }
+    uint64_t allocs = g_allocs - a0;
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(drain.tid, NULL);
+    uint64_t ns = chat_now_ns() - t0;
+    uint64_t ops = (uint64_t)c->rounds * c->count;
+    if (drain.bytes != (uint64_t)c->rounds * c->bytes + ops * 4u) {
+        printf("# encode drained %llu bytes\n", (unsigned long long)drain.bytes);
+        exit(1);
+    }
+    result_set(r, c, "encode", ops, (uint64_t)c->rounds * c->bytes, ns, allocs);
+    closesocket(sv[0]);
+    closesocket(sv[1]);
+}
+
+// Receive the encoded corpus, fed by a second thread, either through
+// recv() and ChatFrameDecoder or through chat_frame_recv_alloc.
+static void run_decode(const Corpus* c, Result* r, int use_decoder) {
+    size_t stream_len = (size_t)c->bytes + (size_t)c->count * 4u;
+    uint8_t* stream = (uint8_t*)malloc(stream_len);
+    uint8_t* chunk = (uint8_t*)malloc(CHAT_MAX_FRAME + 1u);
+    if (!stream || !chunk) exit(1);
+    size_t at = 0;
+    for (uint32_t i = 0; i < c->count; i++) {
+        uint32_t net_len = htonl(c->lens[i]);
+        memcpy(stream + at, &net_len, 4);
+        memcpy(stream + at + 4, c->items[i], c->lens[i]);
+        at += 4u + c->lens[i];
+    }
+
+    SOCKET sv[2];
+    make_pair(sv);
+    Pump feed = {0};
+    feed.sock = sv[0];
+    feed.stream = stream;
+    feed.stream_len = stream_len;
+    feed.rounds = c->rounds;
+    ChatFrameDecoder dec;
+    chat_decoder_init(&dec, CHAT_MAX_FRAME);
+    if (pthread_create(&feed.tid, NULL, feed_main, &feed) != 0) exit(1);
+
+    uint64_t frames = 0, bytes = 0;
+    uint64_t a0 = g_allocs;
+    uint64_t t0 = chat_now_ns();
+    if (use_decoder) {
+        for (;;) {
+            ssize_t n = recv(sv[1], chunk, CHAT_MAX_FRAME, 0);
+            if (n <= 0) break;
+            chat_decoder_feed(&dec, chunk, (size_t)n);
+            uint8_t* payload;
+            uint32_t len;
+            int rc;
+            while ((rc = chat_decoder_next(&dec, &payload, &len)) == 1) {
+                frames++;
+                bytes += len;
+            }
+            if (rc < 0) break;
+        }
+    } else {
+        uint8_t* payload;
+        uint32_t len;
+        while (chat_frame_recv_alloc(sv[1], &payload, &len, CHAT_MAX_FRAME)) {
+            frames++;
+            bytes += len;
+            free(payload);
+        }
+    }
+    uint64_t ns = chat_now_ns() - t0;
+    uint64_t allocs = g_allocs - a0;
+    pthread_join(feed.tid, NULL);
+    uint64_t ops = (uint64_t)c->rounds * c->count;
+    if (frames != ops || bytes != (uint64_t)c->rounds * c->bytes) {
+        printf("# %s decoded frames=%llu bytes=%llu\n", use_decoder ? "decode" : "recv_alloc",
+            (unsigned long long)frames, (unsigned long long)bytes);
+        exit(1);
+    }
+    result_set(r, c, use_decoder ? "decode" : "recv_alloc", ops, bytes, ns, allocs);
+    chat_decoder_free(&dec);
+    closesocket(sv[0]);
+    closesocket(sv[1]);
+    free(stream);
+    free(chunk);
+}
+
+// Value of key in a line of key=value pairs, or NULL.
+static const char* line_value(const char* line, const char* key, char* out, size_t cap) {
+    size_t kl = strlen(key);
+    const char* p = line;
+    while (*p) {
+        while (*p == ' ') p++;
+        if (strncmp(p, key, kl) == 0 && p[kl] == '=') {
+            p += kl + 1;
+            size_t n = strcspn(p, " \r\n");
+            if (n >= cap) n = cap - 1;
+            memcpy(out, p, n);
+            out[n] = 0;
+            return out;
+        }
+        p += strcspn(p, " ");
+    }
+    return NULL;
+}
+
+// Load a baseline written by an earlier run; returns the number of cases.
+static int load_baseline(const char* path, Result* base, int cap) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Cannot open baseline %s\n", path);
+        return -1;
+    }
+    char line[512], v[64];
+    int n = 0, format = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') {
+            if (line_value(line + 1, "format", v, sizeof(v))) format = atoi(v);
+            continue;
+        }
+        if (n == cap || strncmp(line, "corpus=", 7) != 0 || !line_value(line, "corpus", base[n].corpus, sizeof(base[n].corpus)) ||
+            !line_value(line, "op", base[n].op, sizeof(base[n].op)) || !line_value(line, "ns_per_op", v, sizeof(v)))
+            continue;
+        base[n].ns_per_op = atof(v);
+        base[n].allocs_per_op = line_value(line, "allocs_per_op", v, sizeof(v)) ? atof(v) : 0.0;
+        n++;
+    }
+    fclose(f);
+    if (format != BENCH_FORMAT) {
+        printf("Baseline %s has format %d, expected %d\n", path, format, BENCH_FORMAT);
+        return -1;
+    }
+    return n;
+}
+
+// Print one compare line per case; returns the number of regressions.
+static int compare(const Result* res, int n, const Result* base, int nbase, double tolerance) {
+    int regressions = 0;
+    for (int i = 0; i < n; i++) {
+        const Result* b = NULL;
+        for (int k = 0; k < nbase && !b; k++) {
+            if (strcmp(base[k].corpus, res[i].corpus) == 0 && strcmp(base[k].op, res[i].op) == 0) b = &base[k];
+        }
+        if (!b) {
+            printf("compare corpus=%s op=%s status=new\n", res[i].corpus, res[i].op);
+            continue;
+        }
+        double change = b->ns_per_op > 0 ? (res[i].ns_per_op / b->ns_per_op - 1.0) * 100.0 : 0.0;
+        const char* status = "ok";
+        // Allocation counts are deterministic, so any increase is a regression.
+        if (res[i].allocs_per_op > b->allocs_per_op + 0.005) status = "more_allocs";
+        else if (change > tolerance) status = "slower";
+        else if (change < -tolerance) status = "faster";
+        if (strcmp(status, "more_allocs") == 0 || strcmp(status, "slower") == 0) regressions++;
+        printf("compare corpus=%s op=%s ns_per_op=%.1f base_ns_per_op=%.1f change=%+.1f%% allocs_per_op=%.2f"
+               " base_allocs_per_op=%.2f status=%s\n",
+            res[i].corpus, res[i].op, res[i].ns_per_op, b->ns_per_op, change, res[i].allocs_per_op,
+            b->allocs_per_op, status);
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    double scale = 1.0;
+    double tolerance = 15.0;
+    int simd = -1;
+    long fuzz = 200000;
+    const char* only = NULL;
+    const char* baseline = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+            fuzz = atol(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (scale <= 0 || tolerance < 0 || simd > 2 || fuzz < 0 ||
+        (only && strcmp(only, "short") != 0 && strcmp(only, "text") != 0 && strcmp(only, "spacing") != 0 &&
+            strcmp(only, "max") != 0)) {
+        usage();
+        return 2;
+    }
+
+    Result base[BENCH_MAX_CASES];
+    int nbase = 0;
+    if (baseline && (nbase = load_baseline(baseline, base, BENCH_MAX_CASES)) < 0) return 2;
+
+    Corpus corpora[4];
+    build_short(&corpora[0]);
+    build_text(&corpora[1]);
+    build_spacing(&corpora[2]);
+    build_max(&corpora[3]);
+
+    printf("# chat_shared_bench format=%d max_frame=%u scale=%g\n", BENCH_FORMAT, CHAT_MAX_FRAME, scale);
+    if (verify_parse(corpora, 4, fuzz) != 0 || verify_registry() != 0) return 1;
+    printf("# simd=%d\n", chat_cmd_simd_level(simd));
+    Result res[BENCH_MAX_CASES];
+    int n = 0;
+    for (int i = 0; i < 4; i++) {
+        Corpus* c = &corpora[i];
+        if (only && strcmp(only, c->name) != 0) continue;
+        c->rounds = (long)(c->rounds * scale);
+        if (c->rounds < 1) c->rounds = 1;
+        int first = n;
+        run_parse(c, &res[n++], 0);
+        run_parse(c, &res[n++], 1);
+        run_dispatch(c, &res[n++], 0);
+        run_dispatch(c, &res[n++], 1);
+        run_format(c, &res[n++]);
+        run_encode(c, &res[n++]);
+        run_decode(c, &res[n++], 1);
+        run_decode(c, &res[n++], 0);
+        for (int k = first; k < n; k++) {
+            printf("corpus=%s op=%s items=%u ops=%llu bytes_per_op=%.1f ns_per_op=%.1f bytes_per_sec=%.0f"
+                   " allocs_per_op=%.2f\n",
+                res[k].corpus, res[k].op, c->count, (unsigned long long)res[k].ops, res[k].bytes_per_op,
+                res[k].ns_per_op, res[k].bytes_per_sec, res[k].allocs_per_op);
+        }
+        fflush(stdout);
+    }
+    for (int i = 0; i < 4; i++) corpus_free(&corpora[i]);
+
+    if (!baseline) return 0;
+    int regressions = compare(res, n, base, nbase, tolerance);
+    printf("regressions=%d tolerance=%.1f%%\n", regressions, tolerance);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+#include "chat_platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "chat_cmd.h"
+#include "chat_frame.h"
+#include "chat_proto.h"
+#include "chat_zip.h"
+
+// Per-frame compression benchmark: CPU spent versus bytes saved.
+// Builds ROOMMSG events as the server broadcasts them (v1 text or v2
+// binary) with chat-like text of a given average length, then packs every
+// frame that reaches the bypass threshold and unpacks it again. Reports
+// wire bytes per message before and after (length prefixes included),
+// nanoseconds to pack and unpack one frame, and what packing costs per
+// delivery when one packed frame is shared by a room of --fanout members.
+
+#define BENCH_MESSAGES 20000
+
+static const char* words[] = {
+    "the", "build", "is", "green", "again", "can", "you", "review", "my", "patch", "please", "I", "think",
+    "we", "should", "ship", "it", "today", "lunch", "at", "noon", "sounds", "good", "thanks", "for", "the",
+    "heads", "up", "deploy", "failed", "on", "staging", "because", "of", "a", "flaky", "test", "what",
+    "time", "is", "the", "meeting", "tomorrow", "yeah", "okay", "sure", "let", "me", "check", "that",
+    "https://example.com/issues/4821", "lol", "really", "nice", "work", "everyone", "about", "there",
+};
+
+typedef struct Corpus {
+    uint8_t** payload;
+    uint32_t* len;
+    int count;
+} Corpus;
+
+static void usage(void) {
+    printf("chat_zip_bench [--messages <n>] [--text <bytes>] [--min <bytes>] [--fanout <n>]\n");
+}
+
+static void corpus_build(Corpus* c, int n, int text_avg, int bin) {
+    c->payload = (uint8_t**)calloc((size_t)n, sizeof(*c->payload));
+    c->len = (uint32_t*)calloc((size_t)n, sizeof(*c->len));
+    if (!c->payload || !c->len) exit(1);
+    c->count = n;
+    uint32_t rng = 2463534242u;
+    int nwords = (int)(sizeof(words) / sizeof(words[0]));
+    for (int i = 0; i < n; i++) {
+        int want = text_avg / 2 + (int)(bench_rng_next(&rng) % (uint32_t)(text_avg + 1));
+        char text[2048];
+        int len = 0;
+        while (len < want) {
+            const char* w = words[bench_rng_next(&rng) % (uint32_t)nwords];
+            int wl = (int)strlen(w);
+            if (len + wl + 1 >= (int)sizeof(text)) break;
+            if (len) text[len++] = ' ';
+            memcpy(text + len, w, (size_t)wl);
+            len += wl;
+        }
+        text[len] = 0;
+
+        char room[32], user[32];
+        uint32_t room_i = bench_rng_next(&rng) % 16, user_i = bench_rng_next(&rng) % 512;
+        snprintf(room, sizeof(room), "team-%u", room_i);
+        snprintf(user, sizeof(user), "user_%u", user_i);
+        uint8_t buf[4096];
+        uint32_t plen;
+        if (bin) {
+            ChatBinWriter w;
+            chat_bw_init(&w, buf, sizeof(buf));
+            chat_bw_u8(&w, CHAT_OP_ROOMMSG);
+            chat_bw_varint(&w, room_i + 1);
+            chat_bw_varint(&w, user_i + 1);
+            chat_bw_text(&w, text);
+            plen = w.len;
+        } else {
+            if (!chat_cmd_format((char*)buf, sizeof(buf), "ROOMMSG", room, user, text)) exit(1);
+            plen = (uint32_t)strlen((char*)buf);
+        }
+        c->payload[i] = (uint8_t*)malloc(plen);
+        if (!c->payload[i]) exit(1);
+        memcpy(c->payload[i], buf, plen);
+        c->len[i] = plen;
+    }
+}
+
+static void corpus_free(Corpus* c) {
+    for (int i = 0; i < c->count; i++) free(c->payload[i]);
+    free(c->payload);
+    free(c->len);
+}
+
+// Wire bytes for one payload: v1 has a 4-byte length, v2 a varint.
+static uint32_t wire_len(uint32_t len, int bin) {
+    uint8_t tmp[CHAT_VARINT_MAX];
+    return len + (bin ? chat_varint_put(tmp, len) : 4u);
+}
+
+static void run(const Corpus* c, int bin, int level, uint32_t min, int fanout, int text_avg) {
+    ChatZip* z = chat_zip_new(level);
+    uint8_t* packed = (uint8_t*)malloc(CHAT_MAX_FRAME);
+    uint8_t* back = (uint8_t*)malloc(CHAT_MAX_FRAME);
+    uint32_t* packed_len = (uint32_t*)calloc((size_t)c->count, sizeof(*packed_len));
+    if (!z || !packed || !back || !packed_len) exit(1);
+
+    uint64_t plain_bytes = 0, wire_bytes = 0;
+    int attempted = 0, kept = 0;
+    uint64_t t0 = chat_now_ns();
+    for (int i = 0; i < c->count; i++) {
+        uint32_t n = 0;
+        if (c->len[i] >= min) {
+            attempted++;
+            n = chat_zip_pack(z, c->payload[i], c->len[i], packed, c->len[i]);
+        }
+        packed_len[i] = n;
+        kept += n > 0;
+        plain_bytes += wire_len(c->len[i], bin);
+        wire_bytes += wire_len(n ? n : c->len[i], bin);
+    }
+    double pack_secs = (double)(chat_now_ns() - t0) / 1e9;
+
+    // Unpack what was kept (packing again first: one buffer per frame).
+    double unpack_secs = 0;
+    int mismatch = 0;
+    for (int i = 0; i < c->count; i++) {
+        if (!packed_len[i]) continue;
+        uint32_t n = chat_zip_pack(z, c->payload[i], c->len[i], packed, c->len[i]);
+        uint64_t u0 = chat_now_ns();
+        int ok = chat_zip_unpack(z, packed, n, back, c->len[i]);
+        unpack_secs += (double)(chat_now_ns() - u0) / 1e9;
+        if (!ok || memcmp(back, c->payload[i], c->len[i]) != 0) mismatch++;
+    }
+
+    double pack_ns = attempted ? pack_secs * 1e9 / attempted : 0.0;
+    printf("proto=v%d text_avg=%d level=%d min=%u packed=%.1f%% plain_bytes_per_msg=%.1f wire_bytes_per_msg=%.1f"
+           " saved=%.1f%% pack_ns=%.0f unpack_ns=%.0f pack_ns_per_delivery=%.1f mismatch=%d\n",
+        bin ? 2 : 1, text_avg, level, min, 100.0 * kept / c->count, (double)plain_bytes / c->count,
+        (double)wire_bytes / c->count, 100.0 * (1.0 - (double)wire_bytes / (double)plain_bytes), pack_ns,
+        kept ? unpack_secs * 1e9 / kept : 0.0, pack_ns / fanout, mismatch);
+
+    chat_zip_free(z);
+    free(packed);
+    free(back);
+    free(packed_len);
+}
+
+int main(int argc, char** argv) {
+    int messages = BENCH_MESSAGES;
+    int text_len = -1;
+    long min = 96;
+    int fanout = 50;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--text") == 0 && i + 1 < argc) {
+            text_len = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min") == 0 && i + 1 < argc) {
+            min = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--fanout") == 0 && i + 1 < argc) {
+            fanout = atoi(argv[++i]);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (messages <= 0 || text_len == 0 || text_len > 1000 || min < 1 || fanout <= 0) {
+        usage();
+        return 2;
+    }
+    if (!chat_zip_available()) {
+        printf("built without zlib\n");
+        return 1;
+    }
+
+    static const int sizes[] = {32, 128, 512};
+    static const int levels[] = {1, 6, 9};
+    int nsizes = text_len > 0 ? 1 : (int)(sizeof(sizes) / sizeof(sizes[0]));
+    for (int bin = 0; bin <= 1; bin++) {
+        for (int k = 0; k < nsizes; k++) {
+            int avg = text_len > 0 ? text_len : sizes[k];
+            Corpus c;
+            corpus_build(&c, messages, avg, bin);
+            for (int l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++) {
+                run(&c, bin, levels[l], (uint32_t)min, fanout, avg);
+            }
+            corpus_free(&c);
+        }
+    }
+    return 0;
+}
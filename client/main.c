@@ -17,6 +17,7 @@
 // Uses shared framing/command helpers for protocol messages.
 
 #define APP_TITLE L"ChatApp Client"
+#define CLIENT_READ_CHUNK 16384 // Bytes read per recv() on the network thread.
 
 #define IDC_HOST 101
 #define IDC_PORT 102
@@ -68,10 +69,6 @@ typedef struct NetStart {
     char pass[64];
 } NetStart;
 
-static int starts_with(const char* s, const char* pfx) {
-    return s && pfx && strncmp(s, pfx, strlen(pfx)) == 0;
-}
-
 static void ui_append_line(AppState* st, const wchar_t* line) {
     // Append line plus newline to the log edit control.
     if (!line) return;
@@ -164,53 +161,63 @@ static DWORD WINAPI net_thread_main(LPVOID param) {
         return 0;
     }
     freeaddrinfo(res);
+    // Each frame goes out in one write; Nagle would only hold it back.
+    (void)chat_socket_set_nodelay(sock);
 
     PostMessageW(ns->hwnd, WM_APP_NET_STATUS, 1, (LPARAM)sock);
 
-    // Expect initial HELLO from server.
-    uint8_t* payload = NULL;
-    uint32_t payload_len = 0;
-    if (!chat_frame_recv_alloc(sock, &payload, &payload_len, CHAT_MAX_FRAME)) {
-        shutdown(sock, SD_BOTH);
-        closesocket(sock);
-        PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)_strdup("Disconnected during HELLO"));
-        PostMessageW(ns->hwnd, WM_APP_NET_STATUS, 0, 0);
-        free(ns);
-        return 0;
-    }
+    // Read frames in place through the decoder; the first must be HELLO,
+    // after which every frame is a text line for the UI thread.
+    ChatFrameDecoder dec;
+    chat_decoder_init(&dec, CHAT_MAX_FRAME);
+    uint8_t rbuf[CLIENT_READ_CHUNK + 1]; // Spare byte for the decoder's terminator.
+    int greeted = 0;
+    const char* fail = NULL;
+    while (!fail) {
+        int n = chat_recv_some(sock, rbuf, CLIENT_READ_CHUNK);
+        if (n <= 0) {
+            if (!greeted) fail = "Disconnected during HELLO";
+            break;
+        }
+        chat_decoder_feed(&dec, rbuf, (size_t)n);
 
-    if (strcmp((char*)payload, "HELLO 1") != 0) {
-        free(payload);
-        shutdown(sock, SD_BOTH);
-        closesocket(sock);
-        PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)_strdup("Bad server HELLO"));
-        PostMessageW(ns->hwnd, WM_APP_NET_STATUS, 0, 0);
-        free(ns);
-        return 0;
+        uint8_t* p = NULL;
+        uint32_t len = 0;
+        int r = 0;
+        while (!fail && (r = chat_decoder_next(&dec, &p, &len)) > 0) {
+            if (greeted) {
+                // UI thread takes ownership of the copy and frees it.
+                char* line = _strdup((char*)p);
+                if (line) PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)line);
+                continue;
+            }
+            if (strcmp((char*)p, "HELLO 1") != 0) {
+                fail = "Bad server HELLO";
+                break;
+            }
+
+            // Send AUTH with username/password.
+            char auth[256];
+            snprintf(auth, sizeof(auth), "AUTH %s %s", ns->user, ns->pass);
+            if (!chat_frame_send(sock, auth, (uint32_t)strlen(auth))) {
+                fail = "AUTH send failed";
+                break;
+            }
+            greeted = 1;
+        }
+        if (!fail && r < 0) break;
     }
-    free(payload);
+    chat_decoder_free(&dec);
 
-    // Send AUTH with username/password.
-    char auth[256];
-    snprintf(auth, sizeof(auth), "AUTH %s %s", ns->user, ns->pass);
-    if (!chat_frame_send(sock, auth, (uint32_t)strlen(auth))) {
+    if (fail) {
         shutdown(sock, SD_BOTH);
         closesocket(sock);
-        PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)_strdup("AUTH send failed"));
+        PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)_strdup(fail));
         PostMessageW(ns->hwnd, WM_APP_NET_STATUS, 0, 0);
         free(ns);
         return 0;
     }
 
-    // Read frames and forward text lines to the UI thread.
-    for (;;) {
-        uint8_t* p = NULL;
-        uint32_t n = 0;
-        if (!chat_frame_recv_alloc(sock, &p, &n, CHAT_MAX_FRAME)) break;
-        // UI thread takes ownership of buffer and frees it.
-        PostMessageW(ns->hwnd, WM_APP_NET_LINE, 0, (LPARAM)p);
-    }
-
     shutdown(sock, SD_BOTH);
     closesocket(sock);
     PostMessageW(ns->hwnd, WM_APP_NET_STATUS, 0, (LPARAM)_strdup("Disconnected"));
@@ -286,33 +293,48 @@ static void send_input(AppState* st) {
 
     SetWindowTextW(st->input_edit, L"");
 
-    if (starts_with(input, "/join ")) {
-        const char* room = input + 6;
-        strncpy(st->current_room, room, sizeof(st->current_room) - 1);
-        st->current_room[sizeof(st->current_room) - 1] = 0;
-        (void)client_send_cmd(st, "JOIN", room, NULL, NULL);
-        return;
-    }
-
-    if (starts_with(input, "/leave ")) {
-        const char* room = input + 7;
-        (void)client_send_cmd(st, "LEAVE", room, NULL, NULL);
-        if (_stricmp(st->current_room, room) == 0) st->current_room[0] = 0;
-        return;
-    }
-
-    if (starts_with(input, "/pm ")) {
-        const char* rest = input + 4;
-        const char* space = strchr(rest, ' ');
-        if (!space) return;
-        char user[64];
-        size_t ulen = (size_t)(space - rest);
-        if (ulen >= sizeof(user)) ulen = sizeof(user) - 1;
-        memcpy(user, rest, ulen);
-        user[ulen] = 0;
-        const char* msg = space + 1;
-        (void)client_send_cmd(st, "PM", user, NULL, msg);
-        return;
+    // "/name args": a registered command name, in any case. Anything else,
+    // or a command without the arguments it needs, goes out as text.
+    if (input[0] == '/') {
+        const char* name = input + 1;
+        size_t name_len = strcspn(name, " ");
+        const char* rest = name[name_len] == ' ' ? name + name_len + 1 : NULL;
+        const ChatCmdSpec* spec = chat_cmd_lookup(name, (uint32_t)name_len);
+        switch (spec ? spec->id : CHAT_CMD_NONE) {
+        case CHAT_CMD_JOIN:
+            if (!rest) break;
+            strncpy(st->current_room, rest, sizeof(st->current_room) - 1);
+            st->current_room[sizeof(st->current_room) - 1] = 0;
+            (void)client_send_cmd(st, "JOIN", rest, NULL, NULL);
+            return;
+        case CHAT_CMD_LEAVE:
+            if (!rest) break;
+            (void)client_send_cmd(st, "LEAVE", rest, NULL, NULL);
+            if (_stricmp(st->current_room, rest) == 0) st->current_room[0] = 0;
+            return;
+        case CHAT_CMD_PM: {
+            if (!rest) break;
+            const char* space = strchr(rest, ' ');
+            if (!space) return;
+            char user[64];
+            size_t ulen = (size_t)(space - rest);
+            if (ulen >= sizeof(user)) ulen = sizeof(user) - 1;
+            memcpy(user, rest, ulen);
+            user[ulen] = 0;
+            const char* msg = space + 1;
+            (void)client_send_cmd(st, "PM", user, NULL, msg);
+            return;
+        }
+        case CHAT_CMD_HISTORY: {
+            // Recent messages of the current room; an optional count limits them.
+            if (st->current_room[0] == 0) return;
+            const char* count = rest && rest[0] ? rest : NULL;
+            (void)client_send_cmd(st, "HISTORY", st->current_room, count, NULL);
+            return;
+        }
+        default:
+            break;
+        }
     }
 
     if (st->current_room[0] == 0) return;
@@ -388,7 +410,7 @@ static LRESULT CALLBACK wndproc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpara
         st->sock = INVALID_SOCKET;
         st->current_room[0] = 0;
         ui_set_connected(st, 0);
-        ui_append_line(st, L"Commands: /join room, /leave room, /pm user message");
+        ui_append_line(st, L"Commands: /join room, /leave room, /pm user message, /history [count]");
         return 0;
     }
     case WM_SIZE:
@@ -1,419 +1,330 @@
-#define WIN32_LEAN_AND_MEAN
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
+#include "chat_platform.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "chat_cmd.h"
-#include "chat_frame.h"
+#include "server.h"
 
-// Simple threaded chat server for Windows.
-// Uses length-prefixed frames and text commands from shared helpers.
+// Chat server entry point: parses args, opens the listener(s) and hands
+// them to the selected connection backend (see server.h).
 
-#define CHAT_PORT_DEFAULT "5555" // Default TCP port if none provided.
-#define CHAT_NAME_MAX 31 // Max username/room length (excluding NUL).
-
-typedef struct Client Client;
-typedef struct Room Room;
-
-// Connected client tracked by server state.
-struct Client {
-    SOCKET sock;
-    HANDLE thread;
-    int authed; // Set after successful AUTH.
-    char username[CHAT_NAME_MAX + 1];
-    Client* next; // Linked list of all clients.
-};
-
-// Chat room with a fixed-size member list (simple demo structure).
-struct Room {
-    char name[CHAT_NAME_MAX + 1];
-    Client* members[128]; // Fixed-size array of member pointers.
-    int member_count;
-    Room* next; // Linked list of rooms.
-};
-
-typedef struct ServerState {
-    CRITICAL_SECTION lock; // Protects clients/rooms.
-    Client* clients;
-    Room* rooms;
-    const char* password; // Plaintext shared password from args.
-} ServerState;
-
-static int starts_with(const char* s, const char* pfx) {
-    return s && pfx && strncmp(s, pfx, strlen(pfx)) == 0;
+static void usage(void) {
+    printf("chat_server --password <pw> | --credentials <path> [--port <port>] [--mode threads|epoll] [--reactors <n>]\n"
+           "            [--outq-bytes <n>] [--slow-policy disconnect|drop-oldest|coalesce]\n"
+           "            [--flush-us <us>] [--flush-bytes <n>] [--deflate on|off] [--deflate-min <n>]\n"
+           "            [--history <n>] [--history-mem <bytes>] [--history-join <n>]\n"
+           "            [--log-dir <path>] [--log-sync-ms <ms>] [--log-segment-mb <n>] [--log-segments <n>]\n"
+           "            [--admin <user>[,<user>...] (needs --credentials)]\n"
+           "            [--metrics-file <path>] [--metrics-interval-ms <ms>] [--trace-file <path>] [--trace-sample <n>]\n"
+           "            [--node <id> --peer-secret <secret>] [--peer <id>@<host>:<port>]...\n"
+           "            [--shm <name>] [--shm-ring-kb <n>]\n"
+           "            [--max-handshakes <n>] [--handshake-timeout-ms <ms>]\n"
+           "            [--auth-workers <n>] [--auth-cache-ms <ms>]\n");
 }
 
-// Find an authenticated client by username (case-insensitive).
-static Client* state_find_client_by_name(ServerState* st, const char* username) {
-    for (Client* c = st->clients; c; c = c->next) {
-        if (c->authed && _stricmp(c->username, username) == 0) return c;
-    }
-    return NULL;
-}
+// Open a bound, listening TCP socket; reuseport lets sibling sockets share the port.
+static SOCKET open_listener(const char* port, int reuseport) {
+    // Resolve bind address for listening socket.
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
 
-// Find a room by name (case-insensitive).
-static Room* state_find_room(ServerState* st, const char* name) {
-    for (Room* r = st->rooms; r; r = r->next) {
-        if (_stricmp(r->name, name) == 0) return r;
+    struct addrinfo* res = NULL;
+    int gai_rc = getaddrinfo(NULL, port, &hints, &res);
+    if (gai_rc != 0) {
+        printf("getaddrinfo failed: %s\n", gai_strerrorA(gai_rc));
+        return INVALID_SOCKET;
     }
-    return NULL;
-}
 
-// Look up or create a room; caller must hold st->lock.
-static Room* state_get_or_create_room(ServerState* st, const char* name) {
-    Room* r = state_find_room(st, name);
-    if (r) return r;
-
-    r = (Room*)calloc(1, sizeof(*r));
-    if (!r) return NULL;
-    strncpy(r->name, name, CHAT_NAME_MAX);
-    r->name[CHAT_NAME_MAX] = 0;
-    r->next = st->rooms;
-    st->rooms = r;
-    return r;
-}
-
-// Check if a client is already in the room.
-static int room_has_member(Room* r, Client* c) {
-    for (int i = 0; i < r->member_count; i++) {
-        if (r->members[i] == c) return 1;
+    SOCKET listen_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (listen_sock == INVALID_SOCKET) {
+        printf("socket failed\n");
+        freeaddrinfo(res);
+        return INVALID_SOCKET;
     }
-    return 0;
-}
 
-// Add a client if there's capacity and not already present.
-static void room_add_member(Room* r, Client* c) {
-    if (!r || !c) return;
-    if (room_has_member(r, c)) return;
-    if (r->member_count >= (int)(sizeof(r->members) / sizeof(r->members[0]))) return;
-    r->members[r->member_count++] = c;
-}
-
-// Remove a client by swapping with the last entry.
-static void room_remove_member(Room* r, Client* c) {
-    if (!r || !c) return;
-    for (int i = 0; i < r->member_count; i++) {
-        if (r->members[i] == c) {
-            r->members[i] = r->members[r->member_count - 1];
-            r->members[r->member_count - 1] = NULL;
-            r->member_count--;
-            return;
-        }
+    int yes = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&yes, sizeof(yes)) != 0) {
+        printf("SO_REUSEPORT failed\n");
+        closesocket(listen_sock);
+        freeaddrinfo(res);
+        return INVALID_SOCKET;
     }
-}
-
-// Send a raw text payload as a framed message.
-static int send_text(SOCKET sock, const char* payload) {
-    return chat_frame_send(sock, payload, (uint32_t)strlen(payload));
-}
+#else
+    (void)reuseport;
+#endif
 
-// Send "OK <what>" response.
-static int send_ok(SOCKET sock, const char* what) {
-    char buf[256];
-    if (!chat_cmd_format(buf, sizeof(buf), "OK", what, NULL, NULL)) return 0;
-    return send_text(sock, buf);
-}
-
-// Send "ERR <code> :reason" response.
-static int send_err(SOCKET sock, const char* code, const char* reason) {
-    char buf[512];
-    if (!chat_cmd_format(buf, sizeof(buf), "ERR", code, NULL, reason)) return 0;
-    return send_text(sock, buf);
-}
-
-// Broadcast payload to all members of a room.
-static void broadcast_room(ServerState* st, Room* r, const char* payload) {
-    SOCKET socks[128];
-    int count = 0;
-
-    // Snapshot socket list while holding lock; send without lock.
-    EnterCriticalSection(&st->lock);
-    for (int i = 0; i < r->member_count && count < (int)(sizeof(socks) / sizeof(socks[0])); i++) {
-        if (r->members[i]) socks[count++] = r->members[i]->sock;
+    if (bind(listen_sock, res->ai_addr, (int)res->ai_addrlen) != 0) {
+        printf("bind failed\n");
+        closesocket(listen_sock);
+        freeaddrinfo(res);
+        return INVALID_SOCKET;
     }
-    LeaveCriticalSection(&st->lock);
+    freeaddrinfo(res);
 
-    for (int i = 0; i < count; i++) {
-        (void)chat_frame_send(socks[i], payload, (uint32_t)strlen(payload));
+    if (listen(listen_sock, SOMAXCONN) != 0) {
+        printf("listen failed\n");
+        closesocket(listen_sock);
+        return INVALID_SOCKET;
     }
+    return listen_sock;
 }
 
-// Remove user from all rooms and notify remaining members.
-static void broadcast_user_leave(ServerState* st, Client* c) {
-    char payload[256];
-
-    EnterCriticalSection(&st->lock);
-    for (Room* r = st->rooms; r; r = r->next) {
-        if (room_has_member(r, c)) {
-            room_remove_member(r, c);
-            LeaveCriticalSection(&st->lock);
+int main(int argc, char** argv) {
+    const char* port = CHAT_PORT_DEFAULT;
+    const char* password = NULL;
+    const char* mode = "threads";
+    int reactors = 0;
+    uint32_t outq_limit = CHAT_OUTQ_DEFAULT;
+    SlowPolicy slow_policy = SLOW_DISCONNECT;
+    uint32_t flush_us = 0;
+    uint32_t flush_bytes = CHAT_FLUSH_BYTES_DEFAULT;
+    int zip = 1;
+    uint32_t zip_min = CHAT_ZIP_MIN_DEFAULT;
+    uint32_t hist_depth = CHAT_HISTORY_DEFAULT;
+    uint32_t hist_limit = CHAT_HISTORY_MEM_DEFAULT;
+    uint32_t hist_join = 0;
+    LogConfig log_cfg = {NULL, CHAT_LOG_SEGMENT_DEFAULT, 0, CHAT_LOG_SYNC_MS_DEFAULT};
+    const char* admins = NULL;
+    const char* metrics_file = NULL;
+    uint32_t metrics_interval = CHAT_METRICS_INTERVAL_DEFAULT;
+    const char* trace_file = NULL;
+    uint32_t trace_sample = CHAT_TRACE_SAMPLE_DEFAULT;
+    int node_id = 0;
+    int peer_count = 0;
+    const char* shm_name = NULL;
+    const char* peer_secret = NULL;
+    uint32_t max_handshakes = CHAT_HANDSHAKES_DEFAULT;
+    uint32_t handshake_ms = CHAT_HANDSHAKE_MS_DEFAULT;
+    uint32_t shm_ring = CHAT_SHM_RING_DEFAULT;
+    AuthConfig auth_cfg = {NULL, CHAT_AUTH_WORKERS_DEFAULT, CHAT_AUTH_CACHE_MS_DEFAULT};
 
-            if (chat_cmd_format(payload, sizeof(payload), "USERLEAVE", r->name, c->username, NULL)) {
-                broadcast_room(st, r, payload);
+    // Parse command-line args.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
+            password = argv[++i];
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            mode = argv[++i];
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            reactors = atoi(argv[++i]);
+            mode = "epoll";
+        } else if (strcmp(argv[i], "--outq-bytes") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1024 || n > (1L << 30)) {
+                printf("--outq-bytes must be between 1024 and %ld\n", 1L << 30);
+                return 2;
             }
-
-            EnterCriticalSection(&st->lock);
-        }
-    }
-    LeaveCriticalSection(&st->lock);
-}
-
-typedef struct ThreadCtx {
-    ServerState* st;
-    Client* client;
-} ThreadCtx;
-
-// Per-client worker thread. Handles AUTH and subsequent commands.
-static DWORD WINAPI client_thread(LPVOID param) {
-    ThreadCtx* ctx = (ThreadCtx*)param;
-    ServerState* st = ctx->st;
-    Client* c = ctx->client;
-    free(ctx);
-
-    // Protocol greeting so the client can confirm server version.
-    (void)send_text(c->sock, "HELLO 1");
-
-    for (;;) {
-        uint8_t* payload = NULL;
-        uint32_t payload_len = 0;
-        if (!chat_frame_recv_alloc(c->sock, &payload, &payload_len, CHAT_MAX_FRAME)) break;
-
-        ChatCmd cmd;
-        if (!chat_cmd_parse_inplace((char*)payload, &cmd) || !cmd.cmd) {
-            free(payload);
-            (void)send_err(c->sock, "BAD", "Malformed command");
-            continue;
-        }
-
-        // First command must be AUTH username password.
-        if (!c->authed) {
-            if (_stricmp(cmd.cmd, "AUTH") != 0 || !cmd.arg1 || !cmd.arg2) {
-                free(payload);
-                (void)send_err(c->sock, "AUTH", "Expected AUTH username password");
-                continue;
+            outq_limit = (uint32_t)n;
+        } else if (strcmp(argv[i], "--flush-us") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > 1000000) {
+                printf("--flush-us must be between 0 and 1000000\n");
+                return 2;
             }
-
-            const char* username = cmd.arg1;
-            const char* password = cmd.arg2;
-            if (strlen(username) > CHAT_NAME_MAX) {
-                free(payload);
-                (void)send_err(c->sock, "AUTH", "Username too long");
-                continue;
+            flush_us = (uint32_t)n;
+        } else if (strcmp(argv[i], "--flush-bytes") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > (1L << 30)) {
+                printf("--flush-bytes must be between 1 and %ld\n", 1L << 30);
+                return 2;
             }
-            if (strcmp(password, st->password) != 0) {
-                free(payload);
-                (void)send_err(c->sock, "AUTH", "Bad password");
-                break;
+            flush_bytes = (uint32_t)n;
+        } else if (strcmp(argv[i], "--deflate") == 0 && i + 1 < argc) {
+            const char* v = argv[++i];
+            if (strcmp(v, "on") != 0 && strcmp(v, "off") != 0) {
+                usage();
+                return 2;
             }
-
-            EnterCriticalSection(&st->lock);
-            if (state_find_client_by_name(st, username)) {
-                LeaveCriticalSection(&st->lock);
-                free(payload);
-                (void)send_err(c->sock, "AUTH", "Username already in use");
-                break;
+            zip = strcmp(v, "on") == 0;
+        } else if (strcmp(argv[i], "--deflate-min") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > (long)CHAT_MAX_FRAME) {
+                printf("--deflate-min must be between 1 and %u\n", CHAT_MAX_FRAME);
+                return 2;
             }
-            strncpy(c->username, username, CHAT_NAME_MAX);
-            c->username[CHAT_NAME_MAX] = 0;
-            c->authed = 1;
-            LeaveCriticalSection(&st->lock);
-
-            free(payload);
-            (void)send_ok(c->sock, "AUTH");
-            continue;
-        }
-
-        if (_stricmp(cmd.cmd, "JOIN") == 0) {
-            if (!cmd.arg1) {
-                free(payload);
-                (void)send_err(c->sock, "JOIN", "Missing room");
-                continue;
+            zip_min = (uint32_t)n;
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > (long)CHAT_HISTORY_MAX) {
+                printf("--history must be between 0 and %u\n", CHAT_HISTORY_MAX);
+                return 2;
             }
-
-            const char* room_name = cmd.arg1;
-            if (strlen(room_name) > CHAT_NAME_MAX) {
-                free(payload);
-                (void)send_err(c->sock, "JOIN", "Room name too long");
-                continue;
+            hist_depth = (uint32_t)n;
+        } else if (strcmp(argv[i], "--history-mem") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 65536 || n > (1L << 30)) {
+                printf("--history-mem must be between 65536 and %ld\n", 1L << 30);
+                return 2;
             }
-
-            char ev[256];
-            // Create room if needed and add member under lock.
-            EnterCriticalSection(&st->lock);
-            Room* r = state_get_or_create_room(st, room_name);
-            if (r) room_add_member(r, c);
-            LeaveCriticalSection(&st->lock);
-
-            free(payload);
-            if (!r) {
-                (void)send_err(c->sock, "JOIN", "Server out of memory");
-                continue;
+            hist_limit = (uint32_t)n;
+        } else if (strcmp(argv[i], "--history-join") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > (long)CHAT_HISTORY_MAX) {
+                printf("--history-join must be between 0 and %u\n", CHAT_HISTORY_MAX);
+                return 2;
             }
-            (void)send_ok(c->sock, "JOIN");
-            if (chat_cmd_format(ev, sizeof(ev), "USERJOIN", r->name, c->username, NULL)) {
-                broadcast_room(st, r, ev);
+            hist_join = (uint32_t)n;
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            log_cfg.dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-sync-ms") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > 10000) {
+                printf("--log-sync-ms must be between 0 and 10000\n");
+                return 2;
             }
-            continue;
-        }
-
-        if (_stricmp(cmd.cmd, "LEAVE") == 0) {
-            if (!cmd.arg1) {
-                free(payload);
-                (void)send_err(c->sock, "LEAVE", "Missing room");
-                continue;
+            log_cfg.sync_ms = (uint32_t)n;
+        } else if (strcmp(argv[i], "--log-segment-mb") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > 1024) {
+                printf("--log-segment-mb must be between 1 and 1024\n");
+                return 2;
             }
-            const char* room_name = cmd.arg1;
-            char ev[256];
-
-            // Remove member under lock if room exists.
-            EnterCriticalSection(&st->lock);
-            Room* r = state_find_room(st, room_name);
-            if (r) room_remove_member(r, c);
-            LeaveCriticalSection(&st->lock);
-
-            free(payload);
-            (void)send_ok(c->sock, "LEAVE");
-            if (r && chat_cmd_format(ev, sizeof(ev), "USERLEAVE", r->name, c->username, NULL)) {
-                broadcast_room(st, r, ev);
+            log_cfg.segment_bytes = (uint32_t)n * 1024u * 1024u;
+        } else if (strcmp(argv[i], "--log-segments") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > 1000000) {
+                printf("--log-segments must be between 0 and 1000000\n");
+                return 2;
             }
-            continue;
-        }
-
-        if (_stricmp(cmd.cmd, "MSG") == 0) {
-            if (!cmd.arg1 || !cmd.text) {
-                free(payload);
-                (void)send_err(c->sock, "MSG", "Expected MSG room :text");
-                continue;
+            log_cfg.keep_segments = (uint32_t)n;
+        } else if (strcmp(argv[i], "--admin") == 0 && i + 1 < argc) {
+            admins = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval-ms") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 100 || n > 3600000) {
+                printf("--metrics-interval-ms must be between 100 and 3600000\n");
+                return 2;
             }
-
-            const char* room_name = cmd.arg1;
-            const char* text = cmd.text;
-
-            Room* r = NULL;
-            // Validate membership under lock.
-            EnterCriticalSection(&st->lock);
-            r = state_find_room(st, room_name);
-            int allowed = (r && room_has_member(r, c));
-            LeaveCriticalSection(&st->lock);
-
-            if (!allowed) {
-                free(payload);
-                (void)send_err(c->sock, "MSG", "Not in room");
-                continue;
+            metrics_interval = (uint32_t)n;
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > 1000000) {
+                printf("--trace-sample must be between 1 and 1000000\n");
+                return 2;
             }
-
-            char out[1024];
-            if (!chat_cmd_format(out, sizeof(out), "ROOMMSG", room_name, c->username, text)) {
-                free(payload);
-                (void)send_err(c->sock, "MSG", "Message too long");
-                continue;
+            trace_sample = (uint32_t)n;
+        } else if (strcmp(argv[i], "--node") == 0 && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+            if (node_id < 1 || node_id > CHAT_MAX_NODES) {
+                printf("--node must be between 1 and %d\n", CHAT_MAX_NODES);
+                return 2;
             }
-
-            free(payload);
-            broadcast_room(st, r, out);
-            continue;
-        }
-
-        if (_stricmp(cmd.cmd, "PM") == 0) {
-            if (!cmd.arg1 || !cmd.text) {
-                free(payload);
-                (void)send_err(c->sock, "PM", "Expected PM user :text");
-                continue;
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (!peer_add(argv[++i])) {
+                printf("--peer takes <id>@<host>:<port> with a distinct id between 1 and %d\n", CHAT_MAX_NODES);
+                return 2;
             }
-            const char* target = cmd.arg1;
-            const char* text = cmd.text;
-
-            Client* dst = NULL;
-            // Lookup recipient under lock.
-            EnterCriticalSection(&st->lock);
-            dst = state_find_client_by_name(st, target);
-            LeaveCriticalSection(&st->lock);
-
-            if (!dst) {
-                free(payload);
-                (void)send_err(c->sock, "PM", "User not found");
-                continue;
+            peer_count++;
+        } else if (strcmp(argv[i], "--peer-secret") == 0 && i + 1 < argc) {
+            peer_secret = argv[++i];
+        } else if (strcmp(argv[i], "--max-handshakes") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > 1000000) {
+                printf("--max-handshakes must be between 1 and 1000000\n");
+                return 2;
             }
-
-            char out[1024];
-            if (!chat_cmd_format(out, sizeof(out), "PRIVMSG", c->username, NULL, text)) {
-                free(payload);
-                (void)send_err(c->sock, "PM", "Message too long");
-                continue;
+            max_handshakes = (uint32_t)n;
+        } else if (strcmp(argv[i], "--handshake-timeout-ms") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 100 || n > 600000) {
+                printf("--handshake-timeout-ms must be between 100 and 600000\n");
+                return 2;
             }
-            free(payload);
-            (void)send_text(dst->sock, out);
-            (void)send_ok(c->sock, "PM");
-            continue;
-        }
-
-        if (_stricmp(cmd.cmd, "PING") == 0) {
-            // Keepalive response.
-            free(payload);
-            (void)send_text(c->sock, "PONG");
-            continue;
+            handshake_ms = (uint32_t)n;
+        } else if (strcmp(argv[i], "--credentials") == 0 && i + 1 < argc) {
+            auth_cfg.path = argv[++i];
+        } else if (strcmp(argv[i], "--auth-workers") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1 || n > 64) {
+                printf("--auth-workers must be between 1 and 64\n");
+                return 2;
+            }
+            auth_cfg.workers = (int)n;
+        } else if (strcmp(argv[i], "--auth-cache-ms") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 0 || n > 86400000) {
+                printf("--auth-cache-ms must be between 0 and 86400000\n");
+                return 2;
+            }
+            auth_cfg.cache_ms = (uint32_t)n;
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--shm-ring-kb") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 256 || n > 65536 || (n & (n - 1)) != 0) {
+                printf("--shm-ring-kb must be a power of two between 256 and 65536\n");
+                return 2;
+            }
+            shm_ring = (uint32_t)n << 10;
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            if (!slow_policy_parse(argv[++i], &slow_policy)) {
+                usage();
+                return 2;
+            }
+        } else {
+            usage();
+            return 2;
         }
-
-        free(payload);
-        (void)send_err(c->sock, "CMD", "Unknown command");
     }
 
-    shutdown(c->sock, SD_BOTH);
-    closesocket(c->sock);
-
-    // Remove from global client list under lock.
-    EnterCriticalSection(&st->lock);
-    Client** pp = &st->clients;
-    while (*pp) {
-        if (*pp == c) {
-            *pp = c->next;
-            break;
-        }
-        pp = &((*pp)->next);
+    if (password && password[0] == 0) password = NULL;
+    if (!password && !auth_cfg.path) {
+        usage();
+        return 2;
     }
-    LeaveCriticalSection(&st->lock);
-
-    if (c->authed) {
-        broadcast_user_leave(st, c);
-        printf("Disconnected: %s\n", c->username);
-    } else {
-        printf("Disconnected (unauth)\n");
+    if (admins && !auth_cfg.path) {
+        // With only a shared password, anyone could log in as an admin name.
+        printf("--admin needs --credentials\n");
+        return 2;
     }
-
-    CloseHandle(c->thread);
-    free(c);
-    return 0;
-}
-
-static void usage(void) {
-    printf("chat_server --password <pw> [--port <port>]\n");
-}
-
-int main(int argc, char** argv) {
-    const char* port = CHAT_PORT_DEFAULT;
-    const char* password = NULL;
-
-    // Parse command-line args.
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
-            port = argv[++i];
-        } else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc) {
-            password = argv[++i];
-        } else {
-            usage();
+    if (shm_name && (node_id || peer_count)) {
+        // Backplane node ids come from its slots.
+        printf("--shm cannot be combined with --node or --peer\n");
+        return 2;
+    }
+    if (node_id || peer_count) {
+        // Links must not open to anyone who can log in as a user.
+        size_t n = peer_secret ? strlen(peer_secret) : 0;
+        if (n < CHAT_PEER_SECRET_MIN || n > CHAT_PEER_SECRET_MAX || strpbrk(peer_secret, " \t") ||
+            (password && strcmp(peer_secret, password) == 0)) {
+            printf("--node and --peer need a --peer-secret of %d to %d characters, without spaces,\n"
+                   "that is not the --password\n",
+                CHAT_PEER_SECRET_MIN, CHAT_PEER_SECRET_MAX);
             return 2;
         }
     }
 
-    if (!password || password[0] == 0) {
+    int use_epoll = 0;
+    if (strcmp(mode, "epoll") == 0) {
+#ifdef CHAT_HAVE_EPOLL
+        use_epoll = 1;
+        if (reactors == 0) reactors = 1;
+        if (reactors < 1 || reactors > CHAT_MAX_SHARDS) {
+            printf("--reactors must be between 1 and %d\n", CHAT_MAX_SHARDS);
+            return 2;
+        }
+#else
+        printf("epoll mode is only available on Linux\n");
+        return 2;
+#endif
+    } else if (strcmp(mode, "threads") != 0) {
         usage();
         return 2;
     }
+    int listener_count = use_epoll ? reactors : 1;
 
     // Initialize Winsock.
     WSADATA wsa;
@@ -422,92 +333,140 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    // Resolve bind address for listening socket.
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_PASSIVE;
-
-    struct addrinfo* res = NULL;
-    int gai_rc = getaddrinfo(NULL, port, &hints, &res);
-    if (gai_rc != 0) {
-        printf("getaddrinfo failed: %s\n", gai_strerrorA(gai_rc));
-        WSACleanup();
-        return 1;
-    }
-
-    SOCKET listen_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (listen_sock == INVALID_SOCKET) {
-        printf("socket failed\n");
-        freeaddrinfo(res);
-        WSACleanup();
-        return 1;
-    }
-
-    int yes = 1;
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
-
-    if (bind(listen_sock, res->ai_addr, (int)res->ai_addrlen) != 0) {
-        printf("bind failed\n");
-        closesocket(listen_sock);
-        freeaddrinfo(res);
-        WSACleanup();
-        return 1;
-    }
-    freeaddrinfo(res);
-
-    if (listen(listen_sock, SOMAXCONN) != 0) {
-        printf("listen failed\n");
-        closesocket(listen_sock);
-        WSACleanup();
-        return 1;
+    // One listener per reactor; the kernel spreads new connections across
+    // them, and across the processes sharing a backplane.
+    SOCKET listen_socks[CHAT_MAX_SHARDS];
+    for (int i = 0; i < listener_count; i++) {
+        listen_socks[i] = open_listener(port, listener_count > 1 || shm_name);
+        if (listen_socks[i] == INVALID_SOCKET) {
+            for (int j = 0; j < i; j++) closesocket(listen_socks[j]);
+            WSACleanup();
+            return 1;
+        }
     }
 
     ServerState st;
     memset(&st, 0, sizeof(st));
-    InitializeCriticalSection(&st.lock);
+    InitializeSRWLock(&st.lock);
+    metrics_init();
+    epoch_init();
+    zip_init();
+    state_pools_init(listener_count);
     st.password = password;
-
-    printf("Server listening on port %s\n", port);
-
-    // Accept clients and spawn worker threads.
-    for (;;) {
-        SOCKET client_sock = accept(listen_sock, NULL, NULL);
-        if (client_sock == INVALID_SOCKET) break;
-
-        Client* c = (Client*)calloc(1, sizeof(*c));
-        if (!c) {
-            closesocket(client_sock);
-            continue;
+    st.peer_secret = peer_secret;
+    st.admins = admins;
+    st.outq_limit = outq_limit;
+    st.slow_policy = slow_policy;
+    st.flush_us = flush_us;
+    st.flush_bytes = flush_bytes;
+    st.zip = zip && chat_zip_available();
+    st.zip_min = zip_min;
+    st.hist_depth = hist_depth;
+    st.hist_join = hist_join < hist_depth ? hist_join : hist_depth;
+    st.hist_limit = hist_limit;
+    st.max_handshakes = max_handshakes;
+    st.handshake_ms = handshake_ms;
+    InitializeCriticalSection(&st.hist_lock);
+    if (log_cfg.dir) {
+        st.log = log_open(&log_cfg);
+        if (!st.log) {
+            for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+            WSACleanup();
+            return 1;
         }
-        c->sock = client_sock;
-
-        EnterCriticalSection(&st.lock);
-        c->next = st.clients;
-        st.clients = c;
-        LeaveCriticalSection(&st.lock);
+    }
 
-        ThreadCtx* ctx = (ThreadCtx*)malloc(sizeof(*ctx));
-        if (!ctx) {
-            closesocket(client_sock);
-            continue;
+    if (use_epoll) printf("Server listening on port %s (epoll mode, %d reactors)\n", port, reactors);
+    else printf("Server listening on port %s (threads mode)\n", port);
+    printf("Outbound queue limit %u bytes, slow consumers: %s\n", outq_limit, slow_policy_name(slow_policy));
+    if (flush_us) printf("Write coalescing: %u us window, %u byte threshold\n", flush_us, flush_bytes);
+    else printf("Write coalescing: off\n");
+    if (st.zip) printf("Compression: offered, frames from %u bytes\n", zip_min);
+    else printf("Compression: %s\n", zip ? "unavailable (built without zlib)" : "off");
+    if (hist_depth) {
+        printf("History: %u messages per room, %u bytes in all, %u replayed on JOIN\n", hist_depth, hist_limit,
+            st.hist_join);
+    } else {
+        printf("History: off\n");
+    }
+    if (st.log) {
+        LogStats ls;
+        log_stats(st.log, &ls);
+        printf("Message log: %s, %u segments, %llu bytes, %u rooms; %u MB segments, sync every %u ms\n",
+            log_cfg.dir, ls.segments, (unsigned long long)ls.bytes, ls.rooms, log_cfg.segment_bytes >> 20,
+            log_cfg.sync_ms);
+    } else {
+        printf("Message log: off\n");
+    }
+    if (metrics_file) {
+        if (!metrics_start_dump(&st, metrics_file, metrics_interval)) {
+            if (st.log) log_close(st.log);
+            for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+            WSACleanup();
+            return 1;
         }
-        ctx->st = &st;
-        ctx->client = c;
-        c->thread = CreateThread(NULL, 0, client_thread, ctx, 0, NULL);
-        if (!c->thread) {
-            closesocket(client_sock);
-            free(ctx);
-            continue;
+        printf("Metrics: %s every %u ms\n", metrics_file, metrics_interval);
+    } else {
+        printf("Metrics: STATS only\n");
+    }
+    if (trace_file) {
+        if (!trace_open(trace_file, trace_sample)) {
+            if (st.log) log_close(st.log);
+            for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+            WSACleanup();
+            return 1;
         }
-
-        printf("Client connected\n");
+        printf("Tracing: 1 in %u frames to %s\n", trace_sample, trace_file);
+    } else {
+        printf("Tracing: off\n");
     }
-
-    closesocket(listen_sock);
-    DeleteCriticalSection(&st.lock);
+    printf("Admins: %s\n", admins ? admins : "none (STATS is refused)");
+    // A burst of reconnects finds its Clients already carved out.
+    if (!state_reserve_clients(max_handshakes)) printf("Could not preallocate %u clients\n", max_handshakes);
+    printf("Handshakes: at most %u pending, %u ms to authenticate\n", max_handshakes, handshake_ms);
+    if (auth_cfg.path) {
+        st.auth = auth_open(&st, &auth_cfg);
+        if (!st.auth) {
+            if (st.log) log_close(st.log);
+            for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+            WSACleanup();
+            return 1;
+        }
+        printf("Credentials: %u users from %s, %d verifier threads, ", auth_user_count(st.auth), auth_cfg.path,
+            auth_cfg.workers);
+        if (auth_cfg.cache_ms) printf("verified logins cached %u ms\n", auth_cfg.cache_ms);
+        else printf("no cache\n");
+    } else {
+        printf("Credentials: shared password\n");
+    }
+    if (shm_name) {
+        node_id = shm_attach(shm_name, shm_ring);
+        if (!node_id) {
+            if (st.log) log_close(st.log);
+            for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+            WSACleanup();
+            return 1;
+        }
+    }
+    st.node_id = node_id;
+    if (!peer_start(&st) || !shm_start(&st)) {
+        if (st.log) log_close(st.log);
+        for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
+        WSACleanup();
+        return 1;
+    }
+    if (shm_name) printf("Federation: node %d on backplane %s\n", node_id, shm_name);
+    else if (node_id) printf("Federation: node %d, %d peers\n", node_id, peer_count);
+    else printf("Federation: off\n");
+
+#ifdef CHAT_HAVE_EPOLL
+    if (use_epoll) (void)server_run_epoll(&st, listen_socks, listener_count);
+    else (void)server_run_threads(&st, listen_socks[0]);
+#else
+    (void)server_run_threads(&st, listen_socks[0]);
+#endif
+
+    for (int i = 0; i < listener_count; i++) closesocket(listen_socks[i]);
     WSACleanup();
     return 0;
 }
@@ -0,0 +1,732 @@
+#pragma once
+
+#include "chat_platform.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chat_cmd.h"
+#include "chat_frame.h"
+#include "chat_proto.h"
+#include "chat_trace.h"
+#include "chat_zip.h"
+
+// Server state shared by the connection backends (thread-per-client and,
+// on Linux, sharded epoll reactors). Backends own sockets and I/O; the
+// command state machine in server_cmd.c is backend-agnostic.
+
+#define CHAT_PORT_DEFAULT "5555" // Default TCP port if none provided.
+#define CHAT_NAME_MAX 31 // Max username/room length (excluding NUL).
+#define CHAT_MAX_SHARDS 64 // Max reactor threads (one bit each in Room.shard_mask).
+#define CHAT_MAX_NODES 64 // Federation node ids are 1..64 (one bit each in room interest).
+#define CHAT_OUTQ_DEFAULT (1024u * 1024u) // Default per-client outbound queue limit.
+#define CHAT_FLUSH_BYTES_DEFAULT (16u * 1024u) // Held bytes that force an early flush.
+#define CHAT_ZIP_MIN_DEFAULT 96u // Payloads shorter than this are never compressed.
+#define CHAT_HISTORY_DEFAULT 64u // Messages kept per room.
+#define CHAT_HISTORY_MAX 1024u // Largest per-room history.
+#define CHAT_HISTORY_MEM_DEFAULT (64u * 1024u * 1024u) // History bytes across all rooms.
+#define CHAT_LOG_SEGMENT_DEFAULT (64u * 1024u * 1024u) // Message log segment size.
+#define CHAT_LOG_SYNC_MS_DEFAULT 10u // Group-commit window of the message log.
+#define CHAT_TRACE_SAMPLE_DEFAULT 100u // Trace one inbound frame in this many.
+#define CHAT_METRICS_INTERVAL_DEFAULT 10000u // Metrics file rewrite period (ms).
+#define CHAT_HANDSHAKES_DEFAULT 1024u // Connections past accept but not AUTH.
+#define CHAT_HANDSHAKE_MS_DEFAULT 10000u // Time a connection gets to authenticate.
+#define CHAT_PEER_SECRET_MIN 8 // --peer-secret length bounds; NODE frames carry it.
+#define CHAT_PEER_SECRET_MAX 48
+#define CHAT_AUTH_WORKERS_DEFAULT 2 // Threads verifying hashed passwords.
+#define CHAT_AUTH_CACHE_MS_DEFAULT 60000u // How long a verified login skips the hash.
+
+typedef struct Client Client;
+typedef struct Room Room;
+typedef struct ServerState ServerState;
+typedef struct ChatLog ChatLog;
+typedef struct Auth Auth;
+typedef struct AuthJob AuthJob;
+
+// Longest v1 ROOMMSG header: "ROOMMSG <room> <user> :".
+#define ROOMMSG_HEAD_MAX (8 + 2 * CHAT_NAME_MAX + 3)
+
+// One room a client has joined, and its position in that room's member array.
+typedef struct RoomLink {
+    Room* room;
+    uint32_t slot; // Index into room->shards[client->shard].members.
+    // Headers of this client's ROOMMSG events in the room, built by its
+    // first MSG there: v1 "ROOMMSG <room> <user> :", v2 opcode and ids.
+    uint8_t text_head_len; // 0 until built.
+    uint8_t bin_head_len;
+    char text_head[ROOMMSG_HEAD_MAX];
+    uint8_t bin_head[1 + 2 * CHAT_VARINT_MAX];
+} RoomLink;
+
+// What to do when a client's outbound queue is full.
+typedef enum SlowPolicy {
+    SLOW_DISCONNECT, // Drop the connection.
+    SLOW_DROP_OLDEST, // Discard the oldest unsent frames to make room.
+    SLOW_COALESCE, // Discard new frames; send one "DROPPED <n>" once drained.
+} SlowPolicy;
+
+// Encoded frame: length prefix followed by the payload. Built once per
+// message and shared by every queue it is pushed to. A spliced frame keeps
+// only the prefix and header in data; the rest of the payload is body, a
+// raw frame shared by the message's other encodings, and goes out as a
+// second iovec.
+typedef struct OutFrame {
+    volatile int32_t refs;
+    uint32_t len; // Bytes on the wire: data, then body's data.
+    uint32_t head; // Bytes in data.
+    uint32_t trace; // Trace of the inbound frame that caused it (server_trace.c), or 0.
+    struct OutFrame* body; // Holds a reference; NULL if data is the whole frame.
+    uint8_t data[];
+} OutFrame;
+
+// One message encoded for each wire version; a version no recipient speaks
+// is left NULL. Recipients take the frame matching Client.proto, packed if
+// they negotiated compression and a packed copy was worth making.
+typedef struct OutFrames {
+    OutFrame* text; // v1
+    OutFrame* bin; // v2
+    OutFrame* text_zip; // v1, packed (chat_zip.h)
+    OutFrame* bin_zip; // v2, packed
+} OutFrames;
+
+#define outframes_pick(fs, c) \
+    ((c)->proto == CHAT_PROTO_BIN ? ((c)->zip && (fs)->bin_zip ? (fs)->bin_zip : (fs)->bin) \
+                                  : ((c)->zip && (fs)->text_zip ? (fs)->text_zip : (fs)->text))
+
+// Bounded per-client outbound queue drained by non-blocking gather writes.
+typedef struct OutQueue {
+    OutFrame** ring; // Queued frames (one reference each), oldest at head.
+    uint32_t cap; // Ring slots; power of two.
+    uint32_t head;
+    uint32_t head_off; // Bytes of head already written.
+    uint32_t frames; // Queued frames, including a partially written head.
+    uint32_t bytes; // Unwritten bytes across all frames.
+    uint32_t hwm_bytes; // High-water mark of bytes.
+    uint32_t hwm_frames; // High-water mark of frames.
+    uint32_t dropped; // Frames discarded by the slow-consumer policy.
+    uint32_t coalesced; // Coalesce policy: drops not yet reported.
+    uint32_t sent; // Frames fully written.
+    uint32_t writes; // Write syscalls issued.
+    int bin; // Owner speaks v2: notices queued here are binary frames.
+    uint32_t owner; // Owner's Client.id, for trace records.
+} OutQueue;
+
+// Connected client tracked by server state.
+struct Client {
+    SOCKET sock;
+    int authed; // Set after successful AUTH.
+    int admin; // Authenticated as a user named by --admin; may run STATS.
+    int dead; // Socket failed or closed; further sends are dropped.
+    int shard; // Owning reactor; all I/O for this client runs there.
+    int proto; // Wire version (CHAT_PROTO_*); only changes before AUTH.
+    int zip; // Negotiated per-frame compression; only changes before AUTH.
+    uint32_t id; // Names this user in v2 events; assigned at AUTH.
+    int peer; // Federation link to this node id (server_peer.c); 0 for users.
+    // Handshake: when it was accepted (0 for dialed links), and whether it
+    // still counts in st->handshakes; the backend lists such clients,
+    // oldest first, through hs_next/hs_prev.
+    uint64_t accepted_ns;
+    int handshaking;
+    Client* hs_next;
+    Client* hs_prev;
+    // AUTH waiting on the verifier pool (server_auth.c). Until it is done,
+    // no more frames are handled; the bytes read behind it wait in parked.
+    AuthJob* auth_job;
+    uint8_t* parked;
+    uint32_t parked_len;
+    volatile int32_t refs; // Owner's reference plus in-flight cross-thread uses.
+    char username[CHAT_NAME_MAX + 1];
+    Client* next; // Doubly linked list of all connections.
+    Client* prev;
+    RoomLink* joined; // Rooms this client is in (unordered).
+    uint32_t joined_count;
+    uint32_t joined_cap;
+
+    ChatFrameDecoder in; // Inbound frames; used only by the reading thread.
+    // Reactor backend: queued for the end-of-pass flush (holds a reference).
+    int flush_queued;
+    int flush_urgent; // A frame this pass must not wait for the flush tick.
+    Client* flush_next;
+    // Waiting for the backend's flush tick (the held list holds a reference).
+    int held;
+    Client* held_next;
+
+    // Frames not yet accepted by the socket. Only the owning reactor touches
+    // it in reactor mode; the threaded backend serializes on send_lock.
+    OutQueue outq;
+    CRITICAL_SECTION send_lock;
+    int draining; // Threaded backend: registered with the drain thread.
+};
+
+// Intrusive header for objects reclaimed through the epoch (server_epoch.c).
+typedef struct EpochNode {
+    struct EpochNode* next;
+    int32_t epoch; // Global epoch when retired.
+    void (*free_fn)(struct EpochNode* n);
+} EpochNode;
+
+// Immutable copy of a shard's member list for lock-free fan-out. Holds a
+// reference to each member; retired through the epoch once unpublished.
+typedef struct MemberSnap {
+    EpochNode node;
+    int count;
+    Client* members[];
+} MemberSnap;
+
+// Members of a room that live on one shard. Only that shard's thread
+// touches it in reactor mode; in threaded mode everything is shard 0.
+// Dense and unordered so fan-out is a linear scan; links[i] is the index of
+// this room in members[i]->joined, which makes removal a swap with the last.
+typedef struct RoomShard {
+    Client** members;
+    uint32_t* links; // Same allocation as members.
+    int member_count;
+    int member_cap;
+    // Threaded backend: published snapshot of members, NULL when stale.
+    // Membership changes unpublish it; the next broadcast rebuilds it.
+    MemberSnap* volatile snap;
+} RoomShard;
+
+// Recent ROOMMSG events of one room (server_history.c): a ring of the
+// frames the broadcast built, oldest at head.
+typedef struct RoomHistory {
+    CRITICAL_SECTION lock; // Guards the ring and counters.
+    OutFrames* ring; // ServerState.hist_depth slots; NULL until the first message.
+    uint32_t head;
+    uint32_t count;
+    uint32_t bytes; // Ring plus frames, as counted in ServerState.hist_bytes.
+    int live; // Accepting messages; cleared when the room is pruned.
+    uint64_t used_ns; // Last append; the coldest room is evicted first.
+    Room* prev; // ServerState.hist_rooms, under hist_lock.
+    Room* next;
+} RoomHistory;
+
+// Chat room; membership is split per shard so fan-out stays shard-local.
+// The registry holds one reference until the last member leaves; anyone
+// using a Room* after dropping st->lock holds another.
+struct Room {
+    char name[CHAT_NAME_MAX + 1];
+    uint32_t id; // Names this room in v2 events; never reused.
+    volatile int32_t refs;
+    // Members per wire version, so broadcasts only encode what is needed.
+    volatile int32_t text_members;
+    volatile int32_t bin_members;
+    // Of those, members that accept packed frames.
+    volatile int32_t text_zip_members;
+    volatile int32_t bin_zip_members;
+    volatile uint64_t shard_mask; // Bit per shard with at least one member.
+    RoomHistory hist;
+    RoomShard shards[]; // ServerState.nshards entries.
+};
+
+// Slab pool of fixed-size objects (server_pool.c).
+typedef struct ObjPool {
+    const char* name;
+    uint32_t size; // Object size, rounded up to 16 bytes.
+    uint32_t per_slab;
+    uint32_t cache_max; // Objects each thread may cache.
+    int id; // Index of this pool's per-thread caches.
+    CRITICAL_SECTION lock; // Guards the fields below.
+    void* free_list;
+    uint32_t free_count;
+    void** slabs;
+    uint32_t slab_count;
+    uint32_t slab_cap;
+    int64_t orphan_live; // Counts for threads that could not get a cache.
+    int64_t orphan_bytes;
+    uint64_t orphan_allocs;
+} ObjPool;
+
+#define BUF_CLASSES 10 // Buffer size classes: 32 B to 16 KB, powers of two.
+
+typedef struct PoolStats {
+    const char* name;
+    uint32_t obj_size;
+    uint32_t slabs;
+    uint64_t in_use; // Objects allocated and not yet freed.
+    uint64_t idle; // Carved but free, in the shared list or thread caches.
+    uint64_t reserved_bytes; // Slab memory held.
+    uint64_t allocs; // Total allocations.
+    double frag_pct; // Reserved bytes not holding requested data.
+} PoolStats;
+
+// Open-addressing index from case-insensitive name to entry (server_table.c).
+typedef struct NameSlot {
+    uint32_t hash; // Cached name_hash(key).
+    const char* key; // Points into the entry; stable while indexed.
+    void* item; // NULL for an empty slot.
+} NameSlot;
+
+typedef struct NameTable {
+    NameSlot* slots;
+    uint32_t cap; // Power of two (or 0 before first insert).
+    uint32_t count;
+} NameTable;
+
+// Deliver one encoded frame to a client / every room member (each member
+// gets the frame for its wire version); set by the backend. Backends take
+// their own references; the caller keeps its own. Direct frames are urgent
+// and bypass the flush window; broadcasts may be held for it.
+typedef int (*ServerSendFn)(ServerState* st, Client* c, OutFrame* f);
+typedef void (*ServerBroadcastFn)(ServerState* st, Room* r, const OutFrames* fs);
+// Serve a connected, non-blocking socket in c->sock as if it had been
+// accepted; takes over the caller's reference. Returns 0 (leaving c and
+// the socket to the caller) if it cannot.
+typedef int (*ServerAdoptFn)(ServerState* st, Client* c);
+// Close a client from any thread once what is already queued for it has
+// been offered to the socket.
+typedef void (*ServerKickFn)(ServerState* st, Client* c);
+// The verifier pool finished c's AUTH; called on a verifier thread. The
+// backend runs auth_finish on the thread that serves c, then resumes
+// reading. Takes over the job's reference to c.
+typedef void (*ServerAuthDoneFn)(ServerState* st, Client* c);
+
+struct ServerState {
+    SRWLOCK lock; // Protects the registries and names; lookups take it shared.
+    Client* clients; // Every connection, authenticated or not.
+    NameTable users; // Authenticated clients by username.
+    NameTable rooms; // Rooms with at least one member, by name.
+    const char* password; // Plaintext shared password from args; NULL with credentials only.
+    Auth* auth; // Hashed per-user credentials (server_auth.c); NULL checks password.
+    const char* admins; // Comma-separated usernames allowed STATS; NULL for none.
+    int nshards; // Reactor count (1 in threaded mode).
+    uint32_t outq_limit; // Max unwritten bytes per client.
+    SlowPolicy slow_policy;
+    // Write coalescing: room traffic waits up to flush_us for more frames,
+    // or until flush_bytes are queued; 0 writes at once. Direct replies and
+    // PMs always go out immediately.
+    uint32_t flush_us;
+    uint32_t flush_bytes;
+    // Compression: offered in HELLO when set; payloads under zip_min go plain.
+    int zip;
+    uint32_t zip_min;
+    // Room history: hist_depth messages per room (0 keeps none), hist_join of
+    // them replayed on JOIN. When hist_bytes passes hist_limit the coldest
+    // rooms lose theirs. hist_lock guards hist_rooms and is taken before
+    // any room's history lock.
+    uint32_t hist_depth;
+    uint32_t hist_join;
+    uint32_t hist_limit;
+    volatile int32_t hist_bytes;
+    CRITICAL_SECTION hist_lock;
+    Room* hist_rooms; // Every indexed room, while hist_depth is set.
+    // Persistent message log (server_log.c); NULL when disabled. New rooms
+    // seed their history from it.
+    ChatLog* log;
+    uint32_t last_user_id; // Last v2 ids handed out; guarded by lock.
+    uint32_t last_room_id;
+    // Federation (server_peer.c): this node's id, 0 when it has no peers,
+    // and the users other nodes hold, by name (guarded by lock).
+    int node_id;
+    NameTable remote_users;
+    const char* peer_secret; // Links' shared secret (--peer-secret); never the users' password.
+    // Handshake admission: connections are accepted only while fewer than
+    // max_handshakes are still before AUTH, and one that has not
+    // authenticated after handshake_ms is closed.
+    uint32_t max_handshakes;
+    uint32_t handshake_ms;
+    volatile int32_t handshakes;
+
+    ServerSendFn send_frame;
+    ServerBroadcastFn broadcast;
+    ServerAdoptFn adopt;
+    ServerKickFn kick;
+    ServerAuthDoneFn auth_done;
+    void* backend; // Backend-private state.
+};
+
+// server_table.c: name index. Keys are matched case-insensitively (ASCII).
+uint32_t name_hash(const char* name);
+void* name_table_find(const NameTable* t, const char* key);
+// Returns 0 if the key is already present or memory runs out.
+int name_table_insert(NameTable* t, const char* key, void* item);
+void* name_table_remove(NameTable* t, const char* key);
+void name_table_free(NameTable* t);
+
+// server_epoch.c: epoch-based reclamation for lock-free readers. Readers
+// bracket their use of published pointers with epoch_enter/epoch_exit
+// (not nested); writers unpublish an object first, then retire it, and it
+// is freed once no reader can still hold it.
+void epoch_init(void);
+// Returns 0 if the thread's reader slot cannot be allocated.
+int epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(EpochNode* n, void (*free_fn)(EpochNode* n));
+// Give up the calling thread's reader slot; call before the thread exits.
+void epoch_thread_exit(void);
+
+// server_pool.c: slab pools with per-thread caches. pools_init and
+// pool_init run before any other thread starts; memory is reused, never
+// returned to the system. Buffers over the largest class fall back to
+// malloc. buf_free takes the size that was requested.
+void pools_init(void);
+int pool_init(ObjPool* p, const char* name, size_t size);
+// Carve slabs until n objects are free; returns 0 if memory runs out.
+int pool_reserve(ObjPool* p, uint32_t n);
+void* pool_alloc(ObjPool* p);
+void pool_free(ObjPool* p, void* obj);
+void* buf_alloc(size_t size);
+void buf_free(void* buf, size_t size);
+// Return the calling thread's cached objects; call before the thread exits.
+void pool_thread_exit(void);
+// Snapshot of every pool; returns how many entries were filled.
+int pool_stats_all(PoolStats* out, int max);
+
+// server_state.c: registries and room membership. Caller holds st->lock
+// (exclusively for anything that modifies). Returned pointers are only
+// valid under the lock unless the caller takes a reference.
+Client* state_find_client_by_name(ServerState* st, const char* username);
+// Index an authenticated client by username; 0 if taken or out of memory.
+int state_register_user(ServerState* st, Client* c);
+Room* state_find_room(ServerState* st, const char* name);
+Room* state_get_or_create_room(ServerState* st, const char* name);
+// Unindex r and drop the registry's reference if its last member left.
+void state_prune_room(ServerState* st, Room* r);
+// Remove c from every room it joined; returns how many, with *out holding a
+// retained pointer to each (caller releases them and frees the array).
+int state_leave_all_rooms(ServerState* st, Client* c, Room*** out);
+// Membership costs O(rooms c is in) to find and O(1) to add or remove.
+int room_has_member(Room* r, Client* c);
+// Find a room c has joined by name, without st->lock. Only c's own thread
+// changes its memberships, so this is safe from that thread alone, and the
+// room stays alive while c remains a member.
+Room* client_find_joined(Client* c, const char* name);
+// Same, by v2 room id.
+Room* client_find_joined_id(Client* c, uint32_t id);
+// The link of a joined room, with its cached ROOMMSG headers. Valid until
+// c's next join or leave.
+RoomLink* client_find_link(Client* c, const char* name);
+RoomLink* client_find_link_id(Client* c, uint32_t id);
+// The shard's published member snapshot, rebuilt under a shared st->lock if
+// a membership change unpublished it. Call inside an epoch section; NULL if
+// the shard is empty or out of memory.
+MemberSnap* room_shard_snapshot(ServerState* st, RoomShard* rs);
+// Returns 0 if out of memory; joining twice is a no-op.
+int room_add_member(Room* r, Client* c);
+void room_remove_member(Room* r, Client* c);
+// Room lifetime: freed when the last reference is released.
+void room_retain(Room* r);
+void room_release(Room* r);
+// Set up the buffer pools and the Client/Room pools (rooms are sized for
+// nshards). Call once, before any thread starts.
+void state_pools_init(int nshards);
+// Have n Clients carved out ahead of time, so a burst of connections
+// allocates none; returns 0 if memory runs out.
+int state_reserve_clients(uint32_t n);
+// Zeroed Client from the pool with one reference; NULL if out of memory.
+Client* client_new(void);
+// Link/unlink a connection (takes st->lock); removal also unindexes it.
+void state_add_client(ServerState* st, Client* c);
+void state_remove_client(ServerState* st, Client* c);
+// Client lifetime: freed when the last reference is released.
+void client_retain(Client* c);
+void client_release(Client* c);
+// Move the bytes c's decoder has not taken yet out of the reading thread's
+// buffer into c->parked, so that buffer can be reused before they are
+// handled; 0 if out of memory. client_unpark frees c->parked once the
+// decoder has taken everything from it.
+int client_park_input(Client* c);
+void client_unpark(Client* c);
+
+// server_history.c: per-room message history. attach runs when a room is
+// created and detach when it is pruned (both under st->lock); the room's
+// history lock lives from attach until the room is freed.
+void history_attach(ServerState* st, Room* r);
+void history_detach(ServerState* st, Room* r);
+// Keep a reference to one broadcast's frames, evicting the oldest entry
+// and, over the memory limit, the coldest rooms' histories.
+void history_append(ServerState* st, Room* r, const OutFrames* fs);
+// Queue the last count messages to c, each in c's wire version; returns
+// how many were sent.
+int history_replay(ServerState* st, Room* r, Client* c, uint32_t count);
+
+// Seed a new room's history with its last messages from st->log. Runs
+// under st->lock, right after history_attach.
+void history_backfill(ServerState* st, Room* r);
+
+// server_log.c: append-only message log in memory-mapped segment files
+// (POSIX; log_open fails on Windows). Appends only queue the record; a
+// writer thread copies batches into the active segment and makes them
+// durable with one msync per group-commit window.
+typedef struct LogConfig {
+    const char* dir; // Created if missing.
+    uint32_t segment_bytes; // Size of each segment file.
+    uint32_t keep_segments; // Delete the oldest sealed segments past this; 0 keeps all.
+    uint32_t sync_ms; // Group-commit window; 0 syncs every batch at once.
+} LogConfig;
+
+typedef struct LogStats {
+    uint64_t appended; // Records accepted by log_append.
+    uint64_t synced; // Of those, records known durable.
+    uint64_t dropped; // Records refused because the writer fell behind.
+    uint64_t syncs; // msync calls for group commits.
+    uint64_t bytes; // Log offset past the last written record.
+    uint32_t segments; // Segment files mapped.
+    uint32_t rooms; // Rooms with at least one record.
+} LogStats;
+
+// Called oldest first with NUL-terminated copies of one record's fields.
+typedef void (*LogRecordFn)(void* arg, const char* user, const char* text, uint64_t time_ms);
+
+// Map the directory's segments, recover the active one and start the
+// writer; NULL (with the reason printed) on failure.
+ChatLog* log_open(const LogConfig* cfg);
+// Write and sync everything queued, stop the writer and unmap.
+void log_close(ChatLog* log);
+// Queue one message (text_len bytes of text); returns 0 if it was dropped.
+int log_append(ChatLog* log, const char* room, const char* user, const char* text, uint32_t text_len);
+// Block until every record appended so far is durable.
+void log_sync(ChatLog* log);
+// Call fn for up to max of the room's newest written records; returns how
+// many. Follows the room's back-pointer chain through the mapped segments,
+// so the cost depends on max, not on the size of the log.
+int log_read_recent(ChatLog* log, const char* room, uint32_t max, LogRecordFn fn, void* arg);
+void log_stats(ChatLog* log, LogStats* out);
+
+// server_metrics.c: counters and latency histograms. Updates are plain adds
+// to a slot the calling thread owns; reads sum every slot without blocking
+// writers, so they are a snapshot.
+typedef enum MetricCounter {
+    MET_FRAMES_IN, // Frames handed to server_handle_frame.
+    MET_BYTES_IN, // Their payload bytes.
+    MET_FRAMES_OUT, // Frames fully written to a socket.
+    MET_BYTES_OUT, // Bytes written to sockets.
+    MET_AUTH_OK,
+    MET_AUTH_FAILED,
+    MET_CONNECTS, // Connections accepted.
+    MET_DISCONNECTS,
+    MET_BROADCASTS, // Room events sent.
+    MET_DELIVERIES, // Members they were sent to.
+    MET_HANDSHAKE_TIMEOUTS, // Connections closed for not authenticating in time.
+    MET_ACCEPT_PAUSES, // Times a listener stopped accepting at max_handshakes.
+    MET_AUTH_HASHED, // Logins verified by hashing, on the verifier pool.
+    MET_AUTH_CACHED, // Logins accepted from the cache without hashing.
+    MET_CRED_RELOADS, // Times the credential file was reloaded.
+    MET_COUNTERS
+} MetricCounter;
+
+// Histograms: handling time of each command, by ChatCmdId (CHAT_CMD_NONE
+// holds unknown and malformed ones), then room broadcasts and handshakes.
+typedef enum MetricHist {
+    MET_HIST_CMD_NS = 0,
+    MET_HIST_BROADCAST_NS = MET_HIST_CMD_NS + CHAT_CMD_COUNT, // Fan-out to every member.
+    MET_HIST_FANOUT, // Members per broadcast.
+    MET_HIST_HANDSHAKE_NS, // Accept to OK AUTH.
+    MET_HIST_AUTH_WAIT_NS, // AUTH queued for the verifier pool until picked up.
+    MET_HIST_AUTH_HASH_NS, // Hashing one password.
+    MET_HISTS
+} MetricHist;
+
+typedef struct MetricsSummary {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t p50; // Quantiles and max are bucket tops: within 1/16 above.
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+} MetricsSummary;
+
+typedef struct MetricsView {
+    uint64_t counters[MET_COUNTERS];
+    uint64_t uptime_ms;
+    uint32_t connections; // Open now, authenticated or not.
+    uint32_t handshakes; // Open now and not yet authenticated.
+    uint32_t users; // Authenticated now.
+    uint32_t rooms;
+    MetricsSummary hists[MET_HISTS];
+} MetricsView;
+
+// Start the uptime clock; call once before any thread starts.
+void metrics_init(void);
+void metrics_add(MetricCounter counter, uint64_t v);
+void metrics_record(MetricHist hist, uint64_t v);
+// Give up the calling thread's slot; call before the thread exits.
+void metrics_thread_exit(void);
+void metrics_read(ServerState* st, MetricsView* out);
+const char* metrics_counter_name(MetricCounter counter);
+// Name of a histogram as STATS reports it, e.g. "cmd_msg_ns".
+void metrics_hist_name(MetricHist hist, char* out, size_t cap);
+// Everything in Prometheus text exposition format; returns 0 on a write error.
+int metrics_write_prometheus(ServerState* st, FILE* f);
+// Rewrite path every interval_ms from a background thread. Each dump goes
+// to "<path>.tmp" first and is renamed over path, so readers never see a
+// partial file.
+int metrics_start_dump(ServerState* st, const char* path, uint32_t interval_ms);
+
+// server_trace.c: sampled message tracing (chat_trace.h). Every hook is a
+// no-op until trace_open. Backends call trace_read_done after each socket
+// read that returned data; server_handle_frame brackets each frame with
+// begin/end, which samples it and makes it the calling thread's current
+// trace. Frames allocated meanwhile carry that trace into the queues.
+int trace_open(const char* path, uint32_t sample);
+void trace_read_done(void);
+void trace_frame_begin(uint32_t client, uint32_t len);
+void trace_frame_end(void);
+// Current frame's trace, or 0 if it is not sampled or tracing is muted.
+uint32_t trace_current(void);
+// Record a stage of the current frame, which was decoded as command cmd.
+void trace_stage(ChatTraceStage stage, int cmd);
+// Record a stage of a queued frame for recipient client.
+void trace_frame(uint32_t trace, ChatTraceStage stage, uint32_t client, uint32_t bytes);
+// While muted, frames get no trace and queued ones record nothing (history
+// replays are not part of the message that triggered them).
+void trace_mute(int mute);
+// Give up the calling thread's buffer; call before the thread exits.
+void trace_thread_exit(void);
+
+// server_outq.c: shared frames and outbound queues. Push takes a reference
+// and returns 0 if the client must be disconnected; flush returns 0 on a
+// socket error.
+OutFrame* outframe_new(const void* payload, uint32_t len);
+// Same payload behind v2's varint length prefix.
+OutFrame* outframe_new_bin(const void* payload, uint32_t len);
+// Frame of the payload head followed by tail, copied straight into place.
+OutFrame* outframe_new_parts(const void* head, uint32_t head_len, const void* tail, uint32_t tail_len, int bin);
+// Bytes with no length prefix, for use as the body of spliced frames.
+OutFrame* outframe_new_raw(const void* bytes, uint32_t len);
+// Frame of the payload head followed by body's bytes, which are shared,
+// not copied; takes a reference on body.
+OutFrame* outframe_new_spliced(const void* head, uint32_t head_len, OutFrame* body, int bin);
+// Packed copy of a payload (head then tail) for clients that negotiated
+// compression; NULL if packing would not make it smaller (send the plain
+// frame instead).
+OutFrame* outframe_new_zip(const void* head, uint32_t head_len, const void* tail, uint32_t tail_len, int bin);
+void outframe_retain(OutFrame* f);
+void outframe_release(OutFrame* f);
+// Retain/release every frame a set holds.
+void outframes_retain(const OutFrames* fs);
+void outframes_release(const OutFrames* fs);
+// Compression contexts are large, so threads borrow them from a shared
+// free list. zip_init runs once before any thread starts; acquire returns
+// NULL without zlib or memory.
+void zip_init(void);
+ChatZip* zip_acquire(void);
+void zip_release(ChatZip* z);
+int outq_push(ServerState* st, OutQueue* q, OutFrame* f);
+int outq_flush(OutQueue* q, SOCKET sock);
+void outq_clear(OutQueue* q);
+int slow_policy_parse(const char* name, SlowPolicy* out);
+const char* slow_policy_name(SlowPolicy policy);
+
+// server_cmd.c: protocol state machine shared by all backends.
+int send_text(ServerState* st, Client* c, const char* payload);
+int send_bin(ServerState* st, Client* c, const ChatBinWriter* w);
+// Send a room event to every member in its own wire version. keep also
+// records it in the room's history, which needs every version built.
+void broadcast_room(ServerState* st, Room* r, const char* text, const ChatBinWriter* bin, int keep);
+// Same for an event made of a header per version followed by body bytes
+// both share (ROOMMSG text).
+void broadcast_room_parts(ServerState* st, Room* r, const char* text_head, uint32_t text_head_len,
+    const uint8_t* bin_head, uint32_t bin_head_len, const char* body, uint32_t body_len, int keep);
+// USERJOIN / USERLEAVE of the user with v2 id user_id.
+void broadcast_membership(ServerState* st, Room* r, uint32_t user_id, const char* username, int joined);
+// Whether a user or room name can appear in v1 events, whichever version
+// it arrived in: not empty, no spaces or control bytes, no leading ':'.
+int name_valid(const char* name);
+// PRIVMSG from a user to dst; the caller checked the v1 event fits a frame
+// (pm_frame_len, its payload length).
+uint32_t pm_frame_len(const char* from, uint32_t text_len);
+void deliver_pm(ServerState* st, Client* dst, uint32_t from_id, const char* from, const char* text, uint32_t text_len);
+// Send the greeting to a freshly accepted client.
+void server_on_connect(ServerState* st, Client* c);
+// Handshake admission, for the backends: whether another connection may be
+// accepted, start counting an accepted one, whether c is past AUTH (or
+// NODE), and stop counting it (once authenticated or closed).
+int handshake_admit(ServerState* st);
+void handshake_begin(ServerState* st, Client* c);
+int handshake_done(const Client* c);
+void handshake_end(ServerState* st, Client* c);
+// AUTH checked against the credentials: register c as username if ok;
+// returns 0 to close c.
+int server_auth_verified(ServerState* st, Client* c, const char* username, int ok);
+// Handle one NUL-terminated frame; returns 0 if the connection should close.
+// An AUTH that needs hashing leaves c->auth_job set instead of replying:
+// the backend parks the input behind it and calls auth_queue.
+int server_handle_frame(ServerState* st, Client* c, char* payload, uint32_t payload_len);
+// Unlink a closed client and notify its rooms. Caller releases c afterwards.
+void server_on_disconnect(ServerState* st, Client* c);
+
+// server_peer.c: federation links between chat_server processes. Peers
+// are configured before peer_start; the hooks below do nothing without
+// them. The *_changed hooks run under st->lock held exclusively, so every
+// link sees registry changes in the order they happened.
+// Add a peer from "<id>@<host>:<port>"; 0 if malformed or a duplicate.
+int peer_add(const char* spec);
+int peer_start(ServerState* st);
+// A connection sent "NODE <id> <secret>": made a link only if it came
+// from that peer's address with the cluster secret; returns 0 to close it.
+int peer_accept(ServerState* st, Client* c, const char* node, const char* secret);
+// One frame from a link; returns 0 to close it.
+int peer_handle_frame(ServerState* st, Client* c, uint8_t* payload, uint32_t payload_len);
+void peer_link_closed(ServerState* st, Client* c);
+void peer_user_changed(ServerState* st, const char* username, int online);
+void peer_room_changed(ServerState* st, const char* room, int interested);
+// Node holding a user that is not here (0 if none); takes st->lock shared.
+int peer_user_node(ServerState* st, const char* username);
+// Call fn for every user on another node known to be in room; caller holds st->lock.
+typedef void (*PeerMemberFn)(void* arg, uint32_t id, const char* username);
+void peer_each_member(ServerState* st, const char* room, PeerMemberFn fn, void* arg);
+// Relay local traffic to the nodes that need it; no lock held.
+void peer_relay_msg(ServerState* st, const char* room, const char* user, const char* text, uint32_t text_len);
+void peer_relay_join(ServerState* st, const char* room, const char* user, int joined);
+void peer_relay_pm(ServerState* st, const char* from, const char* to, const char* text, uint32_t text_len);
+// Payload length of the PEER_PM peer_relay_pm would send; must fit CHAT_MAX_FRAME.
+uint32_t peer_pm_len(const char* from, const char* to, uint32_t text_len);
+// Nodes on this host's backplane, driven by server_shm.c: a node id to
+// link through it, its link coming up or going down, one frame from it,
+// and asking it to sync again after frames from it were lost.
+int peer_add_shm(int node);
+void peer_shm_up(ServerState* st, int node);
+void peer_shm_down(ServerState* st, int node);
+void peer_shm_frame(ServerState* st, int node, uint8_t* payload, uint32_t payload_len);
+void peer_shm_resync(ServerState* st, int node);
+
+// server_auth.c: hashed per-user credentials from a file with one line
+// per user: "<user> pbkdf2-sha256 <iterations> <salt hex> <hash hex>".
+// The file is mapped and parsed whole, then checked for changes every
+// second and reloaded when it changes. PBKDF2 runs on a pool of verifier
+// threads, never on the thread reading the connection. A login verified
+// within cache_ms is recognised again with one HMAC, until the user's line
+// changes.
+typedef struct AuthConfig {
+    const char* path;
+    int workers;
+    uint32_t cache_ms; // 0: always hash.
+} AuthConfig;
+
+// Load the file and start the verifier and reload threads; NULL (after
+// printing why) on failure.
+Auth* auth_open(ServerState* st, const AuthConfig* cfg);
+// Users in the file currently loaded.
+uint32_t auth_user_count(Auth* a);
+// Whether this login was verified within cache_ms; costs one HMAC.
+int auth_cached(Auth* a, const char* username, const char* password);
+// Set c->auth_job to verify this login; 0 if out of memory.
+int auth_prepare(Client* c, const char* username, const char* password);
+// Hand c's job to the verifier pool (with a reference to c). The caller
+// must not touch c afterwards until st->auth_done calls back.
+void auth_queue(ServerState* st, Client* c);
+// On c's serving thread, after st->auth_done: reply to the AUTH and clear
+// c->auth_job; returns 0 to close c.
+int auth_finish(ServerState* st, Client* c);
+// Free a job that was never queued (c is being freed).
+void auth_discard(Client* c);
+
+// server_shm.c: shared-memory backplane between chat_server processes on
+// one host (Linux). shm_attach claims a process slot in the named segment,
+// creating it with ring_bytes per slot if it does not exist yet, and
+// returns this process's node id (slot + 1; 0 on failure). shm_start runs
+// the consumer thread once the backend is serving. shm_publish writes one
+// frame (head, then text) for the nodes in the mask.
+#define CHAT_SHM_PROCS 16 // Process slots per segment.
+#define CHAT_SHM_RING_DEFAULT (1u << 20)
+int shm_attach(const char* name, uint32_t ring_bytes);
+int shm_start(ServerState* st);
+void shm_publish(uint64_t nodes, const uint8_t* head, uint32_t head_len, const char* text, uint32_t text_len);
+
+// Backends: run the accept/serve loop until the listener fails.
+int server_run_threads(ServerState* st, SOCKET listen_sock);
+#ifdef CHAT_HAVE_EPOLL
+// One reactor thread per listener (SO_REUSEPORT siblings when count > 1).
+int server_run_epoll(ServerState* st, SOCKET* listen_socks, int count);
+#endif
@@ -0,0 +1,442 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "chat_hash.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+// Hashed credentials. The file is mapped, parsed into a CredStore indexed
+// by name, and unmapped again; a reload builds a new store and swaps it in
+// under store_lock, so a bad edit leaves the old one serving. Verifier
+// threads hold a reference to the store they hash against, so a swap never
+// waits for them.
+//
+// An AUTH that needs hashing becomes an AuthJob on c. The backend parks
+// the bytes read behind it and queues it. A verifier thread hashes the
+// password, then st->auth_done hands the client back to its serving thread,
+// which replies through auth_finish. Unknown names cost the same hash, so
+// response times do not tell which names exist.
+//
+// The cache is a slot in each Credential: the HMAC of the last password
+// verified for it, under a per-process random key. A hit therefore needs
+// the same password, and costs only an HMAC on the reading thread. A
+// reload carries a slot over only if the user's line is unchanged.
+
+#define AUTH_RELOAD_MS 1000 // Credential file change check period.
+#define AUTH_SALT_MAX 64
+#define AUTH_ITERATIONS_MAX 100000000u
+
+typedef struct Credential {
+    char name[CHAT_NAME_MAX + 1];
+    uint32_t iterations;
+    uint32_t salt_len;
+    uint8_t salt[AUTH_SALT_MAX];
+    uint8_t hash[CHAT_SHA256_LEN];
+    // Under Auth.cache_lock.
+    uint8_t cache_key[CHAT_SHA256_LEN]; // HMAC of the password last verified.
+    uint64_t cache_expires_ns; // 0 when empty.
+} Credential;
+
+// One loaded file; freed when the last reference is released.
+typedef struct CredStore {
+    volatile int32_t refs;
+    Credential* creds;
+    uint32_t count;
+    uint32_t max_iterations; // Work spent on unknown names.
+    NameTable index;
+} CredStore;
+
+struct AuthJob {
+    AuthJob* next;
+    Client* client; // Holds a reference while queued.
+    uint64_t queued_ns;
+    int ok;
+    char username[CHAT_NAME_MAX + 1];
+    uint32_t password_len;
+    char password[]; // Wiped once hashed.
+};
+
+// File identity, to notice a rewrite or a rename over it.
+typedef struct FileStamp {
+    uint64_t mtime;
+    uint64_t size;
+    uint64_t inode;
+} FileStamp;
+
+struct Auth {
+    ServerState* st;
+    char* path;
+    uint32_t cache_ms;
+    SRWLOCK store_lock;
+    CredStore* store;
+    FileStamp stamp;
+    ChatHmac cache_hmac; // Keyed with random bytes at startup.
+    SRWLOCK cache_lock;
+    CRITICAL_SECTION queue_lock;
+    CONDITION_VARIABLE queue_wake;
+    AuthJob* head;
+    AuthJob* tail;
+};
+
+static size_t job_size(uint32_t password_len) {
+    return sizeof(AuthJob) + password_len + 1;
+}
+
+static void store_release(CredStore* s) {
+    if (chat_atomic_add(&s->refs, -1) != 0) return;
+    name_table_free(&s->index);
+    free(s->creds);
+    free(s);
+}
+
+static CredStore* store_get(Auth* a) {
+    AcquireSRWLockShared(&a->store_lock);
+    CredStore* s = a->store;
+    chat_atomic_add(&s->refs, 1);
+    ReleaseSRWLockShared(&a->store_lock);
+    return s;
+}
+
+static int file_stamp(const char* path, FileStamp* out) {
+    struct stat sb;
+    if (stat(path, &sb) != 0) return 0;
+    memset(out, 0, sizeof(*out));
+#ifdef _WIN32
+    out->mtime = (uint64_t)sb.st_mtime;
+#else
+    out->mtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000ull + (uint64_t)sb.st_mtim.tv_nsec;
+    out->inode = (uint64_t)sb.st_ino;
+#endif
+    out->size = (uint64_t)sb.st_size;
+    return 1;
+}
+
+// Next whitespace-separated field of a line; 0 at its end.
+static size_t next_field(const char** p, const char* end, const char** field) {
+    while (*p < end && (**p == ' ' || **p == '\t' || **p == '\r')) (*p)++;
+    *field = *p;
+    while (*p < end && **p != ' ' && **p != '\t' && **p != '\r') (*p)++;
+    return (size_t)(*p - *field);
+}
+
+static int parse_line(const char* p, const char* end, Credential* out) {
+    const char* f[6];
+    size_t n[6];
+    for (int i = 0; i < 6; i++) n[i] = next_field(&p, end, &f[i]);
+    if (!n[4] || n[5]) return 0;
+    if (n[0] > CHAT_NAME_MAX || n[1] != 13 || memcmp(f[1], "pbkdf2-sha256", 13) != 0) return 0;
+    uint32_t iterations = 0;
+    for (size_t i = 0; i < n[2]; i++) {
+        if (f[2][i] < '0' || f[2][i] > '9' || iterations > AUTH_ITERATIONS_MAX / 10) return 0;
+        iterations = iterations * 10 + (uint32_t)(f[2][i] - '0');
+    }
+    if (iterations == 0 || iterations > AUTH_ITERATIONS_MAX) return 0;
+    size_t salt_len = n[3] / 2;
+    if (salt_len == 0 || salt_len > AUTH_SALT_MAX || !chat_hex_decode(f[3], n[3], out->salt, salt_len)) return 0;
+    if (!chat_hex_decode(f[4], n[4], out->hash, CHAT_SHA256_LEN)) return 0;
+    memcpy(out->name, f[0], n[0]);
+    out->name[n[0]] = 0;
+    out->iterations = iterations;
+    out->salt_len = (uint32_t)salt_len;
+    out->cache_expires_ns = 0;
+    return 1;
+}
+
+// Parse a whole file; NULL (after printing where) if any line is bad, so a
+// half-edited file is never served.
+static CredStore* store_parse(const char* path, const char* text, size_t len) {
+    CredStore* s = (CredStore*)calloc(1, sizeof(*s));
+    uint32_t cap = 0;
+    if (!s) return NULL;
+    s->refs = 1;
+    uint32_t line = 0;
+    for (const char* p = text; p < text + len; line++) {
+        const char* eol = (const char*)memchr(p, '\n', (size_t)(text + len - p));
+        if (!eol) eol = text + len;
+        const char* q = p;
+        const char* field;
+        size_t n = next_field(&q, eol, &field);
+        if (n && field[0] != '#') {
+            if (s->count == cap) {
+                cap = cap ? cap * 2 : 64;
+                Credential* grown = (Credential*)realloc(s->creds, cap * sizeof(*grown));
+                if (!grown) goto fail;
+                s->creds = grown;
+            }
+            if (!parse_line(p, eol, &s->creds[s->count])) {
+                printf("Credentials: %s:%u: expected <user> pbkdf2-sha256 <iterations> <salt hex> <hash hex>\n",
+                    path, line + 1);
+                goto fail;
+            }
+            s->count++;
+        }
+        p = eol + 1;
+    }
+    // Index once the array stops moving.
+    for (uint32_t i = 0; i < s->count; i++) {
+        Credential* cr = &s->creds[i];
+        if (name_table_find(&s->index, cr->name)) {
+            printf("Credentials: %s: %s is listed twice\n", path, cr->name);
+            goto fail;
+        }
+        if (!name_table_insert(&s->index, cr->name, cr)) goto fail;
+        if (cr->iterations > s->max_iterations) s->max_iterations = cr->iterations;
+    }
+    return s;
+
+fail:
+    store_release(s);
+    return NULL;
+}
+
+static CredStore* store_load(const char* path) {
+    CredStore* s = NULL;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("Credentials: cannot open %s\n", path);
+        return NULL;
+    }
+    if (!GetFileSizeEx(file, &size)) size.QuadPart = -1;
+    if (size.QuadPart == 0) {
+        s = store_parse(path, "", 0);
+    } else if (size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        const char* map = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (map) {
+            s = store_parse(path, map, (size_t)size.QuadPart);
+            UnmapViewOfFile(map);
+        } else {
+            printf("Credentials: cannot map %s\n", path);
+        }
+        if (mapping) CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        printf("Credentials: cannot open %s\n", path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if (sb.st_size == 0) {
+        s = store_parse(path, "", 0);
+    } else {
+        void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            s = store_parse(path, (const char*)map, (size_t)sb.st_size);
+            munmap(map, (size_t)sb.st_size);
+        } else {
+            printf("Credentials: cannot map %s\n", path);
+        }
+    }
+    close(fd);
+#endif
+    return s;
+}
+
+// Keep the cache of every user whose line a reload left unchanged.
+static void cache_carry(Auth* a, const CredStore* old, CredStore* s) {
+    if (!a->cache_ms) return;
+    AcquireSRWLockShared(&a->cache_lock);
+    for (uint32_t i = 0; i < s->count; i++) {
+        Credential* cr = &s->creds[i];
+        const Credential* was = (const Credential*)name_table_find(&old->index, cr->name);
+        // A new salt or password gives a new hash.
+        if (!was || !was->cache_expires_ns || memcmp(was->hash, cr->hash, sizeof(cr->hash)) != 0) continue;
+        memcpy(cr->cache_key, was->cache_key, sizeof(cr->cache_key));
+        cr->cache_expires_ns = was->cache_expires_ns;
+    }
+    ReleaseSRWLockShared(&a->cache_lock);
+}
+
+static void cache_put(Auth* a, Credential* cr, const char* password, uint32_t password_len) {
+    if (!a->cache_ms) return;
+    uint8_t key[CHAT_SHA256_LEN];
+    chat_hmac(&a->cache_hmac, password, password_len, key);
+    AcquireSRWLockExclusive(&a->cache_lock);
+    memcpy(cr->cache_key, key, sizeof(key));
+    cr->cache_expires_ns = chat_now_ns() + (uint64_t)a->cache_ms * 1000000u;
+    ReleaseSRWLockExclusive(&a->cache_lock);
+}
+
+int auth_cached(Auth* a, const char* username, const char* password) {
+    if (!a->cache_ms) return 0;
+    uint8_t key[CHAT_SHA256_LEN];
+    chat_hmac(&a->cache_hmac, password, strlen(password), key);
+    int hit = 0;
+    AcquireSRWLockShared(&a->store_lock);
+    const Credential* cr = (const Credential*)name_table_find(&a->store->index, username);
+    if (cr) {
+        AcquireSRWLockShared(&a->cache_lock);
+        hit = cr->cache_expires_ns > chat_now_ns() && chat_equal_ct(cr->cache_key, key, sizeof(key));
+        ReleaseSRWLockShared(&a->cache_lock);
+    }
+    ReleaseSRWLockShared(&a->store_lock);
+    if (hit) metrics_add(MET_AUTH_CACHED, 1);
+    return hit;
+}
+
+static int auth_verify(Auth* a, AuthJob* job) {
+    CredStore* s = store_get(a);
+    Credential* cr = (Credential*)name_table_find(&s->index, job->username);
+    uint8_t out[CHAT_SHA256_LEN];
+    int ok = 0;
+    uint64_t t0 = chat_now_ns();
+    if (cr) {
+        chat_pbkdf2_sha256(job->password, job->password_len, cr->salt, cr->salt_len, cr->iterations, out, sizeof(out));
+        ok = chat_equal_ct(out, cr->hash, sizeof(out));
+        if (ok) cache_put(a, cr, job->password, job->password_len);
+    } else {
+        static const uint8_t salt[16];
+        chat_pbkdf2_sha256(job->password, job->password_len, salt, sizeof(salt), s->max_iterations ? s->max_iterations : 1,
+            out, sizeof(out));
+    }
+    metrics_record(MET_HIST_AUTH_HASH_NS, chat_now_ns() - t0);
+    metrics_add(MET_AUTH_HASHED, 1);
+    store_release(s);
+    return ok;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL auth_worker(void* arg) {
+    Auth* a = (Auth*)arg;
+    for (;;) {
+        EnterCriticalSection(&a->queue_lock);
+        while (!a->head) SleepConditionVariableCS(&a->queue_wake, &a->queue_lock, INFINITE);
+        AuthJob* job = a->head;
+        a->head = job->next;
+        if (!a->head) a->tail = NULL;
+        LeaveCriticalSection(&a->queue_lock);
+
+        metrics_record(MET_HIST_AUTH_WAIT_NS, chat_now_ns() - job->queued_ns);
+        job->ok = auth_verify(a, job);
+        memset(job->password, 0, job->password_len);
+        a->st->auth_done(a->st, job->client);
+    }
+    return 0;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL auth_reload_thread(void* arg) {
+    Auth* a = (Auth*)arg;
+    for (;;) {
+        Sleep(AUTH_RELOAD_MS);
+        FileStamp now;
+        if (!file_stamp(a->path, &now) || memcmp(&now, &a->stamp, sizeof(now)) == 0) continue;
+        // Remember the attempt either way: a bad edit is reported once.
+        a->stamp = now;
+        CredStore* s = store_load(a->path);
+        if (!s) {
+            printf("Credentials: keeping the %u users loaded before\n", auth_user_count(a));
+            continue;
+        }
+        // Only this thread swaps stores, so the old one can be read unlocked.
+        cache_carry(a, a->store, s);
+        AcquireSRWLockExclusive(&a->store_lock);
+        CredStore* old = a->store;
+        a->store = s;
+        ReleaseSRWLockExclusive(&a->store_lock);
+        store_release(old);
+        metrics_add(MET_CRED_RELOADS, 1);
+        printf("Credentials: reloaded %u users from %s\n", s->count, a->path);
+    }
+    return 0;
+}
+
+Auth* auth_open(ServerState* st, const AuthConfig* cfg) {
+    Auth* a = (Auth*)calloc(1, sizeof(*a));
+    size_t len = strlen(cfg->path);
+    if (a) a->path = (char*)malloc(len + 1);
+    if (!a || !a->path) {
+        free(a);
+        printf("Credentials: out of memory\n");
+        return NULL;
+    }
+    memcpy(a->path, cfg->path, len + 1);
+    a->st = st;
+    a->cache_ms = cfg->cache_ms;
+    InitializeSRWLock(&a->store_lock);
+    InitializeSRWLock(&a->cache_lock);
+    InitializeCriticalSection(&a->queue_lock);
+    InitializeConditionVariable(&a->queue_wake);
+
+    uint8_t secret[CHAT_SHA256_LEN];
+    if (!chat_random_bytes(secret, sizeof(secret))) {
+        printf("Credentials: no random source\n");
+        return NULL;
+    }
+    chat_hmac_init(&a->cache_hmac, secret, sizeof(secret));
+    memset(secret, 0, sizeof(secret));
+
+    (void)file_stamp(a->path, &a->stamp);
+    a->store = store_load(a->path);
+    if (!a->store) return NULL;
+    for (int i = 0; i < cfg->workers; i++) {
+        if (!chat_thread_start(auth_worker, a)) {
+            printf("Credentials: cannot start verifier threads\n");
+            return NULL;
+        }
+    }
+    if (!chat_thread_start(auth_reload_thread, a)) printf("Credentials: %s will not be reloaded\n", a->path);
+    return a;
+}
+
+uint32_t auth_user_count(Auth* a) {
+    AcquireSRWLockShared(&a->store_lock);
+    uint32_t count = a->store->count;
+    ReleaseSRWLockShared(&a->store_lock);
+    return count;
+}
+
+int auth_prepare(Client* c, const char* username, const char* password) {
+    size_t len = strlen(password);
+    if (len > CHAT_MAX_FRAME) return 0;
+    AuthJob* job = (AuthJob*)buf_alloc(job_size((uint32_t)len));
+    if (!job) return 0;
+    memset(job, 0, sizeof(*job));
+    snprintf(job->username, sizeof(job->username), "%s", username);
+    job->password_len = (uint32_t)len;
+    memcpy(job->password, password, len + 1);
+    job->client = c;
+    c->auth_job = job;
+    return 1;
+}
+
+void auth_queue(ServerState* st, Client* c) {
+    Auth* a = st->auth;
+    AuthJob* job = c->auth_job;
+    client_retain(c);
+    job->queued_ns = chat_now_ns();
+    job->next = NULL;
+    EnterCriticalSection(&a->queue_lock);
+    if (a->tail) a->tail->next = job;
+    else a->head = job;
+    a->tail = job;
+    WakeConditionVariable(&a->queue_wake);
+    LeaveCriticalSection(&a->queue_lock);
+}
+
+int auth_finish(ServerState* st, Client* c) {
+    AuthJob* job = c->auth_job;
+    c->auth_job = NULL;
+    int keep = !c->dead && server_auth_verified(st, c, job->username, job->ok);
+    buf_free(job, job_size(job->password_len));
+    return keep;
+}
+
+void auth_discard(Client* c) {
+    AuthJob* job = c->auth_job;
+    if (!job) return;
+    c->auth_job = NULL;
+    memset(job->password, 0, job->password_len);
+    buf_free(job, job_size(job->password_len));
+}
@@ -0,0 +1,924 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_cmd.h"
+#include "chat_frame.h"
+#include "chat_proto.h"
+
+// Each connection speaks v1 (command text) or, once negotiated, v2
+// (binary opcodes, see chat_proto.h). Handlers decode either into the same
+// arguments and encode replies in the client's own version; room events are
+// encoded once per version present in the room. A client that negotiated
+// compression may send and receive packed frames (chat_zip.h) in either.
+
+#define CMD_MEMBERS_MAX 4096 // Bytes per v2 MEMBERS frame.
+// Message text at least this long is copied once into a body that every
+// encoding of the event shares; shorter text is copied into each frame,
+// which saves an allocation and an iovec per frame.
+#define CMD_SPLICE_MIN 1024
+
+// A room event: each version's header followed by the same body bytes.
+typedef struct EventParts {
+    const char* text_head;
+    uint32_t text_head_len;
+    const uint8_t* bin_head; // NULL if there is no v2 encoding.
+    uint32_t bin_head_len;
+    const char* body;
+    uint32_t body_len;
+} EventParts;
+
+// Frame head then tail for c, packed if c takes packed frames and it pays.
+static OutFrame* frame_for_parts(ServerState* st, Client* c, const void* head, uint32_t head_len, const void* tail,
+    uint32_t tail_len, int bin) {
+    OutFrame* f = NULL;
+    if (c->zip && head_len + tail_len >= st->zip_min) f = outframe_new_zip(head, head_len, tail, tail_len, bin);
+    if (!f) f = outframe_new_parts(head, head_len, tail, tail_len, bin);
+    return f;
+}
+
+// Frame one payload for c, packed if c takes packed frames and it pays.
+static OutFrame* frame_for(ServerState* st, Client* c, const void* payload, uint32_t len, int bin) {
+    return frame_for_parts(st, c, payload, len, NULL, 0, bin);
+}
+
+// Send a raw text payload as a framed message.
+int send_text(ServerState* st, Client* c, const char* payload) {
+    OutFrame* f = frame_for(st, c, payload, (uint32_t)strlen(payload), 0);
+    if (!f) return 0;
+    int ok = st->send_frame(st, c, f);
+    outframe_release(f);
+    return ok;
+}
+
+// Send a built v2 payload as a framed message.
+int send_bin(ServerState* st, Client* c, const ChatBinWriter* w) {
+    if (w->overflow) return 0;
+    OutFrame* f = frame_for(st, c, w->buf, w->len, 1);
+    if (!f) return 0;
+    int ok = st->send_frame(st, c, f);
+    outframe_release(f);
+    return ok;
+}
+
+// Send "OK <what>" response (v2: the request's opcode).
+static int send_ok(ServerState* st, Client* c, uint8_t op) {
+    if (c->proto == CHAT_PROTO_BIN) {
+        uint8_t buf[2];
+        ChatBinWriter w;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_OK);
+        chat_bw_u8(&w, op);
+        return send_bin(st, c, &w);
+    }
+    char buf[256];
+    if (!chat_cmd_format(buf, sizeof(buf), "OK", chat_op_name(op), NULL, NULL)) return 0;
+    return send_text(st, c, buf);
+}
+
+// Send "ERR <code> :reason" response.
+static int send_err(ServerState* st, Client* c, const char* code, const char* reason) {
+    if (c->proto == CHAT_PROTO_BIN) {
+        uint8_t buf[512];
+        ChatBinWriter w;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_ERR);
+        chat_bw_str(&w, code);
+        chat_bw_text(&w, reason);
+        return send_bin(st, c, &w);
+    }
+    char buf[512];
+    if (!chat_cmd_format(buf, sizeof(buf), "ERR", code, NULL, reason)) return 0;
+    return send_text(st, c, buf);
+}
+
+// Only the versions some member speaks are allocated; a member whose
+// version was skipped can only have joined concurrently with the event.
+// History may be replayed to anyone later, so a kept event has both.
+// Each version is packed at most once, here, however many members take it.
+// A long body is shared by reference: each version's frame holds only its
+// prefix and header, and the body goes out as a second iovec.
+static void broadcast_parts(ServerState* st, Room* r, const EventParts* p, int keep) {
+    OutFrames fs = {NULL, NULL, NULL, NULL};
+    int want_text = keep || chat_atomic_load(&r->text_members) > 0;
+    int want_bin = p->bin_head && (keep || chat_atomic_load(&r->bin_members) > 0);
+    OutFrame* body = NULL;
+    if (p->body_len >= CMD_SPLICE_MIN && (want_text || want_bin)) body = outframe_new_raw(p->body, p->body_len);
+    if (want_text) {
+        fs.text = body ? outframe_new_spliced(p->text_head, p->text_head_len, body, 0)
+                       : outframe_new_parts(p->text_head, p->text_head_len, p->body, p->body_len, 0);
+    }
+    if (want_bin) {
+        fs.bin = body ? outframe_new_spliced(p->bin_head, p->bin_head_len, body, 1)
+                      : outframe_new_parts(p->bin_head, p->bin_head_len, p->body, p->body_len, 1);
+    }
+    if (fs.text && p->text_head_len + p->body_len >= st->zip_min && chat_atomic_load(&r->text_zip_members) > 0) {
+        fs.text_zip = outframe_new_zip(p->text_head, p->text_head_len, p->body, p->body_len, 0);
+    }
+    if (fs.bin && p->bin_head_len + p->body_len >= st->zip_min && chat_atomic_load(&r->bin_zip_members) > 0) {
+        fs.bin_zip = outframe_new_zip(p->bin_head, p->bin_head_len, p->body, p->body_len, 1);
+    }
+    if (body) outframe_release(body);
+    if (fs.text || fs.bin) {
+        uint32_t fanout = (uint32_t)(chat_atomic_load(&r->text_members) + chat_atomic_load(&r->bin_members));
+        uint64_t t0 = chat_now_ns();
+        st->broadcast(st, r, &fs);
+        metrics_record(MET_HIST_BROADCAST_NS, chat_now_ns() - t0);
+        metrics_record(MET_HIST_FANOUT, fanout);
+        metrics_add(MET_BROADCASTS, 1);
+        metrics_add(MET_DELIVERIES, fanout);
+    }
+    if (keep && fs.text && fs.bin) history_append(st, r, &fs);
+    outframes_release(&fs);
+}
+
+void broadcast_room(ServerState* st, Room* r, const char* text, const ChatBinWriter* bin, int keep) {
+    EventParts p = {text, (uint32_t)strlen(text), bin->overflow ? NULL : bin->buf, bin->len, NULL, 0};
+    broadcast_parts(st, r, &p, keep);
+}
+
+void broadcast_room_parts(ServerState* st, Room* r, const char* text_head, uint32_t text_head_len,
+    const uint8_t* bin_head, uint32_t bin_head_len, const char* body, uint32_t body_len, int keep) {
+    EventParts p = {text_head, text_head_len, bin_head, bin_head_len, body, body_len};
+    broadcast_parts(st, r, &p, keep);
+}
+
+void broadcast_membership(ServerState* st, Room* r, uint32_t user_id, const char* username, int joined) {
+    char text[256];
+    uint8_t buf[64];
+    ChatBinWriter w;
+    if (!chat_cmd_format(text, sizeof(text), joined ? "USERJOIN" : "USERLEAVE", r->name, username, NULL)) return;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, joined ? CHAT_OP_USERJOIN : CHAT_OP_USERLEAVE);
+    chat_bw_varint(&w, r->id);
+    chat_bw_varint(&w, user_id);
+    if (joined) chat_bw_str(&w, username);
+    broadcast_room(st, r, text, &w, 0);
+}
+
+// A local user joined or left r: tell its members here and on other nodes.
+static void announce_membership(ServerState* st, Room* r, Client* c, int joined) {
+    broadcast_membership(st, r, c->id, c->username, joined);
+    if (st->node_id) peer_relay_join(st, r->name, c->username, joined);
+}
+
+// Remove user from all rooms and notify remaining members.
+static void broadcast_user_leave(ServerState* st, Client* c) {
+    Room** left = NULL;
+
+    AcquireSRWLockExclusive(&st->lock);
+    int count = state_leave_all_rooms(st, c, &left);
+    ReleaseSRWLockExclusive(&st->lock);
+
+    for (int i = 0; i < count; i++) {
+        announce_membership(st, left[i], c, 0);
+        room_release(left[i]);
+    }
+    free(left);
+}
+
+void server_on_connect(ServerState* st, Client* c) {
+    metrics_add(MET_CONNECTS, 1);
+    if (c->peer) {
+        // A link this node dialed: introduce ourselves instead.
+        char text[64];
+        char node[16];
+        snprintf(node, sizeof(node), "%d", st->node_id);
+        if (chat_cmd_format(text, sizeof(text), "NODE", node, st->peer_secret, NULL)) (void)send_text(st, c, text);
+        return;
+    }
+    // Protocol greeting so the client can confirm server version.
+    (void)send_text(st, c, "HELLO 1");
+}
+
+int handshake_admit(ServerState* st) {
+    return !st->max_handshakes || (uint32_t)chat_atomic_load(&st->handshakes) < st->max_handshakes;
+}
+
+void handshake_begin(ServerState* st, Client* c) {
+    c->accepted_ns = chat_now_ns();
+    c->handshaking = 1;
+    (void)chat_atomic_add(&st->handshakes, 1);
+}
+
+int handshake_done(const Client* c) {
+    return c->authed || c->peer;
+}
+
+void handshake_end(ServerState* st, Client* c) {
+    if (!c->handshaking) return;
+    c->handshaking = 0;
+    (void)chat_atomic_add(&st->handshakes, -1);
+}
+
+// Version negotiation, in v1 before AUTH: the client names the highest
+// version it speaks, optionally followed by "deflate", and the server
+// answers with what both will use.
+static void handle_hello(ServerState* st, Client* c, const char* version, const char* option) {
+    int bin = version && atoi(version) >= CHAT_PROTO_BIN;
+    int zip = st->zip && option && _stricmp(option, "deflate") == 0;
+    char reply[32];
+    snprintf(reply, sizeof(reply), "HELLO %d%s", bin ? CHAT_PROTO_BIN : CHAT_PROTO_TEXT, zip ? " deflate" : "");
+    (void)send_text(st, c, reply);
+    // Packed frames are accepted and sent from the next frame on.
+    c->zip = zip;
+    if (!bin) return;
+    // Everything after the confirmation is v2, inbound from the next frame on.
+    c->proto = CHAT_PROTO_BIN;
+    chat_decoder_set_varint(&c->in, 1);
+    EnterCriticalSection(&c->send_lock);
+    c->outq.bin = 1;
+    LeaveCriticalSection(&c->send_lock);
+}
+
+// v1 clients split USERJOIN, ROOMMSG and PRIVMSG on spaces and take a
+// leading ':' as the start of the text, so a name holding either would
+// let its owner forge what they parse.
+int name_valid(const char* name) {
+    if (!name[0] || name[0] == ':') return 0;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        if (*p <= ' ' || *p == 0x7f) return 0;
+    }
+    return 1;
+}
+
+// Whether username appears in the comma-separated --admin list.
+static int is_admin(const char* admins, const char* username) {
+    size_t len = strlen(username);
+    for (const char* p = admins; p && *p;) {
+        const char* end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && _strnicmp(p, username, len) == 0) return 1;
+        p = end ? end + 1 : p + n;
+    }
+    return 0;
+}
+
+int server_auth_verified(ServerState* st, Client* c, const char* username, int ok) {
+    if (!ok) {
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Bad password");
+        return 0;
+    }
+
+    AcquireSRWLockExclusive(&st->lock);
+    if (state_find_client_by_name(st, username) || name_table_find(&st->remote_users, username)) {
+        ReleaseSRWLockExclusive(&st->lock);
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Username already in use");
+        return 0;
+    }
+    strncpy(c->username, username, CHAT_NAME_MAX);
+    c->username[CHAT_NAME_MAX] = 0;
+    if (!state_register_user(st, c)) {
+        c->username[0] = 0;
+        ReleaseSRWLockExclusive(&st->lock);
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Server out of memory");
+        return 0;
+    }
+    c->id = ++st->last_user_id;
+    c->admin = is_admin(st->admins, c->username);
+    c->authed = 1;
+    if (st->node_id) peer_user_changed(st, c->username, 1);
+    ReleaseSRWLockExclusive(&st->lock);
+    metrics_add(MET_AUTH_OK, 1);
+    if (c->accepted_ns) metrics_record(MET_HIST_HANDSHAKE_NS, chat_now_ns() - c->accepted_ns);
+    EnterCriticalSection(&c->send_lock);
+    c->outq.owner = c->id;
+    LeaveCriticalSection(&c->send_lock);
+
+    (void)send_ok(st, c, CHAT_OP_AUTH);
+    return 1;
+}
+
+// First command must be AUTH username password. With a credential file,
+// a login not in the cache is left to the verifier pool (c->auth_job).
+static int handle_auth(ServerState* st, Client* c, const char* username, const char* password) {
+    if (strlen(username) > CHAT_NAME_MAX) {
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Username too long");
+        return 1;
+    }
+    if (!name_valid(username)) {
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Invalid username");
+        return 1;
+    }
+    if (!st->auth) return server_auth_verified(st, c, username, strcmp(password, st->password) == 0);
+    if (auth_cached(st->auth, username, password)) return server_auth_verified(st, c, username, 1);
+    if (!auth_prepare(c, username, password)) {
+        metrics_add(MET_AUTH_FAILED, 1);
+        (void)send_err(st, c, "AUTH", "Server out of memory");
+        return 0;
+    }
+    return 1;
+}
+
+// MEMBERS frames for one JOIN reply, sent as each fills up.
+typedef struct MembersOut {
+    ServerState* st;
+    Client* c;
+    Room* r;
+    ChatBinWriter w;
+    uint32_t empty; // w.len with no members in it.
+    uint8_t buf[CMD_MEMBERS_MAX];
+} MembersOut;
+
+static void members_begin(MembersOut* out) {
+    chat_bw_init(&out->w, out->buf, sizeof(out->buf));
+    chat_bw_u8(&out->w, CHAT_OP_MEMBERS);
+    chat_bw_varint(&out->w, out->r->id);
+    out->empty = out->w.len;
+}
+
+static void members_add(void* arg, uint32_t id, const char* username) {
+    MembersOut* out = (MembersOut*)arg;
+    if (out->w.cap - out->w.len < 2 * CHAT_VARINT_MAX + CHAT_NAME_MAX) {
+        (void)send_bin(out->st, out->c, &out->w);
+        members_begin(out);
+    }
+    chat_bw_varint(&out->w, id);
+    chat_bw_str(&out->w, username);
+}
+
+// v2 reply to JOIN: bind the room's id, then name every member already
+// there, on this node or another. Caller holds st->lock exclusively, so
+// both are queued before any broadcast that can reach c in this room.
+static void send_joined(ServerState* st, Client* c, Room* r) {
+    MembersOut out;
+    out.st = st;
+    out.c = c;
+    out.r = r;
+    chat_bw_init(&out.w, out.buf, sizeof(out.buf));
+    chat_bw_u8(&out.w, CHAT_OP_JOINED);
+    chat_bw_varint(&out.w, r->id);
+    chat_bw_str(&out.w, r->name);
+    (void)send_bin(st, c, &out.w);
+
+    members_begin(&out);
+    for (int k = 0; k < st->nshards; k++) {
+        RoomShard* rs = &r->shards[k];
+        for (int i = 0; i < rs->member_count; i++) {
+            Client* m = rs->members[i];
+            if (m != c) members_add(&out, m->id, m->username);
+        }
+    }
+    if (st->node_id) peer_each_member(st, r->name, members_add, &out);
+    if (out.w.len > out.empty) (void)send_bin(st, c, &out.w);
+}
+
+static void handle_join(ServerState* st, Client* c, const char* room_name) {
+    if (strlen(room_name) > CHAT_NAME_MAX) {
+        (void)send_err(st, c, "JOIN", "Room name too long");
+        return;
+    }
+    if (!name_valid(room_name)) {
+        (void)send_err(st, c, "JOIN", "Invalid room name");
+        return;
+    }
+
+    // Create room if needed and add member under lock.
+    AcquireSRWLockExclusive(&st->lock);
+    Room* r = state_get_or_create_room(st, room_name);
+    if (r && !room_add_member(r, c)) {
+        state_prune_room(st, r);
+        r = NULL;
+    }
+    // The reply is queued under the lock, ahead of any USERJOIN a peer
+    // introduces once the room change below reaches it.
+    if (r) {
+        room_retain(r);
+        if (c->proto == CHAT_PROTO_BIN) send_joined(st, c, r);
+        else (void)send_ok(st, c, CHAT_OP_JOIN);
+    }
+    ReleaseSRWLockExclusive(&st->lock);
+
+    if (!r) {
+        (void)send_err(st, c, "JOIN", "Server out of memory");
+        return;
+    }
+    // A message sent while the join is in progress may arrive both live
+    // and in the replay.
+    (void)history_replay(st, r, c, st->hist_join);
+    announce_membership(st, r, c, 1);
+    room_release(r);
+}
+
+// Leave a room named by v1 text or, when room_name is NULL, by v2 id.
+static void handle_leave(ServerState* st, Client* c, const char* room_name, uint32_t room_id) {
+    // Remove member under lock if room exists; the last one out frees it.
+    AcquireSRWLockExclusive(&st->lock);
+    Room* r = room_name ? state_find_room(st, room_name) : client_find_joined_id(c, room_id);
+    if (r) {
+        room_retain(r);
+        room_remove_member(r, c);
+        state_prune_room(st, r);
+    }
+    ReleaseSRWLockExclusive(&st->lock);
+
+    (void)send_ok(st, c, CHAT_OP_LEAVE);
+    if (!r) return;
+    announce_membership(st, r, c, 0);
+    room_release(r);
+}
+
+// Build c's ROOMMSG headers for the room behind link; neither the names
+// nor the ids change while c stays in the room.
+static void link_build_heads(Client* c, RoomLink* link) {
+    Room* r = link->room;
+    int n = snprintf(link->text_head, sizeof(link->text_head), "ROOMMSG %s %s :", r->name, c->username);
+    link->text_head_len = (uint8_t)n;
+    ChatBinWriter w;
+    chat_bw_init(&w, link->bin_head, sizeof(link->bin_head));
+    chat_bw_u8(&w, CHAT_OP_ROOMMSG);
+    chat_bw_varint(&w, r->id);
+    chat_bw_varint(&w, c->id);
+    link->bin_head_len = (uint8_t)w.len;
+}
+
+// link comes from c's own room list (client_find_link*), so the hot path
+// takes no lock and no room reference: c cannot leave while this thread
+// handles it. v1 members see the room as the sender spelled it. The text
+// is copied from the receive buffer straight into the outgoing frames, or
+// once into a shared body, behind the cached headers.
+static void handle_msg(ServerState* st, Client* c, RoomLink* link, const char* room_name, const char* text,
+    uint32_t text_len) {
+    if (!link) {
+        (void)send_err(st, c, "MSG", "Not in room");
+        return;
+    }
+    Room* r = link->room;
+    if (!link->text_head_len) link_build_heads(c, link);
+
+    char spelled[ROOMMSG_HEAD_MAX];
+    const char* head = link->text_head;
+    uint32_t head_len = link->text_head_len;
+    if (strcmp(room_name, r->name) != 0) {
+        // Same length as r->name: the names only differ in case.
+        head_len = (uint32_t)snprintf(spelled, sizeof(spelled), "ROOMMSG %s %s :", room_name, c->username);
+        head = spelled;
+    }
+    if (!text_len) head_len -= 2; // Empty text: no " :".
+    // The v1 event is the longer one, so it decides "too long".
+    if (head_len + text_len > CHAT_MAX_FRAME) {
+        (void)send_err(st, c, "MSG", "Message too long");
+        return;
+    }
+
+    EventParts p = {head, head_len, link->bin_head, link->bin_head_len, text, text_len};
+    broadcast_parts(st, r, &p, st->hist_depth > 0);
+    if (st->log) (void)log_append(st->log, r->name, c->username, text, text_len);
+    if (st->node_id) peer_relay_msg(st, r->name, c->username, text, text_len);
+}
+
+// Replay up to count (0: all) of the room's kept messages, then OK.
+static void handle_history(ServerState* st, Client* c, Room* r, uint32_t count) {
+    if (!r) {
+        (void)send_err(st, c, "HISTORY", "Not in room");
+        return;
+    }
+    (void)history_replay(st, r, c, count ? count : st->hist_depth);
+    (void)send_ok(st, c, CHAT_OP_HISTORY);
+}
+
+// v1 PRIVMSG header; its length decides "too long" for either version.
+static uint32_t pm_text_head(char* out, size_t cap, const char* from, uint32_t text_len) {
+    return (uint32_t)snprintf(out, cap, text_len ? "PRIVMSG %s :" : "PRIVMSG %s", from);
+}
+
+uint32_t pm_frame_len(const char* from, uint32_t text_len) {
+    char head[16 + CHAT_NAME_MAX];
+    return pm_text_head(head, sizeof(head), from, text_len) + text_len;
+}
+
+void deliver_pm(ServerState* st, Client* dst, uint32_t from_id, const char* from, const char* text, uint32_t text_len) {
+    char head[16 + CHAT_NAME_MAX];
+    uint32_t head_len = pm_text_head(head, sizeof(head), from, text_len);
+    int bin = dst->proto == CHAT_PROTO_BIN;
+    uint8_t bin_head[1 + CHAT_VARINT_MAX + CHAT_VARINT_MAX + CHAT_NAME_MAX];
+    if (bin) {
+        // The sender may share no room with dst, so its name travels inline.
+        ChatBinWriter w;
+        chat_bw_init(&w, bin_head, sizeof(bin_head));
+        chat_bw_u8(&w, CHAT_OP_PRIVMSG);
+        chat_bw_varint(&w, from_id);
+        chat_bw_str(&w, from);
+        head_len = w.len;
+    }
+    // The text goes from the receive buffer straight into the frame.
+    OutFrame* f = frame_for_parts(st, dst, bin ? (const void*)bin_head : head, head_len, text, text_len, bin);
+    if (f) {
+        (void)st->send_frame(st, dst, f);
+        outframe_release(f);
+    }
+}
+
+static void handle_pm(ServerState* st, Client* c, const char* target, const char* text, uint32_t text_len) {
+    Client* dst = NULL;
+    // Lookup recipient under lock; the reference keeps it alive after unlock.
+    AcquireSRWLockShared(&st->lock);
+    dst = state_find_client_by_name(st, target);
+    if (dst) client_retain(dst);
+    ReleaseSRWLockShared(&st->lock);
+
+    // Not here: the node that holds the user delivers it.
+    int node = !dst && st->node_id ? peer_user_node(st, target) : 0;
+    if (!dst && !node) {
+        (void)send_err(st, c, "PM", "User not found");
+        return;
+    }
+
+    // A relayed PM must also fit the link's PEER_PM frame, or the other node
+    // would drop the link over it.
+    uint32_t len = pm_frame_len(c->username, text_len);
+    uint32_t relayed = dst ? 0 : peer_pm_len(c->username, target, text_len);
+    if ((relayed > len ? relayed : len) > CHAT_MAX_FRAME) {
+        if (dst) client_release(dst);
+        (void)send_err(st, c, "PM", "Message too long");
+        return;
+    }
+    if (dst) {
+        deliver_pm(st, dst, c->id, c->username, text, text_len);
+        client_release(dst);
+    } else {
+        peer_relay_pm(st, c->username, target, text, text_len);
+    }
+    (void)send_ok(st, c, CHAT_OP_PM);
+}
+
+static void handle_ping(ServerState* st, Client* c) {
+    // Keepalive response.
+    if (c->proto == CHAT_PROTO_BIN) {
+        uint8_t buf[1];
+        ChatBinWriter w;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_PONG);
+        (void)send_bin(st, c, &w);
+    } else {
+        (void)send_text(st, c, "PONG");
+    }
+}
+
+// Report this connection's outbound queue:
+// "QUEUE <frames> <bytes> <hwm_bytes> <dropped> <sent> <writes>".
+static void handle_queue(ServerState* st, Client* c) {
+    EnterCriticalSection(&c->send_lock);
+    uint32_t v[6] = {c->outq.frames, c->outq.bytes, c->outq.hwm_bytes, c->outq.dropped, c->outq.sent,
+        c->outq.writes};
+    LeaveCriticalSection(&c->send_lock);
+    if (c->proto == CHAT_PROTO_BIN) {
+        uint8_t buf[1 + 6 * CHAT_VARINT_MAX];
+        ChatBinWriter w;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_QUEUE_STATS);
+        for (int i = 0; i < 6; i++) chat_bw_varint(&w, v[i]);
+        (void)send_bin(st, c, &w);
+        return;
+    }
+    char out[128];
+    snprintf(out, sizeof(out), "QUEUE %u %u %u %u %u %u", v[0], v[1], v[2], v[3], v[4], v[5]);
+    (void)send_text(st, c, out);
+}
+
+// One POOL line per allocator pool, then OK POOLS. v2 carries 64-bit
+// counters truncated to 32 bits and fragmentation in permille.
+static void handle_pools(ServerState* st, Client* c) {
+    PoolStats stats[32];
+    int n = pool_stats_all(stats, 32);
+    for (int i = 0; i < n; i++) {
+        if (c->proto == CHAT_PROTO_BIN) {
+            uint8_t buf[128];
+            ChatBinWriter w;
+            chat_bw_init(&w, buf, sizeof(buf));
+            chat_bw_u8(&w, CHAT_OP_POOL);
+            chat_bw_str(&w, stats[i].name);
+            chat_bw_varint(&w, stats[i].obj_size);
+            chat_bw_varint(&w, (uint32_t)stats[i].in_use);
+            chat_bw_varint(&w, (uint32_t)stats[i].idle);
+            chat_bw_varint(&w, stats[i].slabs);
+            chat_bw_varint(&w, (uint32_t)stats[i].reserved_bytes);
+            chat_bw_varint(&w, (uint32_t)stats[i].allocs);
+            chat_bw_varint(&w, (uint32_t)(stats[i].frag_pct * 10.0 + 0.5));
+            (void)send_bin(st, c, &w);
+            continue;
+        }
+        char out[160];
+        snprintf(out, sizeof(out), "POOL %s %u %llu %llu %u %llu %llu %.1f", stats[i].name, stats[i].obj_size,
+            (unsigned long long)stats[i].in_use, (unsigned long long)stats[i].idle, stats[i].slabs,
+            (unsigned long long)stats[i].reserved_bytes, (unsigned long long)stats[i].allocs, stats[i].frag_pct);
+        (void)send_text(st, c, out);
+    }
+    (void)send_ok(st, c, CHAT_OP_POOLS);
+}
+
+// Admins only: one STAT line per counter and gauge, one HIST line per
+// histogram with samples (values in ns, fan-out in members), then OK STATS.
+// v2 carries values truncated to 32 bits, as POOL does.
+static void handle_stats(ServerState* st, Client* c) {
+    if (!c->admin) {
+        (void)send_err(st, c, "STATS", "Not permitted");
+        return;
+    }
+    MetricsView v;
+    metrics_read(st, &v);
+    const char* names[5 + MET_COUNTERS] = {"uptime_ms", "connections", "handshakes", "users", "rooms"};
+    uint64_t values[5 + MET_COUNTERS] = {v.uptime_ms, v.connections, v.handshakes, v.users, v.rooms};
+    for (int i = 0; i < MET_COUNTERS; i++) {
+        names[5 + i] = metrics_counter_name((MetricCounter)i);
+        values[5 + i] = v.counters[i];
+    }
+    int bin = c->proto == CHAT_PROTO_BIN;
+    for (int i = 0; i < 5 + MET_COUNTERS; i++) {
+        if (bin) {
+            uint8_t buf[64];
+            ChatBinWriter w;
+            chat_bw_init(&w, buf, sizeof(buf));
+            chat_bw_u8(&w, CHAT_OP_STAT);
+            chat_bw_str(&w, names[i]);
+            chat_bw_varint(&w, (uint32_t)values[i]);
+            (void)send_bin(st, c, &w);
+            continue;
+        }
+        char out[96];
+        snprintf(out, sizeof(out), "STAT %s %llu", names[i], (unsigned long long)values[i]);
+        (void)send_text(st, c, out);
+    }
+    for (int h = 0; h < MET_HISTS; h++) {
+        const MetricsSummary* m = &v.hists[h];
+        if (!m->count) continue;
+        char name[32];
+        metrics_hist_name((MetricHist)h, name, sizeof(name));
+        if (bin) {
+            uint8_t buf[96];
+            ChatBinWriter w;
+            chat_bw_init(&w, buf, sizeof(buf));
+            chat_bw_u8(&w, CHAT_OP_HIST);
+            chat_bw_str(&w, name);
+            chat_bw_varint(&w, (uint32_t)m->count);
+            chat_bw_varint(&w, (uint32_t)m->p50);
+            chat_bw_varint(&w, (uint32_t)m->p90);
+            chat_bw_varint(&w, (uint32_t)m->p99);
+            chat_bw_varint(&w, (uint32_t)m->max);
+            (void)send_bin(st, c, &w);
+            continue;
+        }
+        char out[192];
+        snprintf(out, sizeof(out), "HIST %s %llu %llu %llu %llu %llu", name, (unsigned long long)m->count,
+            (unsigned long long)m->p50, (unsigned long long)m->p90, (unsigned long long)m->p99,
+            (unsigned long long)m->max);
+        (void)send_text(st, c, out);
+    }
+    (void)send_ok(st, c, CHAT_OP_STATS);
+}
+
+// v1: parse command text in place and dispatch through the command registry.
+// *id names the command for its handling-time histogram.
+static int handle_text_frame(ServerState* st, Client* c, char* payload, uint32_t payload_len, ChatCmdId* id) {
+    ChatCmd cmd;
+    if (!chat_cmd_parse(payload, payload_len, &cmd) || !cmd.cmd) {
+        (void)send_err(st, c, "BAD", "Malformed command");
+        return 1;
+    }
+
+    const ChatCmdSpec* spec = chat_cmd_lookup(cmd.cmd, cmd.cmd_len);
+    if (spec) *id = spec->id;
+    trace_stage(CHAT_TRACE_PARSE, *id);
+    if (!c->authed) {
+        if (spec && spec->id == CHAT_CMD_HELLO) {
+            trace_stage(CHAT_TRACE_DISPATCH, *id);
+            handle_hello(st, c, cmd.arg1, cmd.arg2);
+            return 1;
+        }
+        if (spec && spec->id == CHAT_CMD_NODE && chat_cmd_check(spec, &cmd)) {
+            trace_stage(CHAT_TRACE_DISPATCH, *id);
+            return peer_accept(st, c, cmd.arg1, cmd.arg2);
+        }
+        if (!spec || spec->id != CHAT_CMD_AUTH || !chat_cmd_check(spec, &cmd)) {
+            (void)send_err(st, c, "AUTH", "Expected AUTH username password");
+            return 1;
+        }
+        trace_stage(CHAT_TRACE_DISPATCH, *id);
+        return handle_auth(st, c, cmd.arg1, cmd.arg2);
+    }
+
+    if (!spec || (spec->flags & CHAT_CMD_PREAUTH)) {
+        (void)send_err(st, c, "CMD", "Unknown command");
+        return 1;
+    }
+    if (!chat_cmd_check(spec, &cmd)) {
+        (void)send_err(st, c, spec->name, spec->usage);
+        return 1;
+    }
+    trace_stage(CHAT_TRACE_DISPATCH, *id);
+    switch (spec->id) {
+    case CHAT_CMD_JOIN:
+        handle_join(st, c, cmd.arg1);
+        break;
+    case CHAT_CMD_LEAVE:
+        handle_leave(st, c, cmd.arg1, 0);
+        break;
+    case CHAT_CMD_MSG:
+        handle_msg(st, c, client_find_link(c, cmd.arg1), cmd.arg1, cmd.text, cmd.text_len);
+        break;
+    case CHAT_CMD_PM:
+        handle_pm(st, c, cmd.arg1, cmd.text, cmd.text_len);
+        break;
+    case CHAT_CMD_HISTORY: {
+        // "HISTORY room [count]"; without a count, everything kept.
+        char* end = NULL;
+        long count = cmd.arg2 ? strtol(cmd.arg2, &end, 10) : 0;
+        if (cmd.arg2 && (*end != 0 || count <= 0)) {
+            (void)send_err(st, c, spec->name, spec->usage);
+            break;
+        }
+        if (count > (long)CHAT_HISTORY_MAX) count = CHAT_HISTORY_MAX;
+        handle_history(st, c, client_find_joined(c, cmd.arg1), (uint32_t)count);
+        break;
+    }
+    case CHAT_CMD_PING:
+        handle_ping(st, c);
+        break;
+    case CHAT_CMD_QUEUE:
+        handle_queue(st, c);
+        break;
+    case CHAT_CMD_POOLS:
+        handle_pools(st, c);
+        break;
+    case CHAT_CMD_STATS:
+        handle_stats(st, c);
+        break;
+    default:
+        (void)send_err(st, c, "CMD", "Unknown command");
+        break;
+    }
+    return 1;
+}
+
+// The v1 command a v2 request opcode stands for.
+static ChatCmdId cmd_of_op(uint8_t op) {
+    switch (op) {
+    case CHAT_OP_AUTH:
+        return CHAT_CMD_AUTH;
+    case CHAT_OP_JOIN:
+        return CHAT_CMD_JOIN;
+    case CHAT_OP_LEAVE:
+        return CHAT_CMD_LEAVE;
+    case CHAT_OP_MSG:
+        return CHAT_CMD_MSG;
+    case CHAT_OP_PM:
+        return CHAT_CMD_PM;
+    case CHAT_OP_PING:
+        return CHAT_CMD_PING;
+    case CHAT_OP_QUEUE:
+        return CHAT_CMD_QUEUE;
+    case CHAT_OP_POOLS:
+        return CHAT_CMD_POOLS;
+    case CHAT_OP_HISTORY:
+        return CHAT_CMD_HISTORY;
+    case CHAT_OP_STATS:
+        return CHAT_CMD_STATS;
+    }
+    return CHAT_CMD_NONE;
+}
+
+// v2: decode the opcode's fields in place and dispatch by opcode.
+static int handle_bin_frame(ServerState* st, Client* c, uint8_t* payload, uint32_t payload_len, ChatCmdId* id) {
+    ChatBinReader rd;
+    chat_br_init(&rd, payload, payload_len);
+    uint8_t op = chat_br_u8(&rd);
+    if (rd.bad) {
+        (void)send_err(st, c, "BAD", "Malformed command");
+        return 1;
+    }
+    *id = cmd_of_op(op);
+    trace_stage(CHAT_TRACE_PARSE, *id);
+
+    if (!c->authed) {
+        const char* user = op == CHAT_OP_AUTH ? chat_br_str(&rd) : NULL;
+        const char* password = user ? chat_br_str(&rd) : NULL;
+        if (!password) {
+            (void)send_err(st, c, "AUTH", "Expected AUTH username password");
+            return 1;
+        }
+        trace_stage(CHAT_TRACE_DISPATCH, *id);
+        return handle_auth(st, c, user, password);
+    }
+
+    trace_stage(CHAT_TRACE_DISPATCH, *id);
+    switch (op) {
+    case CHAT_OP_JOIN: {
+        const char* room = chat_br_str(&rd);
+        if (room) handle_join(st, c, room);
+        else (void)send_err(st, c, "JOIN", "Missing room");
+        break;
+    }
+    case CHAT_OP_LEAVE: {
+        uint32_t room = chat_br_varint(&rd);
+        if (!rd.bad) handle_leave(st, c, NULL, room);
+        else (void)send_err(st, c, "LEAVE", "Missing room");
+        break;
+    }
+    case CHAT_OP_MSG: {
+        uint32_t room = chat_br_varint(&rd);
+        const char* text = chat_br_text(&rd);
+        RoomLink* link = text ? client_find_link_id(c, room) : NULL;
+        if (text) handle_msg(st, c, link, link ? link->room->name : NULL, text, (uint32_t)strlen(text));
+        else (void)send_err(st, c, "MSG", "Expected MSG room :text");
+        break;
+    }
+    case CHAT_OP_PM: {
+        const char* user = chat_br_str(&rd);
+        const char* text = chat_br_text(&rd);
+        if (user && text) handle_pm(st, c, user, text, (uint32_t)strlen(text));
+        else (void)send_err(st, c, "PM", "Expected PM user :text");
+        break;
+    }
+    case CHAT_OP_HISTORY: {
+        uint32_t room = chat_br_varint(&rd);
+        uint32_t count = chat_br_varint(&rd);
+        if (!rd.bad) handle_history(st, c, client_find_joined_id(c, room), count);
+        else (void)send_err(st, c, "HISTORY", "Expected HISTORY room count");
+        break;
+    }
+    case CHAT_OP_PING:
+        handle_ping(st, c);
+        break;
+    case CHAT_OP_QUEUE:
+        handle_queue(st, c);
+        break;
+    case CHAT_OP_POOLS:
+        handle_pools(st, c);
+        break;
+    case CHAT_OP_STATS:
+        handle_stats(st, c);
+        break;
+    default:
+        (void)send_err(st, c, "CMD", "Unknown command");
+        break;
+    }
+    return 1;
+}
+
+// Times every frame, parsing included, under the command it turned out to be.
+static int handle_plain_frame(ServerState* st, Client* c, char* payload, uint32_t payload_len) {
+    ChatCmdId id = CHAT_CMD_NONE;
+    uint64_t t0 = chat_now_ns();
+    int keep = c->proto == CHAT_PROTO_BIN ? handle_bin_frame(st, c, (uint8_t*)payload, payload_len, &id)
+                                          : handle_text_frame(st, c, payload, payload_len, &id);
+    metrics_record((MetricHist)(MET_HIST_CMD_NS + id), chat_now_ns() - t0);
+    return keep;
+}
+
+// Inflate a packed frame into a scratch buffer and handle what it held.
+static int handle_packed_frame(ServerState* st, Client* c, const uint8_t* payload, uint32_t payload_len) {
+    uint32_t len = chat_zip_packed_len(payload, payload_len);
+    uint8_t* buf = len > 0 && len <= CHAT_MAX_FRAME ? (uint8_t*)buf_alloc(len + 1u) : NULL;
+    ChatZip* z = buf ? zip_acquire() : NULL;
+    int ok = z && chat_zip_unpack(z, payload, payload_len, buf, len);
+    zip_release(z);
+    if (!ok) {
+        if (buf) buf_free(buf, len + 1u);
+        (void)send_err(st, c, "BAD", "Malformed compressed frame");
+        return 1;
+    }
+    buf[len] = 0; // Handlers rely on the terminator, as with decoded frames.
+    int keep = handle_plain_frame(st, c, (char*)buf, len);
+    buf_free(buf, len + 1u);
+    return keep;
+}
+
+int server_handle_frame(ServerState* st, Client* c, char* payload, uint32_t payload_len) {
+    metrics_add(MET_FRAMES_IN, 1);
+    metrics_add(MET_BYTES_IN, payload_len);
+    trace_frame_begin(c->id, payload_len);
+    int keep = c->peer ? peer_handle_frame(st, c, (uint8_t*)payload, payload_len)
+               : c->zip && payload_len > 0 && (uint8_t)payload[0] == CHAT_ZIP_MARK
+                   ? handle_packed_frame(st, c, (const uint8_t*)payload, payload_len)
+                   : handle_plain_frame(st, c, payload, payload_len);
+    trace_frame_end();
+    return keep;
+}
+
+void server_on_disconnect(ServerState* st, Client* c) {
+    state_remove_client(st, c);
+    metrics_add(MET_DISCONNECTS, 1);
+    if (c->peer) {
+        peer_link_closed(st, c);
+        return;
+    }
+
+    EnterCriticalSection(&c->send_lock);
+    uint32_t hwm = c->outq.hwm_bytes;
+    uint32_t dropped = c->outq.dropped;
+    LeaveCriticalSection(&c->send_lock);
+
+    if (c->authed) {
+        broadcast_user_leave(st, c);
+        printf("Disconnected: %s (queue hwm %u bytes, %u dropped)\n", c->username, hwm, dropped);
+    } else {
+        printf("Disconnected (unauth)\n");
+    }
+}
@@ -0,0 +1,115 @@
+#include "server.h"
+
+#include <stdlib.h>
+
+// Epoch-based reclamation. Each reader thread owns a slot announcing the
+// global epoch it entered under. The epoch only advances once every active
+// reader has caught up with it, so an object retired in epoch e can no
+// longer be referenced by anyone once the epoch reaches e + 2. Retired
+// objects are batched, so the slot scan is amortized over many retires.
+
+#define EPOCH_BATCH 32 // Pending retires before an advance is attempted.
+
+typedef struct EpochSlot {
+    volatile int32_t active; // Inside an epoch_enter/epoch_exit section.
+    volatile int32_t epoch; // Global epoch observed on entry.
+    int in_use; // Claimed by a live thread; guarded by epoch_lock.
+    struct EpochSlot* next;
+} EpochSlot;
+
+static CRITICAL_SECTION epoch_lock; // Guards the slot list and limbo.
+static volatile int32_t global_epoch;
+static EpochSlot* slots;
+static EpochNode* limbo; // Retired objects, newest first.
+static int limbo_count;
+static CHAT_THREAD_LOCAL EpochSlot* self;
+
+void epoch_init(void) {
+    InitializeCriticalSection(&epoch_lock);
+}
+
+static EpochSlot* epoch_claim_slot(void) {
+    EnterCriticalSection(&epoch_lock);
+    EpochSlot* s = slots;
+    while (s && s->in_use) s = s->next;
+    if (!s) {
+        s = (EpochSlot*)calloc(1, sizeof(*s));
+        if (s) {
+            s->next = slots;
+            slots = s;
+        }
+    }
+    if (s) s->in_use = 1;
+    LeaveCriticalSection(&epoch_lock);
+    self = s;
+    return s;
+}
+
+int epoch_enter(void) {
+    EpochSlot* s = self ? self : epoch_claim_slot();
+    if (!s) return 0;
+    s->epoch = chat_atomic_load(&global_epoch);
+    // Full barrier: the announcement is visible before any pointer is read.
+    (void)chat_atomic_xchg(&s->active, 1);
+    return 1;
+}
+
+void epoch_exit(void) {
+    (void)chat_atomic_xchg(&self->active, 0);
+}
+
+// Advance if every active reader is in the current epoch; caller holds epoch_lock.
+static int epoch_try_advance(void) {
+    int32_t e = chat_atomic_load(&global_epoch);
+    for (EpochSlot* s = slots; s; s = s->next) {
+        if (chat_atomic_load(&s->active) && chat_atomic_load(&s->epoch) != e) return 0;
+    }
+    (void)chat_atomic_add(&global_epoch, 1);
+    return 1;
+}
+
+// Detach objects retired at least two epochs ago; caller holds epoch_lock.
+static EpochNode* epoch_collect(void) {
+    int32_t e = chat_atomic_load(&global_epoch);
+    EpochNode** link = &limbo;
+    while (*link && (int32_t)(e - (*link)->epoch) < 2) link = &(*link)->next;
+    EpochNode* ready = *link;
+    *link = NULL;
+    for (EpochNode* n = ready; n; n = n->next) limbo_count--;
+    return ready;
+}
+
+// Free collected objects outside the lock; destructors may release clients.
+static void epoch_free_all(EpochNode* n) {
+    while (n) {
+        EpochNode* next = n->next;
+        n->free_fn(n);
+        n = next;
+    }
+}
+
+void epoch_retire(EpochNode* n, void (*free_fn)(EpochNode* n)) {
+    EnterCriticalSection(&epoch_lock);
+    n->epoch = chat_atomic_load(&global_epoch);
+    n->free_fn = free_fn;
+    n->next = limbo;
+    limbo = n;
+    limbo_count++;
+    EpochNode* ready = NULL;
+    if (limbo_count >= EPOCH_BATCH && epoch_try_advance()) ready = epoch_collect();
+    LeaveCriticalSection(&epoch_lock);
+    epoch_free_all(ready);
+}
+
+void epoch_thread_exit(void) {
+    if (!self) return;
+    EnterCriticalSection(&epoch_lock);
+    self->active = 0;
+    self->in_use = 0;
+    self = NULL;
+    // Exiting threads also drive reclamation, so a quiet server still drains.
+    EpochNode* ready = NULL;
+    if (limbo && epoch_try_advance()) ready = epoch_collect();
+    LeaveCriticalSection(&epoch_lock);
+    epoch_free_all(ready);
+}
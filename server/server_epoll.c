@@ -0,0 +1,680 @@
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "chat_frame.h"
+
+// Linux epoll reactor backend. Each reactor thread owns one listening
+// socket (SO_REUSEPORT siblings spread accepts across them) and every
+// connection it accepts. Sockets are non-blocking and registered
+// edge-triggered for both directions once, so a connection costs no
+// syscalls while idle and no stack. Frames are reassembled incrementally
+// and handed to the shared command state machine.
+//
+// Room membership is split per shard. A broadcast delivers to the local
+// shard's members directly and posts one message per other interested
+// shard to that shard's lock-free inbox; PMs to clients on another shard
+// go through the owner's inbox the same way. Only a client's own reactor
+// ever writes to its socket, and it does so once per loop pass, after all
+// ready events are handled, so a burst of frames costs one syscall.
+//
+// With a flush window (--flush-us), clients that only collected room
+// traffic in a pass are held instead, and a one-shot timerfd armed when the
+// first one is held flushes them all when the window closes. Direct frames
+// and a queue past flush_bytes still flush at the end of the pass.
+//
+// Connections run HELLO/AUTH through the same state machine as any other
+// command. Until they authenticate they are pending handshakes, listed per
+// reactor in accept order. A reactor stops accepting while max_handshakes
+// are pending anywhere and leaves the rest in the kernel's backlog. It
+// resumes at the end of a pass, or on its handshake timer, once there is
+// room again. The timer runs only while the reactor has handshakes pending
+// or is paused, and closes those older than handshake_ms.
+
+#define REACTOR_BATCH 256 // Events handled per epoll_wait.
+#define REACTOR_READ_CHUNK (64u * 1024u) // Per-reactor receive scratch size.
+#define HANDSHAKE_TICK_MS 50 // Handshake timer period while it runs.
+
+typedef enum ShardMsgKind {
+    SHARD_ROOM, // Deliver to this shard's members of room.
+    SHARD_DIRECT, // Deliver to one client owned by this shard.
+    SHARD_CLOSE, // Close one client owned by this shard.
+    SHARD_AUTH, // The verifier pool finished the AUTH of one client owned by this shard.
+} ShardMsgKind;
+
+typedef struct ShardMsg {
+    struct ShardMsg* volatile next;
+    ShardMsgKind kind;
+    Room* room; // Holds a reference for SHARD_ROOM.
+    Client* client; // Holds a reference for SHARD_DIRECT, SHARD_CLOSE and SHARD_AUTH.
+    OutFrames frames; // Holds a reference to each; recipients pick theirs.
+} ShardMsg;
+
+// Intrusive multi-producer/single-consumer queue (Vyukov). Producers
+// only swap the head; the owning reactor is the sole consumer.
+typedef struct ShardInbox {
+    ShardMsg* volatile head;
+    ShardMsg* tail;
+    ShardMsg stub;
+    volatile int32_t wake_pending; // Set while an eventfd wakeup is outstanding.
+    int wake_fd;
+} ShardInbox;
+
+typedef struct Reactor {
+    ServerState* st;
+    int index;
+    int epfd;
+    SOCKET listen_sock;
+    ShardInbox inbox;
+    Client* dirty; // Clients with frames queued during this pass.
+    Client* held; // Clients waiting for the flush tick.
+    int tick_fd; // One-shot flush timer; -1 without a flush window.
+    Client* hs_head; // Pending handshakes, oldest first.
+    Client* hs_tail;
+    int accept_paused; // Connections left in the backlog; retried on the handshake timer.
+    int sweep_fd; // Periodic handshake timer.
+    int sweep_armed;
+    uint8_t rbuf[REACTOR_READ_CHUNK];
+} Reactor;
+
+typedef struct ReactorSet {
+    Reactor** reactors;
+    int count;
+} ReactorSet;
+
+// Tags for non-client epoll registrations.
+static char listen_tag;
+static char wake_tag;
+static char tick_tag;
+static char sweep_tag;
+
+// Reactor running on the calling thread (NULL off reactor threads).
+static CHAT_THREAD_LOCAL Reactor* current_reactor;
+
+static Reactor* reactor_for_shard(ServerState* st, int shard) {
+    return ((ReactorSet*)st->backend)->reactors[shard];
+}
+
+static void inbox_init(ShardInbox* q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->wake_pending = 0;
+}
+
+static void inbox_push_node(ShardInbox* q, ShardMsg* m) {
+    m->next = NULL;
+    ShardMsg* prev = (ShardMsg*)chat_atomic_xchg_ptr(&q->head, m);
+    chat_atomic_store_ptr(&prev->next, m);
+}
+
+// Pop one message; NULL when empty or a producer is mid-push (it will wake us).
+static ShardMsg* inbox_pop(ShardInbox* q) {
+    ShardMsg* tail = q->tail;
+    ShardMsg* next = (ShardMsg*)chat_atomic_load_ptr(&tail->next);
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = (ShardMsg*)chat_atomic_load_ptr(&tail->next);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != (ShardMsg*)chat_atomic_load_ptr(&q->head)) return NULL;
+    inbox_push_node(q, &q->stub);
+    next = (ShardMsg*)chat_atomic_load_ptr(&tail->next);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Post to another shard and wake it if it isn't already scheduled to drain.
+// The message takes its own references on the frames and r.
+static int inbox_post(Reactor* dst, ShardMsgKind kind, Room* r, Client* c, const OutFrames* fs) {
+    ShardMsg* m = (ShardMsg*)buf_alloc(sizeof(*m));
+    if (!m) return 0;
+    outframes_retain(fs);
+    if (r) room_retain(r);
+    m->kind = kind;
+    m->room = r;
+    m->client = c;
+    m->frames = *fs;
+    inbox_push_node(&dst->inbox, m);
+
+    if (chat_atomic_xchg(&dst->inbox.wake_pending, 1) == 0) {
+        uint64_t one = 1;
+        (void)!write(dst->inbox.wake_fd, &one, sizeof(one));
+    }
+    return 1;
+}
+
+// Queue c for the end-of-pass flush (takes a reference).
+static void reactor_mark_dirty(Reactor* rx, Client* c) {
+    if (c->flush_queued) return;
+    client_retain(c);
+    c->flush_queued = 1;
+    c->flush_next = rx->dirty;
+    rx->dirty = c;
+}
+
+// Queue one frame for a client owned by the calling reactor. Writes are
+// deferred to the end of the pass so every frame a client collects in one
+// pass goes out in a single gather write; what the socket refuses then is
+// finished on EPOLLOUT.
+static int reactor_send_local(ServerState* st, Client* c, OutFrame* f, int urgent) {
+    if (c->dead) return 0;
+    if (!outq_push(st, &c->outq, f)) c->dead = 1;
+    if (urgent) c->flush_urgent = 1;
+    reactor_mark_dirty(current_reactor, c);
+    return !c->dead;
+}
+
+static int reactor_send_frame(ServerState* st, Client* c, OutFrame* f) {
+    Reactor* self = current_reactor;
+    if (self && c->shard == self->index) return reactor_send_local(st, c, f, 1);
+
+    // Owned by another reactor: hand it over with a reference on the client.
+    OutFrames fs = {NULL, NULL, NULL, NULL};
+    if (c->proto == CHAT_PROTO_BIN) fs.bin = f;
+    else fs.text = f;
+    client_retain(c);
+    if (!inbox_post(reactor_for_shard(st, c->shard), SHARD_DIRECT, NULL, c, &fs)) {
+        client_release(c);
+        return 0;
+    }
+    return 1;
+}
+
+static void deliver_room_local(ServerState* st, Room* r, int shard, const OutFrames* fs) {
+    RoomShard* rs = &r->shards[shard];
+    for (int i = 0; i < rs->member_count; i++) {
+        Client* m = rs->members[i];
+        OutFrame* f = outframes_pick(fs, m);
+        if (f) (void)reactor_send_local(st, m, f, 0);
+    }
+}
+
+static void reactor_broadcast(ServerState* st, Room* r, const OutFrames* fs) {
+    // Off the reactors (the backplane consumer) every shard is remote.
+    int self = current_reactor ? current_reactor->index : -1;
+    if (self >= 0) deliver_room_local(st, r, self, fs);
+
+    // Every other interested shard gets a reference to the same frames.
+    uint64_t remote = chat_atomic_load64(&r->shard_mask);
+    if (self >= 0) remote &= ~(1ull << self);
+    for (int k = 0; remote && k < st->nshards; k++) {
+        if (remote & (1ull << k)) (void)inbox_post(reactor_for_shard(st, k), SHARD_ROOM, r, NULL, fs);
+    }
+}
+
+// Close a client owned by rx at the end of the pass, after offering the
+// socket what is queued.
+static void reactor_kick_local(Reactor* rx, Client* c) {
+    if (c->sock == INVALID_SOCKET) return;
+    if (!c->dead) (void)outq_flush(&c->outq, c->sock);
+    c->dead = 1;
+    reactor_mark_dirty(rx, c);
+}
+
+static void reactor_kick(ServerState* st, Client* c) {
+    Reactor* self = current_reactor;
+    if (self && c->shard == self->index) {
+        reactor_kick_local(self, c);
+        return;
+    }
+    OutFrames fs = {NULL, NULL, NULL, NULL};
+    client_retain(c);
+    if (!inbox_post(reactor_for_shard(st, c->shard), SHARD_CLOSE, NULL, c, &fs)) client_release(c);
+}
+
+static void reactor_auth_resume(Reactor* rx, Client* c);
+
+// Deliver everything other shards have posted to this one.
+static void reactor_drain_inbox(Reactor* rx) {
+    uint64_t count = 0;
+    (void)!read(rx->inbox.wake_fd, &count, sizeof(count));
+    chat_atomic_xchg(&rx->inbox.wake_pending, 0);
+
+    ShardMsg* m;
+    while ((m = inbox_pop(&rx->inbox)) != NULL) {
+        if (m->kind == SHARD_ROOM) {
+            deliver_room_local(rx->st, m->room, rx->index, &m->frames);
+            room_release(m->room);
+        } else if (m->kind == SHARD_CLOSE) {
+            reactor_kick_local(rx, m->client);
+            client_release(m->client);
+        } else if (m->kind == SHARD_AUTH) {
+            reactor_auth_resume(rx, m->client);
+            client_release(m->client);
+        } else {
+            OutFrame* f = outframes_pick(&m->frames, m->client);
+            if (f) (void)reactor_send_local(rx->st, m->client, f, 1);
+            client_release(m->client);
+        }
+        outframes_release(&m->frames);
+        buf_free(m, sizeof(*m));
+    }
+}
+
+// Run the handshake timer while anything is pending here or accepting is
+// paused.
+static void reactor_sweep_arm(Reactor* rx, int on) {
+    if (rx->sweep_armed == on) return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_value.tv_nsec = HANDSHAKE_TICK_MS * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    if (timerfd_settime(rx->sweep_fd, 0, &its, NULL) == 0) rx->sweep_armed = on;
+}
+
+static void handshake_push(Reactor* rx, Client* c) {
+    handshake_begin(rx->st, c);
+    c->hs_next = NULL;
+    c->hs_prev = rx->hs_tail;
+    if (rx->hs_tail) rx->hs_tail->hs_next = c;
+    else rx->hs_head = c;
+    rx->hs_tail = c;
+    reactor_sweep_arm(rx, 1);
+}
+
+// c authenticated or is closing.
+static void handshake_pop(Reactor* rx, Client* c) {
+    if (!c->handshaking) return;
+    if (c->hs_prev) c->hs_prev->hs_next = c->hs_next;
+    else rx->hs_head = c->hs_next;
+    if (c->hs_next) c->hs_next->hs_prev = c->hs_prev;
+    else rx->hs_tail = c->hs_prev;
+    c->hs_next = NULL;
+    c->hs_prev = NULL;
+    handshake_end(rx->st, c);
+}
+
+// Dispatch every complete frame in c's decoder; returns 0 to close. An
+// AUTH handed to the verifier pool stops it: the rest is parked until the
+// result comes back.
+static int reactor_frames(ServerState* st, Client* c) {
+    for (;;) {
+        if (c->auth_job) {
+            if (!client_park_input(c)) return 0;
+            auth_queue(st, c);
+            return 1;
+        }
+        uint8_t* payload = NULL;
+        uint32_t len = 0;
+        int r = chat_decoder_next(&c->in, &payload, &len);
+        if (r <= 0) {
+            if (r == 0) client_unpark(c);
+            return r == 0;
+        }
+        if (!server_handle_frame(st, c, (char*)payload, len) || c->dead) return 0;
+    }
+}
+
+// Drain the socket until EAGAIN (required for edge-triggered mode), or
+// until an AUTH is being verified; reading resumes with its result.
+static int reactor_read(Reactor* rx, Client* c) {
+    for (;;) {
+        if (c->auth_job) return 1;
+        // One spare byte lets the decoder NUL-terminate a frame in place.
+        ssize_t n = recv(c->sock, rx->rbuf, sizeof(rx->rbuf) - 1, 0);
+        if (n > 0) {
+            trace_read_done();
+            chat_decoder_feed(&c->in, rx->rbuf, (size_t)n);
+            if (!reactor_frames(rx->st, c)) return 0;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+// Hand a verified AUTH back to the reactor that owns c; see
+// ServerAuthDoneFn. The message carries the job's reference.
+static void reactor_auth_done(ServerState* st, Client* c) {
+    OutFrames fs = {NULL, NULL, NULL, NULL};
+    // The verifier thread can afford to wait for memory; c cannot be dropped.
+    while (!inbox_post(reactor_for_shard(st, c->shard), SHARD_AUTH, NULL, c, &fs)) Sleep(1);
+}
+
+// Reply to c's verified AUTH, then take up the frames parked behind it and
+// what the socket has received since. Runs mid-pass like the timers, so a
+// client to close is left for the end-of-pass flush, its final reply (a
+// rejected AUTH) written first as reactor_close would.
+static void reactor_auth_resume(Reactor* rx, Client* c) {
+    int alive = auth_finish(rx->st, c);
+    // Closed while it was being verified.
+    if (c->sock == INVALID_SOCKET) return;
+    if (alive) alive = reactor_frames(rx->st, c);
+    if (alive) alive = reactor_read(rx, c);
+    if (!alive || c->dead) {
+        if (!c->dead) (void)outq_flush(&c->outq, c->sock);
+        c->dead = 1;
+        reactor_mark_dirty(rx, c);
+    } else if (c->handshaking && handshake_done(c)) {
+        handshake_pop(rx, c);
+    }
+}
+
+static void reactor_close(Reactor* rx, Client* c) {
+    // Best effort: a final reply (e.g. a rejected AUTH) may still be queued.
+    if (!c->dead) (void)outq_flush(&c->outq, c->sock);
+    c->dead = 1;
+    handshake_pop(rx, c);
+    epoll_ctl(rx->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    shutdown(c->sock, SD_BOTH);
+    closesocket(c->sock);
+    c->sock = INVALID_SOCKET; // Marks it closed for a pending flush.
+
+    server_on_disconnect(rx->st, c);
+    client_release(c);
+}
+
+// Hold a client's queue until the flush tick; the first hold arms the timer
+// so nothing waits longer than the window.
+static void reactor_hold(Reactor* rx, Client* c) {
+    if (c->held) return;
+    if (!rx->held) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = rx->st->flush_us / 1000000u;
+        its.it_value.tv_nsec = (long)(rx->st->flush_us % 1000000u) * 1000;
+        if (timerfd_settime(rx->tick_fd, 0, &its, NULL) != 0) {
+            if (!outq_flush(&c->outq, c->sock)) c->dead = 1;
+            return;
+        }
+    }
+    client_retain(c);
+    c->held = 1;
+    c->held_next = rx->held;
+    rx->held = c;
+}
+
+// Write out everything queued during this pass: one gather write per client
+// however many frames it collected, unless the flush window lets it wait.
+// Closing a client may queue more.
+static void reactor_flush_dirty(Reactor* rx) {
+    ServerState* st = rx->st;
+    while (rx->dirty) {
+        Client* c = rx->dirty;
+        rx->dirty = c->flush_next;
+        c->flush_queued = 0;
+        int urgent = c->flush_urgent;
+        c->flush_urgent = 0;
+        if (c->sock != INVALID_SOCKET) {
+            if (c->dead) {
+                reactor_close(rx, c);
+            } else if (st->flush_us && !urgent && c->outq.bytes < st->flush_bytes) {
+                reactor_hold(rx, c);
+                if (c->dead) reactor_close(rx, c);
+            } else {
+                if (!outq_flush(&c->outq, c->sock)) c->dead = 1;
+                if (c->dead) reactor_close(rx, c);
+            }
+        }
+        client_release(c);
+    }
+}
+
+// The flush window closed: write out every held client. Runs mid-pass, when
+// other events for these clients may still be pending, so a failed one is
+// left for the end-of-pass flush to close.
+static void reactor_tick(Reactor* rx) {
+    uint64_t expirations = 0;
+    (void)!read(rx->tick_fd, &expirations, sizeof(expirations));
+    Client* c = rx->held;
+    rx->held = NULL;
+    while (c) {
+        Client* next = c->held_next;
+        c->held = 0;
+        if (c->sock != INVALID_SOCKET && !c->dead && !outq_flush(&c->outq, c->sock)) {
+            c->dead = 1;
+            reactor_mark_dirty(rx, c);
+        }
+        client_release(c);
+        c = next;
+    }
+}
+
+// Accept every pending connection (listener is edge-triggered too), or as
+// many as admission allows; the handshake timer retries the rest.
+static void reactor_accept(Reactor* rx) {
+    for (;;) {
+        if (!handshake_admit(rx->st)) {
+            if (!rx->accept_paused) metrics_add(MET_ACCEPT_PAUSES, 1);
+            rx->accept_paused = 1;
+            reactor_sweep_arm(rx, 1);
+            return;
+        }
+        SOCKET s = accept4(rx->listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            rx->accept_paused = errno != EAGAIN && errno != EWOULDBLOCK;
+            if (errno == EMFILE || errno == ENFILE) printf("accept: out of file descriptors\n");
+            if (rx->accept_paused) reactor_sweep_arm(rx, 1);
+            return;
+        }
+
+        Client* c = client_new();
+        if (!c) {
+            closesocket(s);
+            continue;
+        }
+        c->sock = s;
+        c->shard = rx->index;
+        // Writes are batched here, so Nagle would only add delay.
+        (void)chat_socket_set_nodelay(s);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+            closesocket(s);
+            client_release(c);
+            continue;
+        }
+
+        handshake_push(rx, c);
+        state_add_client(rx->st, c);
+        server_on_connect(rx->st, c);
+        printf("Client connected\n");
+    }
+}
+
+// Handshake timer: close what has not authenticated in time, and retry a
+// paused accept. An AUTH with the verifier pool is waiting on the server,
+// not the client, so it is not timed out. Runs mid-pass, so the expired
+// are left for the end-of-pass flush to close.
+static void reactor_sweep(Reactor* rx) {
+    uint64_t expirations = 0;
+    (void)!read(rx->sweep_fd, &expirations, sizeof(expirations));
+    uint64_t now = chat_now_ns();
+    uint64_t limit = (uint64_t)rx->st->handshake_ms * 1000000u;
+    for (Client* c = rx->hs_head; c && now - c->accepted_ns >= limit; c = c->hs_next) {
+        if (c->dead || c->auth_job) continue;
+        metrics_add(MET_HANDSHAKE_TIMEOUTS, 1);
+        c->dead = 1;
+        reactor_mark_dirty(rx, c);
+    }
+    if (rx->accept_paused) reactor_accept(rx);
+    reactor_sweep_arm(rx, rx->hs_head || rx->accept_paused);
+}
+
+// Serve a connected socket from any thread; see ServerAdoptFn. Links are
+// spread over the reactors by node id.
+static int reactor_adopt(ServerState* st, Client* c) {
+    ReactorSet* set = (ReactorSet*)st->backend;
+    Reactor* rx = set->reactors[(unsigned)c->peer % (unsigned)set->count];
+    c->shard = rx->index;
+    state_add_client(st, c);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    // The reactor owns c from here and may close it at once.
+    client_retain(c);
+    if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, c->sock, &ev) != 0) {
+        state_remove_client(st, c);
+        client_release(c);
+        return 0;
+    }
+    server_on_connect(st, c);
+    client_release(c);
+    return 1;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL reactor_loop(void* param) {
+    Reactor* rx = (Reactor*)param;
+    current_reactor = rx;
+
+    struct epoll_event events[REACTOR_BATCH];
+    for (;;) {
+        int n = epoll_wait(rx->epfd, events, REACTOR_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* tag = events[i].data.ptr;
+            if (tag == &listen_tag) {
+                reactor_accept(rx);
+                continue;
+            }
+            if (tag == &wake_tag) {
+                reactor_drain_inbox(rx);
+                continue;
+            }
+            if (tag == &tick_tag) {
+                reactor_tick(rx);
+                continue;
+            }
+            if (tag == &sweep_tag) {
+                reactor_sweep(rx);
+                continue;
+            }
+
+            Client* c = (Client*)tag;
+            uint32_t e = events[i].events;
+            int alive = !c->dead;
+            // Read first so a final frame before FIN/RST is still processed.
+            if (alive && (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) alive = reactor_read(rx, c);
+            if (alive && (e & EPOLLOUT)) alive = outq_flush(&c->outq, c->sock);
+            if (!alive || c->dead) reactor_close(rx, c);
+            else if (c->handshaking && handshake_done(c)) handshake_pop(rx, c);
+        }
+        // Handshakes finished this pass may have made room for more.
+        if (rx->accept_paused && handshake_admit(rx->st)) reactor_accept(rx);
+        reactor_flush_dirty(rx);
+    }
+    return 0;
+}
+
+static Reactor* reactor_create(ServerState* st, int index, SOCKET listen_sock) {
+    Reactor* rx = (Reactor*)calloc(1, sizeof(*rx));
+    if (!rx) return NULL;
+    rx->st = st;
+    rx->index = index;
+    rx->listen_sock = listen_sock;
+    inbox_init(&rx->inbox);
+    rx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    rx->inbox.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    rx->tick_fd = st->flush_us ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) : -1;
+    rx->sweep_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (rx->epfd < 0 || rx->inbox.wake_fd < 0 || (st->flush_us && rx->tick_fd < 0) || rx->sweep_fd < 0 ||
+        !chat_socket_set_nonblocking(listen_sock))
+        goto fail;
+
+    // Listener and wakeup fd carry tags; clients carry their Client*.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, listen_sock, &ev) != 0) goto fail;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, rx->inbox.wake_fd, &ev) != 0) goto fail;
+    ev.data.ptr = &tick_tag;
+    if (rx->tick_fd >= 0 && epoll_ctl(rx->epfd, EPOLL_CTL_ADD, rx->tick_fd, &ev) != 0) goto fail;
+    ev.data.ptr = &sweep_tag;
+    if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, rx->sweep_fd, &ev) != 0) goto fail;
+    return rx;
+
+fail:
+    if (rx->epfd >= 0) close(rx->epfd);
+    if (rx->inbox.wake_fd >= 0) close(rx->inbox.wake_fd);
+    if (rx->tick_fd >= 0) close(rx->tick_fd);
+    if (rx->sweep_fd >= 0) close(rx->sweep_fd);
+    free(rx);
+    return NULL;
+}
+
+// Allow one process to hold as many sockets as the hard limit permits.
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    printf("File descriptor limit: %llu\n", (unsigned long long)rl.rlim_cur);
+}
+
+int server_run_epoll(ServerState* st, SOCKET* listen_socks, int count) {
+    if (count < 1 || count > CHAT_MAX_SHARDS) return 1;
+    raise_fd_limit();
+
+    ReactorSet* set = (ReactorSet*)calloc(1, sizeof(*set));
+    Reactor** reactors = (Reactor**)calloc((size_t)count, sizeof(*reactors));
+    if (!set || !reactors) {
+        free(set);
+        free(reactors);
+        return 1;
+    }
+    set->reactors = reactors;
+    set->count = count;
+
+    st->nshards = count;
+    st->backend = set;
+
+    for (int i = 0; i < count; i++) {
+        reactors[i] = reactor_create(st, i, listen_socks[i]);
+        if (!reactors[i]) {
+            printf("epoll setup failed\n");
+            return 1;
+        }
+    }
+
+    // The peer dialer and the backplane consumer start using these as soon
+    // as they are set, so only once every reactor exists.
+    st->send_frame = reactor_send_frame;
+    st->broadcast = reactor_broadcast;
+    st->adopt = reactor_adopt;
+    st->kick = reactor_kick;
+    st->auth_done = reactor_auth_done;
+
+    // Reactor 0 runs on the calling thread.
+    for (int i = 1; i < count; i++) {
+        if (!chat_thread_start(reactor_loop, reactors[i])) {
+            printf("failed to start reactor %d\n", i);
+            return 1;
+        }
+    }
+    (void)reactor_loop(reactors[0]);
+    return 0;
+}
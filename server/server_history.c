@@ -0,0 +1,210 @@
+#include "server.h"
+
+#include <string.h>
+
+#include "chat_cmd.h"
+
+// Room history: the last st->hist_depth ROOMMSG events of each room, kept
+// as the OutFrames the broadcast already built, so a replay only queues
+// references. Each room's ring has its own lock; st->hist_lock guards the
+// list of rooms and eviction, and is always taken before a room's lock.
+// Appends touch only the room's lock and the global byte counter.
+
+static uint32_t frame_bytes(const OutFrame* f) {
+    return f ? (uint32_t)sizeof(OutFrame) + f->head : 0u;
+}
+
+// Bytes an entry holds: each frame is counted whole, even though queues
+// may share it. A body its spliced frames share is counted once.
+static uint32_t entry_bytes(const OutFrames* e) {
+    uint32_t n = frame_bytes(e->text) + frame_bytes(e->bin) + frame_bytes(e->text_zip) + frame_bytes(e->bin_zip);
+    const OutFrame* body = e->text && e->text->body ? e->text->body : e->bin ? e->bin->body : NULL;
+    return n + frame_bytes(body);
+}
+
+static size_t ring_size(ServerState* st) {
+    return (size_t)st->hist_depth * sizeof(OutFrames);
+}
+
+// Drop every entry and the ring itself. Caller holds h->lock.
+static void history_clear_locked(ServerState* st, RoomHistory* h) {
+    if (!h->ring) return;
+    for (uint32_t i = 0; i < h->count; i++) outframes_release(&h->ring[(h->head + i) % st->hist_depth]);
+    buf_free(h->ring, ring_size(st));
+    chat_atomic_add(&st->hist_bytes, -(int32_t)h->bytes);
+    h->ring = NULL;
+    h->head = 0;
+    h->count = 0;
+    h->bytes = 0;
+}
+
+void history_attach(ServerState* st, Room* r) {
+    RoomHistory* h = &r->hist;
+    InitializeCriticalSection(&h->lock);
+    if (!st->hist_depth) return;
+    EnterCriticalSection(&st->hist_lock);
+    h->live = 1;
+    h->prev = NULL;
+    h->next = st->hist_rooms;
+    if (st->hist_rooms) st->hist_rooms->hist.prev = r;
+    st->hist_rooms = r;
+    LeaveCriticalSection(&st->hist_lock);
+}
+
+void history_detach(ServerState* st, Room* r) {
+    RoomHistory* h = &r->hist;
+    if (!st->hist_depth) return;
+    EnterCriticalSection(&st->hist_lock);
+    if (h->prev) h->prev->hist.next = h->next;
+    else st->hist_rooms = h->next;
+    if (h->next) h->next->hist.prev = h->prev;
+    h->prev = h->next = NULL;
+    EnterCriticalSection(&h->lock);
+    h->live = 0;
+    history_clear_locked(st, h);
+    LeaveCriticalSection(&h->lock);
+    LeaveCriticalSection(&st->hist_lock);
+}
+
+#define HIST_EVICT_BATCH 32 // Coldest rooms collected per scan of the list.
+
+typedef struct ColdRoom {
+    Room* room;
+    uint64_t used_ns;
+} ColdRoom;
+
+// Clear the coldest rooms until usage is back under 7/8 of the limit, so
+// one eviction pays for many appends. Each scan of the room list collects
+// a batch of the coldest, oldest first.
+static void history_evict(ServerState* st) {
+    int32_t low = (int32_t)(st->hist_limit - st->hist_limit / 8);
+    EnterCriticalSection(&st->hist_lock);
+    while (chat_atomic_load(&st->hist_bytes) > low) {
+        ColdRoom cold[HIST_EVICT_BATCH];
+        int n = 0;
+        for (Room* r = st->hist_rooms; r; r = r->hist.next) {
+            // Read without the room's lock; a stale value only makes the
+            // choice slightly less exact.
+            uint64_t used = r->hist.used_ns;
+            if (!r->hist.count || (n == HIST_EVICT_BATCH && used >= cold[n - 1].used_ns)) continue;
+            int i = n < HIST_EVICT_BATCH ? n++ : n - 1;
+            for (; i > 0 && cold[i - 1].used_ns > used; i--) cold[i] = cold[i - 1];
+            cold[i].room = r;
+            cold[i].used_ns = used;
+        }
+        if (n == 0) break;
+        for (int i = 0; i < n && chat_atomic_load(&st->hist_bytes) > low; i++) {
+            EnterCriticalSection(&cold[i].room->hist.lock);
+            history_clear_locked(st, &cold[i].room->hist);
+            LeaveCriticalSection(&cold[i].room->hist.lock);
+        }
+    }
+    LeaveCriticalSection(&st->hist_lock);
+}
+
+void history_append(ServerState* st, Room* r, const OutFrames* fs) {
+    RoomHistory* h = &r->hist;
+    uint32_t bytes = entry_bytes(fs);
+    EnterCriticalSection(&h->lock);
+    // A pruned room may still be broadcasting; nobody can join it to read.
+    if (!h->live) {
+        LeaveCriticalSection(&h->lock);
+        return;
+    }
+    if (!h->ring) {
+        h->ring = (OutFrames*)buf_alloc(ring_size(st));
+        if (!h->ring) {
+            LeaveCriticalSection(&h->lock);
+            return;
+        }
+        h->bytes = (uint32_t)ring_size(st);
+        chat_atomic_add(&st->hist_bytes, (int32_t)h->bytes);
+    }
+    int32_t delta = (int32_t)bytes;
+    uint32_t slot = (h->head + h->count) % st->hist_depth;
+    if (h->count == st->hist_depth) {
+        // Full: the new entry replaces the oldest.
+        delta -= (int32_t)entry_bytes(&h->ring[h->head]);
+        outframes_release(&h->ring[h->head]);
+        h->head = (h->head + 1) % st->hist_depth;
+    } else {
+        h->count++;
+    }
+    h->ring[slot] = *fs;
+    outframes_retain(fs);
+    h->bytes = (uint32_t)((int32_t)h->bytes + delta);
+    h->used_ns = chat_now_ns();
+    LeaveCriticalSection(&h->lock);
+
+    if (chat_atomic_add(&st->hist_bytes, delta) > (int32_t)st->hist_limit) history_evict(st);
+}
+
+int history_replay(ServerState* st, Room* r, Client* c, uint32_t count) {
+    RoomHistory* h = &r->hist;
+    if (!st->hist_depth || count == 0) return 0;
+    if (count > st->hist_depth) count = st->hist_depth;
+
+    // Take references under the lock and send after it, so a slow socket
+    // never holds up appends to the room.
+    size_t size = (size_t)count * sizeof(OutFrame*);
+    OutFrame** picked = (OutFrame**)buf_alloc(size);
+    if (!picked) return 0;
+    uint32_t n = 0;
+    EnterCriticalSection(&h->lock);
+    uint32_t skip = h->count > count ? h->count - count : 0;
+    for (uint32_t i = skip; i < h->count; i++) {
+        OutFrame* f = outframes_pick(&h->ring[(h->head + i) % st->hist_depth], c);
+        if (!f) continue;
+        outframe_retain(f);
+        picked[n++] = f;
+    }
+    LeaveCriticalSection(&h->lock);
+
+    // The frames still carry the traces of the messages they were; queuing
+    // them again is no stage of those.
+    int sent = 0;
+    trace_mute(1);
+    for (uint32_t i = 0; i < n; i++) {
+        if (st->send_frame(st, c, picked[i])) sent++;
+        outframe_release(picked[i]);
+    }
+    trace_mute(0);
+    buf_free(picked, size);
+    return sent;
+}
+
+typedef struct Backfill {
+    ServerState* st;
+    Room* r;
+} Backfill;
+
+// Rebuild one logged message as its broadcast would have. The sender may be
+// offline or gone, in which case v2 names them with user id 0 (unknown).
+static void backfill_record(void* arg, const char* user, const char* text, uint64_t time_ms) {
+    Backfill* b = (Backfill*)arg;
+    (void)time_ms;
+    size_t text_len = strlen(text);
+    size_t cap = text_len + 2 * CHAT_NAME_MAX + 32;
+    char* out = (char*)buf_alloc(cap);
+    uint8_t* bin = (uint8_t*)buf_alloc(cap);
+    if (out && bin && chat_cmd_format(out, (uint32_t)cap, "ROOMMSG", b->r->name, user, text)) {
+        const Client* sender = state_find_client_by_name(b->st, user);
+        ChatBinWriter w;
+        chat_bw_init(&w, bin, (uint32_t)cap);
+        chat_bw_u8(&w, CHAT_OP_ROOMMSG);
+        chat_bw_varint(&w, b->r->id);
+        chat_bw_varint(&w, sender ? sender->id : 0);
+        chat_bw_text(&w, text);
+        OutFrames fs = {outframe_new(out, (uint32_t)strlen(out)), outframe_new_bin(w.buf, w.len), NULL, NULL};
+        if (fs.text && fs.bin) history_append(b->st, b->r, &fs);
+        outframes_release(&fs);
+    }
+    if (out) buf_free(out, cap);
+    if (bin) buf_free(bin, cap);
+}
+
+void history_backfill(ServerState* st, Room* r) {
+    if (!st->log || !st->hist_depth) return;
+    Backfill b = {st, r};
+    (void)log_read_recent(st->log, r->name, st->hist_depth, backfill_record, &b);
+}
@@ -0,0 +1,789 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+// Persistent message log. Records are appended to fixed-size segment files
+// named after their first log offset (a byte position across all
+// segments); every segment stays mapped, so reading a record is a memory
+// access served from the page cache. Each record points back at the
+// previous record of the same room, and an in-memory index holds every
+// room's newest record, so a room's last N messages are N hops however
+// large the log grows. When a segment fills up its room index is saved
+// next to it (<base>.idx); startup loads the newest one and only scans the
+// segments after it.
+//
+// Appends never touch the files: they queue the encoded record under
+// log->lock and return. The writer thread copies batches into the active
+// segment and msyncs them; within one sync_ms window every record that
+// arrives shares a single sync (group commit). Readers see records as
+// soon as they are copied, before they are durable.
+
+#ifdef _WIN32
+
+ChatLog* log_open(const LogConfig* cfg) {
+    (void)cfg;
+    printf("The message log needs a POSIX system.\n");
+    return NULL;
+}
+
+void log_close(ChatLog* log) {
+    (void)log;
+}
+
+int log_append(ChatLog* log, const char* room, const char* user, const char* text, uint32_t text_len) {
+    (void)log;
+    (void)room;
+    (void)user;
+    (void)text;
+    (void)text_len;
+    return 0;
+}
+
+void log_sync(ChatLog* log) {
+    (void)log;
+}
+
+int log_read_recent(ChatLog* log, const char* room, uint32_t max, LogRecordFn fn, void* arg) {
+    (void)log;
+    (void)room;
+    (void)max;
+    (void)fn;
+    (void)arg;
+    return 0;
+}
+
+void log_stats(ChatLog* log, LogStats* out) {
+    (void)log;
+    memset(out, 0, sizeof(*out));
+}
+
+#else
+
+#define LOG_MAGIC "CHATLOG1"
+#define LOG_IDX_MAGIC "CHATIDX1"
+#define LOG_HEADER 64u // Segment header bytes; the first record follows.
+#define LOG_PENDING_MAX (16u * 1024u * 1024u) // Queued bytes before appends are dropped.
+#define LOG_PATH_MAX 4096
+
+// Segment header, at offset 0 of every file.
+typedef struct LogSegHeader {
+    char magic[8];
+    uint64_t base; // Log offset of the file's first byte.
+} LogSegHeader;
+
+// Record header; room, user and text bytes follow, then zero padding to a
+// multiple of 8 so every header is aligned in the mapping.
+typedef struct LogRecord {
+    uint32_t crc; // CRC-32C of the rest of the record, from len on.
+    uint32_t len; // Whole record, padding included; 0 past the last record.
+    uint64_t prev; // Log offset of the room's previous record; 0 if none.
+    uint64_t time_ms; // Wall-clock time of the append, Unix milliseconds.
+    uint32_t text_len;
+    uint8_t room_len;
+    uint8_t user_len;
+    uint16_t reserved;
+} LogRecord;
+
+typedef struct LogSegment {
+    uint64_t base; // Log offset of the file's first byte.
+    uint64_t size; // File and mapping size.
+    uint8_t* map;
+    int fd;
+} LogSegment;
+
+// Index entry; the table's key points at name.
+typedef struct LogRoom {
+    char name[CHAT_NAME_MAX + 1];
+    uint64_t tail; // Log offset of the room's newest record.
+} LogRoom;
+
+// Encoded records back to back.
+typedef struct LogBuf {
+    uint8_t* data;
+    uint32_t len;
+    uint32_t cap;
+} LogBuf;
+
+struct ChatLog {
+    LogConfig cfg; // cfg.dir points at dir.
+    char* dir;
+
+    // Producers and the writer hand over records under lock.
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake; // Writer: records queued or stop requested.
+    CONDITION_VARIABLE synced_cv; // log_sync and log_close waiters.
+    LogBuf pending;
+    uint64_t appended;
+    uint64_t synced;
+    uint64_t dropped;
+    int stop;
+    int stopped;
+
+    // Writer-owned; changes to segs, rooms and end also take read_lock,
+    // which readers hold while they walk the mapping.
+    CRITICAL_SECTION read_lock;
+    LogSegment* segs; // Oldest first; the last one is active.
+    uint32_t seg_count;
+    uint32_t seg_cap;
+    NameTable rooms; // LogRoom by room name.
+    uint64_t end; // Log offset past the last written record.
+    uint64_t dirty; // Log offset of the first byte not yet synced.
+    uint64_t syncs;
+    LogBuf batch; // Records taken from pending, being written.
+};
+
+static uint32_t crc_table[8][256];
+
+// CRC-32C (Castagnoli), eight bytes per step (slicing-by-8). Records are
+// stored in host byte order, and the checksum is too.
+static void log_crc_init(void) {
+    if (crc_table[0][1]) return;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t log_crc(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t c = 0xFFFFFFFFu;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^ crc_table[5][(lo >> 16) & 0xFF] ^
+            crc_table[4][lo >> 24] ^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+            crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    for (; len; p++, len--) c = crc_table[0][(c ^ *p) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static void seg_path(const ChatLog* log, uint64_t base, const char* ext, char* out, size_t size) {
+    snprintf(out, size, "%s/%020llu.%s", log->dir, (unsigned long long)base, ext);
+}
+
+static int buf_reserve(LogBuf* b, uint32_t need) {
+    if (b->len + need <= b->cap) return 1;
+    uint32_t cap = b->cap ? b->cap : 64 * 1024;
+    while (cap < b->len + need) cap *= 2;
+    uint8_t* data = (uint8_t*)realloc(b->data, cap);
+    if (!data) return 0;
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+// The record at pos if it is whole and intact, else NULL.
+static const LogRecord* record_check(const LogSegment* s, uint64_t pos) {
+    if (pos % 8 || pos < LOG_HEADER || pos + sizeof(LogRecord) > s->size) return NULL;
+    const LogRecord* rec = (const LogRecord*)(s->map + pos);
+    if (rec->len < sizeof(LogRecord) || rec->len % 8 || rec->len > s->size - pos) return NULL;
+    if (!rec->room_len || rec->room_len > CHAT_NAME_MAX || rec->user_len > CHAT_NAME_MAX) return NULL;
+    if (sizeof(LogRecord) + rec->room_len + rec->user_len + (uint64_t)rec->text_len > rec->len) return NULL;
+    if (log_crc(&rec->len, rec->len - 4) != rec->crc) return NULL;
+    return rec;
+}
+
+// Segment holding a log offset below end; NULL if it was deleted. Caller
+// holds read_lock (or is the writer).
+static const LogSegment* seg_find(const ChatLog* log, uint64_t off) {
+    if (!log->seg_count || off >= log->end || off < log->segs[0].base) return NULL;
+    uint32_t lo = 0, hi = log->seg_count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (log->segs[mid].base <= off) lo = mid;
+        else hi = mid;
+    }
+    return &log->segs[lo];
+}
+
+static const LogRecord* record_at(const ChatLog* log, uint64_t off) {
+    const LogSegment* s = seg_find(log, off);
+    return s ? record_check(s, off - s->base) : NULL;
+}
+
+static const LogRecord* record_at_unchecked(const ChatLog* log, uint64_t off) {
+    const LogSegment* s = seg_find(log, off);
+    return (const LogRecord*)(s->map + (off - s->base));
+}
+
+static LogRoom* room_note(ChatLog* log, const char* name, uint32_t name_len, uint64_t tail) {
+    char key[CHAT_NAME_MAX + 1];
+    memcpy(key, name, name_len);
+    key[name_len] = 0;
+    LogRoom* room = (LogRoom*)name_table_find(&log->rooms, key);
+    if (!room) {
+        room = (LogRoom*)malloc(sizeof(*room));
+        if (!room) return NULL;
+        memcpy(room->name, key, name_len + 1);
+        if (!name_table_insert(&log->rooms, room->name, room)) {
+            free(room);
+            return NULL;
+        }
+    }
+    room->tail = tail;
+    return room;
+}
+
+// Map an existing segment file, or create and preallocate a new one.
+static int seg_open(ChatLog* log, uint64_t base, int create, LogSegment* out) {
+    char path[LOG_PATH_MAX];
+    seg_path(log, base, "log", path, sizeof(path));
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+    if (fd < 0) {
+        printf("message log: cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    uint64_t size = log->cfg.segment_bytes;
+    if (create) {
+        // Reserve the blocks now so a full disk fails here, not as SIGBUS
+        // on a store into the mapping.
+        int err = posix_fallocate(fd, 0, (off_t)size);
+        if (err != 0) {
+            printf("message log: cannot allocate %s: %s\n", path, strerror(err));
+            close(fd);
+            unlink(path);
+            return 0;
+        }
+    } else {
+        struct stat sb;
+        if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)(LOG_HEADER + sizeof(LogRecord))) {
+            printf("message log: %s is too short\n", path);
+            close(fd);
+            return 0;
+        }
+        size = (uint64_t)sb.st_size;
+    }
+    uint8_t* map = (uint8_t*)mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("message log: cannot map %s: %s\n", path, strerror(errno));
+        close(fd);
+        if (create) unlink(path);
+        return 0;
+    }
+    LogSegHeader* h = (LogSegHeader*)map;
+    if (create) {
+        memcpy(h->magic, LOG_MAGIC, 8);
+        h->base = base;
+    } else if (memcmp(h->magic, LOG_MAGIC, 8) != 0 || h->base != base) {
+        printf("message log: %s is not a segment of this log\n", path);
+        munmap(map, (size_t)size);
+        close(fd);
+        return 0;
+    }
+    out->base = base;
+    out->size = size;
+    out->map = map;
+    out->fd = fd;
+    return 1;
+}
+
+static void seg_close(LogSegment* s) {
+    munmap(s->map, (size_t)s->size);
+    close(s->fd);
+}
+
+static int seg_push(ChatLog* log, const LogSegment* s) {
+    if (log->seg_count == log->seg_cap) {
+        uint32_t cap = log->seg_cap ? log->seg_cap * 2 : 16;
+        LogSegment* segs = (LogSegment*)realloc(log->segs, cap * sizeof(*segs));
+        if (!segs) return 0;
+        log->segs = segs;
+        log->seg_cap = cap;
+    }
+    log->segs[log->seg_count++] = *s;
+    return 1;
+}
+
+// Save every room's newest record as the index of a sealed segment. Entries
+// are a name length byte, the name and an 8-byte tail; the file is written
+// aside and renamed so a crash leaves the old index or the new one.
+static int index_save(ChatLog* log, uint64_t base) {
+    LogBuf b = {NULL, 0, 0};
+    for (uint32_t i = 0; i < log->rooms.cap; i++) {
+        const LogRoom* room = (const LogRoom*)log->rooms.slots[i].item;
+        if (!room) continue;
+        uint8_t len = (uint8_t)strlen(room->name);
+        if (!buf_reserve(&b, 1u + len + 8u)) {
+            free(b.data);
+            return 0;
+        }
+        b.data[b.len++] = len;
+        memcpy(b.data + b.len, room->name, len);
+        memcpy(b.data + b.len + len, &room->tail, 8);
+        b.len += len + 8u;
+    }
+    uint32_t head[2] = {log->rooms.count, log_crc(b.data, b.len)};
+
+    char path[LOG_PATH_MAX], tmp[LOG_PATH_MAX + 8];
+    seg_path(log, base, "idx", path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    int ok = f && fwrite(LOG_IDX_MAGIC, 1, 8, f) == 8 && fwrite(head, sizeof(head), 1, f) == 1 &&
+             (!b.len || fwrite(b.data, b.len, 1, f) == 1) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f && fclose(f) != 0) ok = 0;
+    free(b.data);
+    if (!ok || rename(tmp, path) != 0) {
+        printf("message log: cannot write %s\n", path);
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+// Load a sealed segment's index into log->rooms; 0 if missing or damaged.
+static int index_load(ChatLog* log, uint64_t base) {
+    char path[LOG_PATH_MAX];
+    seg_path(log, base, "idx", path, sizeof(path));
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+    uint8_t* data = NULL;
+    char magic[8];
+    uint32_t head[2];
+    long size = -1;
+    if (fread(magic, 1, 8, f) == 8 && memcmp(magic, LOG_IDX_MAGIC, 8) == 0 && fread(head, sizeof(head), 1, f) == 1 &&
+        fseek(f, 0, SEEK_END) == 0) {
+        size = ftell(f) - 8 - (long)sizeof(head);
+    }
+    if (size >= 0) {
+        data = (uint8_t*)malloc((size_t)size + 1);
+        if (!data || fseek(f, 8 + (long)sizeof(head), SEEK_SET) != 0 ||
+            (size && fread(data, (size_t)size, 1, f) != 1) || log_crc(data, (size_t)size) != head[1]) {
+            size = -1;
+        }
+    }
+    fclose(f);
+
+    // Check every entry before taking any.
+    uint32_t n = 0;
+    long pos = 0;
+    while (size >= 0 && pos < size) {
+        uint8_t len = data[pos];
+        if (!len || len > CHAT_NAME_MAX || pos + 1 + len + 8 > size) break;
+        pos += 1 + len + 8;
+        n++;
+    }
+    int ok = size >= 0 && pos == size && n == head[0];
+    for (pos = 0; ok && pos < size; pos += 1 + data[pos] + 8) {
+        uint64_t tail;
+        memcpy(&tail, data + pos + 1 + data[pos], 8);
+        if (!room_note(log, (const char*)data + pos + 1, data[pos], tail)) ok = 0;
+    }
+    free(data);
+    return ok;
+}
+
+// Index a segment's records from the start; returns the offset within the
+// segment past the last intact record.
+static uint64_t seg_scan(ChatLog* log, const LogSegment* s) {
+    uint64_t pos = LOG_HEADER;
+    const LogRecord* rec;
+    while ((rec = record_check(s, pos)) != NULL) {
+        (void)room_note(log, (const char*)(rec + 1), rec->room_len, s->base + pos);
+        pos += rec->len;
+    }
+    return pos;
+}
+
+// msync the active segment from the first unsynced byte to end.
+static void log_flush(ChatLog* log) {
+    const LogSegment* s = &log->segs[log->seg_count - 1];
+    if (log->end <= log->dirty) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t from = (log->dirty - s->base) / page * page;
+    if (msync(s->map + from, (size_t)(log->end - s->base - from), MS_SYNC) != 0) {
+        printf("message log: msync failed: %s\n", strerror(errno));
+    }
+    log->dirty = log->end;
+    log->syncs++;
+}
+
+// Seal the active segment and start the next one; drops the oldest sealed
+// segments past keep_segments.
+static int log_roll(ChatLog* log) {
+    LogSegment* cur = &log->segs[log->seg_count - 1];
+    log_flush(log);
+    (void)index_save(log, cur->base);
+    LogSegment next;
+    if (!seg_open(log, cur->base + cur->size, 1, &next)) return 0;
+
+    EnterCriticalSection(&log->read_lock);
+    int ok = seg_push(log, &next);
+    if (ok) log->end = log->dirty = next.base + LOG_HEADER;
+    LeaveCriticalSection(&log->read_lock);
+    if (!ok) {
+        char path[LOG_PATH_MAX];
+        seg_path(log, next.base, "log", path, sizeof(path));
+        seg_close(&next);
+        unlink(path);
+        return 0;
+    }
+    // Sync the header now so recovery finds the new file intact.
+    log->dirty = next.base;
+    log_flush(log);
+
+    while (log->cfg.keep_segments && log->seg_count - 1 > log->cfg.keep_segments) {
+        EnterCriticalSection(&log->read_lock);
+        LogSegment old = log->segs[0];
+        memmove(log->segs, log->segs + 1, (log->seg_count - 1) * sizeof(*log->segs));
+        log->seg_count--;
+        LeaveCriticalSection(&log->read_lock);
+        char path[LOG_PATH_MAX];
+        seg_close(&old);
+        seg_path(log, old.base, "log", path, sizeof(path));
+        unlink(path);
+        seg_path(log, old.base, "idx", path, sizeof(path));
+        unlink(path);
+    }
+    return 1;
+}
+
+static void log_write_record(ChatLog* log, LogRecord* rec) {
+    const LogSegment* s = &log->segs[log->seg_count - 1];
+    if (log->end + rec->len > s->base + s->size) {
+        if (!log_roll(log)) {
+            EnterCriticalSection(&log->lock);
+            log->dropped++;
+            LeaveCriticalSection(&log->lock);
+            return;
+        }
+        s = &log->segs[log->seg_count - 1];
+    }
+    char name[CHAT_NAME_MAX + 1];
+    memcpy(name, rec + 1, rec->room_len);
+    name[rec->room_len] = 0;
+    // Only this thread adds rooms or moves tails, so the lookup needs no lock.
+    const LogRoom* room = (const LogRoom*)name_table_find(&log->rooms, name);
+    rec->prev = room ? room->tail : 0;
+    rec->crc = log_crc(&rec->len, rec->len - 4);
+    memcpy(s->map + (log->end - s->base), rec, rec->len);
+
+    EnterCriticalSection(&log->read_lock);
+    (void)room_note(log, name, rec->room_len, log->end);
+    log->end += rec->len;
+    LeaveCriticalSection(&log->read_lock);
+}
+
+static void log_write_batch(ChatLog* log) {
+    uint32_t pos = 0;
+    while (pos < log->batch.len) {
+        LogRecord* rec = (LogRecord*)(log->batch.data + pos);
+        pos += rec->len;
+        log_write_record(log, rec);
+    }
+    log->batch.len = 0;
+}
+
+// Swap the queued records into batch; returns the append count they reach.
+// Caller holds log->lock.
+static uint64_t log_take(ChatLog* log) {
+    LogBuf b = log->batch;
+    log->batch = log->pending;
+    log->pending = b;
+    return log->appended;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL log_writer(void* arg) {
+    ChatLog* log = (ChatLog*)arg;
+    uint64_t last_sync = 0;
+    EnterCriticalSection(&log->lock);
+    for (;;) {
+        while (!log->pending.len && !log->stop) SleepConditionVariableCS(&log->wake, &log->lock, INFINITE);
+        if (!log->pending.len) break;
+        uint64_t upto = log_take(log);
+        int stopping = log->stop;
+        LeaveCriticalSection(&log->lock);
+        log_write_batch(log);
+
+        // Group commit: at most one sync per window. Records that arrive
+        // while the window is still open are written and share its sync.
+        uint64_t due = last_sync + (uint64_t)log->cfg.sync_ms * 1000000u;
+        uint64_t now = chat_now_ns();
+        if (!stopping && now < due) {
+            Sleep((uint32_t)((due - now + 999999u) / 1000000u));
+            EnterCriticalSection(&log->lock);
+            upto = log_take(log);
+            LeaveCriticalSection(&log->lock);
+            log_write_batch(log);
+        }
+        log_flush(log);
+        last_sync = chat_now_ns();
+
+        EnterCriticalSection(&log->lock);
+        log->synced = upto;
+        WakeAllConditionVariable(&log->synced_cv);
+    }
+    log->stopped = 1;
+    WakeAllConditionVariable(&log->synced_cv);
+    LeaveCriticalSection(&log->lock);
+    return 0;
+}
+
+static int base_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Bases of the directory's segment files, sorted. Returns 0 on failure.
+static int list_segments(const char* dir, uint64_t** out, uint32_t* out_count) {
+    DIR* d = opendir(dir);
+    if (!d) return 0;
+    uint64_t* bases = NULL;
+    uint32_t count = 0, cap = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        const char* n = e->d_name;
+        if (strlen(n) != 24 || strcmp(n + 20, ".log") != 0 || strspn(n, "0123456789") != 20) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t* grown = (uint64_t*)realloc(bases, cap * sizeof(*bases));
+            if (!grown) {
+                free(bases);
+                closedir(d);
+                return 0;
+            }
+            bases = grown;
+        }
+        bases[count++] = strtoull(n, NULL, 10);
+    }
+    closedir(d);
+    if (count) qsort(bases, count, sizeof(*bases), base_cmp);
+    *out = bases;
+    *out_count = count;
+    return 1;
+}
+
+static void rooms_clear(ChatLog* log) {
+    for (uint32_t i = 0; i < log->rooms.cap; i++) free(log->rooms.slots[i].item);
+    name_table_free(&log->rooms);
+}
+
+// Map every segment, rebuild the room index and find the end of the
+// active segment.
+static int log_recover(ChatLog* log) {
+    uint64_t* bases = NULL;
+    uint32_t count = 0;
+    if (!list_segments(log->dir, &bases, &count)) {
+        printf("message log: cannot list %s: %s\n", log->dir, strerror(errno));
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        LogSegment s;
+        if (!seg_open(log, bases[i], 0, &s)) {
+            free(bases);
+            return 0;
+        }
+        if (!seg_push(log, &s)) {
+            seg_close(&s);
+            free(bases);
+            return 0;
+        }
+    }
+    free(bases);
+    if (!log->seg_count) {
+        LogSegment s;
+        if (!seg_open(log, 0, 1, &s) || !seg_push(log, &s)) return 0;
+        log->end = LOG_HEADER;
+        log->dirty = 0;
+        log_flush(log);
+        return 1;
+    }
+
+    // The newest sealed segment with a usable index saves scanning up to it.
+    uint32_t scan_from = 0;
+    for (uint32_t i = log->seg_count - 1; i-- > 0;) {
+        if (index_load(log, log->segs[i].base)) {
+            scan_from = i + 1;
+            break;
+        }
+        rooms_clear(log);
+    }
+    // Sealed segments are read through; end lands in the active one.
+    log->end = log->segs[scan_from].base + LOG_HEADER;
+    for (uint32_t i = scan_from; i < log->seg_count; i++) {
+        log->end = log->segs[i].base + seg_scan(log, &log->segs[i]);
+    }
+
+    // A torn append leaves bytes past the last intact record. Zero them so
+    // a later record can never line up with a stale one that still checks.
+    LogSegment* s = &log->segs[log->seg_count - 1];
+    uint64_t pos = log->end - s->base, last = s->size;
+    while (last > pos && s->map[last - 1] == 0) last--;
+    if (last > pos) {
+        memset(s->map + pos, 0, (size_t)(last - pos));
+        log->dirty = log->end;
+        log->end = s->base + last;
+        log_flush(log);
+        log->end = log->dirty = s->base + pos;
+    }
+    log->dirty = log->end;
+    return 1;
+}
+
+ChatLog* log_open(const LogConfig* cfg) {
+    log_crc_init();
+    if (mkdir(cfg->dir, 0755) != 0 && errno != EEXIST) {
+        printf("message log: cannot create %s: %s\n", cfg->dir, strerror(errno));
+        return NULL;
+    }
+    ChatLog* log = (ChatLog*)calloc(1, sizeof(*log));
+    size_t dir_len = strlen(cfg->dir);
+    if (!log || !(log->dir = (char*)malloc(dir_len + 1))) {
+        free(log);
+        return NULL;
+    }
+    memcpy(log->dir, cfg->dir, dir_len + 1);
+    log->cfg = *cfg;
+    log->cfg.dir = log->dir;
+    InitializeCriticalSection(&log->lock);
+    InitializeCriticalSection(&log->read_lock);
+    InitializeConditionVariable(&log->wake);
+    InitializeConditionVariable(&log->synced_cv);
+
+    if (!log_recover(log) || !chat_thread_start(log_writer, log)) {
+        log->stopped = 1;
+        log_close(log);
+        return NULL;
+    }
+    return log;
+}
+
+void log_close(ChatLog* log) {
+    if (!log) return;
+    EnterCriticalSection(&log->lock);
+    log->stop = 1;
+    WakeConditionVariable(&log->wake);
+    while (!log->stopped) SleepConditionVariableCS(&log->synced_cv, &log->lock, INFINITE);
+    LeaveCriticalSection(&log->lock);
+
+    for (uint32_t i = 0; i < log->seg_count; i++) seg_close(&log->segs[i]);
+    rooms_clear(log);
+    DeleteCriticalSection(&log->lock);
+    DeleteCriticalSection(&log->read_lock);
+    free(log->segs);
+    free(log->pending.data);
+    free(log->batch.data);
+    free(log->dir);
+    free(log);
+}
+
+int log_append(ChatLog* log, const char* room, const char* user, const char* text, uint32_t text_len) {
+    size_t room_len = strlen(room), user_len = strlen(user);
+    if (!room_len || room_len > CHAT_NAME_MAX || user_len > CHAT_NAME_MAX || text_len > CHAT_MAX_FRAME) return 0;
+    uint32_t body = (uint32_t)(sizeof(LogRecord) + room_len + user_len + text_len);
+    uint32_t len = (body + 7u) & ~7u;
+    if (len > log->cfg.segment_bytes - LOG_HEADER) return 0;
+    uint64_t now = wall_ms();
+
+    EnterCriticalSection(&log->lock);
+    if (log->stop || log->pending.len + len > LOG_PENDING_MAX || !buf_reserve(&log->pending, len)) {
+        log->dropped++;
+        LeaveCriticalSection(&log->lock);
+        return 0;
+    }
+    uint8_t* p = log->pending.data + log->pending.len;
+    LogRecord* rec = (LogRecord*)p;
+    memset(rec, 0, sizeof(*rec));
+    rec->len = len;
+    rec->time_ms = now;
+    rec->text_len = (uint32_t)text_len;
+    rec->room_len = (uint8_t)room_len;
+    rec->user_len = (uint8_t)user_len;
+    p += sizeof(*rec);
+    memcpy(p, room, room_len);
+    memcpy(p + room_len, user, user_len);
+    memcpy(p + room_len + user_len, text, text_len);
+    memset(p + body - sizeof(*rec), 0, len - body);
+    int wake = log->pending.len == 0;
+    log->pending.len += len;
+    log->appended++;
+    LeaveCriticalSection(&log->lock);
+    if (wake) WakeConditionVariable(&log->wake);
+    return 1;
+}
+
+void log_sync(ChatLog* log) {
+    EnterCriticalSection(&log->lock);
+    uint64_t target = log->appended;
+    while (log->synced < target && !log->stopped) SleepConditionVariableCS(&log->synced_cv, &log->lock, INFINITE);
+    LeaveCriticalSection(&log->lock);
+}
+
+int log_read_recent(ChatLog* log, const char* room, uint32_t max, LogRecordFn fn, void* arg) {
+    if (!max) return 0;
+    uint64_t* offs = (uint64_t*)malloc((size_t)max * sizeof(*offs));
+    if (!offs) return 0;
+    char user[CHAT_NAME_MAX + 1];
+    char* text = NULL;
+    uint32_t text_cap = 0;
+    uint32_t n = 0;
+
+    EnterCriticalSection(&log->read_lock);
+    const LogRoom* r = (const LogRoom*)name_table_find(&log->rooms, room);
+    uint64_t off = r ? r->tail : 0;
+    const LogRecord* rec;
+    while (off && n < max && (rec = record_at(log, off)) != NULL) {
+        offs[n++] = off;
+        off = rec->prev;
+    }
+    int done = 0;
+    for (uint32_t i = n; i-- > 0;) {
+        // Checked by the walk above; read_lock keeps the mapping in place.
+        rec = record_at_unchecked(log, offs[i]);
+        const char* p = (const char*)(rec + 1) + rec->room_len;
+        if (rec->text_len + 1 > text_cap) {
+            char* grown = (char*)realloc(text, rec->text_len + 1);
+            if (!grown) break;
+            text = grown;
+            text_cap = rec->text_len + 1;
+        }
+        memcpy(user, p, rec->user_len);
+        user[rec->user_len] = 0;
+        memcpy(text, p + rec->user_len, rec->text_len);
+        text[rec->text_len] = 0;
+        fn(arg, user, text, rec->time_ms);
+        done++;
+    }
+    LeaveCriticalSection(&log->read_lock);
+    free(text);
+    free(offs);
+    return done;
+}
+
+void log_stats(ChatLog* log, LogStats* out) {
+    EnterCriticalSection(&log->lock);
+    out->appended = log->appended;
+    out->synced = log->synced;
+    out->dropped = log->dropped;
+    LeaveCriticalSection(&log->lock);
+    EnterCriticalSection(&log->read_lock);
+    out->syncs = log->syncs;
+    out->bytes = log->end;
+    out->segments = log->seg_count;
+    out->rooms = log->rooms.count;
+    LeaveCriticalSection(&log->read_lock);
+}
+
+#endif
@@ -0,0 +1,390 @@
+#include "server.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Server metrics. Counters and histograms live in slots. On its first
+// update a thread claims a free slot of its own and updates it with plain
+// adds; a thread that exits gives its slot, and the counts in it, to the
+// next thread. Once METRICS_OWNED slots are taken (threaded backend with
+// many clients), further threads share METRICS_SHARED slots through atomic
+// adds. Readers add up every slot with atomic loads and never block a
+// writer, so STATS and the dump cost the hot path nothing.
+//
+// Histograms are log-linear, like HdrHistogram: exact below 16, then 16
+// buckets per power of two, so every value is known to within 1/16. Each
+// value is stored as v - 1, which makes every power of two the inclusive
+// top of a bucket, as Prometheus's le is.
+
+#define METRICS_OWNED 64
+#define METRICS_SHARED 8
+#define METRICS_SLOTS (METRICS_OWNED + METRICS_SHARED)
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB (1u << METRICS_SUB_BITS)
+#define METRICS_TOP_BITS 36 // Values past 2^36 (69 s in ns) share the last bucket.
+#define METRICS_BUCKETS ((METRICS_TOP_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB)
+// Prometheus bucket edges: powers of two from 1 us to 17 s, and from 1 to
+// 65536 members.
+#define METRICS_NS_EDGE_MIN 10
+#define METRICS_NS_EDGE_MAX 34
+#define METRICS_FANOUT_EDGE_MAX 16
+
+// The count is the buckets' sum, so quantiles always agree with it.
+typedef struct MetricsHist {
+    volatile uint64_t sum;
+    volatile uint64_t buckets[METRICS_BUCKETS];
+} MetricsHist;
+
+typedef struct MetricsSlot {
+    volatile int32_t owned; // Claimed by a live thread (first METRICS_OWNED only).
+    volatile uint64_t counters[MET_COUNTERS];
+    MetricsHist hists[MET_HISTS];
+} MetricsSlot;
+
+// Allocated on first use and never freed, so readers need no lock.
+static MetricsSlot* volatile metrics_slots[METRICS_SLOTS];
+static volatile int32_t metrics_next;
+static uint64_t metrics_start_ns;
+static CHAT_THREAD_LOCAL MetricsSlot* metrics_self;
+static CHAT_THREAD_LOCAL int metrics_owner; // metrics_self is this thread's alone.
+
+// Owners add with plain loads and stores; shared slots need atomic adds.
+#define METRICS_ADD(p, v) (metrics_owner ? (void)(*(p) += (v)) : chat_atomic_add64((p), (v)))
+
+static const char* metrics_counter_names[MET_COUNTERS] = {
+    "frames_in", "bytes_in", "frames_out", "bytes_out", "auth_ok", "auth_failed", "connects", "disconnects",
+    "broadcasts", "deliveries", "handshake_timeouts", "accept_pauses", "auth_hashed", "auth_cached",
+    "cred_reloads",
+};
+
+void metrics_init(void) {
+    metrics_start_ns = chat_now_ns();
+}
+
+// Slot i, allocated if no thread has used it yet.
+static MetricsSlot* slot_at(uint32_t i) {
+    MetricsSlot* s = (MetricsSlot*)chat_atomic_load_ptr(&metrics_slots[i]);
+    if (s) return s;
+    MetricsSlot* fresh = (MetricsSlot*)calloc(1, sizeof(*fresh));
+    if (!fresh) return NULL;
+    s = (MetricsSlot*)chat_atomic_cas_ptr(&metrics_slots[i], NULL, fresh);
+    if (s) free(fresh); // Another thread got there first.
+    else s = fresh;
+    return s;
+}
+
+static MetricsSlot* metrics_slot(void) {
+    if (metrics_self) return metrics_self;
+    for (uint32_t i = 0; i < METRICS_OWNED; i++) {
+        MetricsSlot* s = slot_at(i);
+        if (!s) return NULL;
+        if (chat_atomic_xchg(&s->owned, 1) == 0) {
+            metrics_owner = 1;
+            metrics_self = s;
+            return s;
+        }
+    }
+    uint32_t i = METRICS_OWNED + (uint32_t)(chat_atomic_add(&metrics_next, 1) - 1) % METRICS_SHARED;
+    metrics_self = slot_at(i);
+    return metrics_self;
+}
+
+void metrics_thread_exit(void) {
+    if (metrics_owner) (void)chat_atomic_xchg(&metrics_self->owned, 0);
+    metrics_owner = 0;
+    metrics_self = NULL;
+}
+
+static uint32_t msb64(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return (uint32_t)i;
+#else
+    return 63u - (uint32_t)__builtin_clzll(v);
+#endif
+}
+
+// Bucket of a stored value (already v - 1).
+static uint32_t bucket_of(uint64_t x) {
+    if (x < METRICS_SUB) return (uint32_t)x;
+    if (x >> METRICS_TOP_BITS) return METRICS_BUCKETS - 1;
+    uint32_t shift = msb64(x) - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB + (uint32_t)((x >> shift) & (METRICS_SUB - 1));
+}
+
+// Largest value recorded into bucket b.
+static uint64_t bucket_top(uint32_t b) {
+    if (b < METRICS_SUB) return (uint64_t)b + 1;
+    uint32_t shift = b / METRICS_SUB - 1;
+    uint64_t low = (uint64_t)(METRICS_SUB + b % METRICS_SUB) << shift;
+    return low + ((uint64_t)1 << shift);
+}
+
+void metrics_add(MetricCounter counter, uint64_t v) {
+    MetricsSlot* s = metrics_slot();
+    if (s) METRICS_ADD(&s->counters[counter], v);
+}
+
+void metrics_record(MetricHist hist, uint64_t v) {
+    MetricsSlot* s = metrics_slot();
+    if (!s) return;
+    MetricsHist* h = &s->hists[hist];
+    METRICS_ADD(&h->sum, v);
+    METRICS_ADD(&h->buckets[bucket_of(v ? v - 1 : 0)], 1);
+}
+
+// Sum one histogram across every slot.
+static void hist_merge(MetricHist hist, uint64_t* buckets, uint64_t* count, uint64_t* sum) {
+    memset(buckets, 0, METRICS_BUCKETS * sizeof(*buckets));
+    *count = 0;
+    *sum = 0;
+    for (int i = 0; i < METRICS_SLOTS; i++) {
+        MetricsSlot* s = (MetricsSlot*)chat_atomic_load_ptr(&metrics_slots[i]);
+        if (!s) continue;
+        MetricsHist* h = &s->hists[hist];
+        for (uint32_t b = 0; b < METRICS_BUCKETS; b++) buckets[b] += chat_atomic_load64(&h->buckets[b]);
+        *sum += chat_atomic_load64(&h->sum);
+    }
+    for (uint32_t b = 0; b < METRICS_BUCKETS; b++) *count += buckets[b];
+}
+
+static uint64_t hist_quantile(const uint64_t* buckets, uint64_t count, uint32_t permille) {
+    uint64_t rank = (count * permille + 999) / 1000;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < METRICS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) return bucket_top(b);
+    }
+    return 0;
+}
+
+// Recorded values up to and including edge, a power of two.
+static uint64_t hist_count_to(const uint64_t* buckets, uint64_t edge) {
+    uint64_t n = 0;
+    for (uint32_t b = 0, end = bucket_of(edge); b < end; b++) n += buckets[b];
+    return n;
+}
+
+static void metrics_gauges(ServerState* st, MetricsView* out) {
+    AcquireSRWLockShared(&st->lock);
+    out->users = st->users.count;
+    out->rooms = st->rooms.count;
+    ReleaseSRWLockShared(&st->lock);
+    uint64_t open = out->counters[MET_CONNECTS] - out->counters[MET_DISCONNECTS];
+    out->connections = out->counters[MET_CONNECTS] >= out->counters[MET_DISCONNECTS] ? (uint32_t)open : 0;
+    int32_t handshakes = chat_atomic_load(&st->handshakes);
+    out->handshakes = handshakes > 0 ? (uint32_t)handshakes : 0;
+    out->uptime_ms = metrics_start_ns ? (chat_now_ns() - metrics_start_ns) / 1000000u : 0;
+}
+
+static void metrics_counters(uint64_t* out) {
+    memset(out, 0, MET_COUNTERS * sizeof(*out));
+    for (int i = 0; i < METRICS_SLOTS; i++) {
+        MetricsSlot* s = (MetricsSlot*)chat_atomic_load_ptr(&metrics_slots[i]);
+        if (!s) continue;
+        for (int k = 0; k < MET_COUNTERS; k++) out[k] += chat_atomic_load64(&s->counters[k]);
+    }
+}
+
+void metrics_read(ServerState* st, MetricsView* out) {
+    memset(out, 0, sizeof(*out));
+    metrics_counters(out->counters);
+    metrics_gauges(st, out);
+    uint64_t buckets[METRICS_BUCKETS];
+    for (int h = 0; h < MET_HISTS; h++) {
+        MetricsSummary* m = &out->hists[h];
+        hist_merge((MetricHist)h, buckets, &m->count, &m->sum);
+        if (!m->count) continue;
+        m->p50 = hist_quantile(buckets, m->count, 500);
+        m->p90 = hist_quantile(buckets, m->count, 900);
+        m->p99 = hist_quantile(buckets, m->count, 990);
+        m->max = hist_quantile(buckets, m->count, 1000);
+    }
+}
+
+const char* metrics_counter_name(MetricCounter counter) {
+    return counter < MET_COUNTERS ? metrics_counter_names[counter] : "?";
+}
+
+// Lower-case command name, "other" for CHAT_CMD_NONE.
+static void cmd_label(ChatCmdId id, char* out, size_t cap) {
+    const ChatCmdSpec* spec = chat_cmd_spec(id);
+    const char* name = spec ? spec->name : "other";
+    size_t i = 0;
+    for (; name[i] && i + 1 < cap; i++) out[i] = (char)tolower((unsigned char)name[i]);
+    out[i] = 0;
+}
+
+void metrics_hist_name(MetricHist hist, char* out, size_t cap) {
+    if (hist < MET_HIST_BROADCAST_NS) {
+        char cmd[16];
+        cmd_label((ChatCmdId)(hist - MET_HIST_CMD_NS), cmd, sizeof(cmd));
+        snprintf(out, cap, "cmd_%s_ns", cmd);
+    } else {
+        snprintf(out, cap, "%s",
+            hist == MET_HIST_BROADCAST_NS   ? "broadcast_ns"
+            : hist == MET_HIST_FANOUT       ? "broadcast_fanout"
+            : hist == MET_HIST_HANDSHAKE_NS ? "handshake_ns"
+            : hist == MET_HIST_AUTH_WAIT_NS ? "auth_wait_ns"
+                                            : "auth_hash_ns");
+    }
+}
+
+static void prom_head(FILE* f, const char* name, const char* type, const char* help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_scalar(FILE* f, const char* name, const char* type, const char* help, uint64_t v) {
+    prom_head(f, name, type, help);
+    fprintf(f, "%s %llu\n", name, (unsigned long long)v);
+}
+
+// One histogram series. ns histograms are exported in seconds.
+static void prom_hist(FILE* f, const char* name, const char* labels, MetricHist hist, int ns) {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count, sum;
+    hist_merge(hist, buckets, &count, &sum);
+    const char* sep = labels[0] ? "," : "";
+    int lo = ns ? METRICS_NS_EDGE_MIN : 0;
+    int hi = ns ? METRICS_NS_EDGE_MAX : METRICS_FANOUT_EDGE_MAX;
+    for (int k = lo; k <= hi; k++) {
+        uint64_t edge = (uint64_t)1 << k;
+        if (ns) fprintf(f, "%s_bucket{%s%sle=\"%.12g\"}", name, labels, sep, (double)edge / 1e9);
+        else fprintf(f, "%s_bucket{%s%sle=\"%llu\"}", name, labels, sep, (unsigned long long)edge);
+        fprintf(f, " %llu\n", (unsigned long long)hist_count_to(buckets, edge));
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)count);
+    if (labels[0]) {
+        if (ns) fprintf(f, "%s_sum{%s} %.9f\n", name, labels, (double)sum / 1e9);
+        else fprintf(f, "%s_sum{%s} %llu\n", name, labels, (unsigned long long)sum);
+        fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+    } else {
+        if (ns) fprintf(f, "%s_sum %.9f\n", name, (double)sum / 1e9);
+        else fprintf(f, "%s_sum %llu\n", name, (unsigned long long)sum);
+        fprintf(f, "%s_count %llu\n", name, (unsigned long long)count);
+    }
+}
+
+int metrics_write_prometheus(ServerState* st, FILE* f) {
+    MetricsView v;
+    memset(&v, 0, sizeof(v));
+    metrics_counters(v.counters);
+    metrics_gauges(st, &v);
+    const uint64_t* n = v.counters;
+
+    prom_scalar(f, "chat_uptime_seconds", "gauge", "Seconds since the server started.", v.uptime_ms / 1000u);
+    prom_scalar(f, "chat_connections", "gauge", "Open connections, authenticated or not.", v.connections);
+    prom_scalar(f, "chat_handshakes", "gauge", "Open connections not yet authenticated.", v.handshakes);
+    prom_scalar(f, "chat_users", "gauge", "Authenticated users.", v.users);
+    prom_scalar(f, "chat_rooms", "gauge", "Rooms with at least one member.", v.rooms);
+    prom_scalar(f, "chat_connections_accepted_total", "counter", "Connections accepted.", n[MET_CONNECTS]);
+    prom_scalar(f, "chat_frames_received_total", "counter", "Frames received.", n[MET_FRAMES_IN]);
+    prom_scalar(f, "chat_received_bytes_total", "counter", "Payload bytes received.", n[MET_BYTES_IN]);
+    prom_scalar(f, "chat_frames_sent_total", "counter", "Frames written to sockets.", n[MET_FRAMES_OUT]);
+    prom_scalar(f, "chat_sent_bytes_total", "counter", "Bytes written to sockets.", n[MET_BYTES_OUT]);
+    prom_head(f, "chat_auth_total", "counter", "AUTH attempts by result.");
+    fprintf(f, "chat_auth_total{result=\"ok\"} %llu\n", (unsigned long long)n[MET_AUTH_OK]);
+    fprintf(f, "chat_auth_total{result=\"failed\"} %llu\n", (unsigned long long)n[MET_AUTH_FAILED]);
+    prom_head(f, "chat_auth_checks_total", "counter", "Logins checked against the credential file, by path.");
+    fprintf(f, "chat_auth_checks_total{path=\"hashed\"} %llu\n", (unsigned long long)n[MET_AUTH_HASHED]);
+    fprintf(f, "chat_auth_checks_total{path=\"cached\"} %llu\n", (unsigned long long)n[MET_AUTH_CACHED]);
+    prom_scalar(f, "chat_credential_reloads_total", "counter", "Times the credential file was reloaded.",
+        n[MET_CRED_RELOADS]);
+    prom_scalar(f, "chat_handshake_timeouts_total", "counter", "Connections closed for not authenticating in time.",
+        n[MET_HANDSHAKE_TIMEOUTS]);
+    prom_scalar(f, "chat_accept_pauses_total", "counter", "Times accepting paused with max_handshakes pending.",
+        n[MET_ACCEPT_PAUSES]);
+    prom_scalar(f, "chat_broadcasts_total", "counter", "Room events broadcast.", n[MET_BROADCASTS]);
+    prom_scalar(f, "chat_deliveries_total", "counter", "Room events times the members they went to.",
+        n[MET_DELIVERIES]);
+
+    prom_head(f, "chat_command_duration_seconds", "histogram", "Time to handle one command frame.");
+    for (int id = 0; id < CHAT_CMD_COUNT; id++) {
+        char cmd[16], labels[32];
+        cmd_label((ChatCmdId)id, cmd, sizeof(cmd));
+        snprintf(labels, sizeof(labels), "command=\"%s\"", cmd);
+        prom_hist(f, "chat_command_duration_seconds", labels, (MetricHist)(MET_HIST_CMD_NS + id), 1);
+    }
+    prom_head(f, "chat_broadcast_duration_seconds", "histogram", "Time to hand one room event to every member.");
+    prom_hist(f, "chat_broadcast_duration_seconds", "", MET_HIST_BROADCAST_NS, 1);
+    prom_head(f, "chat_broadcast_fanout", "histogram", "Members one room event was sent to.");
+    prom_hist(f, "chat_broadcast_fanout", "", MET_HIST_FANOUT, 0);
+    prom_head(f, "chat_handshake_duration_seconds", "histogram", "Time from accept to OK AUTH.");
+    prom_hist(f, "chat_handshake_duration_seconds", "", MET_HIST_HANDSHAKE_NS, 1);
+    prom_head(f, "chat_auth_wait_seconds", "histogram", "Time an AUTH waited for a verifier thread.");
+    prom_hist(f, "chat_auth_wait_seconds", "", MET_HIST_AUTH_WAIT_NS, 1);
+    prom_head(f, "chat_auth_hash_seconds", "histogram", "Time to hash one password.");
+    prom_hist(f, "chat_auth_hash_seconds", "", MET_HIST_AUTH_HASH_NS, 1);
+    return !ferror(f);
+}
+
+typedef struct MetricsDump {
+    ServerState* st;
+    char* path;
+    char* tmp;
+    uint32_t interval_ms;
+} MetricsDump;
+
+static int metrics_dump(MetricsDump* d) {
+    FILE* f = fopen(d->tmp, "w");
+    if (!f) return 0;
+    int ok = metrics_write_prometheus(d->st, f);
+    if (fclose(f) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) ok = MoveFileExA(d->tmp, d->path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    if (ok) ok = rename(d->tmp, d->path) == 0;
+#endif
+    return ok;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL metrics_dump_thread(void* arg) {
+    MetricsDump* d = (MetricsDump*)arg;
+    int failing = 0;
+    for (;;) {
+        Sleep(d->interval_ms);
+        int ok = metrics_dump(d);
+        // Report only changes, not every failed period.
+        if (!ok && !failing) printf("Metrics: cannot write %s\n", d->path);
+        else if (ok && failing) printf("Metrics: writing %s again\n", d->path);
+        failing = !ok;
+    }
+    return 0;
+}
+
+int metrics_start_dump(ServerState* st, const char* path, uint32_t interval_ms) {
+    MetricsDump* d = (MetricsDump*)calloc(1, sizeof(*d));
+    size_t len = strlen(path);
+    if (d) d->path = (char*)malloc(len + 1);
+    if (d && d->path) d->tmp = (char*)malloc(len + 5);
+    if (!d || !d->path || !d->tmp) {
+        if (d) {
+            free(d->path);
+            free(d);
+        }
+        printf("Metrics: out of memory\n");
+        return 0;
+    }
+    memcpy(d->path, path, len + 1);
+    memcpy(d->tmp, path, len);
+    memcpy(d->tmp + len, ".tmp", 5);
+    d->st = st;
+    d->interval_ms = interval_ms;
+    // Write once now, so a bad path fails at startup.
+    if (!metrics_dump(d) || !chat_thread_start(metrics_dump_thread, d)) {
+        printf("Metrics: cannot write %s\n", path);
+        free(d->tmp);
+        free(d->path);
+        free(d);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,331 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bounded per-client outbound queues. A message is encoded once into a
+// refcounted OutFrame and every recipient's queue holds a reference to it;
+// the backend drains a queue with non-blocking gather writes, many frames
+// per syscall. When a queue would exceed ServerState.outq_limit the
+// slow-consumer policy decides what gives.
+
+#define OUTQ_IOV_MAX 64 // Pieces handed to one gather write (a spliced frame takes two).
+#define ZIP_IDLE_MAX 64 // Compression contexts kept for reuse.
+
+static CRITICAL_SECTION zip_lock; // Guards the idle contexts.
+static ChatZip* zip_idle[ZIP_IDLE_MAX];
+static int zip_idle_count;
+
+// Write the length prefix of a len-byte payload; returns its size.
+static uint32_t frame_prefix(uint8_t* out, uint32_t len, int bin) {
+    if (bin) return chat_varint_put(out, len);
+    uint32_t net_len = htonl(len);
+    memcpy(out, &net_len, 4);
+    return 4u;
+}
+
+static OutFrame* frame_alloc(uint32_t head) {
+    OutFrame* f = (OutFrame*)buf_alloc(sizeof(*f) + head);
+    if (!f) return NULL;
+    f->refs = 1;
+    f->len = head;
+    f->head = head;
+    f->trace = trace_current();
+    f->body = NULL;
+    return f;
+}
+
+OutFrame* outframe_new(const void* payload, uint32_t len) {
+    return outframe_new_parts(payload, len, NULL, 0, 0);
+}
+
+OutFrame* outframe_new_bin(const void* payload, uint32_t len) {
+    return outframe_new_parts(payload, len, NULL, 0, 1);
+}
+
+OutFrame* outframe_new_parts(const void* head, uint32_t head_len, const void* tail, uint32_t tail_len, int bin) {
+    uint8_t prefix[CHAT_VARINT_MAX];
+    uint32_t n = frame_prefix(prefix, head_len + tail_len, bin);
+    OutFrame* f = frame_alloc(n + head_len + tail_len);
+    if (!f) return NULL;
+    memcpy(f->data, prefix, n);
+    if (head_len) memcpy(f->data + n, head, head_len);
+    if (tail_len) memcpy(f->data + n + head_len, tail, tail_len);
+    return f;
+}
+
+OutFrame* outframe_new_raw(const void* bytes, uint32_t len) {
+    OutFrame* f = frame_alloc(len);
+    if (f && len) memcpy(f->data, bytes, len);
+    return f;
+}
+
+OutFrame* outframe_new_spliced(const void* head, uint32_t head_len, OutFrame* body, int bin) {
+    uint8_t prefix[CHAT_VARINT_MAX];
+    uint32_t n = frame_prefix(prefix, head_len + body->len, bin);
+    OutFrame* f = frame_alloc(n + head_len);
+    if (!f) return NULL;
+    memcpy(f->data, prefix, n);
+    if (head_len) memcpy(f->data + n, head, head_len);
+    outframe_retain(body);
+    f->body = body;
+    f->len += body->len;
+    return f;
+}
+
+void zip_init(void) {
+    InitializeCriticalSection(&zip_lock);
+}
+
+ChatZip* zip_acquire(void) {
+    ChatZip* z = NULL;
+    EnterCriticalSection(&zip_lock);
+    if (zip_idle_count > 0) z = zip_idle[--zip_idle_count];
+    LeaveCriticalSection(&zip_lock);
+    return z ? z : chat_zip_new(CHAT_ZIP_LEVEL);
+}
+
+void zip_release(ChatZip* z) {
+    if (!z) return;
+    EnterCriticalSection(&zip_lock);
+    if (zip_idle_count < ZIP_IDLE_MAX) {
+        zip_idle[zip_idle_count++] = z;
+        z = NULL;
+    }
+    LeaveCriticalSection(&zip_lock);
+    chat_zip_free(z);
+}
+
+OutFrame* outframe_new_zip(const void* head, uint32_t head_len, const void* tail, uint32_t tail_len, int bin) {
+    // Packing only succeeds below len bytes, so len is enough scratch.
+    uint32_t len = head_len + tail_len;
+    uint8_t* packed = (uint8_t*)buf_alloc(len);
+    ChatZip* z = packed ? zip_acquire() : NULL;
+    uint32_t n = z ? chat_zip_pack2(z, (const uint8_t*)head, head_len, (const uint8_t*)tail, tail_len, packed, len) : 0;
+    zip_release(z);
+    OutFrame* f = NULL;
+    if (n) f = bin ? outframe_new_bin(packed, n) : outframe_new(packed, n);
+    buf_free(packed, len);
+    return f;
+}
+
+void outframe_retain(OutFrame* f) {
+    chat_atomic_add(&f->refs, 1);
+}
+
+void outframe_release(OutFrame* f) {
+    if (chat_atomic_add(&f->refs, -1) != 0) return;
+    if (f->body) outframe_release(f->body);
+    buf_free(f, sizeof(*f) + f->head);
+}
+
+void outframes_retain(const OutFrames* fs) {
+    if (fs->text) outframe_retain(fs->text);
+    if (fs->bin) outframe_retain(fs->bin);
+    if (fs->text_zip) outframe_retain(fs->text_zip);
+    if (fs->bin_zip) outframe_retain(fs->bin_zip);
+}
+
+void outframes_release(const OutFrames* fs) {
+    if (fs->text) outframe_release(fs->text);
+    if (fs->bin) outframe_release(fs->bin);
+    if (fs->text_zip) outframe_release(fs->text_zip);
+    if (fs->bin_zip) outframe_release(fs->bin_zip);
+}
+
+static OutFrame* outq_at(OutQueue* q, uint32_t i) {
+    return q->ring[(q->head + i) & (q->cap - 1)];
+}
+
+static int outq_grow(OutQueue* q) {
+    uint32_t cap = q->cap ? q->cap * 2 : 8;
+    OutFrame** ring = (OutFrame**)malloc((size_t)cap * sizeof(*ring));
+    if (!ring) return 0;
+    for (uint32_t i = 0; i < q->frames; i++) ring[i] = outq_at(q, i);
+    free(q->ring);
+    q->ring = ring;
+    q->cap = cap;
+    q->head = 0;
+    return 1;
+}
+
+// Append f, taking over the caller's reference.
+static int outq_append(OutQueue* q, OutFrame* f) {
+    if (q->frames == q->cap && !outq_grow(q)) return 0;
+    q->ring[(q->head + q->frames) & (q->cap - 1)] = f;
+    q->frames++;
+    q->bytes += f->len;
+    if (q->bytes > q->hwm_bytes) q->hwm_bytes = q->bytes;
+    if (q->frames > q->hwm_frames) q->hwm_frames = q->frames;
+    return 1;
+}
+
+// Pop the head frame once it has been written completely.
+static void outq_pop(OutQueue* q) {
+    OutFrame* f = q->ring[q->head];
+    if (f->trace) trace_frame(f->trace, CHAT_TRACE_WRITE, q->owner, f->len);
+    outframe_release(f);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->head_off = 0;
+    q->frames--;
+    q->sent++;
+}
+
+// Discard the oldest frame that hasn't started going out; returns 0 if none.
+static int outq_drop_oldest(OutQueue* q) {
+    // A partially written head must finish or the stream desyncs.
+    uint32_t skip = q->head_off > 0 ? 1u : 0u;
+    if (q->frames <= skip) return 0;
+
+    uint32_t mask = q->cap - 1;
+    uint32_t victim = (q->head + skip) & mask;
+    OutFrame* f = q->ring[victim];
+    if (skip) {
+        // Slide the partial head into the victim's slot.
+        q->ring[victim] = q->ring[q->head];
+        q->head = victim;
+    } else {
+        q->head = (q->head + 1) & mask;
+    }
+    q->frames--;
+    q->bytes -= f->len;
+    q->dropped++;
+    outframe_release(f);
+    return 1;
+}
+
+int outq_push(ServerState* st, OutQueue* q, OutFrame* f) {
+    if (q->bytes + f->len > st->outq_limit) {
+        switch (st->slow_policy) {
+        case SLOW_DISCONNECT:
+            return 0;
+        case SLOW_DROP_OLDEST:
+            while (q->bytes + f->len > st->outq_limit && outq_drop_oldest(q)) {
+            }
+            if (q->bytes + f->len > st->outq_limit) {
+                q->dropped++;
+                return 1;
+            }
+            break;
+        case SLOW_COALESCE:
+            q->dropped++;
+            q->coalesced++;
+            return 1;
+        }
+    }
+
+    outframe_retain(f);
+    if (outq_append(q, f)) {
+        if (f->trace) trace_frame(f->trace, CHAT_TRACE_ENQUEUE, q->owner, f->len);
+        return 1;
+    }
+    outframe_release(f);
+    return 0;
+}
+
+// Account for n written bytes, popping every frame they complete.
+static void outq_consume(OutQueue* q, uint32_t n) {
+    uint32_t popped = 0;
+    q->bytes -= n;
+    metrics_add(MET_BYTES_OUT, n);
+    while (n > 0) {
+        uint32_t left = q->ring[q->head]->len - q->head_off;
+        if (n < left) {
+            q->head_off += n;
+            break;
+        }
+        n -= left;
+        outq_pop(q);
+        popped++;
+    }
+    if (popped) metrics_add(MET_FRAMES_OUT, popped);
+}
+
+int outq_flush(OutQueue* q, SOCKET sock) {
+    for (;;) {
+        while (q->frames > 0) {
+            ChatIoVec iov[OUTQ_IOV_MAX];
+            int count = 0;
+            uint32_t off = q->head_off;
+            for (uint32_t i = 0; i < q->frames && count + 2 <= OUTQ_IOV_MAX; i++) {
+                OutFrame* f = outq_at(q, i);
+                if (off < f->head) {
+                    chat_iov_set(&iov[count], f->data + off, f->head - off);
+                    count++;
+                }
+                if (f->body) {
+                    uint32_t skip = off > f->head ? off - f->head : 0u;
+                    chat_iov_set(&iov[count], f->body->data + skip, f->body->len - skip);
+                    count++;
+                }
+                off = 0;
+            }
+
+            q->writes++;
+            int n = chat_sendv(sock, iov, count);
+            if (n <= 0) {
+                // Socket buffer full: the backend resumes when it is writable.
+                if (n < 0 && chat_sock_errno() == CHAT_EWOULDBLOCK) return 1;
+#ifndef _WIN32
+                if (n < 0 && errno == EINTR) continue;
+#endif
+                return 0;
+            }
+            outq_consume(q, (uint32_t)n);
+        }
+
+        // Drained: report what the coalesce policy dropped, then stop.
+        if (!q->coalesced) return 1;
+        OutFrame* f;
+        if (q->bin) {
+            uint8_t notice[1 + CHAT_VARINT_MAX];
+            ChatBinWriter w;
+            chat_bw_init(&w, notice, sizeof(notice));
+            chat_bw_u8(&w, CHAT_OP_DROPPED);
+            chat_bw_varint(&w, q->coalesced);
+            f = outframe_new_bin(w.buf, w.len);
+        } else {
+            char notice[32];
+            snprintf(notice, sizeof(notice), "DROPPED %u", q->coalesced);
+            f = outframe_new(notice, (uint32_t)strlen(notice));
+        }
+        q->coalesced = 0;
+        if (!f) return 1;
+        if (!outq_append(q, f)) {
+            outframe_release(f);
+            return 1;
+        }
+    }
+}
+
+void outq_clear(OutQueue* q) {
+    for (uint32_t i = 0; i < q->frames; i++) outframe_release(outq_at(q, i));
+    free(q->ring);
+    q->ring = NULL;
+    q->cap = 0;
+    q->head = 0;
+    q->head_off = 0;
+    q->frames = 0;
+    q->bytes = 0;
+}
+
+int slow_policy_parse(const char* name, SlowPolicy* out) {
+    if (strcmp(name, "disconnect") == 0) *out = SLOW_DISCONNECT;
+    else if (strcmp(name, "drop-oldest") == 0) *out = SLOW_DROP_OLDEST;
+    else if (strcmp(name, "coalesce") == 0) *out = SLOW_COALESCE;
+    else return 0;
+    return 1;
+}
+
+const char* slow_policy_name(SlowPolicy policy) {
+    switch (policy) {
+    case SLOW_DISCONNECT:
+        return "disconnect";
+    case SLOW_DROP_OLDEST:
+        return "drop-oldest";
+    case SLOW_COALESCE:
+        return "coalesce";
+    }
+    return "?";
+}
@@ -0,0 +1,845 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_cmd.h"
+#include "chat_hash.h"
+#include "chat_proto.h"
+
+// Federation: chat_server processes that serve one set of users and rooms
+// between them. Every pair of nodes shares one link: the node with the
+// higher id dials the other's client port and sends "NODE <id> <secret>",
+// and once the other answers "NODE <its id>", both ends speak v2 framing
+// with the CHAT_OP_PEER_* opcodes (chat_proto.h). A link is a Client with
+// peer set, so the backends read and write it like any connection.
+//
+// Each node tells its peers which users it holds, for names that are
+// unique across the cluster and for routing PMs, and which rooms have
+// members on it. A room message or membership change crosses a link only
+// to a node with members in that room, and only once however many it has;
+// that node fans it out to its own members. A node that starts caring
+// about a room is told who is already in it. Users on other nodes get
+// local v2 ids, so v2 clients see them like anyone else.
+//
+// Processes on one host can instead share a backplane (server_shm.c):
+// each is a node whose link has no socket, and frames for it travel
+// through shared memory. Everything above applies to them unchanged.
+//
+// NODE is the only way a connection becomes a link, so it is accepted only
+// from an address its --peer resolves to, with the cluster's --peer-secret
+// (never the users' password), compared in constant time.
+//
+// Two nodes may accept the same name before either hears of the other.
+// When they do, the lower node id keeps it and the other disconnects its
+// user; both reach the same verdict without a round trip.
+
+#define PEER_RETRY_MS 1000 // Redial period while a link is down.
+#define PEER_RESOLVE_ROUNDS 30 // Dialer rounds between lookups of peers' addresses.
+#define PEER_ADDRS_MAX 8 // IPv4 addresses kept per peer host.
+
+typedef struct Peer {
+    int node;
+    char host[256];
+    char port[16];
+    Client* link; // Live link (holds a reference); NULL while down.
+    Client* dialed; // Dialed connection still in its handshake (holds a reference).
+    int shm; // On this host's backplane: link has no socket.
+    struct in_addr addrs[PEER_ADDRS_MAX]; // What host resolved to; NODE is accepted only from these.
+    int addr_count; // Under peer_lock.
+} Peer;
+
+// A user on another node. Its rooms are those this node has members in
+// too: the only ones it is told about.
+typedef struct RemoteUser {
+    char name[CHAT_NAME_MAX + 1];
+    uint32_t id; // Local v2 id.
+    int node;
+    char (*rooms)[CHAT_NAME_MAX + 1];
+    uint32_t room_count;
+    uint32_t room_cap;
+} RemoteUser;
+
+// Nodes with members in a room.
+typedef struct Interest {
+    char name[CHAT_NAME_MAX + 1];
+    uint64_t nodes; // Bit node - 1.
+} Interest;
+
+static Peer peers[CHAT_MAX_NODES];
+static int peer_count;
+// Guards every Peer's link and dialed, and the interest table. Taken after
+// st->lock when both are needed.
+static SRWLOCK peer_lock;
+static NameTable interest;
+static uint8_t secret_hash[CHAT_SHA256_LEN]; // SHA-256 of st->peer_secret.
+
+static Peer* peer_find(int node) {
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].node == node) return &peers[i];
+    }
+    return NULL;
+}
+
+int peer_add(const char* spec) {
+    char* end = NULL;
+    long node = strtol(spec, &end, 10);
+    const char* host = end && *end == '@' ? end + 1 : NULL;
+    const char* colon = host ? strrchr(host, ':') : NULL;
+    if (node < 1 || node > CHAT_MAX_NODES || !colon || colon == host || !colon[1] || peer_find((int)node) ||
+        peer_count == CHAT_MAX_NODES || (size_t)(colon - host) >= sizeof(peers[0].host) ||
+        strlen(colon + 1) >= sizeof(peers[0].port)) {
+        return 0;
+    }
+    Peer* p = &peers[peer_count++];
+    memset(p, 0, sizeof(*p));
+    p->node = (int)node;
+    memcpy(p->host, host, (size_t)(colon - host));
+    strcpy(p->port, colon + 1);
+    return 1;
+}
+
+// Send one PEER_* payload, head then text, to every node in the mask that
+// is up. It is encoded once for all TCP links and written once into the
+// backplane for all nodes there.
+static void peer_send_nodes(ServerState* st, uint64_t nodes, const ChatBinWriter* w, const char* text,
+    uint32_t text_len) {
+    if (w->overflow) return;
+    OutFrame* f = NULL;
+    uint64_t local = 0;
+    AcquireSRWLockShared(&peer_lock);
+    for (int i = 0; i < peer_count; i++) {
+        Peer* p = &peers[i];
+        if (!((nodes >> (p->node - 1)) & 1u) || !p->link) continue;
+        if (p->shm) {
+            local |= 1ull << (p->node - 1);
+            continue;
+        }
+        if (!f) f = outframe_new_parts(w->buf, w->len, text, text_len, 1);
+        if (f) (void)st->send_frame(st, p->link, f);
+    }
+    ReleaseSRWLockShared(&peer_lock);
+    if (f) outframe_release(f);
+    if (local) shm_publish(local, w->buf, w->len, text, text_len);
+}
+
+static void peer_send(ServerState* st, Client* link, const ChatBinWriter* w) {
+    peer_send_nodes(st, 1ull << (link->peer - 1), w, NULL, 0);
+}
+
+static uint64_t interest_of(const char* room) {
+    AcquireSRWLockShared(&peer_lock);
+    Interest* in = (Interest*)name_table_find(&interest, room);
+    uint64_t nodes = in ? in->nodes : 0;
+    ReleaseSRWLockShared(&peer_lock);
+    return nodes;
+}
+
+// Caller holds st->lock.
+static int remote_in_room(const RemoteUser* u, const char* room) {
+    for (uint32_t i = 0; i < u->room_count; i++) {
+        if (_stricmp(u->rooms[i], room) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static void remote_free(RemoteUser* u) {
+    free(u->rooms);
+    free(u);
+}
+
+// Every RemoteUser of a node (all of them for node 0); caller holds st->lock.
+static int remote_users_of(ServerState* st, int node, RemoteUser*** out) {
+    NameTable* t = &st->remote_users;
+    RemoteUser** list = t->count ? (RemoteUser**)malloc(t->count * sizeof(*list)) : NULL;
+    int n = 0;
+    for (uint32_t i = 0; list && i < t->cap; i++) {
+        RemoteUser* u = (RemoteUser*)t->slots[i].item;
+        if (u && (!node || u->node == node)) list[n++] = u;
+    }
+    *out = list;
+    return n;
+}
+
+// Members here see a user on another node leave every room it was in.
+static void remote_leave_all(ServerState* st, RemoteUser* u) {
+    for (uint32_t i = 0; i < u->room_count; i++) {
+        AcquireSRWLockShared(&st->lock);
+        Room* r = state_find_room(st, u->rooms[i]);
+        if (r) room_retain(r);
+        ReleaseSRWLockShared(&st->lock);
+        if (!r) continue;
+        broadcast_membership(st, r, u->id, u->name, 0);
+        room_release(r);
+    }
+}
+
+// A link went away: forget the users and interest that came over it.
+static void peer_forget(ServerState* st, int node) {
+    RemoteUser** gone = NULL;
+    AcquireSRWLockExclusive(&st->lock);
+    int n = remote_users_of(st, node, &gone);
+    for (int i = 0; i < n; i++) (void)name_table_remove(&st->remote_users, gone[i]->name);
+    ReleaseSRWLockExclusive(&st->lock);
+
+    AcquireSRWLockExclusive(&peer_lock);
+    Interest** empty = interest.count ? (Interest**)malloc(interest.count * sizeof(*empty)) : NULL;
+    int dropped = 0;
+    for (uint32_t i = 0; i < interest.cap; i++) {
+        Interest* in = (Interest*)interest.slots[i].item;
+        if (!in) continue;
+        in->nodes &= ~(1ull << (node - 1));
+        if (!in->nodes && empty) empty[dropped++] = in;
+    }
+    for (int i = 0; i < dropped; i++) {
+        (void)name_table_remove(&interest, empty[i]->name);
+        free(empty[i]);
+    }
+    ReleaseSRWLockExclusive(&peer_lock);
+    free(empty);
+
+    for (int i = 0; i < n; i++) {
+        remote_leave_all(st, gone[i]);
+        remote_free(gone[i]);
+    }
+    free(gone);
+}
+
+// Tell a node every user and room here. Updates after this are sent under
+// st->lock too, so they follow on the link in order.
+static void peer_sync(ServerState* st, Client* link) {
+    uint8_t buf[8 + CHAT_NAME_MAX];
+    ChatBinWriter w;
+    AcquireSRWLockShared(&st->lock);
+    for (uint32_t i = 0; i < st->users.cap; i++) {
+        Client* u = (Client*)st->users.slots[i].item;
+        if (!u) continue;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_PEER_USER);
+        chat_bw_str(&w, u->username);
+        chat_bw_u8(&w, 1);
+        peer_send(st, link, &w);
+    }
+    for (uint32_t i = 0; i < st->rooms.cap; i++) {
+        Room* r = (Room*)st->rooms.slots[i].item;
+        if (!r) continue;
+        chat_bw_init(&w, buf, sizeof(buf));
+        chat_bw_u8(&w, CHAT_OP_PEER_ROOM);
+        chat_bw_str(&w, r->name);
+        chat_bw_u8(&w, 1);
+        peer_send(st, link, &w);
+    }
+    ReleaseSRWLockShared(&st->lock);
+}
+
+// Both ends: the handshake is done. Replaces a link the node had before
+// (it restarted), then syncs the node.
+static void peer_link_up(ServerState* st, Client* c) {
+    Peer* p = peer_find(c->peer);
+    AcquireSRWLockExclusive(&peer_lock);
+    Client* old = p->link;
+    p->link = c;
+    if (p->dialed == c) p->dialed = NULL; // Its reference moves to link.
+    else client_retain(c);
+    ReleaseSRWLockExclusive(&peer_lock);
+    if (old) {
+        peer_forget(st, c->peer);
+        if (!p->shm) st->kick(st, old);
+        client_release(old);
+    }
+    peer_sync(st, c);
+    printf("Peer %d: link up%s\n", c->peer, p->shm ? " (backplane)" : "");
+}
+
+// Look up p's host again (its address may change while it is down).
+static void peer_resolve(Peer* p) {
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET; // The listener is IPv4.
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(p->host, p->port, &hints, &res) != 0) return;
+    struct in_addr addrs[PEER_ADDRS_MAX];
+    int n = 0;
+    for (struct addrinfo* ai = res; ai && n < PEER_ADDRS_MAX; ai = ai->ai_next) {
+        addrs[n++] = ((const struct sockaddr_in*)ai->ai_addr)->sin_addr;
+    }
+    freeaddrinfo(res);
+    AcquireSRWLockExclusive(&peer_lock);
+    memcpy(p->addrs, addrs, (size_t)n * sizeof(addrs[0]));
+    p->addr_count = n;
+    ReleaseSRWLockExclusive(&peer_lock);
+}
+
+// Whether c connected from an address p's host resolves to.
+static int peer_from(const Peer* p, Client* c) {
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    if (getpeername(c->sock, (struct sockaddr*)&from, &len) != 0 || from.sin_family != AF_INET) return 0;
+    int ok = 0;
+    AcquireSRWLockShared(&peer_lock);
+    for (int i = 0; i < p->addr_count && !ok; i++) ok = p->addrs[i].s_addr == from.sin_addr.s_addr;
+    ReleaseSRWLockShared(&peer_lock);
+    return ok;
+}
+
+int peer_accept(ServerState* st, Client* c, const char* node, const char* secret) {
+    char* end = NULL;
+    long id = strtol(node, &end, 10);
+    Peer* p = st->node_id && !*end ? peer_find((int)id) : NULL;
+    if (!p || p->shm || !peer_from(p, c)) {
+        (void)send_text(st, c, "ERR NODE :Unknown node");
+        return 0;
+    }
+    // Hashing both sides makes the compare take the same time for any secret length.
+    uint8_t got[CHAT_SHA256_LEN];
+    ChatSha256 h;
+    chat_sha256_init(&h);
+    chat_sha256_update(&h, secret, strlen(secret));
+    chat_sha256_final(&h, got);
+    if (!chat_equal_ct(got, secret_hash, sizeof(got))) {
+        printf("Peer %ld: refused a link with the wrong secret\n", id);
+        (void)send_text(st, c, "ERR NODE :Bad secret");
+        return 0;
+    }
+    char reply[32];
+    snprintf(reply, sizeof(reply), "NODE %d", st->node_id);
+    (void)send_text(st, c, reply);
+    // v2 framing both ways from the next frame on.
+    c->peer = (int)id;
+    c->proto = CHAT_PROTO_BIN;
+    chat_decoder_set_varint(&c->in, 1);
+    EnterCriticalSection(&c->send_lock);
+    c->outq.bin = 1;
+    LeaveCriticalSection(&c->send_lock);
+    peer_link_up(st, c);
+    return 1;
+}
+
+// Dialing end, before the reply: skip the greeting, wait for "NODE <id>".
+static int peer_handshake(ServerState* st, Client* c, char* payload, uint32_t len) {
+    ChatCmd cmd;
+    if (!chat_cmd_parse(payload, len, &cmd) || !cmd.cmd) return 0;
+    if (_stricmp(cmd.cmd, "HELLO") == 0) return 1;
+    if (_stricmp(cmd.cmd, "NODE") != 0 || !cmd.arg1 || atoi(cmd.arg1) != c->peer) {
+        printf("Peer %d: refused: %s%s%s\n", c->peer, cmd.cmd, cmd.text ? " " : "", cmd.text ? cmd.text : "");
+        return 0;
+    }
+    c->proto = CHAT_PROTO_BIN;
+    chat_decoder_set_varint(&c->in, 1);
+    EnterCriticalSection(&c->send_lock);
+    c->outq.bin = 1;
+    LeaveCriticalSection(&c->send_lock);
+    peer_link_up(st, c);
+    return 1;
+}
+
+// PEER_USER: node holds (or no longer holds) name.
+static void on_user(ServerState* st, int node, const char* name, int online) {
+    if (strlen(name) > CHAT_NAME_MAX || !name_valid(name)) return;
+    Client* loser = NULL;
+    RemoteUser* gone = NULL;
+    AcquireSRWLockExclusive(&st->lock);
+    RemoteUser* u = (RemoteUser*)name_table_find(&st->remote_users, name);
+    Client* local = state_find_client_by_name(st, name);
+    if (!online) {
+        if (u && u->node == node) gone = (RemoteUser*)name_table_remove(&st->remote_users, name);
+    } else if (!(local && st->node_id < node) && !(u && u->node < node)) {
+        // The lower node id keeps a name two nodes accepted at once.
+        if (local) {
+            (void)name_table_remove(&st->users, local->username);
+            loser = local;
+            client_retain(loser);
+        }
+        if (u && u->node != node) {
+            u->node = node;
+            u->room_count = 0;
+        } else if (!u) {
+            u = (RemoteUser*)calloc(1, sizeof(*u));
+            if (u) {
+                strcpy(u->name, name);
+                u->node = node;
+                u->id = ++st->last_user_id;
+                if (!name_table_insert(&st->remote_users, u->name, u)) {
+                    free(u);
+                }
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&st->lock);
+
+    if (loser) {
+        printf("Peer %d: also holds %s, disconnecting ours\n", node, name);
+        (void)send_text(st, loser, "ERR AUTH :Username in use on another node");
+        st->kick(st, loser);
+        client_release(loser);
+    }
+    if (gone) {
+        remote_leave_all(st, gone);
+        remote_free(gone);
+    }
+}
+
+// PEER_ROOM: node has (or no longer has) members in room.
+// Introduce the members of r here to the node at the other end of link
+// (under st->lock).
+static void peer_introduce(ServerState* st, Client* link, Room* r) {
+    uint8_t buf[8 + 2 * CHAT_NAME_MAX];
+    ChatBinWriter w;
+    for (int k = 0; k < st->nshards; k++) {
+        RoomShard* rs = &r->shards[k];
+        for (int i = 0; i < rs->member_count; i++) {
+            chat_bw_init(&w, buf, sizeof(buf));
+            chat_bw_u8(&w, CHAT_OP_PEER_JOIN);
+            chat_bw_str(&w, r->name);
+            chat_bw_str(&w, rs->members[i]->username);
+            chat_bw_u8(&w, 1);
+            peer_send(st, link, &w);
+        }
+    }
+}
+
+static void on_room(ServerState* st, Client* link, const char* room, int interested) {
+    if (strlen(room) > CHAT_NAME_MAX) return;
+    uint64_t bit = 1ull << (link->peer - 1);
+    if (!interested) {
+        AcquireSRWLockExclusive(&peer_lock);
+        Interest* in = (Interest*)name_table_find(&interest, room);
+        if (in) {
+            in->nodes &= ~bit;
+            if (!in->nodes) {
+                (void)name_table_remove(&interest, room);
+                free(in);
+            }
+        }
+        ReleaseSRWLockExclusive(&peer_lock);
+        return;
+    }
+
+    // Under st->lock so no join or leave here is missed or sent twice out
+    // of order: those read the interest after changing membership under it.
+    AcquireSRWLockShared(&st->lock);
+    AcquireSRWLockExclusive(&peer_lock);
+    Interest* in = (Interest*)name_table_find(&interest, room);
+    if (!in) {
+        in = (Interest*)calloc(1, sizeof(*in));
+        if (in) {
+            strcpy(in->name, room);
+            if (!name_table_insert(&interest, in->name, in)) {
+                free(in);
+                in = NULL;
+            }
+        }
+    }
+    if (in) in->nodes |= bit;
+    ReleaseSRWLockExclusive(&peer_lock);
+    // Introduce the members here to the node that just started caring.
+    Room* r = state_find_room(st, room);
+    if (r) peer_introduce(st, link, r);
+    ReleaseSRWLockShared(&st->lock);
+}
+
+// PEER_RESYNC: the node lost frames from here and dropped all it knew of
+// this node. Users and rooms go again, and so do the members of the rooms
+// it still cares about: their first introduction arrived before the users.
+static void on_resync(ServerState* st, Client* link) {
+    peer_sync(st, link);
+    uint64_t bit = 1ull << (link->peer - 1);
+    AcquireSRWLockShared(&st->lock);
+    for (uint32_t i = 0; i < st->rooms.cap; i++) {
+        Room* r = (Room*)st->rooms.slots[i].item;
+        if (r && (interest_of(r->name) & bit)) peer_introduce(st, link, r);
+    }
+    ReleaseSRWLockShared(&st->lock);
+}
+
+// PEER_MSG: a user on node spoke in a room with members here.
+static void on_msg(ServerState* st, int node, const char* room, const char* user, const char* text) {
+    if (!name_valid(user)) return;
+    uint32_t text_len = (uint32_t)strlen(text);
+    uint32_t user_id = 0;
+    AcquireSRWLockShared(&st->lock);
+    Room* r = state_find_room(st, room);
+    if (r) room_retain(r);
+    RemoteUser* u = (RemoteUser*)name_table_find(&st->remote_users, user);
+    if (u && u->node == node) user_id = u->id;
+    ReleaseSRWLockShared(&st->lock);
+    if (!r) return; // Its last member here left meanwhile.
+
+    char head[ROOMMSG_HEAD_MAX];
+    int n = snprintf(head, sizeof(head), text_len ? "ROOMMSG %s %s :" : "ROOMMSG %s %s", room, user);
+    uint8_t bin_head[1 + 2 * CHAT_VARINT_MAX];
+    ChatBinWriter w;
+    chat_bw_init(&w, bin_head, sizeof(bin_head));
+    chat_bw_u8(&w, CHAT_OP_ROOMMSG);
+    chat_bw_varint(&w, r->id);
+    chat_bw_varint(&w, user_id);
+    if (n > 0 && (size_t)n < sizeof(head) && (uint32_t)n + text_len <= CHAT_MAX_FRAME) {
+        broadcast_room_parts(st, r, head, (uint32_t)n, bin_head, w.len, text, text_len, st->hist_depth > 0);
+        if (st->log) (void)log_append(st->log, r->name, user, text, text_len);
+    }
+    room_release(r);
+}
+
+// PEER_JOIN: a user on node joined or left a room with members here.
+static void on_join(ServerState* st, int node, const char* room, const char* user, int joined) {
+    if (strlen(room) > CHAT_NAME_MAX || !name_valid(room) || !name_valid(user)) return;
+    Room* r = NULL;
+    uint32_t user_id = 0;
+    int changed = 0;
+    AcquireSRWLockExclusive(&st->lock);
+    RemoteUser* u = (RemoteUser*)name_table_find(&st->remote_users, user);
+    if (u && u->node == node) {
+        int at = remote_in_room(u, room);
+        // A join for a room whose last member here just left is stale.
+        if (joined && at < 0 && state_find_room(st, room)) {
+            if (u->room_count == u->room_cap) {
+                uint32_t cap = u->room_cap ? u->room_cap * 2 : 4;
+                void* rooms = realloc(u->rooms, cap * sizeof(*u->rooms));
+                if (rooms) {
+                    u->rooms = (char (*)[CHAT_NAME_MAX + 1])rooms;
+                    u->room_cap = cap;
+                }
+            }
+            if (u->room_count < u->room_cap) {
+                strcpy(u->rooms[u->room_count++], room);
+                changed = 1;
+            }
+        } else if (!joined && at >= 0) {
+            memcpy(u->rooms[at], u->rooms[--u->room_count], sizeof(u->rooms[at]));
+            changed = 1;
+        }
+        user_id = u->id;
+        r = changed ? state_find_room(st, room) : NULL;
+        if (r) room_retain(r);
+    }
+    ReleaseSRWLockExclusive(&st->lock);
+    if (!r) return;
+    broadcast_membership(st, r, user_id, user, joined);
+    room_release(r);
+}
+
+// PEER_PM: a user on node wrote to a user here.
+static void on_pm(ServerState* st, int node, const char* from, const char* to, const char* text) {
+    if (!name_valid(from)) return;
+    uint32_t from_id = 0;
+    AcquireSRWLockShared(&st->lock);
+    Client* dst = state_find_client_by_name(st, to);
+    if (dst) client_retain(dst);
+    RemoteUser* u = (RemoteUser*)name_table_find(&st->remote_users, from);
+    if (u && u->node == node) from_id = u->id;
+    ReleaseSRWLockShared(&st->lock);
+    if (!dst) return; // Gone meanwhile; the sender was already told OK.
+    uint32_t text_len = (uint32_t)strlen(text);
+    // The sending node checked this; only a misbehaving one gets here without it.
+    if (strlen(from) <= CHAT_NAME_MAX && pm_frame_len(from, text_len) <= CHAT_MAX_FRAME) {
+        deliver_pm(st, dst, from_id, from, text, text_len);
+    }
+    client_release(dst);
+}
+
+int peer_handle_frame(ServerState* st, Client* c, uint8_t* payload, uint32_t payload_len) {
+    if (c->proto != CHAT_PROTO_BIN) return peer_handshake(st, c, (char*)payload, payload_len);
+
+    ChatBinReader rd;
+    chat_br_init(&rd, payload, payload_len);
+    uint8_t op = chat_br_u8(&rd);
+    switch (op) {
+    case CHAT_OP_PEER_USER: {
+        const char* user = chat_br_str(&rd);
+        uint8_t online = chat_br_u8(&rd);
+        if (!rd.bad) on_user(st, c->peer, user, online);
+        break;
+    }
+    case CHAT_OP_PEER_ROOM: {
+        const char* room = chat_br_str(&rd);
+        uint8_t interested = chat_br_u8(&rd);
+        if (!rd.bad) on_room(st, c, room, interested);
+        break;
+    }
+    case CHAT_OP_PEER_MSG: {
+        const char* room = chat_br_str(&rd);
+        const char* user = chat_br_str(&rd);
+        const char* text = chat_br_text(&rd);
+        if (text) on_msg(st, c->peer, room, user, text);
+        break;
+    }
+    case CHAT_OP_PEER_JOIN: {
+        const char* room = chat_br_str(&rd);
+        const char* user = chat_br_str(&rd);
+        uint8_t joined = chat_br_u8(&rd);
+        if (!rd.bad) on_join(st, c->peer, room, user, joined);
+        break;
+    }
+    case CHAT_OP_PEER_RESYNC:
+        on_resync(st, c);
+        break;
+    case CHAT_OP_PEER_PM: {
+        const char* from = chat_br_str(&rd);
+        const char* to = chat_br_str(&rd);
+        const char* text = chat_br_text(&rd);
+        if (text) on_pm(st, c->peer, from, to, text);
+        break;
+    }
+    default:
+        rd.bad = 1;
+        break;
+    }
+    if (rd.bad) {
+        printf("Peer %d: malformed frame (opcode 0x%02x)\n", c->peer, op);
+        return 0;
+    }
+    return 1;
+}
+
+void peer_link_closed(ServerState* st, Client* c) {
+    Peer* p = peer_find(c->peer);
+    if (!p) return;
+    AcquireSRWLockExclusive(&peer_lock);
+    int was_link = p->link == c;
+    int was_dialed = p->dialed == c;
+    if (was_link) p->link = NULL;
+    if (was_dialed) p->dialed = NULL;
+    ReleaseSRWLockExclusive(&peer_lock);
+    if (was_link) {
+        peer_forget(st, c->peer);
+        printf("Peer %d: link down\n", c->peer);
+    }
+    if (was_link || was_dialed) client_release(c);
+}
+
+int peer_add_shm(int node) {
+    if (node < 1 || node > CHAT_MAX_NODES || peer_find(node) || peer_count == CHAT_MAX_NODES) return 0;
+    Peer* p = &peers[peer_count++];
+    memset(p, 0, sizeof(*p));
+    p->node = node;
+    p->shm = 1;
+    return 1;
+}
+
+// The link of a node on the backplane, with a reference; NULL while down.
+static Client* peer_shm_link(int node) {
+    Peer* p = peer_find(node);
+    AcquireSRWLockShared(&peer_lock);
+    Client* c = p ? p->link : NULL;
+    if (c) client_retain(c);
+    ReleaseSRWLockShared(&peer_lock);
+    return c;
+}
+
+void peer_shm_up(ServerState* st, int node) {
+    Client* c = client_new();
+    if (!c) return;
+    c->sock = INVALID_SOCKET;
+    c->peer = node;
+    c->proto = CHAT_PROTO_BIN;
+    peer_link_up(st, c);
+    client_release(c);
+}
+
+void peer_shm_down(ServerState* st, int node) {
+    Client* c = peer_shm_link(node);
+    if (!c) return;
+    peer_link_closed(st, c);
+    client_release(c);
+}
+
+void peer_shm_frame(ServerState* st, int node, uint8_t* payload, uint32_t payload_len) {
+    Client* c = peer_shm_link(node);
+    if (!c) return;
+    (void)peer_handle_frame(st, c, payload, payload_len);
+    client_release(c);
+}
+
+void peer_shm_resync(ServerState* st, int node) {
+    uint8_t buf[1];
+    ChatBinWriter w;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, CHAT_OP_PEER_RESYNC);
+    peer_send_nodes(st, 1ull << (node - 1), &w, NULL, 0);
+}
+
+void peer_user_changed(ServerState* st, const char* username, int online) {
+    uint8_t buf[8 + CHAT_NAME_MAX];
+    ChatBinWriter w;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, CHAT_OP_PEER_USER);
+    chat_bw_str(&w, username);
+    chat_bw_u8(&w, (uint8_t)online);
+    peer_send_nodes(st, ~0ull, &w, NULL, 0);
+}
+
+void peer_room_changed(ServerState* st, const char* room, int interested) {
+    uint8_t buf[8 + CHAT_NAME_MAX];
+    ChatBinWriter w;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, CHAT_OP_PEER_ROOM);
+    chat_bw_str(&w, room);
+    chat_bw_u8(&w, (uint8_t)interested);
+    peer_send_nodes(st, ~0ull, &w, NULL, 0);
+    if (interested) return;
+    // Nobody here is in it now, so other nodes stop reporting on it.
+    RemoteUser** all = NULL;
+    int n = remote_users_of(st, 0, &all);
+    for (int i = 0; i < n; i++) {
+        int at = remote_in_room(all[i], room);
+        if (at >= 0) memcpy(all[i]->rooms[at], all[i]->rooms[--all[i]->room_count], sizeof(all[i]->rooms[at]));
+    }
+    free(all);
+}
+
+int peer_user_node(ServerState* st, const char* username) {
+    AcquireSRWLockShared(&st->lock);
+    RemoteUser* u = (RemoteUser*)name_table_find(&st->remote_users, username);
+    int node = u ? u->node : 0;
+    ReleaseSRWLockShared(&st->lock);
+    return node;
+}
+
+void peer_each_member(ServerState* st, const char* room, PeerMemberFn fn, void* arg) {
+    NameTable* t = &st->remote_users;
+    for (uint32_t i = 0; i < t->cap; i++) {
+        RemoteUser* u = (RemoteUser*)t->slots[i].item;
+        if (u && remote_in_room(u, room) >= 0) fn(arg, u->id, u->name);
+    }
+}
+
+void peer_relay_msg(ServerState* st, const char* room, const char* user, const char* text, uint32_t text_len) {
+    uint64_t nodes = interest_of(room);
+    if (!nodes) return;
+    uint8_t buf[1 + 2 * (CHAT_VARINT_MAX + CHAT_NAME_MAX)];
+    ChatBinWriter w;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, CHAT_OP_PEER_MSG);
+    chat_bw_str(&w, room);
+    chat_bw_str(&w, user);
+    peer_send_nodes(st, nodes, &w, text, text_len);
+}
+
+void peer_relay_join(ServerState* st, const char* room, const char* user, int joined) {
+    uint64_t nodes = interest_of(room);
+    if (!nodes) return;
+    uint8_t buf[2 + 2 * (CHAT_VARINT_MAX + CHAT_NAME_MAX)];
+    ChatBinWriter w;
+    chat_bw_init(&w, buf, sizeof(buf));
+    chat_bw_u8(&w, CHAT_OP_PEER_JOIN);
+    chat_bw_str(&w, room);
+    chat_bw_str(&w, user);
+    chat_bw_u8(&w, (uint8_t)joined);
+    peer_send_nodes(st, nodes, &w, NULL, 0);
+}
+
+// PEER_PM head: everything before the text.
+static void pm_head(ChatBinWriter* w, uint8_t* buf, uint32_t cap, const char* from, const char* to) {
+    chat_bw_init(w, buf, cap);
+    chat_bw_u8(w, CHAT_OP_PEER_PM);
+    chat_bw_str(w, from);
+    chat_bw_str(w, to);
+}
+
+uint32_t peer_pm_len(const char* from, const char* to, uint32_t text_len) {
+    uint8_t buf[1 + 2 * (CHAT_VARINT_MAX + CHAT_NAME_MAX)];
+    ChatBinWriter w;
+    pm_head(&w, buf, sizeof(buf), from, to);
+    return w.len + text_len;
+}
+
+void peer_relay_pm(ServerState* st, const char* from, const char* to, const char* text, uint32_t text_len) {
+    int node = peer_user_node(st, to);
+    if (!node) return;
+    uint8_t buf[1 + 2 * (CHAT_VARINT_MAX + CHAT_NAME_MAX)];
+    ChatBinWriter w;
+    pm_head(&w, buf, sizeof(buf), from, to);
+    peer_send_nodes(st, 1ull << (node - 1), &w, text, text_len);
+}
+
+// Connect to p and hand the socket to the backend as a link in handshake.
+static void peer_dial(ServerState* st, Peer* p) {
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(p->host, p->port, &hints, &res) != 0) return;
+    SOCKET s = INVALID_SOCKET;
+    for (struct addrinfo* ai = res; ai && s == INVALID_SOCKET; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s != INVALID_SOCKET && connect(s, ai->ai_addr, (int)ai->ai_addrlen) != 0) {
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(res);
+    if (s == INVALID_SOCKET) return;
+    Client* c = chat_socket_set_nonblocking(s) ? client_new() : NULL;
+    if (!c) {
+        closesocket(s);
+        return;
+    }
+    (void)chat_socket_set_nodelay(s);
+    c->sock = s;
+    c->peer = p->node;
+    client_retain(c);
+    AcquireSRWLockExclusive(&peer_lock);
+    p->dialed = c;
+    ReleaseSRWLockExclusive(&peer_lock);
+    if (!st->adopt(st, c)) {
+        AcquireSRWLockExclusive(&peer_lock);
+        p->dialed = NULL;
+        ReleaseSRWLockExclusive(&peer_lock);
+        closesocket(s);
+        client_release(c);
+        client_release(c);
+    }
+}
+
+// Keep a link to every peer with a lower id; the others dial this node.
+// The first round waits a period, by when the backend is serving. Every
+// peer's addresses are looked up again now and then, for NODE checks.
+static CHAT_THREAD_RET CHAT_THREAD_CALL peer_dialer(void* arg) {
+    ServerState* st = (ServerState*)arg;
+    for (uint32_t round = 1;; round++) {
+        Sleep(PEER_RETRY_MS);
+        for (int i = 0; i < peer_count && round % PEER_RESOLVE_ROUNDS == 0; i++) {
+            if (!peers[i].shm) peer_resolve(&peers[i]);
+        }
+        if (!st->adopt) continue;
+        for (int i = 0; i < peer_count; i++) {
+            Peer* p = &peers[i];
+            if (p->shm || p->node > st->node_id) continue;
+            AcquireSRWLockShared(&peer_lock);
+            int busy = p->link || p->dialed;
+            ReleaseSRWLockShared(&peer_lock);
+            if (!busy) peer_dial(st, p);
+        }
+    }
+    return 0;
+}
+
+int peer_start(ServerState* st) {
+    InitializeSRWLock(&peer_lock);
+    int dial = 0;
+    for (int i = 0; i < peer_count; i++) dial |= !peers[i].shm;
+    if (!dial) return 1;
+    if (!st->node_id || peer_find(st->node_id)) {
+        printf("--peer needs --node, and a node cannot be its own peer\n");
+        return 0;
+    }
+    ChatSha256 h;
+    chat_sha256_init(&h);
+    chat_sha256_update(&h, st->peer_secret, strlen(st->peer_secret));
+    chat_sha256_final(&h, secret_hash);
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].shm) continue;
+        peer_resolve(&peers[i]);
+        if (!peers[i].addr_count) printf("Peer %d: cannot resolve %s yet\n", peers[i].node, peers[i].host);
+    }
+    if (!chat_thread_start(peer_dialer, st)) {
+        printf("failed to start the peer dialer\n");
+        return 0;
+    }
+    return 1;
+}
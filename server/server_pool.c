@@ -0,0 +1,268 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Slab pools. Each pool carves fixed-size objects out of 64 KB slabs and
+// recycles them through a free list; slabs are never returned, so a pool's
+// footprint is its high-water mark rather than whatever the heap fragments
+// into. Each thread keeps a small cache per pool so the usual alloc/free is
+// lock-free; caches refill from and spill to the shared list in batches.
+// Buffers are served from power-of-two size classes built the same way.
+
+#define POOL_MAX 16 // Registered pools; ids index the per-thread caches.
+#define POOL_CACHE 32 // Most objects a thread keeps per pool.
+#define POOL_CACHE_BYTES (32u * 1024u) // Per-pool cache budget for large objects.
+#define POOL_SLAB_BYTES (64u * 1024u)
+#define POOL_ALIGN 16u
+#define BUF_CLASS_MIN 32u // Smallest buffer class; each next class doubles.
+
+typedef struct PoolFree {
+    struct PoolFree* next;
+} PoolFree;
+
+typedef struct PoolCache {
+    void* items[POOL_CACHE];
+    int count;
+} PoolCache;
+
+// One thread's caches and counters for every pool. Counters are summed by
+// pool_stats_all; a record (and its counts) outlives its thread and is
+// reused by the next one.
+typedef struct PoolThread {
+    PoolCache caches[POOL_MAX];
+    volatile int64_t live[POOL_MAX]; // Allocations minus frees by this thread.
+    volatile int64_t live_bytes[POOL_MAX]; // Requested bytes, likewise.
+    volatile uint64_t allocs[POOL_MAX];
+    int in_use; // Claimed by a live thread; guarded by pool_lock.
+    struct PoolThread* next;
+} PoolThread;
+
+static CRITICAL_SECTION pool_lock; // Guards the thread records.
+static PoolThread* pool_threads;
+static ObjPool* pools[POOL_MAX];
+static int pool_count;
+static ObjPool buf_pools[BUF_CLASSES];
+static CHAT_THREAD_LOCAL PoolThread* pool_self;
+
+static const char* buf_class_names[BUF_CLASSES] = {
+    "buf32", "buf64", "buf128", "buf256", "buf512", "buf1k", "buf2k", "buf4k", "buf8k", "buf16k",
+};
+
+void pools_init(void) {
+    InitializeCriticalSection(&pool_lock);
+    for (int i = 0; i < BUF_CLASSES; i++) pool_init(&buf_pools[i], buf_class_names[i], BUF_CLASS_MIN << i);
+}
+
+int pool_init(ObjPool* p, const char* name, size_t size) {
+    if (pool_count == POOL_MAX) return 0;
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->size = (uint32_t)((size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1));
+    p->per_slab = POOL_SLAB_BYTES / p->size ? POOL_SLAB_BYTES / p->size : 1;
+    // Caches move half their capacity at a time to or from the shared list.
+    p->cache_max = POOL_CACHE_BYTES / p->size;
+    if (p->cache_max > POOL_CACHE) p->cache_max = POOL_CACHE;
+    if (p->cache_max < 2) p->cache_max = 2;
+    p->id = pool_count;
+    InitializeCriticalSection(&p->lock);
+    pools[pool_count++] = p;
+    return 1;
+}
+
+static PoolThread* pool_thread(void) {
+    if (pool_self) return pool_self;
+    EnterCriticalSection(&pool_lock);
+    PoolThread* t = pool_threads;
+    while (t && t->in_use) t = t->next;
+    if (!t) {
+        t = (PoolThread*)calloc(1, sizeof(*t));
+        if (t) {
+            t->next = pool_threads;
+            pool_threads = t;
+        }
+    }
+    if (t) t->in_use = 1;
+    LeaveCriticalSection(&pool_lock);
+    pool_self = t;
+    return t;
+}
+
+// Carve a new slab onto the free list; caller holds p->lock.
+static int pool_grow(ObjPool* p) {
+    if (p->slab_count == p->slab_cap) {
+        uint32_t cap = p->slab_cap ? p->slab_cap * 2 : 16;
+        void** slabs = (void**)realloc(p->slabs, (size_t)cap * sizeof(*slabs));
+        if (!slabs) return 0;
+        p->slabs = slabs;
+        p->slab_cap = cap;
+    }
+    uint8_t* slab = (uint8_t*)malloc((size_t)p->per_slab * p->size);
+    if (!slab) return 0;
+    p->slabs[p->slab_count++] = slab;
+    for (uint32_t i = p->per_slab; i-- > 0;) {
+        PoolFree* f = (PoolFree*)(slab + (size_t)i * p->size);
+        f->next = (PoolFree*)p->free_list;
+        p->free_list = f;
+    }
+    p->free_count += p->per_slab;
+    return 1;
+}
+
+// Move up to n objects from the shared list into out; returns how many.
+static int pool_take(ObjPool* p, void** out, int n) {
+    int got = 0;
+    EnterCriticalSection(&p->lock);
+    while (got < n) {
+        if (!p->free_list && !pool_grow(p)) break;
+        PoolFree* f = (PoolFree*)p->free_list;
+        p->free_list = f->next;
+        p->free_count--;
+        out[got++] = f;
+    }
+    LeaveCriticalSection(&p->lock);
+    return got;
+}
+
+static void pool_give(ObjPool* p, void** objs, int n) {
+    EnterCriticalSection(&p->lock);
+    for (int i = 0; i < n; i++) {
+        PoolFree* f = (PoolFree*)objs[i];
+        f->next = (PoolFree*)p->free_list;
+        p->free_list = f;
+    }
+    p->free_count += (uint32_t)n;
+    LeaveCriticalSection(&p->lock);
+}
+
+// Counts for a thread that could not get a record (out of memory).
+static void pool_count_orphan(ObjPool* p, int64_t n, int64_t bytes) {
+    EnterCriticalSection(&p->lock);
+    p->orphan_live += n;
+    p->orphan_bytes += bytes;
+    if (n > 0) p->orphan_allocs++;
+    LeaveCriticalSection(&p->lock);
+}
+
+static void* pool_alloc_sized(ObjPool* p, size_t size) {
+    PoolThread* t = pool_thread();
+    void* obj = NULL;
+    if (!t) {
+        if (pool_take(p, &obj, 1) == 0) return NULL;
+        pool_count_orphan(p, 1, (int64_t)size);
+        return obj;
+    }
+    PoolCache* c = &t->caches[p->id];
+    if (c->count == 0) c->count = pool_take(p, c->items, (int)p->cache_max / 2);
+    if (c->count == 0) return NULL;
+    obj = c->items[--c->count];
+    t->live[p->id]++;
+    t->live_bytes[p->id] += (int64_t)size;
+    t->allocs[p->id]++;
+    return obj;
+}
+
+static void pool_free_sized(ObjPool* p, void* obj, size_t size) {
+    PoolThread* t = pool_thread();
+    if (!t) {
+        pool_give(p, &obj, 1);
+        pool_count_orphan(p, -1, -(int64_t)size);
+        return;
+    }
+    PoolCache* c = &t->caches[p->id];
+    if (c->count == (int)p->cache_max) {
+        int n = (int)p->cache_max / 2;
+        c->count -= n;
+        pool_give(p, c->items + c->count, n);
+    }
+    c->items[c->count++] = obj;
+    t->live[p->id]--;
+    t->live_bytes[p->id] -= (int64_t)size;
+}
+
+int pool_reserve(ObjPool* p, uint32_t n) {
+    EnterCriticalSection(&p->lock);
+    int ok = 1;
+    while (ok && p->free_count < n) ok = pool_grow(p);
+    LeaveCriticalSection(&p->lock);
+    return ok;
+}
+
+void* pool_alloc(ObjPool* p) {
+    return pool_alloc_sized(p, p->size);
+}
+
+void pool_free(ObjPool* p, void* obj) {
+    if (obj) pool_free_sized(p, obj, p->size);
+}
+
+static ObjPool* buf_class(size_t size) {
+    uint32_t cap = BUF_CLASS_MIN;
+    for (int i = 0; i < BUF_CLASSES; i++, cap <<= 1) {
+        if (size <= cap) return &buf_pools[i];
+    }
+    return NULL;
+}
+
+void* buf_alloc(size_t size) {
+    ObjPool* p = buf_class(size);
+    return p ? pool_alloc_sized(p, size) : malloc(size);
+}
+
+void buf_free(void* buf, size_t size) {
+    if (!buf) return;
+    ObjPool* p = buf_class(size);
+    if (p) pool_free_sized(p, buf, size);
+    else free(buf);
+}
+
+void pool_thread_exit(void) {
+    PoolThread* t = pool_self;
+    if (!t) return;
+    for (int i = 0; i < pool_count; i++) {
+        PoolCache* c = &t->caches[i];
+        if (c->count > 0) pool_give(pools[i], c->items, c->count);
+        c->count = 0;
+    }
+    EnterCriticalSection(&pool_lock);
+    t->in_use = 0;
+    LeaveCriticalSection(&pool_lock);
+    pool_self = NULL;
+}
+
+int pool_stats_all(PoolStats* out, int max) {
+    int n = pool_count < max ? pool_count : max;
+    for (int i = 0; i < n; i++) {
+        ObjPool* p = pools[i];
+        PoolStats* s = &out[i];
+        memset(s, 0, sizeof(*s));
+        s->name = p->name;
+        s->obj_size = p->size;
+
+        // Other threads' counters are read racily; stats are a snapshot.
+        EnterCriticalSection(&p->lock);
+        int64_t live = p->orphan_live;
+        int64_t live_bytes = p->orphan_bytes;
+        uint64_t allocs = p->orphan_allocs;
+        uint64_t total = (uint64_t)p->slab_count * p->per_slab;
+        s->slabs = p->slab_count;
+        LeaveCriticalSection(&p->lock);
+        EnterCriticalSection(&pool_lock);
+        for (PoolThread* t = pool_threads; t; t = t->next) {
+            live += t->live[i];
+            live_bytes += t->live_bytes[i];
+            allocs += t->allocs[i];
+        }
+        LeaveCriticalSection(&pool_lock);
+        if (live_bytes < 0) live_bytes = 0;
+
+        s->in_use = live > 0 ? (uint64_t)live : 0;
+        s->idle = total > s->in_use ? total - s->in_use : 0;
+        s->reserved_bytes = total * p->size;
+        s->allocs = allocs;
+        // Share of reserved memory not holding requested bytes: idle objects
+        // plus rounding up to the object or class size.
+        if (s->reserved_bytes) s->frag_pct = 100.0 * (1.0 - (double)live_bytes / (double)s->reserved_bytes);
+    }
+    return n;
+}
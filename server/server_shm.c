@@ -0,0 +1,412 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Shared-memory backplane: several chat_server processes on one host, for
+// example behind one SO_REUSEPORT port, federate through a POSIX shm
+// segment instead of TCP links. Each process claims one of its slots and
+// becomes node slot + 1; server_peer.c treats the others as peers whose
+// link has no socket.
+//
+// Every slot owns a ring its process alone writes. A frame is written once,
+// tagged with the slots it is for: for room traffic, the room's interest
+// bitmap, so nodes without members there are neither addressed nor woken.
+// Every consumer reads every ring but skips frames not tagged for it
+// after reading their header. The writer never waits for readers. It
+// raises claim before overwriting bytes and tail after writing them, and a
+// reader that finds claim more than a ring ahead of what it just copied
+// drops the copy. Then it rebuilds its view of the writer: a lagging or
+// stopped process can lose frames, but it never stalls the others.
+//
+// A consumer with nothing to read sleeps on a futex in its slot. Writers
+// only wake a slot they tagged whose consumer says it is asleep, so a busy
+// consumer costs them no syscalls. A slot is owned through a lock on its
+// byte of the segment file, which the kernel drops when the owner exits,
+// however it exits; the next process to start takes the slot over. The
+// others notice within SHM_SCAN_MS that the lock is gone or the
+// generation changed, and drop what the old owner announced.
+
+#ifndef __linux__
+
+int shm_attach(const char* name, uint32_t ring_bytes) {
+    (void)name;
+    (void)ring_bytes;
+    printf("The shared-memory backplane needs Linux.\n");
+    return 0;
+}
+
+int shm_start(ServerState* st) {
+    (void)st;
+    return 1;
+}
+
+void shm_publish(uint64_t nodes, const uint8_t* head, uint32_t head_len, const char* text, uint32_t text_len) {
+    (void)nodes;
+    (void)head;
+    (void)head_len;
+    (void)text;
+    (void)text_len;
+}
+
+#else
+
+#define SHM_MAGIC 0x4c504b4254414843ull // "CHATBKPL"
+#define SHM_VERSION 1
+#define SHM_PAD 0xFFFFFFFFu // Record length: the rest of the ring is unused.
+#define SHM_RECORD_MAX (CHAT_MAX_FRAME + 256u) // Largest payload (a PEER_MSG head and its text).
+#define SHM_SCAN_MS 100 // Longest consumer sleep; slots are checked this often.
+#define SHM_OPEN_WAIT_MS 2000 // How long to wait for another process creating the segment.
+
+typedef struct ShmSlot {
+    volatile uint32_t generation; // Bumped by every new owner; 0 if never owned.
+    volatile uint32_t wake; // Futex word, bumped to wake the owner's consumer.
+    volatile uint32_t sleeping; // The owner's consumer is in (or entering) its wait.
+    volatile uint64_t claim; // Ring bytes the owner may be writing; raised first.
+    volatile uint64_t tail; // Ring bytes written.
+    uint8_t pad[32];
+} ShmSlot;
+_Static_assert(sizeof(ShmSlot) == 64, "one cache line per slot");
+
+typedef struct ShmHeader {
+    volatile uint64_t magic; // Stored last by the creator.
+    uint32_t version;
+    uint32_t ring_bytes;
+    uint8_t pad[48];
+    ShmSlot slots[CHAT_SHM_PROCS];
+} ShmHeader; // Rings follow, one per slot.
+
+// Records are 8-byte aligned and never wrap: one that would is preceded
+// by a SHM_PAD record filling the ring's end.
+typedef struct ShmRecord {
+    uint32_t len; // Payload bytes, or SHM_PAD.
+    uint32_t to; // Slots it is for (bit slot).
+} ShmRecord;
+
+// Another slot's ring, as this process's consumer reads it.
+typedef struct ShmSource {
+    uint32_t generation; // Owner being read; 0 while not linked.
+    uint64_t cursor;
+    // At attach: where each ring was, so that frames its owner wrote for
+    // a previous owner of this slot are skipped.
+    uint32_t attach_generation;
+    uint64_t attach_tail;
+} ShmSource;
+
+typedef struct Backplane {
+    ShmHeader* hdr;
+    int fd; // Kept open: it holds the slot lock.
+    uint8_t* rings;
+    uint32_t ring_bytes;
+    int self;
+    CRITICAL_SECTION lock; // Serializes this process's writers.
+    uint64_t pos; // Own ring's tail (under lock).
+    ShmSource sources[CHAT_SHM_PROCS]; // Consumer thread only.
+} Backplane;
+
+static Backplane bp;
+
+static uint8_t* ring_of(int slot) {
+    return bp.rings + (size_t)slot * bp.ring_bytes;
+}
+
+static uint32_t record_size(uint32_t len) {
+    return (uint32_t)sizeof(ShmRecord) + ((len + 7u) & ~7u);
+}
+
+static long futex(volatile uint32_t* addr, int op, uint32_t val, const struct timespec* timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// Slot ownership: an open-file-description lock on byte slot of the file.
+static int slot_lock(int fd, int slot, int cmd, struct flock* fl) {
+    memset(fl, 0, sizeof(*fl));
+    fl->l_type = F_WRLCK;
+    fl->l_whence = SEEK_SET;
+    fl->l_start = slot;
+    fl->l_len = 1;
+    return fcntl(fd, cmd, fl) == 0;
+}
+
+static int slot_owned(int slot) {
+    struct flock fl;
+    return slot_lock(bp.fd, slot, F_OFD_GETLK, &fl) && fl.l_type != F_UNLCK;
+}
+
+// Open the segment, or create it; waits for a concurrent creator.
+static ShmHeader* shm_map(const char* path, uint32_t ring_bytes, size_t* size_out, int* fd_out) {
+    size_t size = sizeof(ShmHeader) + (size_t)CHAT_SHM_PROCS * ring_bytes;
+    int created = 1;
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(path, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        printf("shm_open %s failed: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (created && ftruncate(fd, (off_t)size) != 0) {
+        printf("sizing %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        (void)shm_unlink(path);
+        return NULL;
+    }
+    struct stat sb;
+    for (int waited = 0;; waited += 10) {
+        if (fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(ShmHeader)) break;
+        if (waited >= SHM_OPEN_WAIT_MS) {
+            printf("%s was never sized by its creator\n", path);
+            close(fd);
+            return NULL;
+        }
+        Sleep(10);
+    }
+    size = (size_t)sb.st_size;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("mapping %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    ShmHeader* hdr = (ShmHeader*)base;
+    if (created) {
+        hdr->version = SHM_VERSION;
+        hdr->ring_bytes = ring_bytes;
+        __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_SEQ_CST);
+    }
+    for (int waited = 0; __atomic_load_n(&hdr->magic, __ATOMIC_SEQ_CST) != SHM_MAGIC; waited += 10) {
+        if (waited >= SHM_OPEN_WAIT_MS) break;
+        Sleep(10);
+    }
+    uint32_t rb = hdr->ring_bytes;
+    if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION || rb < 2 * record_size(SHM_RECORD_MAX) ||
+        (rb & (rb - 1)) != 0 || size != sizeof(ShmHeader) + (size_t)CHAT_SHM_PROCS * rb) {
+        printf("%s is not a chat_server backplane of this version\n", path);
+        munmap(base, size);
+        close(fd);
+        return NULL;
+    }
+    *size_out = size;
+    *fd_out = fd;
+    return hdr;
+}
+
+int shm_attach(const char* name, uint32_t ring_bytes) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    size_t size = 0;
+    int fd = -1;
+    ShmHeader* hdr = shm_map(path, ring_bytes, &size, &fd);
+    if (!hdr) return 0;
+
+    int self = -1;
+    struct flock fl;
+    for (int i = 0; i < CHAT_SHM_PROCS && self < 0; i++) {
+        if (slot_lock(fd, i, F_OFD_SETLK, &fl)) self = i;
+    }
+    if (self < 0) {
+        printf("%s: all %d slots are in use\n", path, CHAT_SHM_PROCS);
+        munmap(hdr, size);
+        close(fd);
+        return 0;
+    }
+
+    bp.hdr = hdr;
+    bp.fd = fd;
+    bp.rings = (uint8_t*)hdr + sizeof(ShmHeader);
+    bp.ring_bytes = hdr->ring_bytes;
+    bp.self = self;
+    bp.pos = 0;
+    InitializeCriticalSection(&bp.lock);
+    // Note where the other rings are before announcing this owner: anything
+    // written for it comes after.
+    for (int i = 0; i < CHAT_SHM_PROCS; i++) {
+        ShmSource* src = &bp.sources[i];
+        src->attach_generation = __atomic_load_n(&hdr->slots[i].generation, __ATOMIC_SEQ_CST);
+        src->attach_tail = __atomic_load_n(&hdr->slots[i].tail, __ATOMIC_SEQ_CST);
+        if (i != self) (void)peer_add_shm(i + 1);
+    }
+    ShmSlot* s = &hdr->slots[self];
+    __atomic_store_n(&s->claim, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->tail, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+    (void)__atomic_add_fetch(&s->generation, 1, __ATOMIC_SEQ_CST);
+    if (bp.ring_bytes != ring_bytes) {
+        printf("Backplane: %s already exists with %u KB rings\n", path, bp.ring_bytes >> 10);
+    }
+    return self + 1;
+}
+
+void shm_publish(uint64_t nodes, const uint8_t* head, uint32_t head_len, const char* text, uint32_t text_len) {
+    uint32_t to = (uint32_t)(nodes & ((1u << CHAT_SHM_PROCS) - 1)) & ~(1u << bp.self);
+    uint32_t len = head_len + text_len;
+    if (!bp.hdr || !to || len > SHM_RECORD_MAX) return;
+    uint32_t need = record_size(len);
+    ShmSlot* s = &bp.hdr->slots[bp.self];
+    uint8_t* ring = ring_of(bp.self);
+
+    EnterCriticalSection(&bp.lock);
+    uint64_t pos = bp.pos;
+    uint32_t off = (uint32_t)(pos & (bp.ring_bytes - 1));
+    uint64_t start = off + need > bp.ring_bytes ? pos + (bp.ring_bytes - off) : pos;
+    // Readers check claim after copying, so it rises before any byte changes.
+    __atomic_store_n(&s->claim, start + need, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (start != pos) {
+        ShmRecord pad = {SHM_PAD, 0};
+        memcpy(ring + off, &pad, sizeof(pad));
+    }
+    uint8_t* at = ring + (start & (bp.ring_bytes - 1));
+    ShmRecord rec = {len, to};
+    memcpy(at, &rec, sizeof(rec));
+    memcpy(at + sizeof(rec), head, head_len);
+    if (text_len) memcpy(at + sizeof(rec) + head_len, text, text_len);
+    bp.pos = start + need;
+    __atomic_store_n(&s->tail, bp.pos, __ATOMIC_RELEASE);
+    LeaveCriticalSection(&bp.lock);
+
+    // Pairs with the consumer's fence between raising sleeping and its
+    // last look at the rings: one of the two sees the other.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < CHAT_SHM_PROCS; i++) {
+        if (!((to >> i) & 1u)) continue;
+        ShmSlot* d = &bp.hdr->slots[i];
+        if (!__atomic_load_n(&d->sleeping, __ATOMIC_RELAXED)) continue;
+        if (!__atomic_exchange_n(&d->sleeping, 0, __ATOMIC_SEQ_CST)) continue;
+        (void)__atomic_add_fetch(&d->wake, 1, __ATOMIC_SEQ_CST);
+        (void)futex(&d->wake, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+// Link new owners and drop gone ones.
+static void shm_scan(ServerState* st) {
+    for (int i = 0; i < CHAT_SHM_PROCS; i++) {
+        if (i == bp.self) continue;
+        ShmSlot* s = &bp.hdr->slots[i];
+        ShmSource* src = &bp.sources[i];
+        uint32_t gen = __atomic_load_n(&s->generation, __ATOMIC_SEQ_CST);
+        int alive = slot_owned(i);
+        if (src->generation && (!alive || gen != src->generation)) {
+            peer_shm_down(st, i + 1);
+            src->generation = 0;
+        }
+        if (!src->generation && alive && gen) {
+            // An owner that came after this process starts its ring at 0.
+            src->generation = gen;
+            src->cursor = gen == src->attach_generation ? src->attach_tail : 0;
+            peer_shm_up(st, i + 1);
+        }
+    }
+}
+
+// Frames lost from a ring: forget its owner's state and have it sent again.
+static void shm_lost(ServerState* st, int slot) {
+    ShmSource* src = &bp.sources[slot];
+    src->cursor = __atomic_load_n(&bp.hdr->slots[slot].tail, __ATOMIC_ACQUIRE);
+    printf("Peer %d: backplane frames lost, resyncing\n", slot + 1);
+    peer_shm_down(st, slot + 1);
+    peer_shm_up(st, slot + 1);
+    peer_shm_resync(st, slot + 1);
+}
+
+// Handle every frame for this process in the linked rings; returns how many.
+static int shm_drain(ServerState* st, uint8_t* buf) {
+    int handled = 0;
+    uint32_t me = 1u << bp.self;
+    uint64_t size = bp.ring_bytes;
+    for (int i = 0; i < CHAT_SHM_PROCS; i++) {
+        ShmSource* src = &bp.sources[i];
+        if (!src->generation) continue;
+        ShmSlot* s = &bp.hdr->slots[i];
+        const uint8_t* ring = ring_of(i);
+        uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+        // tail below the cursor: a new owner is starting; the scan relinks it.
+        while (src->cursor < tail) {
+            uint64_t cur = src->cursor;
+            uint32_t off = (uint32_t)(cur & (size - 1));
+            ShmRecord rec;
+            memcpy(&rec, ring + off, sizeof(rec));
+            uint64_t next = cur + (size - off);
+            int mine = 0;
+            int bad = tail - cur > size;
+            if (!bad && rec.len != SHM_PAD) {
+                bad = rec.len > SHM_RECORD_MAX || off + record_size(rec.len) > size;
+                next = cur + record_size(rec.len);
+                mine = !bad && (rec.to & me);
+                if (mine) memcpy(buf, ring + off + sizeof(rec), rec.len);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (bad || __atomic_load_n(&s->claim, __ATOMIC_RELAXED) - cur > size) {
+                shm_lost(st, i);
+                break;
+            }
+            src->cursor = next;
+            if (mine) {
+                buf[rec.len] = 0;
+                peer_shm_frame(st, i + 1, buf, rec.len);
+                handled++;
+            }
+        }
+    }
+    return handled;
+}
+
+static int shm_pending(void) {
+    for (int i = 0; i < CHAT_SHM_PROCS; i++) {
+        ShmSource* src = &bp.sources[i];
+        if (src->generation && __atomic_load_n(&bp.hdr->slots[i].tail, __ATOMIC_ACQUIRE) > src->cursor) return 1;
+    }
+    return 0;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL shm_consumer(void* arg) {
+    ServerState* st = (ServerState*)arg;
+    static uint8_t buf[SHM_RECORD_MAX + 1];
+    ShmSlot* me = &bp.hdr->slots[bp.self];
+    // Frames are handled like a link's, which needs the backend serving.
+    while (!st->broadcast) Sleep(10);
+
+    uint64_t next_scan = 0;
+    for (;;) {
+        uint64_t now = chat_now_ns();
+        if (now >= next_scan) {
+            shm_scan(st);
+            next_scan = now + SHM_SCAN_MS * 1000000ull;
+        }
+        if (shm_drain(st, buf)) continue;
+
+        uint32_t seen = __atomic_load_n(&me->wake, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&me->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!shm_pending()) {
+            struct timespec ts = {0, SHM_SCAN_MS * 1000000L};
+            (void)futex(&me->wake, FUTEX_WAIT, seen, &ts);
+        }
+        __atomic_store_n(&me->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+int shm_start(ServerState* st) {
+    if (!bp.hdr) return 1;
+    if (!chat_thread_start(shm_consumer, st)) {
+        printf("failed to start the backplane consumer\n");
+        return 0;
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ObjPool client_pool;
+static ObjPool room_pool;
+static size_t room_size; // Room plus one RoomShard per shard.
+
+void state_pools_init(int nshards) {
+    pools_init();
+    room_size = sizeof(Room) + (size_t)nshards * sizeof(RoomShard);
+    (void)pool_init(&client_pool, "client", sizeof(Client));
+    (void)pool_init(&room_pool, "room", room_size);
+}
+
+int state_reserve_clients(uint32_t n) {
+    return pool_reserve(&client_pool, n);
+}
+
+// Find an authenticated client by username (case-insensitive).
+Client* state_find_client_by_name(ServerState* st, const char* username) {
+    return (Client*)name_table_find(&st->users, username);
+}
+
+int state_register_user(ServerState* st, Client* c) {
+    return name_table_insert(&st->users, c->username, c);
+}
+
+// Find a room by name (case-insensitive).
+Room* state_find_room(ServerState* st, const char* name) {
+    return (Room*)name_table_find(&st->rooms, name);
+}
+
+// Look up or create a room; caller must hold st->lock.
+Room* state_get_or_create_room(ServerState* st, const char* name) {
+    Room* r = state_find_room(st, name);
+    if (r) return r;
+
+    r = (Room*)pool_alloc(&room_pool);
+    if (!r) return NULL;
+    memset(r, 0, room_size);
+    strncpy(r->name, name, CHAT_NAME_MAX);
+    r->name[CHAT_NAME_MAX] = 0;
+    r->id = ++st->last_room_id;
+    r->refs = 1; // Held by the registry.
+    if (!name_table_insert(&st->rooms, r->name, r)) {
+        pool_free(&room_pool, r);
+        return NULL;
+    }
+    history_attach(st, r);
+    history_backfill(st, r);
+    if (st->node_id) peer_room_changed(st, r->name, 1);
+    return r;
+}
+
+void state_prune_room(ServerState* st, Room* r) {
+    if (chat_atomic_load64(&r->shard_mask) != 0) return;
+    if (name_table_find(&st->rooms, r->name) != r) return;
+    (void)name_table_remove(&st->rooms, r->name);
+    if (st->node_id) peer_room_changed(st, r->name, 0);
+    history_detach(st, r);
+    room_release(r);
+}
+
+int state_leave_all_rooms(ServerState* st, Client* c, Room*** out) {
+    int count = (int)c->joined_count;
+    Room** left = count ? (Room**)malloc((size_t)count * sizeof(*left)) : NULL;
+    if (count && !left) count = 0; // Still leave every room, just without notices.
+
+    int n = 0;
+    while (c->joined_count > 0) {
+        Room* r = c->joined[c->joined_count - 1].room;
+        room_retain(r);
+        room_remove_member(r, c);
+        state_prune_room(st, r);
+        if (n < count) left[n++] = r;
+        else room_release(r);
+    }
+    *out = left;
+    return n;
+}
+
+// Index of r in c->joined, or -1.
+static int client_link_index(Client* c, Room* r) {
+    for (uint32_t i = 0; i < c->joined_count; i++) {
+        if (c->joined[i].room == r) return (int)i;
+    }
+    return -1;
+}
+
+// Check if a client is already in the room.
+int room_has_member(Room* r, Client* c) {
+    return client_link_index(c, r) >= 0;
+}
+
+RoomLink* client_find_link(Client* c, const char* name) {
+    for (uint32_t i = 0; i < c->joined_count; i++) {
+        if (_stricmp(c->joined[i].room->name, name) == 0) return &c->joined[i];
+    }
+    return NULL;
+}
+
+RoomLink* client_find_link_id(Client* c, uint32_t id) {
+    for (uint32_t i = 0; i < c->joined_count; i++) {
+        if (c->joined[i].room->id == id) return &c->joined[i];
+    }
+    return NULL;
+}
+
+Room* client_find_joined(Client* c, const char* name) {
+    RoomLink* link = client_find_link(c, name);
+    return link ? link->room : NULL;
+}
+
+Room* client_find_joined_id(Client* c, uint32_t id) {
+    RoomLink* link = client_find_link_id(c, id);
+    return link ? link->room : NULL;
+}
+
+static void member_snap_free(EpochNode* n) {
+    MemberSnap* snap = (MemberSnap*)n;
+    for (int i = 0; i < snap->count; i++) client_release(snap->members[i]);
+    buf_free(snap, sizeof(*snap) + (size_t)snap->count * sizeof(Client*));
+}
+
+// Unpublish the shard's snapshot after a membership change; caller holds
+// st->lock exclusively, so no reader can be rebuilding it concurrently.
+static void room_shard_invalidate(RoomShard* rs) {
+    MemberSnap* old = (MemberSnap*)chat_atomic_xchg_ptr(&rs->snap, NULL);
+    if (old) epoch_retire(&old->node, member_snap_free);
+}
+
+MemberSnap* room_shard_snapshot(ServerState* st, RoomShard* rs) {
+    MemberSnap* snap = (MemberSnap*)chat_atomic_load_ptr(&rs->snap);
+    if (snap) return snap;
+
+    AcquireSRWLockShared(&st->lock);
+    snap = (MemberSnap*)chat_atomic_load_ptr(&rs->snap);
+    if (!snap && rs->member_count > 0) {
+        MemberSnap* fresh = (MemberSnap*)buf_alloc(sizeof(*fresh) + (size_t)rs->member_count * sizeof(Client*));
+        if (fresh) {
+            fresh->count = rs->member_count;
+            for (int i = 0; i < fresh->count; i++) {
+                fresh->members[i] = rs->members[i];
+                client_retain(fresh->members[i]);
+            }
+            // Other readers may be building the same list under the shared lock.
+            snap = (MemberSnap*)chat_atomic_cas_ptr(&rs->snap, NULL, fresh);
+            if (snap) member_snap_free(&fresh->node);
+            else snap = fresh;
+        }
+    }
+    ReleaseSRWLockShared(&st->lock);
+    return snap;
+}
+
+// Reallocate a shard's member arrays as one block: pointers, then links.
+static int room_shard_resize(RoomShard* rs, int cap) {
+    Client** members = (Client**)malloc((size_t)cap * (sizeof(*rs->members) + sizeof(*rs->links)));
+    if (!members) return 0;
+    uint32_t* links = (uint32_t*)(members + cap);
+    if (rs->member_count > 0) {
+        memcpy(members, rs->members, (size_t)rs->member_count * sizeof(*members));
+        memcpy(links, rs->links, (size_t)rs->member_count * sizeof(*links));
+    }
+    free(rs->members);
+    rs->members = members;
+    rs->links = links;
+    rs->member_cap = cap;
+    return 1;
+}
+
+int room_add_member(Room* r, Client* c) {
+    if (!r || !c) return 0;
+    if (room_has_member(r, c)) return 1;
+    RoomShard* rs = &r->shards[c->shard];
+    if (rs->member_count == rs->member_cap && !room_shard_resize(rs, rs->member_cap ? rs->member_cap * 2 : 4)) return 0;
+    if (c->joined_count == c->joined_cap) {
+        uint32_t cap = c->joined_cap ? c->joined_cap * 2 : 4;
+        RoomLink* joined = (RoomLink*)realloc(c->joined, (size_t)cap * sizeof(*joined));
+        if (!joined) return 0;
+        c->joined = joined;
+        c->joined_cap = cap;
+    }
+
+    room_shard_invalidate(rs);
+    uint32_t slot = (uint32_t)rs->member_count++;
+    rs->members[slot] = c;
+    rs->links[slot] = c->joined_count;
+    c->joined[c->joined_count].room = r;
+    c->joined[c->joined_count].slot = slot;
+    c->joined[c->joined_count].text_head_len = 0;
+    c->joined[c->joined_count].bin_head_len = 0;
+    c->joined_count++;
+    (void)chat_atomic_add(c->proto == CHAT_PROTO_BIN ? &r->bin_members : &r->text_members, 1);
+    if (c->zip) (void)chat_atomic_add(c->proto == CHAT_PROTO_BIN ? &r->bin_zip_members : &r->text_zip_members, 1);
+    if (rs->member_count == 1) chat_atomic_or64(&r->shard_mask, 1ull << c->shard);
+    return 1;
+}
+
+// Remove a client by swapping the last entry into its place, on both sides.
+void room_remove_member(Room* r, Client* c) {
+    if (!r || !c) return;
+    int li = client_link_index(c, r);
+    if (li < 0) return;
+    RoomShard* rs = &r->shards[c->shard];
+
+    room_shard_invalidate(rs);
+    (void)chat_atomic_add(c->proto == CHAT_PROTO_BIN ? &r->bin_members : &r->text_members, -1);
+    if (c->zip) (void)chat_atomic_add(c->proto == CHAT_PROTO_BIN ? &r->bin_zip_members : &r->text_zip_members, -1);
+    uint32_t slot = c->joined[li].slot;
+    uint32_t last = (uint32_t)--rs->member_count;
+    if (slot != last) {
+        Client* moved = rs->members[last];
+        rs->members[slot] = moved;
+        rs->links[slot] = rs->links[last];
+        moved->joined[rs->links[slot]].slot = slot;
+    }
+
+    uint32_t last_link = --c->joined_count;
+    if ((uint32_t)li != last_link) {
+        RoomLink* moved = &c->joined[li];
+        *moved = c->joined[last_link];
+        moved->room->shards[c->shard].links[moved->slot] = (uint32_t)li;
+    }
+
+    if (rs->member_count == 0) {
+        chat_atomic_and64(&r->shard_mask, ~(1ull << c->shard));
+        free(rs->members); // links share the block
+        memset(rs, 0, sizeof(*rs));
+    } else if (rs->member_cap > 16 && rs->member_count <= rs->member_cap / 4) {
+        (void)room_shard_resize(rs, rs->member_cap / 2);
+    }
+}
+
+void room_retain(Room* r) {
+    chat_atomic_add(&r->refs, 1);
+}
+
+void room_release(Room* r) {
+    if (chat_atomic_add(&r->refs, -1) != 0) return;
+    DeleteCriticalSection(&r->hist.lock);
+    pool_free(&room_pool, r);
+}
+
+Client* client_new(void) {
+    Client* c = (Client*)pool_alloc(&client_pool);
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->refs = 1;
+    c->proto = CHAT_PROTO_TEXT;
+    chat_decoder_init(&c->in, CHAT_MAX_FRAME);
+    InitializeCriticalSection(&c->send_lock);
+    return c;
+}
+
+int client_park_input(Client* c) {
+    size_t n = chat_decoder_unread(&c->in);
+    uint8_t* buf = NULL;
+    if (n) {
+        // One spare byte for the decoder's terminator.
+        buf = (uint8_t*)buf_alloc(n + 1);
+        if (!buf) return 0;
+        chat_decoder_move(&c->in, buf);
+    }
+    // The bytes may have come out of an older parked buffer.
+    client_unpark(c);
+    c->parked = buf;
+    c->parked_len = (uint32_t)n;
+    return 1;
+}
+
+void client_unpark(Client* c) {
+    if (!c->parked) return;
+    buf_free(c->parked, c->parked_len + 1);
+    c->parked = NULL;
+    c->parked_len = 0;
+}
+
+// Link a newly accepted client into the global list.
+void state_add_client(ServerState* st, Client* c) {
+    AcquireSRWLockExclusive(&st->lock);
+    c->prev = NULL;
+    c->next = st->clients;
+    if (st->clients) st->clients->prev = c;
+    st->clients = c;
+    ReleaseSRWLockExclusive(&st->lock);
+}
+
+// Unlink from the global list and the username index under lock.
+void state_remove_client(ServerState* st, Client* c) {
+    AcquireSRWLockExclusive(&st->lock);
+    if (c->prev) c->prev->next = c->next;
+    else if (st->clients == c) st->clients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->next = NULL;
+    c->prev = NULL;
+    if (c->authed && name_table_find(&st->users, c->username) == c) {
+        (void)name_table_remove(&st->users, c->username);
+        if (st->node_id) peer_user_changed(st, c->username, 0);
+    }
+    ReleaseSRWLockExclusive(&st->lock);
+}
+
+void client_retain(Client* c) {
+    chat_atomic_add(&c->refs, 1);
+}
+
+void client_release(Client* c) {
+    if (chat_atomic_add(&c->refs, -1) != 0) return;
+    auth_discard(c);
+    client_unpark(c);
+    outq_clear(&c->outq);
+    DeleteCriticalSection(&c->send_lock);
+    free(c->joined);
+    chat_decoder_free(&c->in);
+    pool_free(&client_pool, c);
+}
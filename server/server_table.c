@@ -0,0 +1,106 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Open-addressing hash table from case-insensitive names to registry
+// entries (linear probing, backward-shift deletion, so no tombstones).
+// Slots cache the full hash, so a probe only compares names on a hash hit.
+// Entries are caller-owned and never move; the table stores pointers.
+
+#define NAME_TABLE_MIN 16 // Initial slot count (power of two).
+
+static unsigned char fold(unsigned char ch) {
+    return (ch >= 'A' && ch <= 'Z') ? (unsigned char)(ch - 'A' + 'a') : ch;
+}
+
+// Same folding as name_hash (and _stricmp in the C locale), without locale lookups.
+static int name_equal(const char* a, const char* b) {
+    const unsigned char* p = (const unsigned char*)a;
+    const unsigned char* q = (const unsigned char*)b;
+    while (*p && fold(*p) == fold(*q)) {
+        p++;
+        q++;
+    }
+    return fold(*p) == fold(*q);
+}
+
+uint32_t name_hash(const char* name) {
+    // FNV-1a over ASCII-folded bytes, then a finalizer so the low bits mix.
+    uint32_t h = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) h = (h ^ fold(*p)) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t name_table_probe(const NameTable* t, const char* key, uint32_t hash) {
+    uint32_t mask = t->cap - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        const NameSlot* s = &t->slots[i];
+        if (!s->item) return i;
+        if (s->hash == hash && name_equal(s->key, key)) return i;
+    }
+}
+
+static int name_table_grow(NameTable* t) {
+    uint32_t cap = t->cap ? t->cap * 2 : NAME_TABLE_MIN;
+    NameSlot* slots = (NameSlot*)calloc(cap, sizeof(*slots));
+    if (!slots) return 0;
+
+    NameTable next = {slots, cap, 0};
+    for (uint32_t i = 0; i < t->cap; i++) {
+        NameSlot* s = &t->slots[i];
+        if (s->item) next.slots[name_table_probe(&next, s->key, s->hash)] = *s;
+    }
+    next.count = t->count;
+    free(t->slots);
+    *t = next;
+    return 1;
+}
+
+void* name_table_find(const NameTable* t, const char* key) {
+    if (t->count == 0) return NULL;
+    return t->slots[name_table_probe(t, key, name_hash(key))].item;
+}
+
+int name_table_insert(NameTable* t, const char* key, void* item) {
+    // Keep the load factor at or below 1/2.
+    if ((t->count + 1) * 2 > t->cap && !name_table_grow(t)) return 0;
+    uint32_t hash = name_hash(key);
+    NameSlot* s = &t->slots[name_table_probe(t, key, hash)];
+    if (s->item) return 0;
+    s->hash = hash;
+    s->key = key;
+    s->item = item;
+    t->count++;
+    return 1;
+}
+
+void* name_table_remove(NameTable* t, const char* key) {
+    if (t->count == 0) return NULL;
+    uint32_t mask = t->cap - 1;
+    uint32_t hole = name_table_probe(t, key, name_hash(key));
+    void* item = t->slots[hole].item;
+    if (!item) return NULL;
+
+    // Pull later members of the probe run back over the hole.
+    for (uint32_t i = (hole + 1) & mask; t->slots[i].item; i = (i + 1) & mask) {
+        uint32_t home = t->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    memset(&t->slots[hole], 0, sizeof(t->slots[hole]));
+    t->count--;
+    return item;
+}
+
+void name_table_free(NameTable* t) {
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
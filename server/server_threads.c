@@ -0,0 +1,485 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_frame.h"
+
+// Thread-per-client backend. Each client's thread blocks reading its own
+// socket; outgoing frames from any thread go through the client's bounded
+// queue and are written non-blocking under its send_lock, so frames never
+// interleave and a full socket never stalls the sender. Whatever a write
+// leaves behind is finished by a single drain thread polling for POLLOUT.
+// With a flush window, room traffic is held in the queue instead and the
+// drain thread writes it out once the oldest hold expires (to the
+// millisecond: that is as fine as its poll timeout goes).
+//
+// A client only gets its thread once it has authenticated. Until then the
+// accepting thread runs its HELLO/AUTH alongside every other pending
+// handshake, polling them together with the listener. It stops polling the
+// listener while max_handshakes are pending, so a reconnect storm queues
+// in the kernel's backlog instead of in threads, and closes handshakes
+// older than handshake_ms. Frames that arrived behind AUTH are parked out
+// of the shared read buffer for the client's thread. An AUTH that needs
+// hashing leaves the accepting thread for the verifier pool, and the
+// verifier thread that finishes it starts the client's thread.
+
+#define DRAIN_POLL_MS 50 // Rescan interval while any client has backlog.
+#define DRAIN_MAX 1024 // Sockets polled per pass.
+#define THREAD_READ_CHUNK 16384 // Bytes read per recv() on a client thread.
+#define HANDSHAKE_POLL_MS 50 // Longest handshake poll; timeouts are checked this often.
+
+typedef struct ThreadCtx {
+    ServerState* st;
+    Client* client;
+} ThreadCtx;
+
+// Clients whose queue still holds bytes the socket would not take, and
+// clients holding room traffic for the flush tick.
+typedef struct Drainer {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;
+    Client** clients;
+    int count;
+    int cap;
+    Client* held; // Linked through held_next; each holds a reference.
+    uint64_t held_deadline; // chat_now_ns() when the oldest hold expires.
+} Drainer;
+
+static Drainer drainer;
+
+// Mark a client dead and wake its thread out of recv(). Caller holds send_lock,
+// so the owner thread cannot have closed the socket yet.
+static void threads_kill(Client* c) {
+    if (c->dead) return;
+    c->dead = 1;
+    shutdown(c->sock, SD_BOTH);
+}
+
+// Hand a client with backlog to the drain thread (takes a reference). The
+// caller set c->draining under send_lock; without room on the list nothing
+// would flush the backlog again, so the client is dropped instead.
+static void drainer_add(Client* c) {
+    EnterCriticalSection(&drainer.lock);
+    if (drainer.count == drainer.cap) {
+        int cap = drainer.cap ? drainer.cap * 2 : 64;
+        Client** p = (Client**)realloc(drainer.clients, (size_t)cap * sizeof(*p));
+        if (!p) {
+            LeaveCriticalSection(&drainer.lock);
+            EnterCriticalSection(&c->send_lock);
+            c->draining = 0;
+            threads_kill(c);
+            LeaveCriticalSection(&c->send_lock);
+            return;
+        }
+        drainer.clients = p;
+        drainer.cap = cap;
+    }
+    client_retain(c);
+    drainer.clients[drainer.count++] = c;
+    WakeConditionVariable(&drainer.wake);
+    LeaveCriticalSection(&drainer.lock);
+}
+
+static void drainer_remove(Client* c) {
+    EnterCriticalSection(&drainer.lock);
+    for (int i = 0; i < drainer.count; i++) {
+        if (drainer.clients[i] == c) {
+            drainer.clients[i] = drainer.clients[--drainer.count];
+            break;
+        }
+    }
+    LeaveCriticalSection(&drainer.lock);
+    client_release(c);
+}
+
+// Hand a client holding room traffic to the drain thread (takes a
+// reference). The caller set c->held under send_lock; the first hold
+// starts the window.
+static void drainer_hold(ServerState* st, Client* c) {
+    EnterCriticalSection(&drainer.lock);
+    if (!drainer.held) {
+        drainer.held_deadline = chat_now_ns() + (uint64_t)st->flush_us * 1000u;
+        WakeConditionVariable(&drainer.wake);
+    }
+    client_retain(c);
+    c->held_next = drainer.held;
+    drainer.held = c;
+    LeaveCriticalSection(&drainer.lock);
+}
+
+// Write out every held client once the window has closed; whatever the
+// socket refuses moves to the drain list.
+static void drainer_tick(void) {
+    EnterCriticalSection(&drainer.lock);
+    Client* c = NULL;
+    if (drainer.held && chat_now_ns() >= drainer.held_deadline) {
+        c = drainer.held;
+        drainer.held = NULL;
+    }
+    LeaveCriticalSection(&drainer.lock);
+
+    while (c) {
+        Client* next = c->held_next;
+        EnterCriticalSection(&c->send_lock);
+        c->held = 0;
+        int ok = !c->dead && outq_flush(&c->outq, c->sock);
+        int backlog = ok && c->outq.frames > 0 && !c->draining;
+        if (!ok) threads_kill(c);
+        if (backlog) c->draining = 1;
+        LeaveCriticalSection(&c->send_lock);
+
+        if (backlog) drainer_add(c);
+        client_release(c);
+        c = next;
+    }
+}
+
+// Milliseconds the drain thread may wait before the next flush is due.
+// Caller holds drainer.lock.
+static int drainer_timeout(ServerState* st) {
+    int timeout = DRAIN_POLL_MS;
+    if (!st->flush_us) return timeout;
+    // A hold may start mid-wait, so never wait longer than one window.
+    int window = (int)((st->flush_us + 999u) / 1000u);
+    if (window < timeout) timeout = window;
+    if (drainer.held) {
+        uint64_t now = chat_now_ns();
+        uint64_t left = drainer.held_deadline > now ? drainer.held_deadline - now : 0;
+        int ms = (int)((left + 999999u) / 1000000u);
+        if (ms < timeout) timeout = ms;
+    }
+    return timeout;
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL drain_thread(void* param) {
+    ServerState* st = (ServerState*)param;
+    WSAPOLLFD* pfds = (WSAPOLLFD*)calloc(DRAIN_MAX, sizeof(*pfds));
+    Client** batch = (Client**)calloc(DRAIN_MAX, sizeof(*batch));
+    if (!pfds || !batch) return 0;
+
+    for (;;) {
+        EnterCriticalSection(&drainer.lock);
+        while (drainer.count == 0 && !drainer.held) {
+            SleepConditionVariableCS(&drainer.wake, &drainer.lock, INFINITE);
+        }
+        int n = drainer.count < DRAIN_MAX ? drainer.count : DRAIN_MAX;
+        for (int i = 0; i < n; i++) {
+            batch[i] = drainer.clients[i];
+            client_retain(batch[i]);
+            memset(&pfds[i], 0, sizeof(pfds[i]));
+            pfds[i].fd = batch[i]->sock;
+            pfds[i].events = POLLOUT;
+        }
+        int timeout = drainer_timeout(st);
+        LeaveCriticalSection(&drainer.lock);
+
+        if (n > 0) (void)WSAPoll(pfds, (unsigned)n, timeout);
+        else if (timeout > 0) Sleep(timeout);
+
+        for (int i = 0; i < n; i++) {
+            Client* c = batch[i];
+            if (pfds[i].revents) {
+                EnterCriticalSection(&c->send_lock);
+                int ok = !c->dead && outq_flush(&c->outq, c->sock);
+                int done = !ok || c->outq.frames == 0;
+                if (!ok) threads_kill(c);
+                if (done) c->draining = 0;
+                LeaveCriticalSection(&c->send_lock);
+
+                if (done) drainer_remove(c);
+            }
+            client_release(c);
+        }
+        drainer_tick();
+    }
+}
+
+// Queue a frame and write what the socket takes. Room traffic may wait for
+// the flush tick instead, unless the queue already holds flush_bytes; a
+// client with backlog is left to the drain thread either way.
+static int threads_queue(ServerState* st, Client* c, OutFrame* f, int urgent) {
+    EnterCriticalSection(&c->send_lock);
+    int ok = !c->dead && outq_push(st, &c->outq, f);
+    int hold = ok && !urgent && st->flush_us && c->outq.bytes < st->flush_bytes;
+    if (ok && !hold) ok = outq_flush(&c->outq, c->sock);
+    int backlog = ok && !hold && c->outq.frames > 0 && !c->draining;
+    int first_hold = hold && !c->held && !c->draining;
+    if (!ok) threads_kill(c);
+    if (backlog) c->draining = 1;
+    if (first_hold) c->held = 1;
+    LeaveCriticalSection(&c->send_lock);
+
+    if (backlog) drainer_add(c);
+    if (first_hold) drainer_hold(st, c);
+    return ok;
+}
+
+static int threads_send_frame(ServerState* st, Client* c, OutFrame* f) {
+    return threads_queue(st, c, f, 1);
+}
+
+// Fan out from the room's published member snapshot without st->lock; the
+// epoch section keeps the snapshot, and the members it references, alive.
+// Without memory for an epoch slot or a snapshot, walk the members under
+// the shared lock instead, as before snapshots, rather than drop the event.
+static void threads_broadcast(ServerState* st, Room* r, const OutFrames* fs) {
+    RoomShard* rs = &r->shards[0];
+    if (epoch_enter()) {
+        MemberSnap* snap = room_shard_snapshot(st, rs);
+        for (int i = 0; snap && i < snap->count; i++) {
+            Client* m = snap->members[i];
+            OutFrame* f = outframes_pick(fs, m);
+            if (f) (void)threads_queue(st, m, f, 0);
+        }
+        epoch_exit();
+        if (snap) return;
+    }
+    AcquireSRWLockShared(&st->lock);
+    for (int i = 0; i < rs->member_count; i++) {
+        Client* m = rs->members[i];
+        OutFrame* f = outframes_pick(fs, m);
+        if (f) (void)threads_queue(st, m, f, 0);
+    }
+    ReleaseSRWLockShared(&st->lock);
+}
+
+// Handle the frames buffered in c's decoder; returns 0 to close. During the
+// handshake (until_done) it stops after the frame that completes it, or
+// that leaves c->auth_job for the verifier pool.
+static int client_frames(ServerState* st, Client* c, int until_done) {
+    for (;;) {
+        if (until_done && (handshake_done(c) || c->auth_job)) return 1;
+        uint8_t* payload = NULL;
+        uint32_t payload_len = 0;
+        int r = chat_decoder_next(&c->in, &payload, &payload_len);
+        if (r <= 0) {
+            if (r == 0) client_unpark(c);
+            return r == 0;
+        }
+        if (!server_handle_frame(st, c, (char*)payload, payload_len) || c->dead) return 0;
+    }
+}
+
+static void client_close(ServerState* st, Client* c) {
+    // Stop further sends before the socket handle goes away.
+    EnterCriticalSection(&c->send_lock);
+    c->dead = 1;
+    shutdown(c->sock, SD_BOTH);
+    closesocket(c->sock);
+    LeaveCriticalSection(&c->send_lock);
+
+    server_on_disconnect(st, c);
+    client_release(c);
+}
+
+// Per-client worker thread. Handles the commands after AUTH (and the
+// handshake too for links the dialer adopted).
+static CHAT_THREAD_RET CHAT_THREAD_CALL client_thread(void* param) {
+    ThreadCtx* ctx = (ThreadCtx*)param;
+    ServerState* st = ctx->st;
+    Client* c = ctx->client;
+    buf_free(ctx, sizeof(*ctx));
+
+    if (!c->accepted_ns) server_on_connect(st, c);
+
+    // Frames are handled in place in the receive buffer (one spare byte for
+    // the decoder's terminator); only frames split across reads are copied.
+    // The first are those parked behind AUTH.
+    uint8_t rbuf[THREAD_READ_CHUNK + 1];
+    int keep = client_frames(st, c, 0);
+    while (keep) {
+        int n = chat_recv_some(c->sock, rbuf, THREAD_READ_CHUNK);
+        if (n <= 0) break;
+        trace_read_done();
+        chat_decoder_feed(&c->in, rbuf, (size_t)n);
+        keep = client_frames(st, c, 0);
+    }
+
+    client_close(st, c);
+    epoch_thread_exit();
+    pool_thread_exit();
+    metrics_thread_exit();
+    trace_thread_exit();
+    return 0;
+}
+
+// Start c's thread; c is already in the client list. Whatever c's decoder
+// has not taken yet from the accepting thread's shared read buffer is
+// parked for it first.
+static int threads_spawn(ServerState* st, Client* c) {
+    if (!client_park_input(c)) return 0;
+    ThreadCtx* ctx = (ThreadCtx*)buf_alloc(sizeof(*ctx));
+    if (!ctx) return 0;
+    ctx->st = st;
+    ctx->client = c;
+    if (!chat_thread_start(client_thread, ctx)) {
+        buf_free(ctx, sizeof(*ctx));
+        return 0;
+    }
+    return 1;
+}
+
+// Serve a connected socket on its own thread; see ServerAdoptFn.
+static int threads_adopt(ServerState* st, Client* c) {
+    // Link before the thread starts so disconnect can always unlink.
+    state_add_client(st, c);
+    if (!threads_spawn(st, c)) {
+        state_remove_client(st, c);
+        return 0;
+    }
+    return 1;
+}
+
+// Finish a verified AUTH on the verifier thread itself, which then starts
+// the client's thread; see ServerAuthDoneFn.
+static void threads_auth_done(ServerState* st, Client* c) {
+    int keep = auth_finish(st, c);
+    handshake_end(st, c);
+    if (!keep || !threads_spawn(st, c)) client_close(st, c);
+    client_release(c);
+}
+
+// Offer the socket what is queued, then end the client's thread.
+static void threads_kick(ServerState* st, Client* c) {
+    (void)st;
+    EnterCriticalSection(&c->send_lock);
+    if (!c->dead) (void)outq_flush(&c->outq, c->sock);
+    threads_kill(c);
+    LeaveCriticalSection(&c->send_lock);
+}
+
+// Connections accepted but not yet authenticated, run by the accepting
+// thread. pfds[0] is the listener while accepting; the clients' sockets
+// follow in the same order as clients.
+typedef struct Handshakes {
+    Client** clients;
+    WSAPOLLFD* pfds;
+    int count;
+    int cap;
+} Handshakes;
+
+// Accept what admission allows.
+static void handshakes_accept(ServerState* st, Handshakes* hs, SOCKET listen_sock) {
+    while (handshake_admit(st) && hs->count < hs->cap) {
+        SOCKET s = chat_accept_nonblocking(listen_sock);
+        if (s == INVALID_SOCKET) {
+            // Out of descriptors, say: back off rather than spin on a
+            // listener that stays readable.
+            if (chat_sock_errno() != CHAT_EWOULDBLOCK) Sleep(10);
+            return;
+        }
+        // Writes are batched here, so Nagle would only add delay.
+        (void)chat_socket_set_nodelay(s);
+
+        Client* c = client_new();
+        if (!c) {
+            closesocket(s);
+            continue;
+        }
+        c->sock = s;
+        handshake_begin(st, c);
+        hs->clients[hs->count++] = c;
+        state_add_client(st, c);
+        server_on_connect(st, c);
+        printf("Client connected\n");
+    }
+    metrics_add(MET_ACCEPT_PAUSES, 1);
+}
+
+// Read what c sent; returns 0 to close it.
+static int handshake_read(ServerState* st, Client* c, uint8_t* rbuf) {
+    for (;;) {
+        int n = recv(c->sock, (char*)rbuf, THREAD_READ_CHUNK, 0);
+        if (n == 0) return 0;
+        if (n < 0) return chat_sock_errno() == CHAT_EWOULDBLOCK;
+        trace_read_done();
+        chat_decoder_feed(&c->in, rbuf, (size_t)n);
+        if (!client_frames(st, c, 1)) return 0;
+        if (handshake_done(c)) return 1;
+        if (c->auth_job) return client_park_input(c);
+    }
+}
+
+int server_run_threads(ServerState* st, SOCKET listen_sock) {
+    st->send_frame = threads_send_frame;
+    st->broadcast = threads_broadcast;
+    st->adopt = threads_adopt;
+    st->kick = threads_kick;
+    st->auth_done = threads_auth_done;
+    st->nshards = 1;
+
+    InitializeCriticalSection(&drainer.lock);
+    InitializeConditionVariable(&drainer.wake);
+    if (!chat_thread_start(drain_thread, st)) {
+        printf("failed to start drain thread\n");
+        return 1;
+    }
+
+    // Writes must never block and reads wait for readability, so every
+    // socket is non-blocking, the listener too.
+    Handshakes hs;
+    memset(&hs, 0, sizeof(hs));
+    hs.cap = st->max_handshakes ? (int)st->max_handshakes : 1024;
+    hs.clients = (Client**)calloc((size_t)hs.cap, sizeof(*hs.clients));
+    hs.pfds = (WSAPOLLFD*)calloc((size_t)hs.cap + 1, sizeof(*hs.pfds));
+    static uint8_t rbuf[THREAD_READ_CHUNK + 1];
+    if (!hs.clients || !hs.pfds || !chat_socket_set_nonblocking(listen_sock)) {
+        printf("handshake setup failed\n");
+        return 1;
+    }
+
+    for (;;) {
+        int listening = handshake_admit(st) && hs.count < hs.cap;
+        int base = listening ? 1 : 0;
+        if (listening) {
+            memset(&hs.pfds[0], 0, sizeof(hs.pfds[0]));
+            hs.pfds[0].fd = listen_sock;
+            hs.pfds[0].events = POLLIN;
+        }
+        for (int i = 0; i < hs.count; i++) {
+            memset(&hs.pfds[base + i], 0, sizeof(hs.pfds[0]));
+            hs.pfds[base + i].fd = hs.clients[i]->sock;
+            hs.pfds[base + i].events = POLLIN;
+        }
+        int ready = WSAPoll(hs.pfds, (unsigned)(base + hs.count), HANDSHAKE_POLL_MS);
+        if (listening && ready > 0 && (hs.pfds[0].revents & (POLLERR | POLLNVAL))) break;
+
+        // Run the handshakes that sent something, then drop the ones that
+        // finished, failed or ran out of time, keeping the rest in order.
+        uint64_t now = chat_now_ns();
+        uint64_t limit = (uint64_t)st->handshake_ms * 1000000u;
+        int kept = 0;
+        for (int i = 0; i < hs.count; i++) {
+            Client* c = hs.clients[i];
+            int keep = !c->dead;
+            if (keep && ready > 0 && hs.pfds[base + i].revents) keep = handshake_read(st, c, rbuf);
+            if (keep && c->auth_job) {
+                // The verifier pool has it now, and threads_auth_done takes
+                // it from there.
+                auth_queue(st, c);
+                continue;
+            }
+            if (keep && handshake_done(c)) {
+                handshake_end(st, c);
+                if (!threads_spawn(st, c)) client_close(st, c);
+                continue;
+            }
+            if (keep && now - c->accepted_ns >= limit) {
+                metrics_add(MET_HANDSHAKE_TIMEOUTS, 1);
+                keep = 0;
+            }
+            if (!keep) {
+                handshake_end(st, c);
+                client_close(st, c);
+                continue;
+            }
+            hs.clients[kept++] = c;
+        }
+        hs.count = kept;
+
+        if (listening && ready > 0 && hs.pfds[0].revents) handshakes_accept(st, &hs, listen_sock);
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sampled message tracing. server_handle_frame picks one inbound frame in
+// trace_sample and gives it a trace id, which the handling thread carries
+// while it runs and frame_alloc copies into every OutFrame it builds, so
+// queue pushes and socket writes on any thread can be attributed to it.
+//
+// Each thread claims a buffer of its own (as metrics slots are claimed) and
+// appends records there: a single-producer ring that the flusher thread
+// drains into the file every TRACE_FLUSH_MS, so recording takes no lock. A
+// full ring drops records and counts them; the flusher reports the count.
+// With tracing off every hook is a test of one flag or a thread-local.
+
+#define TRACE_RINGS 256 // Threads past this many record nothing.
+#define TRACE_RING_RECORDS 8192u // Per thread; power of two.
+#define TRACE_FLUSH_MS 20
+
+_Static_assert(sizeof(ChatTraceRecord) == 24, "trace records are written as-is");
+
+typedef struct TraceRing {
+    volatile int32_t owned; // Claimed by a live thread.
+    volatile int32_t head; // Next record the flusher reads.
+    volatile int32_t tail; // Next slot the owner writes.
+    uint32_t lost; // Written by the owner only.
+    uint32_t lost_reported; // Flusher only.
+    ChatTraceRecord records[TRACE_RING_RECORDS];
+} TraceRing;
+
+static int trace_on;
+static uint32_t trace_sample;
+static FILE* trace_file;
+static TraceRing* volatile trace_rings[TRACE_RINGS];
+static volatile int32_t trace_next_id;
+static CHAT_THREAD_LOCAL TraceRing* trace_self;
+static CHAT_THREAD_LOCAL uint16_t trace_self_index;
+static CHAT_THREAD_LOCAL int trace_no_ring; // Claiming failed; do not retry per record.
+static CHAT_THREAD_LOCAL uint32_t trace_cur; // Trace of the frame being handled.
+static CHAT_THREAD_LOCAL uint32_t trace_cur_client;
+static CHAT_THREAD_LOCAL uint8_t trace_cur_cmd;
+static CHAT_THREAD_LOCAL uint32_t trace_countdown;
+static CHAT_THREAD_LOCAL uint64_t trace_read_ns;
+static CHAT_THREAD_LOCAL int trace_muted;
+
+static TraceRing* trace_ring(void) {
+    if (trace_self || trace_no_ring) return trace_self;
+    for (uint32_t i = 0; i < TRACE_RINGS; i++) {
+        TraceRing* r = (TraceRing*)chat_atomic_load_ptr(&trace_rings[i]);
+        if (!r) {
+            TraceRing* fresh = (TraceRing*)calloc(1, sizeof(*fresh));
+            if (!fresh) break;
+            r = (TraceRing*)chat_atomic_cas_ptr(&trace_rings[i], NULL, fresh);
+            if (r) free(fresh); // Another thread got there first.
+            else r = fresh;
+        }
+        if (chat_atomic_xchg(&r->owned, 1) == 0) {
+            trace_self = r;
+            trace_self_index = (uint16_t)i;
+            return r;
+        }
+    }
+    trace_no_ring = 1;
+    return NULL;
+}
+
+static void trace_put(uint32_t trace, ChatTraceStage stage, uint32_t client, uint32_t bytes, uint64_t time_ns) {
+    TraceRing* r = trace_ring();
+    if (!r) return;
+    int32_t tail = r->tail;
+    if ((uint32_t)(tail - chat_atomic_load(&r->head)) >= TRACE_RING_RECORDS) {
+        r->lost++;
+        return;
+    }
+    ChatTraceRecord* rec = &r->records[(uint32_t)tail & (TRACE_RING_RECORDS - 1)];
+    rec->time_ns = time_ns;
+    rec->trace = trace;
+    rec->client = client;
+    rec->bytes = bytes;
+    rec->stage = (uint8_t)stage;
+    rec->cmd = stage == CHAT_TRACE_PARSE || stage == CHAT_TRACE_DISPATCH ? trace_cur_cmd : 0;
+    rec->thread = trace_self_index;
+    (void)chat_atomic_xchg(&r->tail, tail + 1); // Publish the record.
+}
+
+void trace_read_done(void) {
+    if (trace_on) trace_read_ns = chat_now_ns();
+}
+
+void trace_frame_begin(uint32_t client, uint32_t len) {
+    if (!trace_on) return;
+    if (trace_countdown > 1) {
+        trace_countdown--;
+        return;
+    }
+    trace_countdown = trace_sample;
+    trace_cur = (uint32_t)chat_atomic_add(&trace_next_id, 1);
+    trace_cur_client = client;
+    trace_cur_cmd = CHAT_CMD_NONE;
+    trace_put(trace_cur, CHAT_TRACE_READ, client, len, trace_read_ns ? trace_read_ns : chat_now_ns());
+}
+
+void trace_frame_end(void) {
+    trace_cur = 0;
+}
+
+uint32_t trace_current(void) {
+    return trace_muted ? 0u : trace_cur;
+}
+
+void trace_stage(ChatTraceStage stage, int cmd) {
+    if (!trace_cur) return;
+    trace_cur_cmd = (uint8_t)cmd;
+    trace_put(trace_cur, stage, trace_cur_client, 0, chat_now_ns());
+}
+
+void trace_frame(uint32_t trace, ChatTraceStage stage, uint32_t client, uint32_t bytes) {
+    if (!trace_muted) trace_put(trace, stage, client, bytes, chat_now_ns());
+}
+
+void trace_mute(int mute) {
+    trace_muted = mute;
+}
+
+void trace_thread_exit(void) {
+    if (trace_self) (void)chat_atomic_xchg(&trace_self->owned, 0);
+    trace_self = NULL;
+    trace_no_ring = 0;
+}
+
+// Append every published record to the file, then report drops.
+static void trace_drain(void) {
+    for (uint32_t i = 0; i < TRACE_RINGS; i++) {
+        TraceRing* r = (TraceRing*)chat_atomic_load_ptr(&trace_rings[i]);
+        if (!r) break;
+        int32_t head = r->head;
+        int32_t tail = chat_atomic_load(&r->tail);
+        uint32_t n = (uint32_t)(tail - head);
+        uint32_t at = (uint32_t)head & (TRACE_RING_RECORDS - 1);
+        uint32_t first = n < TRACE_RING_RECORDS - at ? n : TRACE_RING_RECORDS - at;
+        if (first) (void)fwrite(&r->records[at], sizeof(ChatTraceRecord), first, trace_file);
+        if (n > first) (void)fwrite(&r->records[0], sizeof(ChatTraceRecord), n - first, trace_file);
+        (void)chat_atomic_xchg(&r->head, tail); // Hand the slots back.
+
+        uint32_t lost = r->lost;
+        if (lost != r->lost_reported) {
+            ChatTraceRecord rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.time_ns = chat_now_ns();
+            rec.bytes = lost - r->lost_reported;
+            rec.stage = CHAT_TRACE_LOST;
+            rec.thread = (uint16_t)i;
+            (void)fwrite(&rec, sizeof(rec), 1, trace_file);
+            r->lost_reported = lost;
+        }
+    }
+    (void)fflush(trace_file);
+}
+
+static CHAT_THREAD_RET CHAT_THREAD_CALL trace_flusher(void* arg) {
+    (void)arg;
+    for (;;) {
+        Sleep(TRACE_FLUSH_MS);
+        trace_drain();
+    }
+    return 0;
+}
+
+int trace_open(const char* path, uint32_t sample) {
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        printf("Tracing: cannot create %s\n", path);
+        return 0;
+    }
+    ChatTraceHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHAT_TRACE_MAGIC, sizeof(h.magic));
+    h.version = CHAT_TRACE_VERSION;
+    h.record_size = sizeof(ChatTraceRecord);
+    h.start_ns = chat_now_ns();
+    h.sample = sample;
+    if (fwrite(&h, sizeof(h), 1, trace_file) != 1 || fflush(trace_file) != 0) {
+        printf("Tracing: cannot write %s\n", path);
+        fclose(trace_file);
+        trace_file = NULL;
+        return 0;
+    }
+    trace_sample = sample;
+    if (!chat_thread_start(trace_flusher, NULL)) {
+        printf("Tracing: cannot start the flusher\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        return 0;
+    }
+    trace_on = 1;
+    return 1;
+}
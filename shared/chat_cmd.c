@@ -4,59 +4,341 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void trim_leading_spaces(char** p) {
-    // Move pointer past any leading spaces.
-    while (**p == ' ') (*p)++;
+#if defined(__SSE2__) || defined(_M_X64)
+#define CHAT_CMD_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHAT_CMD_AVX2 1
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// The tokenizer makes one pass over the payload in 32-byte blocks. A
+// kernel turns each block into three bitmasks (bit i: byte i is a space,
+// starts " :", is NUL) and scan_block walks them, so the spaces, the
+// first " :" and the terminator are found together. A block also reads
+// the byte after it, which payload[len] == NUL makes safe. The text after
+// " :" only needs its NUL; memchr finds it past the last block scanned.
+#define CMD_BLOCK 32u
+#ifdef __GNUC__
+#define CMD_INLINE static inline __attribute__((always_inline))
+#else
+#define CMD_INLINE static __forceinline
+#endif
+#define CMD_NONE 0xFFFFFFFFu
+
+typedef struct CmdScan {
+    uint32_t start[3];
+    uint32_t end[3];
+    uint32_t ntok;    // Tokens ended.
+    int in_tok;       // start[ntok] is set and its end not yet seen.
+    uint32_t text_at; // First " :", or CMD_NONE.
+    uint32_t stop_at; // First NUL, or CMD_NONE if not seen yet.
+    uint32_t scanned; // Bytes covered by the blocks consumed so far.
+} CmdScan;
+
+// -1 until the first parse picks the best kernel. Every thread computes
+// the same value, so the unsynchronized first write is harmless.
+static volatile int g_simd_level = -1;
+
+static uint32_t ctz32(uint32_t v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (uint32_t)i;
+#else
+    return (uint32_t)__builtin_ctz(v);
+#endif
 }
 
-int chat_cmd_parse_inplace(char* payload, ChatCmd* out) {
-    memset(out, 0, sizeof(*out));
-    out->buf = payload;
+// Record token starts and ends among the first lim bytes of a block.
+CMD_INLINE void scan_tokens(CmdScan* s, uint32_t base, uint32_t lim, uint32_t sp) {
+    uint32_t m = lim >= 32 ? 0xFFFFFFFFu : (1u << lim) - 1u;
+    uint32_t spaces = sp & m;
+    uint32_t words = ~sp & m;
+    uint32_t pos = 0;
+    while (s->ntok < 3) {
+        uint32_t x = (s->in_tok ? spaces : words) >> pos;
+        if (!x) break;
+        pos += ctz32(x);
+        if (s->in_tok) {
+            s->end[s->ntok++] = base + pos;
+            s->in_tok = 0;
+        } else {
+            s->start[s->ntok] = base + pos;
+            s->in_tok = 1;
+        }
+    }
+}
 
-    // Split off trailing free-form text (":" delimiter).
-    char* text_start = strstr(payload, " :");
-    if (text_start) {
-        *text_start = 0;
-        out->text = text_start + 2;
-    } else {
-        char* colon = strchr(payload, ':');
-        if (colon == payload) {
-            out->text = payload + 1;
-            payload[0] = 0;
+// Consume one block's masks; returns 1 once " :" or NUL ends the scan.
+CMD_INLINE int scan_block(CmdScan* s, uint32_t base, uint32_t nbits, uint32_t sp, uint32_t pair, uint32_t nul) {
+    if (nbits < 32) {
+        uint32_t valid = (1u << nbits) - 1u;
+        sp &= valid;
+        pair &= valid;
+        nul &= valid;
+    }
+    uint32_t stop = pair | nul;
+    uint32_t lim = stop ? ctz32(stop) : nbits;
+    if (s->ntok < 3) scan_tokens(s, base, lim, sp);
+    if (!stop) return 0;
+    s->scanned = base + nbits;
+    if (pair & (1u << lim)) s->text_at = base + lim;
+    if (nul) s->stop_at = base + ctz32(nul);
+    return 1;
+}
+
+// Payloads shorter than a block: one byte at a time, with the same
+// results scan_block would reach.
+static void scan_short(const uint8_t* p, uint32_t len, CmdScan* s) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t ch = p[i];
+        if (ch == ' ') {
+            if (p[i + 1] == ':') {
+                s->text_at = i;
+                s->scanned = i + 2;
+                return;
+            }
+            if (s->in_tok) {
+                s->end[s->ntok++] = i;
+                s->in_tok = 0;
+            }
+        } else if (ch == 0) {
+            s->stop_at = i;
+            return;
+        } else if (!s->in_tok && s->ntok < 3) {
+            s->start[s->ntok] = i;
+            s->in_tok = 1;
+        }
+    }
+    s->scanned = len;
+}
+
+// Portable kernel: eight bytes per word, with exact per-byte compares so a
+// match never borrows into its neighbour.
+static uint32_t swar_eq(uint64_t x, uint64_t pattern) {
+    uint64_t t = x ^ pattern;
+    uint64_t y = ((t & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | t;
+    uint64_t hi = ~y & 0x8080808080808080ull;
+    // Gather each byte's flag into bit k for byte k.
+    return (uint32_t)(((hi >> 7) * 0x0102040810204080ull) >> 56);
+}
+
+// Bit i set where b[i] == ch, for the block at b.
+static uint32_t eq_swar(const uint8_t* b, uint8_t ch) {
+    uint32_t m = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (uint32_t i = 0; i < CMD_BLOCK; i++) m |= (uint32_t)(b[i] == ch) << i;
+#else
+    uint64_t pattern = 0x0101010101010101ull * ch;
+    for (uint32_t i = 0; i < CMD_BLOCK; i += 8) {
+        uint64_t x;
+        memcpy(&x, b + i, 8);
+        m |= swar_eq(x, pattern) << i;
+    }
+#endif
+    return m;
+}
+
+// Skip whole blocks with nothing to record: all spaces when between
+// tokens (spaces) and the next byte doesn't make the last one " :",
+// otherwise no space and no NUL. Returns the offset of the first block
+// that needs a look, or of the partial block at the end.
+static uint32_t skip_swar(const uint8_t* p, uint32_t off, uint32_t len, int spaces) {
+    const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+    const uint64_t space = 0x2020202020202020ull;
+    for (; off + CMD_BLOCK <= len; off += CMD_BLOCK) {
+        uint64_t hit = 0;
+        for (uint32_t i = 0; i < CMD_BLOCK; i += 8) {
+            uint64_t x;
+            memcpy(&x, p + off + i, 8);
+            // Nonzero if any byte is a space or NUL (may flag extra bytes,
+            // never misses one).
+            if (spaces) hit |= x ^ space;
+            else hit |= (((x ^ space) - ones) & ~(x ^ space) & highs) | ((x - ones) & ~x & highs);
+        }
+        if (hit || (spaces && p[off + CMD_BLOCK] == ':')) break;
+    }
+    return off;
+}
+
+#ifdef CHAT_CMD_SSE2
+static uint32_t eq_sse2(const uint8_t* b, uint8_t ch) {
+    __m128i c = _mm_set1_epi8((char)ch);
+    __m128i lo = _mm_loadu_si128((const __m128i*)b);
+    __m128i hi = _mm_loadu_si128((const __m128i*)(b + 16));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, c)) |
+           (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, c)) << 16;
+}
+
+static uint32_t skip_sse2(const uint8_t* p, uint32_t off, uint32_t len, int spaces) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i zero = _mm_setzero_si128();
+    for (; off + CMD_BLOCK <= len; off += CMD_BLOCK) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(p + off));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(p + off + 16));
+        __m128i sp = _mm_and_si128(_mm_cmpeq_epi8(lo, space), _mm_cmpeq_epi8(hi, space));
+        if (spaces) {
+            if (_mm_movemask_epi8(sp) != 0xFFFF || p[off + CMD_BLOCK] == ':') break;
+        } else {
+            __m128i lo_hit = _mm_or_si128(_mm_cmpeq_epi8(lo, space), _mm_cmpeq_epi8(lo, zero));
+            __m128i hi_hit = _mm_or_si128(_mm_cmpeq_epi8(hi, space), _mm_cmpeq_epi8(hi, zero));
+            if (_mm_movemask_epi8(_mm_or_si128(lo_hit, hi_hit)) != 0) break;
+        }
+    }
+    return off;
+}
+#endif
+
+#ifdef CHAT_CMD_AVX2
+__attribute__((target("avx2"))) static uint32_t eq_avx2(const uint8_t* b, uint8_t ch) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)b);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)ch)));
+}
+
+__attribute__((target("avx2"))) static uint32_t skip_avx2(const uint8_t* p, uint32_t off, uint32_t len,
+    int spaces) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i zero = _mm256_setzero_si256();
+    for (; off + CMD_BLOCK <= len; off += CMD_BLOCK) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + off));
+        __m256i sp = _mm256_cmpeq_epi8(v, space);
+        if (spaces) {
+            if ((uint32_t)_mm256_movemask_epi8(sp) != 0xFFFFFFFFu || p[off + CMD_BLOCK] == ':') break;
+        } else {
+            if (_mm256_movemask_epi8(_mm256_or_si256(sp, _mm256_cmpeq_epi8(v, zero))) != 0) break;
         }
     }
+    return off;
+}
+#endif
 
-    // Tokenize command and up to two args by inserting NULs.
-    char* p = payload;
-    trim_leading_spaces(&p);
-    if (*p == 0) return 0;
+// One scan loop per kernel, so each inlines its compares. Quiet blocks
+// (inside a long token, or in a run of spaces before the next one) go by
+// in the skip loop; the colon compare for " :" only runs on blocks with a
+// space. The last partial block is read overlapping the one before it,
+// minus the bytes already seen, so len must be at least one block.
+#define CMD_SCAN_LOOP(eq, skip)                                                    \
+    uint32_t off = 0;                                                              \
+    for (;;) {                                                                     \
+        off = skip(p, off, len, !s->in_tok && s->ntok < 3);                        \
+        uint32_t nbits = CMD_BLOCK, seen = 0;                                      \
+        if (off + CMD_BLOCK > len) {                                               \
+            if (off == len) return;                                                \
+            nbits = len - off;                                                     \
+            seen = CMD_BLOCK - nbits;                                              \
+        }                                                                          \
+        const uint8_t* b = p + off - seen;                                         \
+        uint32_t sp = eq(b, ' ') >> seen;                                          \
+        uint32_t nul = eq(b, 0) >> seen;                                           \
+        uint32_t pair = sp ? sp & (eq(b + 1, ':') >> seen) : 0;                    \
+        if (scan_block(s, off, nbits, sp, pair, nul) || nbits < CMD_BLOCK) return; \
+        off += CMD_BLOCK;                                                          \
+    }
 
-    out->cmd = p;
-    char* space = strchr(p, ' ');
-    if (!space) return 1;
-    *space = 0;
+static void scan_swar(const uint8_t* p, uint32_t len, CmdScan* s) {
+    CMD_SCAN_LOOP(eq_swar, skip_swar)
+}
 
-    p = space + 1;
-    trim_leading_spaces(&p);
-    if (*p == 0) return 1;
+#ifdef CHAT_CMD_SSE2
+static void scan_sse2(const uint8_t* p, uint32_t len, CmdScan* s) {
+    CMD_SCAN_LOOP(eq_sse2, skip_sse2)
+}
+#endif
 
-    out->arg1 = p;
-    space = strchr(p, ' ');
-    if (!space) return 1;
-    *space = 0;
+#ifdef CHAT_CMD_AVX2
+__attribute__((target("avx2"))) static void scan_avx2(const uint8_t* p, uint32_t len, CmdScan* s) {
+    CMD_SCAN_LOOP(eq_avx2, skip_avx2)
+}
+#endif
 
-    p = space + 1;
-    trim_leading_spaces(&p);
-    if (*p == 0) return 1;
+static int simd_detect(void) {
+#ifdef CHAT_CMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return 2;
+#endif
+#ifdef CHAT_CMD_SSE2
+    return 1;
+#else
+    return 0;
+#endif
+}
 
-    out->arg2 = p;
-    space = strchr(p, ' ');
-    if (!space) return 1;
-    *space = 0;
+int chat_cmd_simd_level(int want) {
+    int best = simd_detect();
+    if (want >= 0) g_simd_level = want < best ? want : best;
+    else if (g_simd_level < 0) g_simd_level = best;
+    return g_simd_level;
+}
+
+int chat_cmd_parse(char* payload, uint32_t len, ChatCmd* out) {
+    memset(out, 0, sizeof(*out));
+    out->buf = payload;
+
+    CmdScan s;
+    s.ntok = 0;
+    s.in_tok = 0;
+    s.text_at = CMD_NONE;
+    s.stop_at = CMD_NONE;
+    s.scanned = 0;
+    const uint8_t* p = (const uint8_t*)payload;
+    int level = g_simd_level;
+    if (level < 0) level = chat_cmd_simd_level(-1);
+    if (len < CMD_BLOCK) {
+        scan_short(p, len, &s);
+    } else {
+        switch (level) {
+#ifdef CHAT_CMD_AVX2
+        case 2: scan_avx2(p, len, &s); break;
+#endif
+#ifdef CHAT_CMD_SSE2
+        case 1: scan_sse2(p, len, &s); break;
+#endif
+        default: scan_swar(p, len, &s); break;
+        }
+    }
+    if (s.text_at != CMD_NONE && s.stop_at == CMD_NONE && s.scanned < len) {
+        const char* nul = (const char*)memchr(payload + s.scanned, 0, len - s.scanned);
+        s.stop_at = nul ? (uint32_t)(nul - payload) : len;
+    }
+    if (s.stop_at == CMD_NONE) s.stop_at = len;
 
+    // Split off trailing free-form text (":" delimiter).
+    uint32_t limit = s.stop_at;
+    if (s.text_at != CMD_NONE) {
+        payload[s.text_at] = 0;
+        out->text = payload + s.text_at + 2;
+        out->text_len = s.stop_at - s.text_at - 2;
+        limit = s.text_at;
+    } else if (s.stop_at > 0 && payload[0] == ':') {
+        // Text alone leaves nothing to tokenize.
+        payload[0] = 0;
+        out->text = payload + 1;
+        out->text_len = s.stop_at - 1;
+        return 0;
+    }
+
+    // Command and up to two args, each ended by a NUL where its space was.
+    if (s.in_tok) s.end[s.ntok++] = limit;
+    if (s.ntok == 0) return 0;
+    char** fields[3] = {&out->cmd, &out->arg1, &out->arg2};
+    uint32_t* lens[3] = {&out->cmd_len, &out->arg1_len, &out->arg2_len};
+    for (uint32_t i = 0; i < s.ntok; i++) {
+        *fields[i] = payload + s.start[i];
+        *lens[i] = s.end[i] - s.start[i];
+        if (s.end[i] < limit) payload[s.end[i]] = 0;
+    }
     return 1;
 }
 
+int chat_cmd_parse_inplace(char* payload, ChatCmd* out) {
+    return chat_cmd_parse(payload, (uint32_t)strlen(payload), out);
+}
+
 void chat_cmd_free(ChatCmd* cmd) {
     if (!cmd) return;
     // Buffer is usually allocated by chat_frame_recv_alloc.
@@ -86,3 +368,57 @@ int chat_cmd_format(char* out, uint32_t out_cap, const char* cmd, const char* ar
     if ((uint32_t)n >= out_cap) return 0;
     return 1;
 }
+
+#define CMD_SPEC(id, c0, c1, cl, flags, args, text, usage) \
+    {CHAT_CMD_##id, #id, (uint32_t)sizeof(#id) - 1u, flags, args, text, usage},
+static const ChatCmdSpec g_cmd_specs[CHAT_CMD_COUNT] = {
+    {CHAT_CMD_NONE, "", 0, 0, 0, CHAT_CMD_TEXT_ANY, ""},
+    CHAT_CMD_LIST(CMD_SPEC)
+};
+#undef CMD_SPEC
+
+// Hash slot -> handler ID, 0 for an empty slot.
+#define CMD_SLOT(id, c0, c1, cl, flags, args, text, usage) \
+    [CHAT_CMD_HASH(sizeof(#id) - 1u, c0, c1, cl)] = (uint8_t)CHAT_CMD_##id,
+static const uint8_t g_cmd_slots[CHAT_CMD_SLOTS] = {
+    CHAT_CMD_LIST(CMD_SLOT)
+};
+#undef CMD_SLOT
+
+// The hash is perfect if the names' slot bits, OR-ed together, have one
+// bit per command; a collision fails the build here.
+#define CMD_SLOT_BIT(id, c0, c1, cl, flags, args, text, usage) | (1u << CHAT_CMD_HASH(sizeof(#id) - 1u, c0, c1, cl))
+#define CMD_SLOT_MASK (0u CHAT_CMD_LIST(CMD_SLOT_BIT))
+#define CMD_POP2(v) ((v) - (((v) >> 1) & 0x55555555u))
+#define CMD_POP4(v) ((CMD_POP2(v) & 0x33333333u) + ((CMD_POP2(v) >> 2) & 0x33333333u))
+#define CMD_POPCOUNT(v) ((((CMD_POP4(v) + (CMD_POP4(v) >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24)
+_Static_assert(CMD_POPCOUNT(CMD_SLOT_MASK) == CHAT_CMD_COUNT - 1,
+    "two commands share a CHAT_CMD_HASH slot");
+#undef CMD_SLOT_BIT
+
+const ChatCmdSpec* chat_cmd_lookup(const char* name, uint32_t len) {
+    if (!name || len < 2 || len > CHAT_CMD_NAME_MAX) return NULL;
+    uint32_t id = g_cmd_slots[CHAT_CMD_HASH(len, (uint8_t)name[0], (uint8_t)name[1], (uint8_t)name[len - 1])];
+    const ChatCmdSpec* spec = &g_cmd_specs[id];
+    if (id == CHAT_CMD_NONE || spec->name_len != len) return NULL;
+    // Registered names are letters: b | 0x20 equals a lower-case letter
+    // only when b is that letter in either case.
+    for (uint32_t i = 0; i < len; i++) {
+        if (((uint8_t)name[i] | 0x20u) != ((uint8_t)spec->name[i] | 0x20u)) return NULL;
+    }
+    return spec;
+}
+
+const ChatCmdSpec* chat_cmd_spec(ChatCmdId id) {
+    if (id <= CHAT_CMD_NONE || id >= CHAT_CMD_COUNT) return NULL;
+    return &g_cmd_specs[id];
+}
+
+int chat_cmd_check(const ChatCmdSpec* spec, const ChatCmd* cmd) {
+    if (!spec || !cmd) return 0;
+    if (spec->args >= 1 && !cmd->arg1) return 0;
+    if (spec->args >= 2 && !cmd->arg2) return 0;
+    if (spec->text == CHAT_CMD_TEXT_REQUIRED && !cmd->text) return 0;
+    if (spec->text == CHAT_CMD_TEXT_NONE && cmd->text) return 0;
+    return 1;
+}
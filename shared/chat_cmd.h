@@ -7,18 +7,97 @@
 // Only cmd is required; args/text are optional.
 
 // Parsed command; fields point into the original buffer (no copies).
+// Each length is the field's strlen, 0 when the field is absent.
 typedef struct ChatCmd {
     char* buf;
     char* cmd;
     char* arg1;
     char* arg2;
     char* text;
+    uint32_t cmd_len;
+    uint32_t arg1_len;
+    uint32_t arg2_len;
+    uint32_t text_len;
 } ChatCmd;
 
 // Parse payload in place by inserting NULs between tokens.
 int chat_cmd_parse_inplace(char* payload, ChatCmd* out);
+// Same, for a payload of known length; payload[len] must be NUL (frames
+// from the decoder and chat_frame_recv_alloc are). Parsing still ends at
+// the first NUL, as chat_cmd_parse_inplace does.
+int chat_cmd_parse(char* payload, uint32_t len, ChatCmd* out);
+// Tokenizer kernel: 0 portable (8 bytes per word), 1 SSE2, 2 AVX2. Levels
+// the CPU lacks are capped; want < 0 only asks. Returns the level in use.
+// The best level is picked on first use; forcing one is for tests and
+// benchmarks.
+int chat_cmd_simd_level(int want);
 // Free the original buffer referenced by cmd->buf.
 void chat_cmd_free(ChatCmd* cmd);
 
 // Format a command into out; returns 1 if it fits in out_cap.
 int chat_cmd_format(char* out, uint32_t out_cap, const char* cmd, const char* arg1, const char* arg2, const char* text);
+
+// Command registry: every v1 command name with its handler ID and what it
+// takes. Add a command with one X() line:
+//   X(id, first, second, last character, flags, required args, text, usage)
+// The three characters feed CHAT_CMD_HASH, which must give each name its
+// own slot; chat_cmd.c fails to compile if two share one. Then change the
+// hash, for example by doubling one character's weight. chat_shared_bench
+// checks before timing that the characters are the name's and that every
+// name finds its own entry.
+#define CHAT_CMD_LIST(X) \
+    X(HELLO, 'H', 'E', 'O', CHAT_CMD_PREAUTH, 0, CHAT_CMD_TEXT_ANY, "Expected HELLO version") \
+    X(AUTH, 'A', 'U', 'H', CHAT_CMD_PREAUTH, 2, CHAT_CMD_TEXT_ANY, "Expected AUTH username password") \
+    X(JOIN, 'J', 'O', 'N', 0, 1, CHAT_CMD_TEXT_ANY, "Missing room") \
+    X(LEAVE, 'L', 'E', 'E', 0, 1, CHAT_CMD_TEXT_ANY, "Missing room") \
+    X(MSG, 'M', 'S', 'G', 0, 1, CHAT_CMD_TEXT_REQUIRED, "Expected MSG room :text") \
+    X(PM, 'P', 'M', 'M', 0, 1, CHAT_CMD_TEXT_REQUIRED, "Expected PM user :text") \
+    X(HISTORY, 'H', 'I', 'Y', 0, 1, CHAT_CMD_TEXT_NONE, "Expected HISTORY room [count]") \
+    X(PING, 'P', 'I', 'G', 0, 0, CHAT_CMD_TEXT_ANY, "Expected PING") \
+    X(QUEUE, 'Q', 'U', 'E', 0, 0, CHAT_CMD_TEXT_ANY, "Expected QUEUE") \
+    X(POOLS, 'P', 'O', 'S', 0, 0, CHAT_CMD_TEXT_ANY, "Expected POOLS") \
+    X(STATS, 'S', 'T', 'S', 0, 0, CHAT_CMD_TEXT_ANY, "Expected STATS") \
+    X(NODE, 'N', 'O', 'E', CHAT_CMD_PREAUTH, 2, CHAT_CMD_TEXT_NONE, "Expected NODE id secret")
+
+// Handler IDs; 0 is never a registered command.
+typedef enum ChatCmdId {
+    CHAT_CMD_NONE = 0,
+#define CHAT_CMD_ENUM(id, c0, c1, cl, flags, args, text, usage) CHAT_CMD_##id,
+    CHAT_CMD_LIST(CHAT_CMD_ENUM)
+#undef CHAT_CMD_ENUM
+    CHAT_CMD_COUNT
+} ChatCmdId;
+
+#define CHAT_CMD_PREAUTH 0x01 // Only valid before AUTH succeeds.
+
+#define CHAT_CMD_TEXT_ANY 0      // " :text" optional.
+#define CHAT_CMD_TEXT_REQUIRED 1 // " :text" must be present.
+#define CHAT_CMD_TEXT_NONE 2     // " :text" is not allowed.
+
+// Longest registered name; longer tokens are rejected before hashing.
+#define CHAT_CMD_NAME_MAX 7u
+
+// Slot of a name from its length, first, second and last characters,
+// folded to lower case. Also a constant expression for the slot table.
+#define CHAT_CMD_SLOTS 32u
+#define CHAT_CMD_HASH(len, c0, c1, cl) \
+    (((uint32_t)(len) + ((uint32_t)(c0) | 0x20u) + ((uint32_t)(c1) | 0x20u) + ((uint32_t)(cl) | 0x20u)) & \
+        (CHAT_CMD_SLOTS - 1u))
+
+typedef struct ChatCmdSpec {
+    ChatCmdId id;
+    const char* name; // Upper case; also the ERR code for a bad call.
+    uint32_t name_len;
+    uint32_t flags;   // CHAT_CMD_PREAUTH.
+    uint32_t args;    // arg1/arg2 that must be present.
+    uint32_t text;    // CHAT_CMD_TEXT_*.
+    const char* usage; // ERR reason when chat_cmd_check fails.
+} ChatCmdSpec;
+
+// Find a command by name, ignoring case; NULL if it is not registered.
+// One hash and one compare, whatever the number of commands.
+const ChatCmdSpec* chat_cmd_lookup(const char* name, uint32_t len);
+// Spec of a handler ID; NULL for CHAT_CMD_NONE or out of range.
+const ChatCmdSpec* chat_cmd_spec(ChatCmdId id);
+// 1 if cmd has the arguments and text its spec requires.
+int chat_cmd_check(const ChatCmdSpec* spec, const ChatCmd* cmd);
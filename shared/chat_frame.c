@@ -3,12 +3,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "chat_proto.h"
+
 int chat_send_all(SOCKET sock, const void* data, int len) {
     const char* p = (const char*)data;
     int remaining = len;
     // send() may transmit fewer bytes; loop until all bytes are sent.
     while (remaining > 0) {
-        int n = send(sock, p, remaining, 0);
+        int n = send(sock, p, remaining, CHAT_SEND_FLAGS);
         if (n <= 0) return 0;
         p += n;
         remaining -= n;
@@ -16,12 +18,25 @@ int chat_send_all(SOCKET sock, const void* data, int len) {
     return 1;
 }
 
+// Block until sock is readable (for callers using non-blocking sockets).
+static int wait_readable(SOCKET sock) {
+    WSAPOLLFD pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    return WSAPoll(&pfd, 1, -1) > 0;
+}
+
 int chat_recv_all(SOCKET sock, void* data, int len) {
     char* p = (char*)data;
     int remaining = len;
     // recv() may return partial data; loop until we have len bytes.
     while (remaining > 0) {
         int n = recv(sock, p, remaining, 0);
+        if (n < 0 && chat_sock_errno() == CHAT_EWOULDBLOCK) {
+            if (!wait_readable(sock)) return 0;
+            continue;
+        }
         if (n <= 0) return 0;
         p += n;
         remaining -= n;
@@ -29,12 +44,35 @@ int chat_recv_all(SOCKET sock, void* data, int len) {
     return 1;
 }
 
+int chat_recv_some(SOCKET sock, void* data, int len) {
+    for (;;) {
+        int n = recv(sock, (char*)data, len, 0);
+        if (n < 0 && chat_sock_errno() == CHAT_EWOULDBLOCK) {
+            if (!wait_readable(sock)) return 0;
+            continue;
+        }
+        return n > 0 ? n : 0;
+    }
+}
+
 int chat_frame_send(SOCKET sock, const void* payload, uint32_t payload_len) {
     // Prefix payload with a 32-bit length in network byte order.
     uint32_t net_len = htonl(payload_len);
-    if (!chat_send_all(sock, &net_len, (int)sizeof(net_len))) return 0;
-    if (payload_len == 0) return 1;
-    return chat_send_all(sock, payload, (int)payload_len);
+
+    // Prefix and body go out in one gather write; finish any short write piecewise.
+    ChatIoVec iov[2];
+    chat_iov_set(&iov[0], &net_len, sizeof(net_len));
+    chat_iov_set(&iov[1], payload, payload_len);
+    int n = chat_sendv(sock, iov, payload_len ? 2 : 1);
+    if (n <= 0) return 0;
+
+    uint32_t sent = (uint32_t)n;
+    if (sent < sizeof(net_len)) {
+        if (!chat_send_all(sock, (const char*)&net_len + sent, (int)(sizeof(net_len) - sent))) return 0;
+        sent = sizeof(net_len);
+    }
+    sent -= (uint32_t)sizeof(net_len);
+    return chat_send_all(sock, (const char*)payload + sent, (int)(payload_len - sent));
 }
 
 int chat_frame_recv_alloc(SOCKET sock, uint8_t** out_payload, uint32_t* out_payload_len, uint32_t max_payload_len) {
@@ -63,3 +101,150 @@ int chat_frame_recv_alloc(SOCKET sock, uint8_t** out_payload, uint32_t* out_payl
     *out_payload_len = payload_len;
     return 1;
 }
+
+// Parse a length prefix: its size in bytes, 0 if incomplete, -1 if malformed.
+static int frame_prefix(const ChatFrameDecoder* d, const uint8_t* p, size_t avail, uint32_t* n) {
+    if (d->varint) return chat_varint_get(p, avail, n);
+    if (avail < 4) return 0;
+    uint32_t net_len;
+    memcpy(&net_len, p, sizeof(net_len));
+    *n = ntohl(net_len);
+    return 4;
+}
+
+void chat_decoder_init(ChatFrameDecoder* d, uint32_t max_payload) {
+    memset(d, 0, sizeof(*d));
+    d->max_payload = max_payload;
+}
+
+void chat_decoder_free(ChatFrameDecoder* d) {
+    free(d->carry);
+    chat_decoder_init(d, d->max_payload);
+}
+
+void chat_decoder_set_varint(ChatFrameDecoder* d, int varint) {
+    d->varint = varint;
+}
+
+// Release a large carry buffer once the frame viewed in it is done.
+static void decoder_trim(ChatFrameDecoder* d) {
+    if (d->carry_len == 0 && d->carry_cap > CHAT_DECODER_KEEP) {
+        free(d->carry);
+        d->carry = NULL;
+        d->carry_cap = 0;
+    }
+}
+
+void chat_decoder_feed(ChatFrameDecoder* d, uint8_t* chunk, size_t len) {
+    // Any NUL left in the previous chunk belongs to the caller now.
+    d->saved_at = NULL;
+    decoder_trim(d);
+    d->chunk = chunk;
+    d->chunk_len = len;
+    d->chunk_off = 0;
+}
+
+size_t chat_decoder_unread(const ChatFrameDecoder* d) {
+    return d->chunk_len - d->chunk_off;
+}
+
+void chat_decoder_move(ChatFrameDecoder* d, uint8_t* dst) {
+    if (d->saved_at) {
+        *d->saved_at = d->saved;
+        d->saved_at = NULL;
+    }
+    size_t n = d->chunk_len - d->chunk_off;
+    if (n) memcpy(dst, d->chunk + d->chunk_off, n);
+    d->chunk = dst;
+    d->chunk_len = n;
+    d->chunk_off = 0;
+}
+
+static int decoder_fail(ChatFrameDecoder* d) {
+    d->failed = 1;
+    return -1;
+}
+
+static int decoder_reserve(ChatFrameDecoder* d, size_t need) {
+    if (need <= d->carry_cap) return 1;
+    size_t cap = d->carry_cap ? (size_t)d->carry_cap * 2 : 64;
+    if (cap < need) cap = need;
+    uint8_t* carry = (uint8_t*)realloc(d->carry, cap);
+    if (!carry) return 0;
+    d->carry = carry;
+    d->carry_cap = (uint32_t)cap;
+    return 1;
+}
+
+// Append to the carry buffer, keeping one byte spare for the terminator.
+static int decoder_carry(ChatFrameDecoder* d, const uint8_t* p, size_t n) {
+    if (!decoder_reserve(d, (size_t)d->carry_len + n + 1)) return 0;
+    memcpy(d->carry + d->carry_len, p, n);
+    d->carry_len += (uint32_t)n;
+    return 1;
+}
+
+// Complete a frame split across chunks from the current chunk: the prefix
+// first (a byte at a time, since a varint's size is only known at its end),
+// then the payload.
+static int decoder_next_carried(ChatFrameDecoder* d, uint8_t** payload, uint32_t* payload_len) {
+    size_t avail = d->chunk_len - d->chunk_off;
+    uint32_t n = 0;
+    int hdr;
+    while ((hdr = frame_prefix(d, d->carry, d->carry_len, &n)) == 0) {
+        if (avail == 0) return 0;
+        if (!decoder_carry(d, d->chunk + d->chunk_off, 1)) return decoder_fail(d);
+        d->chunk_off++;
+        avail--;
+    }
+    if (hdr < 0 || n > d->max_payload) return decoder_fail(d);
+
+    size_t want = (size_t)hdr + n;
+    if (!decoder_reserve(d, want + 1)) return decoder_fail(d);
+    size_t take = want - d->carry_len < avail ? want - d->carry_len : avail;
+    memcpy(d->carry + d->carry_len, d->chunk + d->chunk_off, take);
+    d->carry_len += (uint32_t)take;
+    d->chunk_off += take;
+    if (d->carry_len < want) return 0;
+
+    d->carry[want] = 0;
+    *payload = d->carry + hdr;
+    *payload_len = n;
+    d->carry_len = 0;
+    return 1;
+}
+
+int chat_decoder_next(ChatFrameDecoder* d, uint8_t** payload, uint32_t* payload_len) {
+    if (d->saved_at) {
+        *d->saved_at = d->saved;
+        d->saved_at = NULL;
+    }
+    decoder_trim(d);
+    if (d->failed) return -1;
+    if (d->carry_len > 0) return decoder_next_carried(d, payload, payload_len);
+
+    size_t avail = d->chunk_len - d->chunk_off;
+    if (avail == 0) return 0;
+    uint8_t* p = d->chunk + d->chunk_off;
+    uint32_t n = 0;
+    int hdr = frame_prefix(d, p, avail, &n);
+    if (hdr < 0 || (hdr > 0 && n > d->max_payload)) return decoder_fail(d);
+    if (hdr > 0 && avail - (size_t)hdr >= n) {
+        // Terminate in place, saving the next frame's first byte.
+        uint8_t* body = p + hdr;
+        d->chunk_off += (size_t)hdr + n;
+        if (d->chunk_off < d->chunk_len) {
+            d->saved_at = body + n;
+            d->saved = *d->saved_at;
+        }
+        body[n] = 0;
+        *payload = body;
+        *payload_len = n;
+        return 1;
+    }
+    // Keep the partial frame until the next chunk arrives.
+    if (!decoder_carry(d, p, avail)) return decoder_fail(d);
+    d->chunk_off = d->chunk_len;
+    return 0;
+}
+
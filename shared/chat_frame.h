@@ -1,9 +1,6 @@
 #pragma once
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#endif
+#include "chat_platform.h"
 
 #include <stdint.h>
 
@@ -15,11 +12,55 @@
 #endif
 
 // Send/receive exactly len bytes; returns 1 on success, 0 on error.
+// chat_recv_all also works on non-blocking sockets (waits for readability).
 int chat_send_all(SOCKET sock, const void* data, int len);
 int chat_recv_all(SOCKET sock, void* data, int len);
 
-// Send a single length-prefixed payload.
+// Send a single length-prefixed payload (one syscall in the common case).
 int chat_frame_send(SOCKET sock, const void* payload, uint32_t payload_len);
 // Receive a length-prefixed payload into a NUL-terminated buffer.
 // Caller owns *out_payload.
 int chat_frame_recv_alloc(SOCKET sock, uint8_t** out_payload, uint32_t* out_payload_len, uint32_t max_payload_len);
+// Receive whatever is available, up to len bytes; waits for readability on
+// non-blocking sockets. Returns the byte count, or 0 on close or error.
+int chat_recv_some(SOCKET sock, void* data, int len);
+
+#define CHAT_DECODER_KEEP 4096u // Largest carry buffer kept once drained.
+
+// Incremental frame decoder for a byte stream. Feed each received chunk,
+// then take frames until chat_decoder_next returns 0. Frames that arrive
+// whole inside a chunk are returned in place; only a frame split across
+// chunks is copied into the carry buffer, which is reused between frames
+// (and released once drained if it grew past CHAT_DECODER_KEEP).
+typedef struct ChatFrameDecoder {
+    uint8_t* chunk; // Caller's current chunk, decoded in place.
+    size_t chunk_len;
+    size_t chunk_off;
+    uint8_t* carry; // Frame split across chunks: prefix, then payload.
+    uint32_t carry_len;
+    uint32_t carry_cap;
+    uint32_t max_payload;
+    uint8_t* saved_at; // Chunk byte replaced by the last frame's NUL terminator.
+    uint8_t saved;
+    int varint; // Protocol v2 prefix (varint) instead of 32-bit big-endian.
+    int failed; // Oversized frame or out of memory; the stream is unusable.
+} ChatFrameDecoder;
+
+void chat_decoder_init(ChatFrameDecoder* d, uint32_t max_payload);
+void chat_decoder_free(ChatFrameDecoder* d);
+// Select the length prefix for frames not yet started: 0 for v1's 32-bit
+// big-endian length, 1 for v2's varint. Safe to call between frames.
+void chat_decoder_set_varint(ChatFrameDecoder* d, int varint);
+// The chunk must stay valid and writable until chat_decoder_next stops
+// returning 1, and needs one spare byte of storage after len.
+void chat_decoder_feed(ChatFrameDecoder* d, uint8_t* chunk, size_t len);
+// Bytes of the current chunk not decoded yet.
+size_t chat_decoder_unread(const ChatFrameDecoder* d);
+// Copy those bytes to dst (with one spare byte after them) and decode from
+// there, so the caller's chunk can be reused before they are taken.
+void chat_decoder_move(ChatFrameDecoder* d, uint8_t* dst);
+// 1: *payload (writable, NUL-terminated) holds the next frame until the
+// next call. 0: needs another chunk. -1: frame over max_payload, bad
+// prefix or out of memory; close the connection.
+int chat_decoder_next(ChatFrameDecoder* d, uint8_t** payload, uint32_t* payload_len);
+
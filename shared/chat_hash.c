@@ -0,0 +1,211 @@
+#include "chat_hash.h"
+
+#include <string.h>
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void sha256_compress(uint32_t h[8], const uint8_t block[CHAT_SHA256_BLOCK]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = load_be32(block + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void chat_sha256_init(ChatSha256* s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, iv, sizeof(iv));
+    s->bytes = 0;
+    s->fill = 0;
+}
+
+void chat_sha256_update(ChatSha256* s, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    s->bytes += len;
+    if (s->fill) {
+        size_t take = CHAT_SHA256_BLOCK - s->fill < len ? CHAT_SHA256_BLOCK - s->fill : len;
+        memcpy(s->block + s->fill, p, take);
+        s->fill += (uint32_t)take;
+        p += take;
+        len -= take;
+        if (s->fill < CHAT_SHA256_BLOCK) return;
+        sha256_compress(s->h, s->block);
+        s->fill = 0;
+    }
+    for (; len >= CHAT_SHA256_BLOCK; p += CHAT_SHA256_BLOCK, len -= CHAT_SHA256_BLOCK) sha256_compress(s->h, p);
+    memcpy(s->block, p, len);
+    s->fill = (uint32_t)len;
+}
+
+void chat_sha256_final(ChatSha256* s, uint8_t out[CHAT_SHA256_LEN]) {
+    uint64_t bits = s->bytes * 8;
+    s->block[s->fill++] = 0x80;
+    if (s->fill > CHAT_SHA256_BLOCK - 8) {
+        memset(s->block + s->fill, 0, CHAT_SHA256_BLOCK - s->fill);
+        sha256_compress(s->h, s->block);
+        s->fill = 0;
+    }
+    memset(s->block + s->fill, 0, CHAT_SHA256_BLOCK - 8 - s->fill);
+    store_be32(s->block + 56, (uint32_t)(bits >> 32));
+    store_be32(s->block + 60, (uint32_t)bits);
+    sha256_compress(s->h, s->block);
+    for (int i = 0; i < 8; i++) store_be32(out + 4 * i, s->h[i]);
+}
+
+void chat_hmac_init(ChatHmac* h, const void* key, size_t key_len) {
+    uint8_t k[CHAT_SHA256_BLOCK];
+    memset(k, 0, sizeof(k));
+    if (key_len > CHAT_SHA256_BLOCK) {
+        ChatSha256 s;
+        chat_sha256_init(&s);
+        chat_sha256_update(&s, key, key_len);
+        chat_sha256_final(&s, k);
+    } else {
+        memcpy(k, key, key_len);
+    }
+    uint8_t pad[CHAT_SHA256_BLOCK];
+    for (int i = 0; i < CHAT_SHA256_BLOCK; i++) pad[i] = k[i] ^ 0x36;
+    chat_sha256_init(&h->inner);
+    chat_sha256_update(&h->inner, pad, sizeof(pad));
+    for (int i = 0; i < CHAT_SHA256_BLOCK; i++) pad[i] = k[i] ^ 0x5c;
+    chat_sha256_init(&h->outer);
+    chat_sha256_update(&h->outer, pad, sizeof(pad));
+    memset(k, 0, sizeof(k));
+}
+
+void chat_hmac(const ChatHmac* h, const void* msg, size_t len, uint8_t out[CHAT_SHA256_LEN]) {
+    ChatSha256 s = h->inner;
+    chat_sha256_update(&s, msg, len);
+    chat_sha256_final(&s, out);
+    s = h->outer;
+    chat_sha256_update(&s, out, CHAT_SHA256_LEN);
+    chat_sha256_final(&s, out);
+}
+
+// One iteration is HMAC of a digest: a single padded block through each of
+// the inner and outer states, built here directly instead of through
+// update/final.
+static void pbkdf2_step(const ChatHmac* h, uint8_t u[CHAT_SHA256_LEN]) {
+    uint8_t block[CHAT_SHA256_BLOCK];
+    memset(block, 0, sizeof(block));
+    block[CHAT_SHA256_LEN] = 0x80;
+    // Message length in bits: the pad block plus the digest.
+    store_be32(block + 60, (CHAT_SHA256_BLOCK + CHAT_SHA256_LEN) * 8);
+
+    uint32_t st[8];
+    memcpy(block, u, CHAT_SHA256_LEN);
+    memcpy(st, h->inner.h, sizeof(st));
+    sha256_compress(st, block);
+    for (int i = 0; i < 8; i++) store_be32(block + 4 * i, st[i]);
+    memcpy(st, h->outer.h, sizeof(st));
+    sha256_compress(st, block);
+    for (int i = 0; i < 8; i++) store_be32(u + 4 * i, st[i]);
+}
+
+void chat_pbkdf2_sha256(const void* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+    uint32_t iterations, uint8_t* out, size_t out_len) {
+    ChatHmac h;
+    chat_hmac_init(&h, password, password_len);
+    for (uint32_t index = 1; out_len > 0; index++) {
+        uint8_t be[4];
+        uint8_t u[CHAT_SHA256_LEN];
+        uint8_t t[CHAT_SHA256_LEN];
+        store_be32(be, index);
+        ChatSha256 s = h.inner;
+        chat_sha256_update(&s, salt, salt_len);
+        chat_sha256_update(&s, be, sizeof(be));
+        chat_sha256_final(&s, u);
+        s = h.outer;
+        chat_sha256_update(&s, u, CHAT_SHA256_LEN);
+        chat_sha256_final(&s, u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            pbkdf2_step(&h, u);
+            for (int j = 0; j < CHAT_SHA256_LEN; j++) t[j] ^= u[j];
+        }
+        size_t n = out_len < CHAT_SHA256_LEN ? out_len : CHAT_SHA256_LEN;
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+    memset(&h, 0, sizeof(h));
+}
+
+int chat_equal_ct(const uint8_t* a, const uint8_t* b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= (uint8_t)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+void chat_hex_encode(const uint8_t* in, size_t len, char* out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 15];
+    }
+    out[2 * len] = 0;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int chat_hex_decode(const char* in, size_t in_len, uint8_t* out, size_t len) {
+    if (in_len != 2 * len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_digit(in[2 * i]);
+        int lo = hex_digit(in[2 * i + 1]);
+        if (hi < 0 || lo < 0) return 0;
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 1;
+}
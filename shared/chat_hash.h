@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256, HMAC-SHA-256 and PBKDF2-HMAC-SHA-256 (FIPS 180-4, RFC 2104,
+// RFC 8018), for the server's credential file and the tool that writes it.
+// Portable C with no dependencies; not hardened against side channels
+// beyond the constant-time compare.
+
+#define CHAT_SHA256_LEN 32
+#define CHAT_SHA256_BLOCK 64
+
+typedef struct ChatSha256 {
+    uint32_t h[8];
+    uint64_t bytes; // Total fed so far.
+    uint8_t block[CHAT_SHA256_BLOCK];
+    uint32_t fill; // Bytes waiting in block.
+} ChatSha256;
+
+void chat_sha256_init(ChatSha256* s);
+void chat_sha256_update(ChatSha256* s, const void* data, size_t len);
+void chat_sha256_final(ChatSha256* s, uint8_t out[CHAT_SHA256_LEN]);
+
+// HMAC with the key's pads already absorbed, so each use of one key costs
+// only its message's blocks and two finals.
+typedef struct ChatHmac {
+    ChatSha256 inner;
+    ChatSha256 outer;
+} ChatHmac;
+
+void chat_hmac_init(ChatHmac* h, const void* key, size_t key_len);
+void chat_hmac(const ChatHmac* h, const void* msg, size_t len, uint8_t out[CHAT_SHA256_LEN]);
+
+// Derive out_len bytes from password and salt.
+void chat_pbkdf2_sha256(const void* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+    uint32_t iterations, uint8_t* out, size_t out_len);
+
+// 1 if the buffers match; takes the same time wherever they differ.
+int chat_equal_ct(const uint8_t* a, const uint8_t* b, size_t len);
+
+// Lowercase hex of len bytes into out (2 * len + 1 with the NUL).
+void chat_hex_encode(const uint8_t* in, size_t len, char* out);
+// Decode exactly 2 * len hex digits; returns 0 on any other input.
+int chat_hex_decode(const char* in, size_t in_len, uint8_t* out, size_t len);
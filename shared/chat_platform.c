@@ -0,0 +1,100 @@
+#include "chat_platform.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <bcrypt.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+int chat_thread_start(ChatThreadFn fn, void* arg) {
+#ifdef _WIN32
+    HANDLE h = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    if (!h) return 0;
+    // Thread runs detached; nobody joins it.
+    CloseHandle(h);
+    return 1;
+#else
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fn, arg) != 0) return 0;
+    pthread_detach(tid);
+    return 1;
+#endif
+}
+
+int chat_socket_set_nonblocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long on = 1;
+    return ioctlsocket(sock, FIONBIO, &on) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return 0;
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+SOCKET chat_accept_nonblocking(SOCKET listen_sock) {
+#ifdef __linux__
+    return accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET s = accept(listen_sock, NULL, NULL);
+    if (s != INVALID_SOCKET && !chat_socket_set_nonblocking(s)) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+#endif
+}
+
+int chat_socket_set_nodelay(SOCKET sock) {
+    int on = 1;
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on)) == 0;
+}
+
+int chat_sendv(SOCKET sock, const ChatIoVec* iov, int count) {
+#ifdef _WIN32
+    DWORD sent = 0;
+    if (WSASend(sock, (LPWSABUF)iov, (DWORD)count, &sent, 0, NULL, NULL) != 0) return -1;
+    return (int)sent;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = (size_t)count;
+    return (int)sendmsg(sock, &msg, CHAT_SEND_FLAGS);
+#endif
+}
+
+uint64_t chat_now_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+int chat_random_bytes(void* buf, size_t len) {
+#ifdef _WIN32
+    return BCryptGenRandom(NULL, (PUCHAR)buf, (ULONG)len, BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0;
+#else
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    uint8_t* p = (uint8_t*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) break;
+        p += n;
+        len -= (size_t)n;
+    }
+    close(fd);
+    return len == 0;
+#endif
+}
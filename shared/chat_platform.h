@@ -0,0 +1,155 @@
+#pragma once
+
+// Thin portability layer so the server and tools build on Windows and POSIX.
+// Windows builds use the native APIs directly; POSIX builds map the small
+// subset the server uses (sockets, critical sections, threads) onto BSD
+// sockets and pthreads.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#define CHAT_THREAD_RET DWORD
+#define CHAT_THREAD_CALL WINAPI
+#define CHAT_THREAD_LOCAL __declspec(thread)
+#define CHAT_SEND_FLAGS 0
+
+// Full-barrier atomics for refcounts, flags and lock-free queues.
+#define chat_atomic_add(p, v) InterlockedAdd((volatile LONG*)(p), (LONG)(v))
+#define chat_atomic_xchg(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define chat_atomic_load(p) InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define chat_atomic_xchg_ptr(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v))
+#define chat_atomic_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define chat_atomic_store_ptr(p, v) ((void)InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v)))
+// Returns the previous value; the swap happened if it equals expected.
+#define chat_atomic_cas_ptr(p, expected, v) \
+    InterlockedCompareExchangePointer((PVOID volatile*)(p), (PVOID)(v), (PVOID)(expected))
+#define chat_atomic_or64(p, v) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), (LONG64)(v)))
+#define chat_atomic_and64(p, v) ((uint64_t)InterlockedAnd64((volatile LONG64*)(p), (LONG64)(v)))
+#define chat_atomic_load64(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+// Statistics counters: no ordering beyond the add itself.
+#define chat_atomic_add64(p, v) ((void)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)))
+
+#define chat_sock_errno() WSAGetLastError()
+#define CHAT_EWOULDBLOCK WSAEWOULDBLOCK
+
+typedef WSABUF ChatIoVec;
+#define chat_iov_set(v, p, n) ((v)->buf = (char*)(p), (v)->len = (ULONG)(n))
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define _strdup strdup
+#define gai_strerrorA gai_strerror
+
+// No socket library initialization outside Windows.
+typedef struct WSAData {
+    int unused;
+} WSADATA;
+#define MAKEWORD(lo, hi) ((uint16_t)(((lo) & 0xff) | (((hi) & 0xff) << 8)))
+#define WSAStartup(version, data) ((void)(version), (void)(data), 0)
+#define WSACleanup() ((void)0)
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init((cs), NULL)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+
+typedef pthread_rwlock_t SRWLOCK;
+#define InitializeSRWLock(l) pthread_rwlock_init((l), NULL)
+#define AcquireSRWLockShared(l) pthread_rwlock_rdlock(l)
+#define ReleaseSRWLockShared(l) pthread_rwlock_unlock(l)
+#define AcquireSRWLockExclusive(l) pthread_rwlock_wrlock(l)
+#define ReleaseSRWLockExclusive(l) pthread_rwlock_unlock(l)
+
+#define Sleep(ms) usleep((useconds_t)(ms) * 1000u)
+
+// Only infinite waits are supported.
+#define INFINITE 0xFFFFFFFFu
+typedef pthread_cond_t CONDITION_VARIABLE;
+#define InitializeConditionVariable(cv) pthread_cond_init((cv), NULL)
+#define SleepConditionVariableCS(cv, cs, ms) ((void)(ms), pthread_cond_wait((cv), (cs)))
+#define WakeConditionVariable(cv) pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv) pthread_cond_broadcast(cv)
+
+typedef struct pollfd WSAPOLLFD;
+#define WSAPoll poll
+
+#define CHAT_THREAD_RET void*
+#define CHAT_THREAD_CALL
+#define CHAT_THREAD_LOCAL _Thread_local
+// Never raise SIGPIPE when a peer disappears mid-send.
+#define CHAT_SEND_FLAGS MSG_NOSIGNAL
+
+#define chat_atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define chat_atomic_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define chat_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define chat_atomic_xchg_ptr(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define chat_atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define chat_atomic_store_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define chat_atomic_cas_ptr(p, expected, v) __sync_val_compare_and_swap((p), (expected), (v))
+#define chat_atomic_or64(p, v) __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define chat_atomic_and64(p, v) __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define chat_atomic_load64(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define chat_atomic_add64(p, v) ((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+
+#define chat_sock_errno() errno
+#define CHAT_EWOULDBLOCK EWOULDBLOCK
+
+typedef struct iovec ChatIoVec;
+#define chat_iov_set(v, p, n) ((v)->iov_base = (void*)(p), (v)->iov_len = (size_t)(n))
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef CHAT_THREAD_RET (CHAT_THREAD_CALL *ChatThreadFn)(void* arg);
+
+// Start a detached thread; returns 1 on success.
+int chat_thread_start(ChatThreadFn fn, void* arg);
+
+// Switch a socket to non-blocking mode; returns 1 on success.
+int chat_socket_set_nonblocking(SOCKET sock);
+
+// Accept one pending connection, already non-blocking (accept4 on Linux).
+// Returns INVALID_SOCKET with the error in chat_sock_errno() if none is
+// pending or accepting failed.
+SOCKET chat_accept_nonblocking(SOCKET listen_sock);
+
+// Disable Nagle's algorithm (TCP_NODELAY); callers batch their own writes.
+// Returns 1 on success.
+int chat_socket_set_nodelay(SOCKET sock);
+
+// Gather-write count buffers with one syscall (WSASend / sendmsg). Returns
+// bytes sent, or -1 with the error in chat_sock_errno().
+int chat_sendv(SOCKET sock, const ChatIoVec* iov, int count);
+
+// Monotonic clock in nanoseconds (for timing and benchmarks).
+uint64_t chat_now_ns(void);
+
+// Fill buf from the system's cryptographic random source; returns 1 on
+// success.
+int chat_random_bytes(void* buf, size_t len);
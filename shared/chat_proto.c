@@ -0,0 +1,133 @@
+#include "chat_proto.h"
+
+#include <string.h>
+
+const char* chat_op_name(uint8_t op) {
+    switch (op) {
+    case CHAT_OP_AUTH:
+        return "AUTH";
+    case CHAT_OP_JOIN:
+        return "JOIN";
+    case CHAT_OP_LEAVE:
+        return "LEAVE";
+    case CHAT_OP_MSG:
+        return "MSG";
+    case CHAT_OP_PM:
+        return "PM";
+    case CHAT_OP_PING:
+        return "PING";
+    case CHAT_OP_QUEUE:
+        return "QUEUE";
+    case CHAT_OP_POOLS:
+        return "POOLS";
+    case CHAT_OP_HISTORY:
+        return "HISTORY";
+    case CHAT_OP_STATS:
+        return "STATS";
+    }
+    return "?";
+}
+
+uint32_t chat_varint_put(uint8_t* out, uint32_t v) {
+    uint32_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+int chat_varint_get(const uint8_t* p, size_t avail, uint32_t* v) {
+    uint32_t x = 0;
+    for (size_t i = 0; i < avail && i < CHAT_VARINT_MAX; i++) {
+        x |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            // The fifth byte may only carry the top four bits.
+            if (i == CHAT_VARINT_MAX - 1 && p[i] > 0x0f) return -1;
+            *v = x;
+            return (int)i + 1;
+        }
+    }
+    return avail >= CHAT_VARINT_MAX ? -1 : 0;
+}
+
+void chat_bw_init(ChatBinWriter* w, uint8_t* buf, uint32_t cap) {
+    w->buf = buf;
+    w->len = 0;
+    w->cap = cap;
+    w->overflow = 0;
+}
+
+static void bw_bytes(ChatBinWriter* w, const void* p, size_t n) {
+    if (w->overflow || n > (size_t)(w->cap - w->len)) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += (uint32_t)n;
+}
+
+void chat_bw_u8(ChatBinWriter* w, uint8_t v) {
+    bw_bytes(w, &v, 1);
+}
+
+void chat_bw_varint(ChatBinWriter* w, uint32_t v) {
+    uint8_t tmp[CHAT_VARINT_MAX];
+    bw_bytes(w, tmp, chat_varint_put(tmp, v));
+}
+
+void chat_bw_str(ChatBinWriter* w, const char* s) {
+    size_t n = strlen(s);
+    chat_bw_varint(w, (uint32_t)n);
+    bw_bytes(w, s, n);
+}
+
+void chat_bw_text(ChatBinWriter* w, const char* s) {
+    bw_bytes(w, s, strlen(s));
+}
+
+void chat_br_init(ChatBinReader* r, uint8_t* payload, uint32_t len) {
+    r->p = payload;
+    r->end = payload + len;
+    r->bad = 0;
+}
+
+uint8_t chat_br_u8(ChatBinReader* r) {
+    if (r->bad || r->p == r->end) {
+        r->bad = 1;
+        return 0;
+    }
+    return *r->p++;
+}
+
+uint32_t chat_br_varint(ChatBinReader* r) {
+    uint32_t v = 0;
+    int n = r->bad ? -1 : chat_varint_get(r->p, (size_t)(r->end - r->p), &v);
+    if (n <= 0) {
+        r->bad = 1;
+        return 0;
+    }
+    r->p += n;
+    return v;
+}
+
+char* chat_br_str(ChatBinReader* r) {
+    uint32_t n = chat_br_varint(r);
+    if (r->bad || n > (size_t)(r->end - r->p) || memchr(r->p, 0, n)) {
+        r->bad = 1;
+        return NULL;
+    }
+    char* s = (char*)r->p - 1;
+    memmove(s, r->p, n);
+    s[n] = 0;
+    r->p += n;
+    return s;
+}
+
+char* chat_br_text(ChatBinReader* r) {
+    if (r->bad) return NULL;
+    char* s = (char*)r->p;
+    r->p = r->end;
+    return s;
+}
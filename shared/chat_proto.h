@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary protocol v2. Every connection starts in v1 (text commands behind a
+// 32-bit length) and the server greets with "HELLO 1". A client that speaks
+// v2 answers "HELLO 2", waits for the server to confirm with "HELLO 2", and
+// from then on both directions use v2:
+//   frame   = varint(payload length) payload
+//   payload = opcode byte, then that opcode's fields
+// Varints are unsigned LEB128. A string is a varint byte count followed by
+// the bytes; a trailing text field runs to the end of the payload. Rooms and
+// users are named by numeric ids the server announces once per session.
+
+#define CHAT_PROTO_TEXT 1 // v1: command text.
+#define CHAT_PROTO_BIN 2 // v2: binary opcodes.
+#define CHAT_VARINT_MAX 5 // Longest encoding of a 32-bit varint.
+
+// Requests (client to server).
+#define CHAT_OP_AUTH 0x01 // str user, str password
+#define CHAT_OP_JOIN 0x02 // str room
+#define CHAT_OP_LEAVE 0x03 // varint room
+#define CHAT_OP_MSG 0x04 // varint room, text
+#define CHAT_OP_PM 0x05 // str user, text
+#define CHAT_OP_PING 0x06
+#define CHAT_OP_QUEUE 0x07
+#define CHAT_OP_POOLS 0x08
+#define CHAT_OP_HISTORY 0x09 // varint room, varint count (0: all kept)
+#define CHAT_OP_STATS 0x0A // admins only
+
+// Events (server to client).
+#define CHAT_OP_OK 0x40 // u8 request opcode
+#define CHAT_OP_ERR 0x41 // str code, text reason
+#define CHAT_OP_JOINED 0x42 // varint room, str name (reply to JOIN)
+#define CHAT_OP_MEMBERS 0x43 // varint room, then (varint user, str name) to the end
+#define CHAT_OP_ROOMMSG 0x44 // varint room, varint user, text
+#define CHAT_OP_PRIVMSG 0x45 // varint user, str name, text
+#define CHAT_OP_USERJOIN 0x46 // varint room, varint user, str name
+#define CHAT_OP_USERLEAVE 0x47 // varint room, varint user
+#define CHAT_OP_PONG 0x48
+#define CHAT_OP_QUEUE_STATS 0x49 // varint frames, bytes, hwm_bytes, dropped, sent, writes
+#define CHAT_OP_POOL 0x4A // str name, varint obj_size, in_use, idle, slabs, reserved, allocs, frag (permille)
+#define CHAT_OP_DROPPED 0x4B // varint count
+#define CHAT_OP_STAT 0x4C // str name, varint value
+#define CHAT_OP_HIST 0x4D // str name, varint count, p50, p90, p99, max
+
+// Federation links (server to server, after "NODE"; see server_peer.c).
+#define CHAT_OP_PEER_USER 0x60 // str user, u8 online: the sender holds (or no longer holds) user
+#define CHAT_OP_PEER_ROOM 0x61 // str room, u8 interested: the sender has members in room
+#define CHAT_OP_PEER_MSG 0x62 // str room, str user, text
+#define CHAT_OP_PEER_JOIN 0x63 // str room, str user, u8 joined
+#define CHAT_OP_PEER_PM 0x64 // str from, str to, text
+#define CHAT_OP_PEER_RESYNC 0x65 // (empty): send every PEER_USER, PEER_ROOM and wanted PEER_JOIN again
+
+// v1 command name for a request opcode ("?" if unknown).
+const char* chat_op_name(uint8_t op);
+
+// Encode v into out (CHAT_VARINT_MAX bytes); returns the bytes written.
+uint32_t chat_varint_put(uint8_t* out, uint32_t v);
+// Decode a varint from the first avail bytes of p: returns the bytes used,
+// 0 if more are needed, -1 if malformed (too long or over 32 bits).
+int chat_varint_get(const uint8_t* p, size_t avail, uint32_t* v);
+
+// Bounded payload builder; a write that does not fit sets overflow.
+typedef struct ChatBinWriter {
+    uint8_t* buf;
+    uint32_t len;
+    uint32_t cap;
+    int overflow;
+} ChatBinWriter;
+
+void chat_bw_init(ChatBinWriter* w, uint8_t* buf, uint32_t cap);
+void chat_bw_u8(ChatBinWriter* w, uint8_t v);
+void chat_bw_varint(ChatBinWriter* w, uint32_t v);
+// Length-prefixed string.
+void chat_bw_str(ChatBinWriter* w, const char* s);
+// Trailing text: no prefix, so it must be the last field.
+void chat_bw_text(ChatBinWriter* w, const char* s);
+
+// Reader over one writable payload; a field that runs past the end sets bad.
+typedef struct ChatBinReader {
+    uint8_t* p;
+    uint8_t* end;
+    int bad;
+} ChatBinReader;
+
+void chat_br_init(ChatBinReader* r, uint8_t* payload, uint32_t len);
+uint8_t chat_br_u8(ChatBinReader* r);
+uint32_t chat_br_varint(ChatBinReader* r);
+// Length-prefixed string, NUL-terminated in place: it is slid one byte back
+// over its own prefix, so later fields are untouched. NULL if bad, or if
+// it holds a NUL byte that would cut it short.
+char* chat_br_str(ChatBinReader* r);
+// The rest of the payload; relies on the frame decoder's NUL terminator.
+char* chat_br_text(ChatBinReader* r);
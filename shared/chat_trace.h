@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Message trace file, written by the server's --trace-file option and read
+// by chat_trace. A ChatTraceHeader, then fixed-size ChatTraceRecords in the
+// order the server drained its per-thread buffers, not in time order. Both
+// are in the writer's byte order; a reader on another order sees a bad magic.
+// A trace follows one sampled inbound frame: the frame's own stages, then
+// each frame it caused, per recipient.
+
+#define CHAT_TRACE_MAGIC "CHATTRC1"
+#define CHAT_TRACE_VERSION 1u
+
+typedef enum ChatTraceStage {
+    CHAT_TRACE_READ = 1, // The socket read that completed the frame returned.
+    CHAT_TRACE_PARSE, // Frame decoded into a command; cmd is set from here on.
+    CHAT_TRACE_DISPATCH, // Command checked; its handler starts.
+    CHAT_TRACE_ENQUEUE, // A frame it caused was queued for client.
+    CHAT_TRACE_WRITE, // That frame's last byte went into client's socket.
+    CHAT_TRACE_LOST, // Not a stage: bytes records this thread's buffer dropped.
+} ChatTraceStage;
+
+typedef struct ChatTraceHeader {
+    char magic[8]; // CHAT_TRACE_MAGIC, without the NUL.
+    uint32_t version;
+    uint32_t record_size; // sizeof(ChatTraceRecord)
+    uint64_t start_ns; // Server's monotonic clock when the file was opened.
+    uint64_t sample; // One inbound frame in this many was traced.
+} ChatTraceHeader;
+
+typedef struct ChatTraceRecord {
+    uint64_t time_ns; // Server's monotonic clock (chat_now_ns).
+    uint32_t trace; // Trace id, from 1; 0 for LOST.
+    uint32_t client; // v2 user id of the sender (READ..DISPATCH) or recipient; 0 before AUTH.
+    uint32_t bytes; // Payload bytes (READ), wire bytes (ENQUEUE, WRITE), or the LOST count.
+    uint8_t stage; // ChatTraceStage
+    uint8_t cmd; // ChatCmdId (chat_cmd.h) for PARSE and DISPATCH, else 0.
+    uint16_t thread; // Index of the server buffer that recorded it.
+} ChatTraceRecord;
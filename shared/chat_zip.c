@@ -0,0 +1,163 @@
+#include "chat_zip.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_proto.h"
+
+#ifdef CHAT_HAVE_ZLIB
+#include <zlib.h>
+
+#define ZIP_WBITS 15 // Raw deflate window (passed negated: no zlib header).
+#define ZIP_MEMLEVEL 5 // Hash tables are cleared per frame; small keeps that cheap.
+
+// Preset dictionary: what chat frames tend to repeat. zlib matches nearer
+// the end most cheaply, so the most common strings come last.
+static const char zip_dict[] =
+    "HELLO QUEUE POOLS PONG PING DROPPED ERR AUTH :Bad password ERR JOIN ERR MSG :Not in room "
+    "https://www. .com/ thanks please because about would could should there their think "
+    "really going yeah okay sure what when where have this that with from just like know "
+    "the and you for are not but OK LEAVE OK JOIN OK MSG "
+    "USERLEAVE USERJOIN MEMBERS JOINED PRIVMSG ROOMMSG lobby :";
+
+struct ChatZip {
+    z_stream def;
+    z_stream inf;
+    int level;
+    int def_ready;
+    int inf_ready;
+};
+
+int chat_zip_available(void) {
+    return 1;
+}
+
+ChatZip* chat_zip_new(int level) {
+    ChatZip* z = (ChatZip*)calloc(1, sizeof(*z));
+    if (z) z->level = level;
+    return z;
+}
+
+void chat_zip_free(ChatZip* z) {
+    if (!z) return;
+    if (z->def_ready) deflateEnd(&z->def);
+    if (z->inf_ready) inflateEnd(&z->inf);
+    free(z);
+}
+
+uint32_t chat_zip_pack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t cap) {
+    return chat_zip_pack2(z, in, len, NULL, 0, out, cap);
+}
+
+uint32_t chat_zip_pack2(ChatZip* z, const uint8_t* head, uint32_t head_len, const uint8_t* tail, uint32_t tail_len,
+    uint8_t* out, uint32_t cap) {
+    uint32_t len = head_len + tail_len;
+    if (len == 0) return 0;
+    if (cap >= len) cap = len - 1;
+    uint8_t hdr[1 + CHAT_VARINT_MAX];
+    uint32_t h = 0;
+    hdr[h++] = CHAT_ZIP_MARK;
+    h += chat_varint_put(hdr + h, len);
+    if (h >= cap) return 0;
+
+    // Every frame starts from the dictionary alone, so any receiver can
+    // inflate it without having seen earlier frames.
+    if (!z->def_ready) {
+        if (deflateInit2(&z->def, z->level, Z_DEFLATED, -ZIP_WBITS, ZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+        z->def_ready = 1;
+    } else if (deflateReset(&z->def) != Z_OK) {
+        return 0;
+    }
+    if (deflateSetDictionary(&z->def, (const Bytef*)zip_dict, (uInt)(sizeof(zip_dict) - 1)) != Z_OK) return 0;
+
+    memcpy(out, hdr, h);
+    z->def.next_out = out + h;
+    z->def.avail_out = cap - h;
+    if (head_len && tail_len) {
+        // The head goes in without a flush, so both pieces make one stream.
+        z->def.next_in = (Bytef*)head;
+        z->def.avail_in = head_len;
+        if (deflate(&z->def, Z_NO_FLUSH) != Z_OK || z->def.avail_in) return 0;
+    }
+    z->def.next_in = (Bytef*)(tail_len ? tail : head);
+    z->def.avail_in = tail_len ? tail_len : head_len;
+    if (deflate(&z->def, Z_FINISH) != Z_STREAM_END) return 0;
+    return cap - z->def.avail_out;
+}
+
+int chat_zip_unpack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t out_len) {
+    uint32_t want = 0;
+    int n = len >= 2 && in[0] == CHAT_ZIP_MARK ? chat_varint_get(in + 1, len - 1, &want) : -1;
+    if (n <= 0 || want == 0 || want != out_len) return 0;
+    uint32_t h = 1u + (uint32_t)n;
+
+    if (!z->inf_ready) {
+        if (inflateInit2(&z->inf, -ZIP_WBITS) != Z_OK) return 0;
+        z->inf_ready = 1;
+    } else if (inflateReset(&z->inf) != Z_OK) {
+        return 0;
+    }
+    if (inflateSetDictionary(&z->inf, (const Bytef*)zip_dict, (uInt)(sizeof(zip_dict) - 1)) != Z_OK) return 0;
+
+    // Output is capped at the announced length, so a frame cannot expand
+    // past it; one that would is rejected.
+    z->inf.next_in = (Bytef*)in + h;
+    z->inf.avail_in = len - h;
+    z->inf.next_out = out;
+    z->inf.avail_out = out_len;
+    return inflate(&z->inf, Z_FINISH) == Z_STREAM_END && z->inf.avail_out == 0 && z->inf.avail_in == 0;
+}
+
+#else
+
+int chat_zip_available(void) {
+    return 0;
+}
+
+ChatZip* chat_zip_new(int level) {
+    (void)level;
+    return NULL;
+}
+
+void chat_zip_free(ChatZip* z) {
+    (void)z;
+}
+
+uint32_t chat_zip_pack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t cap) {
+    (void)z;
+    (void)in;
+    (void)len;
+    (void)out;
+    (void)cap;
+    return 0;
+}
+
+uint32_t chat_zip_pack2(ChatZip* z, const uint8_t* head, uint32_t head_len, const uint8_t* tail, uint32_t tail_len,
+    uint8_t* out, uint32_t cap) {
+    (void)z;
+    (void)head;
+    (void)head_len;
+    (void)tail;
+    (void)tail_len;
+    (void)out;
+    (void)cap;
+    return 0;
+}
+
+int chat_zip_unpack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t out_len) {
+    (void)z;
+    (void)in;
+    (void)len;
+    (void)out;
+    (void)out_len;
+    return 0;
+}
+
+#endif
+
+uint32_t chat_zip_packed_len(const uint8_t* in, uint32_t len) {
+    uint32_t v = 0;
+    if (len < 2 || in[0] != CHAT_ZIP_MARK) return 0;
+    int n = chat_varint_get(in + 1, len - 1, &v);
+    return n > 0 ? v : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per-frame compression, negotiated with "HELLO <version> deflate". Either
+// side may then send a packed frame in place of any payload:
+//   payload = CHAT_ZIP_MARK, varint(original length), raw deflate data
+// Each frame is compressed on its own against a preset dictionary of
+// protocol keywords, so a broadcast is packed once and the same bytes suit
+// every recipient. No v1 command or v2 opcode starts with the mark byte.
+// Without zlib (CHAT_HAVE_ZLIB unset) the codec is absent and the server
+// declines the option.
+
+#define CHAT_ZIP_MARK 0x80
+#define CHAT_ZIP_LEVEL 6 // zlib level used by the server.
+
+typedef struct ChatZip ChatZip;
+
+// 1 if this build can compress.
+int chat_zip_available(void);
+
+// Deflate and inflate state, built on first use. NULL without zlib or memory.
+ChatZip* chat_zip_new(int level);
+void chat_zip_free(ChatZip* z);
+
+// Pack len bytes into out (cap bytes). Returns the packed size, or 0 if it
+// would not be smaller than the input or does not fit.
+uint32_t chat_zip_pack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t cap);
+// Same, for a payload held in two pieces: head then tail.
+uint32_t chat_zip_pack2(ChatZip* z, const uint8_t* head, uint32_t head_len, const uint8_t* tail, uint32_t tail_len,
+    uint8_t* out, uint32_t cap);
+// Original length announced by a packed payload; 0 if malformed.
+uint32_t chat_zip_packed_len(const uint8_t* in, uint32_t len);
+// Unpack into out, which must hold exactly the announced length. Returns 1
+// if the payload inflates to exactly that many bytes.
+int chat_zip_unpack(ChatZip* z, const uint8_t* in, uint32_t len, uint8_t* out, uint32_t out_len);
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_hash.h"
+#include "chat_platform.h"
+
+// Print a chat_server --credentials line for one user:
+//   <user> pbkdf2-sha256 <iterations> <salt hex> <hash hex>
+// with a fresh random salt. The password comes from the command line or,
+// without one, from the first line of stdin (so it stays out of ps and
+// shell history). Append the output to the file; a running server picks it
+// up within a second.
+
+#define PASSWD_ITERATIONS_DEFAULT 100000u
+#define PASSWD_SALT_LEN 16
+#define PASSWD_NAME_MAX 31 // The server's CHAT_NAME_MAX.
+
+static void usage(void) {
+    printf("chat_passwd [--iterations <n>] <user> [<password>]\n");
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = PASSWD_ITERATIONS_DEFAULT;
+    const char* user = NULL;
+    const char* password = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            long n = atol(argv[++i]);
+            if (n < 1000 || n > 100000000) {
+                printf("--iterations must be between 1000 and 100000000\n");
+                return 2;
+            }
+            iterations = (uint32_t)n;
+        } else if (!user) {
+            user = argv[i];
+        } else if (!password) {
+            password = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!user) {
+        usage();
+        return 2;
+    }
+    if (strlen(user) > PASSWD_NAME_MAX || strpbrk(user, " \t\r\n#")) {
+        fprintf(stderr, "user names are at most %d characters, without spaces or '#'\n", PASSWD_NAME_MAX);
+        return 2;
+    }
+
+    char line[1024];
+    if (!password) {
+        if (!fgets(line, sizeof(line), stdin)) {
+            fprintf(stderr, "no password on stdin\n");
+            return 1;
+        }
+        line[strcspn(line, "\r\n")] = 0;
+        password = line;
+    }
+    if (password[0] == 0) {
+        fprintf(stderr, "empty password\n");
+        return 1;
+    }
+
+    uint8_t salt[PASSWD_SALT_LEN];
+    if (!chat_random_bytes(salt, sizeof(salt))) {
+        fprintf(stderr, "no random source\n");
+        return 1;
+    }
+    uint8_t hash[CHAT_SHA256_LEN];
+    chat_pbkdf2_sha256(password, strlen(password), salt, sizeof(salt), iterations, hash, sizeof(hash));
+    memset(line, 0, sizeof(line));
+
+    char salt_hex[2 * PASSWD_SALT_LEN + 1];
+    char hash_hex[2 * CHAT_SHA256_LEN + 1];
+    chat_hex_encode(salt, sizeof(salt), salt_hex);
+    chat_hex_encode(hash, sizeof(hash), hash_hex);
+    printf("%s pbkdf2-sha256 %u %s %s\n", user, iterations, salt_hex, hash_hex);
+    return 0;
+}
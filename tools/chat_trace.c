@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat_cmd.h"
+#include "chat_trace.h"
+
+// Per-stage latency report for a trace file written by chat_server
+// --trace-file. Groups records by trace, pairs each queued frame with its
+// socket write per recipient (queues are FIFO), and prints, for every
+// command seen, the count, p50, p90, p99 and max in microseconds of:
+//   read->parse      socket read returned .. command decoded
+//   parse->dispatch  decoded .. handler starts (lookups, checks)
+//   dispatch->queue  handler starts .. frame queued, per recipient
+//   queue->write     queued .. last byte written, per recipient
+//   read->write      end to end, per recipient
+// Recipients whose frame never went out (dropped, or the server stopped)
+// count as unwritten.
+
+static const char* const cmd_names[CHAT_CMD_COUNT] = {
+    "(none)",
+#define CHAT_CMD_NAME(id, c0, c1, cl, flags, args, text, usage) #id,
+    CHAT_CMD_LIST(CHAT_CMD_NAME)
+#undef CHAT_CMD_NAME
+};
+
+enum { SPAN_PARSE, SPAN_DISPATCH, SPAN_QUEUE, SPAN_WRITE, SPAN_TOTAL, SPANS };
+
+static const char* const span_names[SPANS] = {
+    "read->parse", "parse->dispatch", "dispatch->queue", "queue->write", "read->write"};
+
+typedef struct Samples {
+    uint64_t* v;
+    size_t count;
+    size_t cap;
+} Samples;
+
+static Samples samples[CHAT_CMD_COUNT][SPANS];
+static uint64_t traces_per_cmd[CHAT_CMD_COUNT];
+
+static void usage(void) {
+    printf("chat_trace <trace file>\n");
+}
+
+static void add_sample(int cmd, int span, uint64_t ns) {
+    Samples* s = &samples[cmd][span];
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        uint64_t* v = (uint64_t*)realloc(s->v, cap * sizeof(*v));
+        if (!v) {
+            printf("out of memory\n");
+            exit(1);
+        }
+        s->v = v;
+        s->cap = cap;
+    }
+    s->v[s->count++] = ns;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// By trace, then time; a stage breaks ties so a queue precedes its write.
+static int cmp_by_trace(const void* a, const void* b) {
+    const ChatTraceRecord* x = (const ChatTraceRecord*)a;
+    const ChatTraceRecord* y = (const ChatTraceRecord*)b;
+    if (x->trace != y->trace) return x->trace < y->trace ? -1 : 1;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return (int)x->stage - (int)y->stage;
+}
+
+// Within one trace: by recipient, then time.
+static int cmp_by_client(const void* a, const void* b) {
+    const ChatTraceRecord* x = (const ChatTraceRecord*)a;
+    const ChatTraceRecord* y = (const ChatTraceRecord*)b;
+    if (x->client != y->client) return x->client < y->client ? -1 : 1;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return (int)x->stage - (int)y->stage;
+}
+
+static double quantile_us(const Samples* s, double q) {
+    size_t i = (size_t)(q * (double)(s->count - 1) + 0.5);
+    return (double)s->v[i] / 1e3;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        usage();
+        return 2;
+    }
+    FILE* f = fopen(argv[1], "rb");
+    if (!f) {
+        printf("cannot open %s\n", argv[1]);
+        return 1;
+    }
+    ChatTraceHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CHAT_TRACE_MAGIC, sizeof(h.magic)) != 0) {
+        printf("%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+    if (h.version != CHAT_TRACE_VERSION || h.record_size != sizeof(ChatTraceRecord)) {
+        printf("%s: unsupported trace version %u (record size %u)\n", argv[1], h.version, h.record_size);
+        return 1;
+    }
+
+    ChatTraceRecord* recs = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t lost = 0;
+    for (;;) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 65536;
+            ChatTraceRecord* grown = (ChatTraceRecord*)realloc(recs, cap * sizeof(*recs));
+            if (!grown) {
+                printf("out of memory\n");
+                return 1;
+            }
+            recs = grown;
+        }
+        if (fread(&recs[count], sizeof(*recs), 1, f) != 1) break;
+        if (recs[count].stage == CHAT_TRACE_LOST) {
+            lost += recs[count].bytes;
+            continue;
+        }
+        if (recs[count].stage < CHAT_TRACE_READ || recs[count].stage > CHAT_TRACE_WRITE || !recs[count].trace) {
+            continue; // Not from this version; skip rather than guess.
+        }
+        count++;
+    }
+    fclose(f);
+    if (count > 1) qsort(recs, count, sizeof(*recs), cmp_by_trace);
+
+    uint64_t traces = 0, unwritten = 0, stray_writes = 0;
+    for (size_t at = 0; at < count;) {
+        size_t end = at;
+        while (end < count && recs[end].trace == recs[at].trace) end++;
+
+        // The frame's own stages come first in time; its frames follow.
+        uint64_t t_read = 0, t_parse = 0, t_dispatch = 0;
+        int cmd = CHAT_CMD_NONE;
+        size_t sent = at;
+        for (size_t i = at; i < end; i++) {
+            ChatTraceRecord* r = &recs[i];
+            if (r->stage == CHAT_TRACE_READ && !t_read) t_read = r->time_ns;
+            else if (r->stage == CHAT_TRACE_PARSE && !t_parse) t_parse = r->time_ns;
+            else if (r->stage == CHAT_TRACE_DISPATCH && !t_dispatch) t_dispatch = r->time_ns;
+            else if (r->stage == CHAT_TRACE_ENQUEUE || r->stage == CHAT_TRACE_WRITE) recs[sent++] = *r;
+            if ((r->stage == CHAT_TRACE_PARSE || r->stage == CHAT_TRACE_DISPATCH) && r->cmd < CHAT_CMD_COUNT) {
+                cmd = r->cmd;
+            }
+        }
+        if (!t_read) { // Its READ was lost; nothing to measure from.
+            at = end;
+            continue;
+        }
+        traces++;
+        traces_per_cmd[cmd]++;
+        if (t_parse) add_sample(cmd, SPAN_PARSE, t_parse - t_read);
+        if (t_parse && t_dispatch) add_sample(cmd, SPAN_DISPATCH, t_dispatch - t_parse);
+
+        // Pair queue and write records per recipient, oldest first.
+        if (sent - at > 1) qsort(&recs[at], sent - at, sizeof(*recs), cmp_by_client);
+        for (size_t i = at; i < sent;) {
+            size_t j = i, pending = i, queued = 0;
+            for (; j < sent && recs[j].client == recs[i].client; j++) {
+                if (recs[j].stage == CHAT_TRACE_ENQUEUE) {
+                    queued++;
+                    if (t_dispatch) add_sample(cmd, SPAN_QUEUE, recs[j].time_ns - t_dispatch);
+                    continue;
+                }
+                while (pending < j && recs[pending].stage != CHAT_TRACE_ENQUEUE) pending++;
+                if (pending == j) { // Re-sent from history: its queue record was muted.
+                    stray_writes++;
+                    continue;
+                }
+                add_sample(cmd, SPAN_WRITE, recs[j].time_ns - recs[pending].time_ns);
+                add_sample(cmd, SPAN_TOTAL, recs[j].time_ns - t_read);
+                recs[pending].stage = 0; // Paired.
+                queued--;
+                pending++;
+            }
+            unwritten += queued;
+            i = j;
+        }
+        at = end;
+    }
+
+    printf("%s: 1 in %llu frames sampled, %llu traces, %zu records, %llu lost, %llu unwritten, %llu stray writes\n",
+        argv[1], (unsigned long long)h.sample, (unsigned long long)traces, count, (unsigned long long)lost,
+        (unsigned long long)unwritten, (unsigned long long)stray_writes);
+    if (lost) printf("Lost records leave stages unpaired: counts undercount, unwritten overcounts.\n");
+    printf("%-8s %-16s %9s %10s %10s %10s %10s\n", "command", "stage", "count", "p50_us", "p90_us", "p99_us",
+        "max_us");
+    for (int c = 0; c < CHAT_CMD_COUNT; c++) {
+        if (!traces_per_cmd[c]) continue;
+        for (int s = 0; s < SPANS; s++) {
+            Samples* sm = &samples[c][s];
+            if (!sm->count) continue;
+            qsort(sm->v, sm->count, sizeof(*sm->v), cmp_u64);
+            printf("%-8s %-16s %9zu %10.1f %10.1f %10.1f %10.1f\n", cmd_names[c], span_names[s], sm->count,
+                quantile_us(sm, 0.50), quantile_us(sm, 0.90), quantile_us(sm, 0.99),
+                (double)sm->v[sm->count - 1] / 1e3);
+        }
+    }
+    free(recs);
+    return 0;
+}